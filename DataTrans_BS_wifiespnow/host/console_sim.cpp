@@ -0,0 +1,192 @@
+/*
+    What printing every record costs the base station's rx worker, simulated on Linux
+
+    g++ -std=c++17 -O2 -I include -I ../DataTrans_common/include host/console_sim.cpp -o console_sim
+    ./console_sim [seconds] [seed]
+
+    Every slave sends a batch every SIM_FRAME_MS (ESPNOW_BATCH_LATENCY_MS) with the samples it
+    made since (ESPNOW_SAMPLE_PERIOD_MS apart) and its text message every ESPNOW_TEXT_PERIOD_MS,
+    as the slave firmware does. Frames wait in a ring of ESPNOW_RING_SLOTS for the rx worker
+    and are dropped when it is full. The worker takes SIM_RECORD_US per record, plus, when it
+    prints:
+        - printf: one line per record in the format handle_record used to print, through a
+          console at CONFIG_ESP_CONSOLE_UART_BAUDRATE. printf on the ESP32 console blocks until
+          the UART has taken the line, so the worker waits for every byte past the FIFO
+        - counted: ESP_LOGD (compiled out at the default log level) and one housekeeping line
+          every ESPNOW_STATS_MS with the counts
+    Lines are the real format with the real numbers filled in. Columns: samples/s the slaves
+    send and the worker gets through, frames lost to a full ring, console bytes/s, how busy the
+    worker is, and how long a frame waits in the ring
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <vector>
+
+#include "dt_port.h"
+#include "espnow_ring.h"
+
+#define SIM_FRAME_MS 500            // the slave's ESPNOW_BATCH_LATENCY_MS
+#define SIM_SAMPLE_MS 100           // the slave's ESPNOW_SAMPLE_PERIOD_MS
+#define SIM_TEXT_MS 2000            // the slave's ESPNOW_TEXT_PERIOD_MS
+#define SIM_UART_BAUD 115200        // CONFIG_ESP_CONSOLE_UART_BAUDRATE
+#define SIM_UART_FIFO 128           // bytes the UART takes before printf has to wait
+#define SIM_RECORD_US 15            // decode, node table and ts_store per record, rough for 240 MHz
+#define SIM_STATS_MS 10000          // the base station's ESPNOW_STATS_MS
+
+static const char *TEXT = "Hello via ESP-NOW";
+
+typedef struct
+{
+    int64_t arrive_us;
+    uint16_t node_id;
+    uint32_t seq;
+    int samples;
+    bool text;
+} sim_frame_t;
+
+typedef struct
+{
+    double offered;                 // samples/s
+    double handled;
+    uint32_t dropped;               // frames
+    double console_bps;
+    double busy_pct;
+    double p50_ms;
+    double p99_ms;
+} sim_result_t;
+
+// Console bytes the old handle_record printed for one frame
+static size_t printed_bytes(const sim_frame_t *f)
+{
+    char line[128];
+    size_t bytes = 0;
+    if (f->text)
+    {
+        bytes += snprintf(line, sizeof(line), "Node %04X seq %lu (rssi %d): %.*s\n",
+                          f->node_id, (unsigned long)f->seq, -67, (int)strlen(TEXT), TEXT);
+    }
+    for (int i = 0; i < f->samples; i++)
+    {
+        bytes += snprintf(line, sizeof(line), "Node %04X seq %lu channel %u: %ld\n",
+                          f->node_id, (unsigned long)f->seq, 0u, (long)(1000 + rand() % 3000));
+    }
+    return bytes;
+}
+
+static sim_result_t simulate(int slaves, bool print, int seconds)
+{
+    int64_t end_us = (int64_t)seconds * 1000000;
+    std::vector<sim_frame_t> frames;
+
+    for (int n = 0; n < slaves; n++)
+    {
+        int64_t phase_us = rand() % (SIM_FRAME_MS * 1000);
+        uint32_t seq = 0;
+        int64_t next_text_us = phase_us;
+        for (int64_t t = phase_us + SIM_FRAME_MS * 1000; t < end_us; t += SIM_FRAME_MS * 1000)
+        {
+            sim_frame_t f;
+            f.arrive_us = t + rand() % 2000;
+            f.node_id = (uint16_t)(n + 1);
+            f.seq = seq++;
+            f.samples = SIM_FRAME_MS / SIM_SAMPLE_MS;
+            f.text = t >= next_text_us;
+            if (f.text)
+            {
+                next_text_us += SIM_TEXT_MS * 1000;
+            }
+            frames.push_back(f);
+        }
+    }
+    std::sort(frames.begin(), frames.end(), [](const sim_frame_t &a, const sim_frame_t &b) { return a.arrive_us < b.arrive_us; });
+
+    // one server, FIFO, ESPNOW_RING_SLOTS waiting at most
+    double uart_us_per_byte = 1e6 / (SIM_UART_BAUD / 10.0);
+    std::vector<int64_t> done_at;           // finish times of frames in the ring or being handled
+    std::vector<double> waits_ms;
+    int64_t worker_free_us = 0;
+    double uart_done_us = 0;                // when the UART will have sent everything so far
+    int64_t busy_us = 0;
+    uint64_t offered = 0, handled = 0, console_bytes = 0;
+    uint32_t dropped = 0;
+    size_t oldest = 0;
+
+    for (const sim_frame_t &f : frames)
+    {
+        offered += f.samples;
+        while (oldest < done_at.size() && done_at[oldest] <= f.arrive_us)
+        {
+            oldest++;
+        }
+        if (done_at.size() - oldest > ESPNOW_RING_SLOTS)
+        {
+            dropped++;
+            continue;
+        }
+
+        int records = f.samples + (f.text ? 1 : 0);
+        int64_t start_us = f.arrive_us > worker_free_us ? f.arrive_us : worker_free_us;
+        int64_t service_us = (int64_t)records * SIM_RECORD_US;
+        if (print)
+        {
+            // the line is written once the FIFO has room for its tail, the worker waits until then
+            size_t bytes = printed_bytes(&f);
+            console_bytes += bytes;
+            uart_done_us = (uart_done_us > start_us ? uart_done_us : start_us) + bytes * uart_us_per_byte;
+            int64_t written_us = (int64_t)(uart_done_us - SIM_UART_FIFO * uart_us_per_byte);
+            service_us += written_us > start_us ? written_us - start_us : 0;
+        }
+        worker_free_us = start_us + service_us;
+        busy_us += service_us;
+        done_at.push_back(worker_free_us);
+        waits_ms.push_back((start_us - f.arrive_us) / 1000.0);
+        if (worker_free_us <= end_us)
+        {
+            handled += f.samples;
+        }
+    }
+    if (!print)
+    {
+        uint64_t lines = end_us / (SIM_STATS_MS * 1000);
+        console_bytes = lines * snprintf(NULL, 0, "I (%lu) Data_Trans: esp_now %lu samples, %lu text messages in %d s\n",
+                                         (unsigned long)(end_us / 1000), (unsigned long)(offered * SIM_STATS_MS * 1000 / end_us),
+                                         (unsigned long)(slaves * SIM_STATS_MS / SIM_TEXT_MS), SIM_STATS_MS / 1000);
+    }
+
+    std::sort(waits_ms.begin(), waits_ms.end());
+    sim_result_t r;
+    r.offered = (double)offered / seconds;
+    r.handled = (double)handled / seconds;
+    r.dropped = dropped;
+    r.console_bps = (double)console_bytes / seconds;
+    r.busy_pct = 100.0 * busy_us / end_us;
+    r.p50_ms = waits_ms.empty() ? 0 : waits_ms[waits_ms.size() / 2];
+    r.p99_ms = waits_ms.empty() ? 0 : waits_ms[waits_ms.size() * 99 / 100];
+    return r;
+}
+
+int main(int argc, char **argv)
+{
+    int seconds = argc > 1 ? atoi(argv[1]) : 60;
+    srand(argc > 2 ? atoi(argv[2]) : 1);
+
+    printf("%d s, a frame per slave every %d ms, a sample every %d ms, text every %d ms, console %d baud\n\n",
+           seconds, SIM_FRAME_MS, SIM_SAMPLE_MS, SIM_TEXT_MS, SIM_UART_BAUD);
+    printf("%6s  %-7s  %9s  %9s  %8s  %10s  %6s  %8s  %8s\n",
+           "slaves", "mode", "offered/s", "handled/s", "dropped", "console B/s", "busy", "p50 ms", "p99 ms");
+
+    static const int slave_counts[] = {5, 10, 20, 30, 50, 100};
+    for (int slaves : slave_counts)
+    {
+        for (int print = 1; print >= 0; print--)
+        {
+            sim_result_t r = simulate(slaves, print, seconds);
+            printf("%6d  %-7s  %9.0f  %9.0f  %8lu  %10.0f  %5.1f%%  %8.1f  %8.1f\n",
+                   slaves, print ? "printf" : "counted", r.offered, r.handled, (unsigned long)r.dropped,
+                   r.console_bps, r.busy_pct > 100 ? 100.0 : r.busy_pct, r.p50_ms, r.p99_ms);
+        }
+    }
+    return 0;
+}
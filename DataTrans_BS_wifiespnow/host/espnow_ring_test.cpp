@@ -0,0 +1,264 @@
+/*
+    espnow_ring.h on Linux: the corner cases one at a time, then a producer and a consumer
+    thread hammering it like on_data_recv and the rx worker
+
+    g++ -std=c++17 -O2 -pthread -I include -I ../DataTrans_common/include host/espnow_ring_test.cpp -o espnow_ring_test
+    ./espnow_ring_test [stress frames]
+
+    wrap:      slot indexes going round many times, and the free running counters going
+               past UINT32_MAX
+    overflow:  a full ring refuses the next frame, counts it in dropped and keeps no buffer
+    truncated: a frame bigger than ESPNOW_MAX_PAYLOAD is cut and counted
+    pool:      the pool running out first is counted there, not in dropped
+    high_water is checked along the way. Exits 1 if anything is off
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <thread>
+
+#include "dt_port.h"
+#include "espnow_ring.h"
+
+#define TEST_POOL_BLOCKS 64
+
+static shared_buf_t s_bufs[TEST_POOL_BLOCKS];
+static std::atomic<uint16_t> s_next[TEST_POOL_BLOCKS];
+static block_pool_t s_pool;
+static espnow_ring_t s_ring;
+static int s_failures;
+
+static const uint8_t MAC[6] = { 0x24, 0x0A, 0xC4, 0x00, 0x00, 0x01 };
+
+#define CHECK(cond)                                                         \
+    do                                                                      \
+    {                                                                       \
+        if (!(cond))                                                        \
+        {                                                                   \
+            printf("  FAIL %s:%d: %s\n", __FILE__, __LINE__, #cond);        \
+            s_failures++;                                                   \
+        }                                                                   \
+    } while (0)
+
+static void reset(uint16_t blocks, uint32_t start)
+{
+    shared_buf_pool_init(&s_pool, s_bufs, s_next, blocks);
+    espnow_ring_init(&s_ring, &s_pool);
+    s_ring.head.store(start, std::memory_order_relaxed);
+    s_ring.tail.store(start, std::memory_order_relaxed);
+}
+
+static bool push_seq(uint32_t seq, int len)
+{
+    uint8_t data[ESPNOW_MAX_PAYLOAD + 16];
+    for (int i = 0; i < len; i++)
+    {
+        data[i] = (uint8_t)(seq + i);
+    }
+    return espnow_ring_push(&s_ring, seq, MAC, -40, data, len);
+}
+
+static bool frame_ok(const shared_buf_t *buf, uint32_t seq, int len)
+{
+    if (buf->len != len || buf->rx_us != (int64_t)seq || memcmp(buf->mac, MAC, 6) != 0 || buf->rssi != -40)
+    {
+        return false;
+    }
+    for (int i = 0; i < len; i++)
+    {
+        if (buf->data[i] != (uint8_t)(seq + i))
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+static void test_wrap(uint32_t start)
+{
+    reset(TEST_POOL_BLOCKS, start);
+    uint32_t seq = 0, expect = 0;
+    for (int round = 0; round < 200; round++)
+    {
+        int n = 1 + round % ESPNOW_RING_SLOTS;
+        for (int i = 0; i < n; i++)
+        {
+            CHECK(push_seq(seq, 1 + (int)(seq % 40)));
+            seq++;
+        }
+        uint32_t readable = espnow_ring_readable(&s_ring);
+        CHECK(readable == (uint32_t)n);
+        for (uint32_t i = 0; i < readable; i++, expect++)
+        {
+            CHECK(frame_ok(espnow_ring_peek(&s_ring, i), expect, 1 + (int)(expect % 40)));
+        }
+        espnow_ring_consume(&s_ring, readable);
+    }
+    CHECK(espnow_ring_readable(&s_ring) == 0);
+    CHECK(s_ring.high_water == ESPNOW_RING_SLOTS);
+    CHECK(s_ring.dropped.load() == 0);
+    CHECK(s_pool.in_use.load() == 0);
+}
+
+static void test_overflow(void)
+{
+    reset(TEST_POOL_BLOCKS, 0);
+    for (int i = 0; i < ESPNOW_RING_SLOTS; i++)
+    {
+        CHECK(push_seq(i, 10));
+    }
+    CHECK(!push_seq(99, 10));
+    CHECK(!push_seq(100, 10));
+    CHECK(s_ring.dropped.load() == 2);
+    CHECK(s_pool.in_use.load() == ESPNOW_RING_SLOTS);
+    CHECK(s_pool.exhausted.load() == 0);
+
+    // the frames that made it are untouched, and one slot free takes one more
+    CHECK(espnow_ring_readable(&s_ring) == ESPNOW_RING_SLOTS);
+    CHECK(frame_ok(espnow_ring_peek(&s_ring, ESPNOW_RING_SLOTS - 1), ESPNOW_RING_SLOTS - 1, 10));
+    espnow_ring_consume(&s_ring, 1);
+    CHECK(push_seq(101, 10));
+    CHECK(!push_seq(102, 10));
+    CHECK(s_ring.dropped.load() == 3);
+    CHECK(frame_ok(espnow_ring_peek(&s_ring, ESPNOW_RING_SLOTS - 1), 101, 10));
+    espnow_ring_consume(&s_ring, espnow_ring_readable(&s_ring));
+    CHECK(s_pool.in_use.load() == 0);
+}
+
+static void test_truncated(void)
+{
+    reset(TEST_POOL_BLOCKS, 0);
+    CHECK(push_seq(1, ESPNOW_MAX_PAYLOAD));
+    CHECK(push_seq(2, ESPNOW_MAX_PAYLOAD + 10));
+    CHECK(push_seq(3, -5));
+    CHECK(s_ring.truncated.load() == 1);
+    CHECK(espnow_ring_readable(&s_ring) == 3);
+    CHECK(frame_ok(espnow_ring_peek(&s_ring, 0), 1, ESPNOW_MAX_PAYLOAD));
+    CHECK(frame_ok(espnow_ring_peek(&s_ring, 1), 2, ESPNOW_MAX_PAYLOAD));
+    CHECK(espnow_ring_peek(&s_ring, 2)->len == 0);
+    espnow_ring_consume(&s_ring, 3);
+}
+
+static void test_pool(void)
+{
+    reset(8, 0);
+    for (int i = 0; i < 8; i++)
+    {
+        CHECK(push_seq(i, 20));
+    }
+    CHECK(!push_seq(8, 20));
+    CHECK(s_pool.exhausted.load() == 1);
+    CHECK(s_ring.dropped.load() == 0);
+    CHECK(espnow_ring_readable(&s_ring) == 8);
+
+    // a reference kept past consume (the TCP bridge) holds on to its block
+    shared_buf_t *kept = espnow_ring_peek(&s_ring, 0);
+    shared_buf_ref(kept);
+    espnow_ring_consume(&s_ring, 8);
+    CHECK(s_pool.in_use.load() == 1);
+    CHECK(frame_ok(kept, 0, 20));
+    shared_buf_release(kept);
+    CHECK(s_pool.in_use.load() == 0);
+}
+
+static void test_high_water(void)
+{
+    reset(TEST_POOL_BLOCKS, 0);
+    for (int i = 0; i < 5; i++)
+    {
+        push_seq(i, 4);
+    }
+    CHECK(espnow_ring_readable(&s_ring) == 5);
+    espnow_ring_consume(&s_ring, 5);
+    for (int i = 0; i < 3; i++)
+    {
+        push_seq(i, 4);
+    }
+    CHECK(espnow_ring_readable(&s_ring) == 3);
+    CHECK(s_ring.high_water == 5);
+    espnow_ring_consume(&s_ring, 3);
+}
+
+static void test_stress(uint32_t frames)
+{
+    reset(TEST_POOL_BLOCKS, UINT32_MAX - 1000);
+    std::atomic<bool> done(false);
+    uint32_t refused = 0;
+
+    std::thread producer([&]()
+    {
+        for (uint32_t seq = 0; seq < frames;)
+        {
+            if (push_seq(seq, 1 + (int)(seq % ESPNOW_MAX_PAYLOAD)))
+            {
+                seq++;
+            }
+            else
+            {
+                refused++;
+                sched_yield();
+            }
+        }
+        done.store(true, std::memory_order_release);
+    });
+
+    uint32_t expect = 0, bad = 0;
+    while (expect < frames)
+    {
+        uint32_t readable = espnow_ring_readable(&s_ring);
+        if (readable == 0)
+        {
+            if (done.load(std::memory_order_acquire) && espnow_ring_readable(&s_ring) == 0)
+            {
+                break;
+            }
+            sched_yield();
+            continue;
+        }
+        // take them a few at a time, like the worker's batches
+        uint32_t batch = readable > 8 ? 8 : readable;
+        for (uint32_t i = 0; i < batch; i++, expect++)
+        {
+            bad += !frame_ok(espnow_ring_peek(&s_ring, i), expect, 1 + (int)(expect % ESPNOW_MAX_PAYLOAD));
+        }
+        espnow_ring_consume(&s_ring, batch);
+    }
+    producer.join();
+
+    CHECK(expect == frames);
+    CHECK(bad == 0);
+    CHECK(s_pool.in_use.load() == 0);
+    CHECK(s_ring.dropped.load() == refused - s_pool.exhausted.load());
+    printf("stress: %lu frames, %lu bad, %lu refused (%lu ring full, %lu no buffer), high water %lu\n",
+           (unsigned long)expect, (unsigned long)bad, (unsigned long)refused,
+           (unsigned long)s_ring.dropped.load(), (unsigned long)s_pool.exhausted.load(),
+           (unsigned long)s_ring.high_water);
+}
+
+int main(int argc, char **argv)
+{
+    uint32_t frames = argc > 1 ? (uint32_t)atol(argv[1]) : 2000000;
+
+    struct
+    {
+        const char *name;
+        void (*run)(void);
+    } tests[] = {
+        { "wrap", []() { test_wrap(0); } },
+        { "wrap past UINT32_MAX", []() { test_wrap(UINT32_MAX - 300); } },
+        { "overflow", test_overflow },
+        { "truncated", test_truncated },
+        { "pool", test_pool },
+        { "high_water", test_high_water },
+    };
+    for (auto &t : tests)
+    {
+        int before = s_failures;
+        t.run();
+        printf("%-22s %s\n", t.name, s_failures == before ? "ok" : "FAILED");
+    }
+    test_stress(frames);
+
+    printf(s_failures ? "%d checks failed\n" : "all passed\n", s_failures);
+    return s_failures ? 1 : 0;
+}
@@ -0,0 +1,352 @@
+/*
+    Fragmentation over a lossy simulated ESP-NOW link: the slave's frag_tx sending to
+    the base station's frag_rx, with frames lost at random both ways
+
+    g++ -std=c++17 -O2 -I include -I ../DataTrans_common/include -I ../DataTrans_slave_wifiespnow/include \
+        host/frag_sim.cpp src/frag_rx.cpp ../DataTrans_slave_wifiespnow/src/frag_tx.cpp -o frag_sim
+    ./frag_sim [messages] [seed]
+
+    Every delivered message is checked byte for byte. The first table sweeps the loss
+    rate with one slave, the second has several slaves sending the biggest messages at
+    once so the reassembly memory runs out. A refused message is sent again after a
+    random back off, like an application would, so "failed" counts attempts
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <vector>
+
+#include "dt_port.h"
+#include "dt_frame.h"
+#include "frag_rx.h"
+#include "frag_tx.h"
+
+#define SIM_MAX_SENDERS 8
+#define SIM_LINK_DELAY_US 2000      // one way, radio + queues
+#define SIM_TX_DEPTH 16             // frames a slave can have queued, like ESPNOW_TXQ_DEPTH
+#define SIM_STEP_US 500
+#define SIM_RETRY_MS 300            // up to, before sending a refused message again
+
+typedef struct
+{
+    int64_t deliver_us;
+    int to_bs;                      // 1 = slave -> base station, 0 = the other way
+    int sender;
+    size_t len;
+    uint8_t data[DT_FRAME_MAX_SIZE];
+} sim_frame_t;
+
+typedef struct
+{
+    frag_tx_t tx;
+    uint32_t seq;
+    uint8_t mac[6];
+    int queued;                     // frames of ours still on the link
+    int64_t link_free_us[2];        // frames from one radio arrive in order, each way
+    int64_t retry_us;               // 0 = nothing to send again
+    std::vector<uint8_t> msg;
+    int sent_msgs;
+    int delivered;
+    int failed;
+    bool busy;
+} sim_sender_t;
+
+static std::vector<sim_frame_t> s_link;
+static sim_sender_t s_senders[SIM_MAX_SENDERS];
+static int s_sender_count;
+static int s_current;               // sender whose frag_tx is running, for the callbacks
+static frag_rx_t s_rx;
+static double s_loss;
+static int64_t s_now;
+
+static uint32_t s_corrupt;
+static uint32_t s_frames_to_bs;
+static uint64_t s_done_us_sum;
+
+static const uint8_t BS_MAC[6] = {0x02, 0, 0, 0, 0, 0xB5};
+
+static uint8_t msg_byte(int sender, uint16_t msg_id, uint32_t i)
+{
+    return (uint8_t)(sender * 131 + msg_id * 31 + i * 7 + (i >> 8));
+}
+
+static void link_put(int to_bs, int sender, const uint8_t *frame, size_t len)
+{
+    if (drand48() < s_loss)
+    {
+        return;
+    }
+
+    // some jitter, but never overtaking the previous frame
+    sim_sender_t *s = &s_senders[sender];
+    int64_t deliver_us = s_now + SIM_LINK_DELAY_US + (int64_t)(drand48() * 1000);
+    if (deliver_us <= s->link_free_us[to_bs])
+    {
+        deliver_us = s->link_free_us[to_bs] + 1;
+    }
+    s->link_free_us[to_bs] = deliver_us;
+
+    sim_frame_t f;
+    f.deliver_us = deliver_us;
+    f.to_bs = to_bs;
+    f.sender = sender;
+    f.len = len;
+    memcpy(f.data, frame, len);
+    s_link.push_back(f);
+}
+
+// frag_tx's send, the slave's radio
+static int slave_send(const uint8_t *, const uint8_t *frame, size_t len)
+{
+    sim_sender_t *s = &s_senders[s_current];
+    if (s->queued >= SIM_TX_DEPTH)
+    {
+        return -1;
+    }
+
+    s->queued++;
+    s_frames_to_bs++;
+    // a lost frame still took its place in the queue until it was sent
+    sim_frame_t marker;
+    marker.deliver_us = s_now + SIM_LINK_DELAY_US;
+    marker.to_bs = -1;
+    marker.sender = s_current;
+    marker.len = 0;
+    s_link.push_back(marker);
+
+    link_put(1, s_current, frame, len);
+    return 0;
+}
+
+static void slave_done(uint16_t, bool delivered)
+{
+    sim_sender_t *s = &s_senders[s_current];
+    s->busy = false;
+    if (delivered)
+    {
+        s->delivered++;
+    }
+    else
+    {
+        s->failed++;
+        s->retry_us = s_now + 1000 + (int64_t)(drand48() * SIM_RETRY_MS * 1000);
+    }
+}
+
+// frag_rx's send, status back to a slave
+static int bs_send(const uint8_t *peer_addr, const uint8_t *frame, size_t len)
+{
+    for (int i = 0; i < s_sender_count; i++)
+    {
+        if (memcmp(s_senders[i].mac, peer_addr, 6) == 0)
+        {
+            link_put(0, i, frame, len);
+        }
+    }
+    return 0;
+}
+
+static void bs_deliver(const frag_rx_msg_t *msg)
+{
+    int sender = msg->mac[5];
+    uint32_t offset = 0;
+
+    for (uint16_t i = 0; i < msg->count; i++)
+    {
+        size_t len;
+        const uint8_t *piece = frag_rx_piece(msg, i, &len);
+        for (size_t j = 0; j < len; j++, offset++)
+        {
+            if (piece[j] != msg_byte(sender, msg->msg_id, offset))
+            {
+                s_corrupt++;
+                return;
+            }
+        }
+    }
+    s_done_us_sum += s_now - msg->first_us;
+}
+
+static void sim_reset(int senders, double loss)
+{
+    s_link.clear();
+    s_sender_count = senders;
+    s_loss = loss;
+    s_now = 0;
+    s_corrupt = 0;
+    s_frames_to_bs = 0;
+    s_done_us_sum = 0;
+
+    frag_rx_init(&s_rx, bs_send, bs_deliver);
+    for (int i = 0; i < senders; i++)
+    {
+        sim_sender_t *s = &s_senders[i];
+        s->seq = 0;
+        memset(s->mac, 0, 6);
+        s->mac[0] = 0x02;
+        s->mac[5] = (uint8_t)i;
+        s->queued = 0;
+        s->sent_msgs = 0;
+        s->delivered = 0;
+        s->failed = 0;
+        s->busy = false;
+        s->link_free_us[0] = s->link_free_us[1] = 0;
+        s->retry_us = 0;
+        frag_tx_init(&s->tx, (uint16_t)(0x100 + i), &s->seq, slave_send, slave_done);
+    }
+}
+
+// Run until every sender has got through its messages. fixed_len 0 = random sizes
+static void sim_run(int messages, uint32_t fixed_len)
+{
+    while (1)
+    {
+        bool all_done = true;
+        for (int i = 0; i < s_sender_count; i++)
+        {
+            sim_sender_t *s = &s_senders[i];
+            s_current = i;
+
+            if (!s->busy && s->retry_us != 0 && s_now >= s->retry_us)
+            {
+                // same bytes, new msg_id
+                uint16_t msg_id = s->tx.next_msg_id;
+                for (uint32_t j = 0; j < s->msg.size(); j++)
+                {
+                    s->msg[j] = msg_byte(i, msg_id, j);
+                }
+                frag_tx_send(&s->tx, BS_MAC, DT_TYPE_BLOB, s->msg.data(), s->msg.size(), s_now);
+                s->busy = true;
+                s->retry_us = 0;
+            }
+            else if (!s->busy && s->retry_us == 0 && s->sent_msgs < messages)
+            {
+                uint32_t len = fixed_len ? fixed_len : 1 + (uint32_t)(drand48() * DT_FRAG_MAX_MSG_SIZE);
+                uint16_t msg_id = s->tx.next_msg_id;
+                s->msg.resize(len);
+                for (uint32_t j = 0; j < len; j++)
+                {
+                    s->msg[j] = msg_byte(i, msg_id, j);
+                }
+                frag_tx_send(&s->tx, BS_MAC, DT_TYPE_BLOB, s->msg.data(), len, s_now);
+                s->busy = true;
+                s->sent_msgs++;
+            }
+            frag_tx_poll(&s->tx, s_now);
+
+            if (s->busy || s->retry_us != 0 || s->sent_msgs < messages)
+            {
+                all_done = false;
+            }
+        }
+        if (all_done)
+        {
+            return;
+        }
+
+        s_now += SIM_STEP_US;
+
+        // everything due by now, oldest first
+        std::vector<sim_frame_t> due;
+        for (size_t k = 0; k < s_link.size();)
+        {
+            if (s_link[k].deliver_us > s_now)
+            {
+                k++;
+                continue;
+            }
+            due.push_back(s_link[k]);
+            s_link[k] = s_link.back();
+            s_link.pop_back();
+        }
+        std::stable_sort(due.begin(), due.end(),
+                         [](const sim_frame_t &a, const sim_frame_t &b) { return a.deliver_us < b.deliver_us; });
+
+        for (const sim_frame_t &f : due)
+        {
+            s_current = f.sender;
+            if (f.to_bs < 0)
+            {
+                s_senders[f.sender].queued--;
+                continue;
+            }
+
+            dt_frame_view_t view;
+            if (dt_frame_decode(f.data, f.len, &view) <= 0)
+            {
+                continue;
+            }
+            if (f.to_bs)
+            {
+                frag_rx_on_frame(&s_rx, s_senders[f.sender].mac, view.hdr, view.payload, s_now);
+            }
+            else
+            {
+                frag_tx_on_status(&s_senders[f.sender].tx, BS_MAC, view.payload, view.hdr->len, s_now);
+            }
+        }
+
+        frag_rx_poll(&s_rx, s_now);
+    }
+}
+
+static void print_row(const char *label)
+{
+    int delivered = 0, failed = 0;
+    uint32_t fragments = 0, retransmits = 0, pokes = 0;
+    for (int i = 0; i < s_sender_count; i++)
+    {
+        delivered += s_senders[i].delivered;
+        failed += s_senders[i].failed;
+        fragments += s_senders[i].tx.stats.fragments;
+        retransmits += s_senders[i].tx.stats.retransmits;
+        pokes += s_senders[i].tx.stats.pokes;
+    }
+
+    uint32_t needed = fragments - retransmits - pokes;
+    printf("%-10s %9d %6d %7lu %9.1f%% %6lu %8lu %7lu %7lu %6.0f %9.1f\n",
+           label, delivered, failed, (unsigned long)s_corrupt,
+           needed ? 100.0 * (fragments - needed) / needed : 0.0,
+           (unsigned long)s_rx.stats.nacks,
+           (unsigned long)s_rx.stats.timeouts,
+           (unsigned long)s_rx.stats.evicted,
+           (unsigned long)s_rx.stats.refused,
+           s_rx.stats.completed ? s_done_us_sum / 1000.0 / s_rx.stats.completed : 0.0,
+           s_now / 1e6);
+}
+
+int main(int argc, char **argv)
+{
+    int messages = argc > 1 ? atoi(argv[1]) : 50;
+    long seed = argc > 2 ? atol(argv[2]) : 1;
+    char label[32];
+
+    printf("%d messages of 1..%d bytes per slave, %d byte fragments, reassembly budget %d fragments\n\n",
+           messages, DT_FRAG_MAX_MSG_SIZE, DT_FRAG_DATA_SIZE, FRAG_RX_BLOCKS);
+    printf("%-10s %9s %6s %7s %10s %6s %8s %7s %7s %6s %9s\n",
+           "loss", "delivered", "failed", "corrupt", "overhead", "nacks", "timeouts", "evicted", "refused", "avg ms", "sim s");
+
+    static const double losses[] = {0.0, 0.05, 0.10, 0.20, 0.30};
+    for (double loss : losses)
+    {
+        srand48(seed);
+        sim_reset(1, loss);
+        sim_run(messages, 0);
+        snprintf(label, sizeof(label), "%.0f%%", loss * 100);
+        print_row(label);
+    }
+
+    printf("\nseveral slaves sending %d byte messages at once, 10%% loss\n", DT_FRAG_MAX_MSG_SIZE);
+    for (int senders = 2; senders <= SIM_MAX_SENDERS; senders *= 2)
+    {
+        srand48(seed);
+        sim_reset(senders, 0.10);
+        sim_run(messages / 5 > 0 ? messages / 5 : 1, DT_FRAG_MAX_MSG_SIZE);
+        snprintf(label, sizeof(label), "%d slaves", senders);
+        print_row(label);
+    }
+
+    printf("\nreassembly blocks high water %lu/%d\n", (unsigned long)s_rx.blocks.high_water.load(), FRAG_RX_BLOCKS);
+    return s_corrupt == 0 ? 0 : 1;
+}
@@ -0,0 +1,312 @@
+/*
+    The base station's task layout under ESP-NOW and TCP load at once, simulated on Linux: the
+    old one against the cores split as dt_tasks.h has them
+
+    g++ -std=c++17 -O2 -I include -I ../DataTrans_common/include host/layout_sim.cpp -o layout_sim
+    ./layout_sim [seconds] [tcp clients] [seed]
+
+    Two cores, each running the highest priority ready task it may run, preempting at once, a
+    microsecond at a time. A task nobody pinned runs on whichever core is free for it, but only
+    on one at a time, like FreeRTOS SMP in IDF
+        old:    espnow_rx (6) on core 1. tcp_server (5), lwIP's tiT (18) and trace_console (1)
+                anywhere. The rx worker pulsed the ESP-NOW LED for every frame, tcp_server the
+                wifi one for every request, and the rx worker printed the 10 second stats itself
+        pinned: espnow_rx (6) on core 1, tcp_server (5) and tiT (18) on core 0, housekeeping
+                (1) on core 1 does the LEDs every DT_HOUSEKEEPING_PERIOD_MS and the stats
+    Both: the wifi task (23) on core 0 takes every frame and TCP segment off the air. ESP-NOW
+    frames come in at random (Poisson) from the slaves, wait in a ring of ESPNOW_RING_SLOTS
+    for the rx worker and are dropped when it is full. `tcp clients` run tcp_bench's closed
+    loop: a request, wait for the answer, the next one. A socket call on the other core to
+    tiT costs SIM_XCORE_US more. Printing blocks the task printing until the UART has taken
+    it, as the IDF console does with no UART driver installed. The costs are rough figures
+    for 240 MHz, what matters is where they land, not their exact size
+
+    Columns: frames/s offered and handled, frames dropped on a full ring, p99 and worst time
+    a frame waited for the rx worker, TCP requests/s and their p50/p99 round trip, and how
+    busy each core was
+*/
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <deque>
+#include <queue>
+#include <vector>
+
+#include "dt_port.h"
+#include "espnow_ring.h"
+
+#define SIM_WIFI_FRAME_US 60        // wifi task, one ESP-NOW frame up to on_data_recv's ring push
+#define SIM_WIFI_SEGMENT_US 50      // wifi task, one TCP segment either way
+#define SIM_LWIP_US 120             // tiT, a segment through the stack either way
+#define SIM_XCORE_US 40             // a socket call handed to tiT on the other core
+#define SIM_RECORD_US 15            // rx worker, decode, node table and ts_store per record
+#define SIM_FRAME_RECORDS 5         // the slave's ESPNOW_BATCH_LATENCY_MS / ESPNOW_SAMPLE_PERIOD_MS
+#define SIM_REQUEST_US 200          // tcp_server, select, tcp_handle_request and building the answer
+#define SIM_LED_US 10               // led_pulse, an esp_timer start and a GPIO write
+#define SIM_AIR_US 1500             // PC to base station over wifi, each way
+#define SIM_UART_BAUD 115200        // CONFIG_ESP_CONSOLE_UART_BAUDRATE
+#define SIM_STATS_BYTES 1400        // the 10 second stats with a few slaves in the node table
+#define SIM_STATS_MS 10000          // the base station's ESPNOW_STATS_MS
+#define SIM_HOUSEKEEPING_MS 50      // DT_HOUSEKEEPING_PERIOD_MS
+#define SIM_CONSOLE_POLL_MS 200     // the old trace_console task's TRACE_CONSOLE_POLL_MS
+#define SIM_POLL_US 20              // a look at the counters or the console with nothing to do
+
+enum
+{
+    TASK_WIFI,
+    TASK_TIT,
+    TASK_RX,
+    TASK_TCP,
+    TASK_LOW,                       // housekeeping, or the old trace_console
+    TASK_COUNT,
+};
+
+enum
+{
+    JOB_FRAME_AIR,                  // wifi: an ESP-NOW frame in
+    JOB_FRAME,                      // rx worker: one frame out of the ring
+    JOB_SEGMENT_IN,                 // wifi: a request in
+    JOB_LWIP_IN,
+    JOB_REQUEST,                    // tcp_server
+    JOB_LWIP_OUT,
+    JOB_SEGMENT_OUT,                // wifi: the answer out
+    JOB_STATS,                      // the stats through the UART
+    JOB_POLL,
+};
+
+typedef struct
+{
+    int kind;
+    int64_t left_us;
+    int64_t t0_us;                  // frame arrival, or when the client sent the request
+    int client;
+    bool started;
+} sim_job_t;
+
+typedef struct
+{
+    const char *name;
+    int prio;
+    int core;                       // -1 = either
+    std::deque<sim_job_t> jobs;
+    int last_core;
+} sim_task_t;
+
+typedef struct
+{
+    double offered;
+    double handled;
+    uint32_t dropped;
+    double wait_p99_ms;
+    double wait_max_ms;
+    double requests;
+    double rtt_p50_ms;
+    double rtt_p99_ms;
+    double busy_pct[2];
+} sim_result_t;
+
+static sim_task_t s_tasks[TASK_COUNT];
+static int s_ring;                  // frames pushed and not yet handled
+
+static double quantile(std::vector<double> &v, double q)
+{
+    if (v.empty())
+    {
+        return 0;
+    }
+    std::sort(v.begin(), v.end());
+    return v[(size_t)(q * (v.size() - 1))];
+}
+
+static void push(int task, int kind, int64_t cost_us, int64_t t0_us, int client)
+{
+    s_tasks[task].jobs.push_back({ kind, cost_us, t0_us, client, false });
+}
+
+static sim_result_t simulate(bool pinned, double frames_per_s, int clients, int seconds)
+{
+    int64_t end_us = (int64_t)seconds * 1000000;
+    s_tasks[TASK_WIFI] = { "wifi", 23, 0, {}, 0 };
+    s_tasks[TASK_TIT] = { "tiT", 18, pinned ? 0 : -1, {}, 0 };
+    s_tasks[TASK_RX] = { "espnow_rx", 6, 1, {}, 1 };
+    s_tasks[TASK_TCP] = { "tcp_server", 5, pinned ? 0 : -1, {}, 0 };
+    s_tasks[TASK_LOW] = { pinned ? "housekeeping" : "trace_console", 1, pinned ? 1 : -1, {}, 1 };
+    s_ring = 0;
+
+    int64_t uart_us = (int64_t)SIM_STATS_BYTES * 10 * 1000000 / SIM_UART_BAUD;
+    int rx_cost_us = SIM_FRAME_RECORDS * SIM_RECORD_US + (pinned ? 0 : SIM_LED_US);
+    int request_cost_us = SIM_REQUEST_US + (pinned ? 0 : SIM_LED_US);
+    int low_period_us = (pinned ? SIM_HOUSEKEEPING_MS : SIM_CONSOLE_POLL_MS) * 1000;
+
+    // requests on their way to the base station: (arrival, client)
+    typedef std::pair<int64_t, int> arrival_t;
+    std::priority_queue<arrival_t, std::vector<arrival_t>, std::greater<arrival_t>> air;
+    for (int c = 0; c < clients; c++)
+    {
+        air.push({ SIM_AIR_US + c * 100, c });
+    }
+    std::vector<int64_t> sent_us(clients);
+    std::vector<int> tit_core(clients);
+
+    int64_t next_frame_us = 0;
+    int64_t next_stats_us = SIM_STATS_MS * 1000;
+    int64_t next_low_us = 0;
+    int64_t busy_us[2] = { 0, 0 };
+    uint64_t offered = 0, handled = 0, requests = 0;
+    uint32_t dropped = 0;
+    std::vector<double> waits_ms, rtts_ms;
+
+    for (int64_t now = 0; now < end_us; now++)
+    {
+        while (next_frame_us <= now)
+        {
+            push(TASK_WIFI, JOB_FRAME_AIR, SIM_WIFI_FRAME_US, next_frame_us, 0);
+            offered++;
+            next_frame_us += (int64_t)(-log(1.0 - drand48()) * 1e6 / frames_per_s) + 1;
+        }
+        while (!air.empty() && air.top().first <= now)
+        {
+            sent_us[air.top().second] = air.top().first - SIM_AIR_US;
+            push(TASK_WIFI, JOB_SEGMENT_IN, SIM_WIFI_SEGMENT_US, air.top().first - SIM_AIR_US, air.top().second);
+            air.pop();
+        }
+        if (now >= next_stats_us)
+        {
+            push(pinned ? TASK_LOW : TASK_RX, JOB_STATS, uart_us, now, 0);
+            next_stats_us += SIM_STATS_MS * 1000;
+        }
+        if (now >= next_low_us)
+        {
+            push(TASK_LOW, JOB_POLL, SIM_POLL_US, now, 0);
+            next_low_us += low_period_us;
+        }
+
+        // core 0 picks first, a task either core may run is then taken
+        int running[2] = { -1, -1 };
+        for (int core = 0; core < 2; core++)
+        {
+            for (int t = 0; t < TASK_COUNT; t++)
+            {
+                sim_task_t *task = &s_tasks[t];
+                if (task->jobs.empty() || (task->core >= 0 && task->core != core) || running[0] == t)
+                {
+                    continue;
+                }
+                if (running[core] < 0 || task->prio > s_tasks[running[core]].prio)
+                {
+                    running[core] = t;
+                }
+            }
+        }
+
+        for (int core = 0; core < 2; core++)
+        {
+            if (running[core] < 0)
+            {
+                continue;
+            }
+            int t = running[core];
+            sim_task_t *task = &s_tasks[t];
+            sim_job_t *job = &task->jobs.front();
+            busy_us[core]++;
+            task->last_core = core;
+            if (!job->started)
+            {
+                job->started = true;
+                // recv and send on the request's socket, tiT somewhere else
+                if (job->kind == JOB_REQUEST && tit_core[job->client] != core)
+                {
+                    job->left_us += 2 * SIM_XCORE_US;
+                }
+            }
+            if (--job->left_us > 0)
+            {
+                continue;
+            }
+
+            sim_job_t done = *job;
+            task->jobs.pop_front();
+            switch (done.kind)
+            {
+            case JOB_FRAME_AIR:
+                if (s_ring >= ESPNOW_RING_SLOTS)
+                {
+                    dropped++;
+                    break;
+                }
+                s_ring++;
+                push(TASK_RX, JOB_FRAME, rx_cost_us, done.t0_us, 0);
+                break;
+            case JOB_FRAME:
+                s_ring--;
+                handled++;
+                waits_ms.push_back((now + 1 - rx_cost_us - done.t0_us) / 1000.0);
+                break;
+            case JOB_SEGMENT_IN:
+                push(TASK_TIT, JOB_LWIP_IN, SIM_LWIP_US, done.t0_us, done.client);
+                break;
+            case JOB_LWIP_IN:
+                tit_core[done.client] = core;
+                push(TASK_TCP, JOB_REQUEST, request_cost_us, done.t0_us, done.client);
+                break;
+            case JOB_REQUEST:
+                push(TASK_TIT, JOB_LWIP_OUT, SIM_LWIP_US, done.t0_us, done.client);
+                break;
+            case JOB_LWIP_OUT:
+                push(TASK_WIFI, JOB_SEGMENT_OUT, SIM_WIFI_SEGMENT_US, done.t0_us, done.client);
+                break;
+            case JOB_SEGMENT_OUT:
+                // back at the client a trip through the air later, which sends the next one straight away
+                requests++;
+                rtts_ms.push_back((now + 1 + SIM_AIR_US - sent_us[done.client]) / 1000.0);
+                air.push({ now + 1 + 2 * SIM_AIR_US, done.client });
+                break;
+            default:
+                break;
+            }
+        }
+    }
+
+    sim_result_t r;
+    r.offered = (double)offered / seconds;
+    r.handled = (double)handled / seconds;
+    r.dropped = dropped;
+    r.wait_p99_ms = quantile(waits_ms, 0.99);
+    r.wait_max_ms = waits_ms.empty() ? 0 : waits_ms.back();
+    r.requests = (double)requests / seconds;
+    r.rtt_p50_ms = quantile(rtts_ms, 0.5);
+    r.rtt_p99_ms = quantile(rtts_ms, 0.99);
+    for (int core = 0; core < 2; core++)
+    {
+        r.busy_pct[core] = 100.0 * busy_us[core] / end_us;
+    }
+    return r;
+}
+
+int main(int argc, char **argv)
+{
+    int seconds = argc > 1 ? atoi(argv[1]) : 30;
+    int clients = argc > 2 ? atoi(argv[2]) : 8;
+    srand48(argc > 3 ? atol(argv[3]) : 1);
+
+    printf("%d s, %d TCP clients, %d records a frame, ring of %d, stats every %d s (%d bytes at %d baud)\n\n",
+           seconds, clients, SIM_FRAME_RECORDS, ESPNOW_RING_SLOTS, SIM_STATS_MS / 1000, SIM_STATS_BYTES, SIM_UART_BAUD);
+    printf("%-7s %9s %9s %8s %9s %9s %8s %8s %8s %7s %7s\n", "layout", "frames/s", "handled", "dropped",
+           "p99 wait", "max wait", "req/s", "p50 rtt", "p99 rtt", "core 0", "core 1");
+
+    static const double FRAME_RATES[] = { 250, 1000, 2000, 3000 };
+    for (double rate : FRAME_RATES)
+    {
+        for (int pinned = 0; pinned <= 1; pinned++)
+        {
+            sim_result_t r = simulate(pinned, rate, clients, seconds);
+            printf("%-7s %9.0f %9.0f %8lu %7.1fms %7.1fms %8.0f %6.1fms %6.1fms %6.1f%% %6.1f%%\n",
+                   pinned ? "pinned" : "old", r.offered, r.handled, (unsigned long)r.dropped,
+                   r.wait_p99_ms, r.wait_max_ms, r.requests, r.rtt_p50_ms, r.rtt_p99_ms,
+                   r.busy_pct[0], r.busy_pct[1]);
+        }
+    }
+    return 0;
+}
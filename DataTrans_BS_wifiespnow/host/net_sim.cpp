@@ -0,0 +1,412 @@
+/*
+    Many slaves and one base station on the simulated radio (dt_transport_sim.h), on Linux.
+    Every slave runs the real send path, espnow_batch into espnow_txq into the transport,
+    and the base station decodes and tracks what arrives with the real node_table
+
+    g++ -std=c++17 -O2 -DDT_SIM_CLOCK -I include -I ../DataTrans_common/include -I ../DataTrans_slave_wifiespnow/include \
+        host/net_sim.cpp src/node_table.cpp ../DataTrans_slave_wifiespnow/src/espnow_batch.cpp \
+        ../DataTrans_slave_wifiespnow/src/espnow_txq.cpp ../DataTrans_slave_wifiespnow/src/rate_ctl.cpp -o net_sim
+    ./net_sim [slaves] [seconds] [seed]
+
+    Every slave makes one sensor sample at a fixed rate (starting at a random point in the
+    first second) and batches it for the base station. The sample's value is when it was
+    made, so the base station gets the latency of each record from sampling to arrival,
+    batching wait included. The first table raises the rate until the channel is full, the
+    second keeps the rate and adds loss. Offered and delivered are records per second for
+    the whole network. The last two drop the channel's bitrate for a while and bring it
+    back, first with the fixed batch deadline, then with every slave's rate controller
+    (rate_ctl.h, fed the way the firmware feeds it) setting how often it sends a frame
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <vector>
+
+#include "dt_port.h"
+#include "dt_frame.h"
+#include "dt_transport_sim.h"
+#include "espnow_batch.h"
+#include "espnow_txq.h"
+#include "node_table.h"
+#include "rate_ctl.h"
+#include "shared_buf.h"
+
+#define SIM_STEP_US 1000            // how often the slaves' tasks get to run
+#define SIM_DRAIN_US 3000000        // after the last sample, for what is still queued to get there
+#define SIM_BATCH_LATENCY_MS 500    // the slave's ESPNOW_BATCH_LATENCY_MS
+#define SIM_TX_WINDOW 2             // the slave's ESPNOW_TX_WINDOW
+#define SIM_TX_ATTEMPTS 3           // the slave's ESPNOW_TX_ATTEMPTS
+#define SIM_BS 0                    // node index of the base station, slaves are 1..n
+#define SIM_SLICE_US 5000000        // one row of the rate control table per
+
+typedef struct
+{
+    int index;
+    dt_transport_t *radio;
+    espnow_batch_t batch;
+    espnow_txq_t txq;
+    shared_buf_t bufs[ESPNOW_TXQ_DEPTH];
+    std::atomic<uint16_t> buf_next[ESPNOW_TXQ_DEPTH];
+    block_pool_t pool;
+    int64_t next_sample_us;
+    rate_ctl_t rate;
+    uint32_t congestion;            // txq timeouts + rejected, last seen
+} sim_slave_t;
+
+static dt_sim_radio_t s_radio;
+static sim_slave_t *s_slaves;
+static int s_slave_count;
+static int s_current;               // slave whose batch/txq is running, their send callbacks take no context
+static uint8_t s_bs_mac[6];
+
+static node_table_t s_nodes;
+static std::vector<uint32_t> s_latency_us;
+static uint32_t s_offered;
+static uint32_t s_bad_frames;
+static bool s_adaptive;             // rate_ctl sets the slaves' batch deadline and txq timeout, as in the firmware
+
+// the txq's send, the slave's radio
+static int slave_raw_send(const uint8_t *peer_addr, const uint8_t *frame, size_t len)
+{
+    return dt_transport_send(s_slaves[s_current].radio, peer_addr, frame, len);
+}
+
+// the batch's send, same as espnow_batch_send in the slave
+static int slave_batch_send(const uint8_t *peer_addr, const uint8_t *frame, size_t len)
+{
+    return espnow_txq_push(&s_slaves[s_current].txq, peer_addr, frame, len);
+}
+
+// The firmware hands this over to its sender task, here it just runs
+static void slave_on_sent(dt_transport_t *t, const uint8_t *dst_mac, bool success)
+{
+    sim_slave_t *slave = (sim_slave_t *)t->user;
+    s_current = slave->index;
+    int32_t driver_us = espnow_txq_on_sent(&slave->txq, dst_mac, success);
+    if (s_adaptive && success && driver_us >= 0)
+    {
+        rate_ctl_on_ack(&slave->rate, (uint32_t)driver_us, esp_timer_get_time());
+        espnow_txq_set_timeout_us(&slave->txq, rate_ctl_rto_us(&slave->rate, 0));
+    }
+    else if (s_adaptive && !success)
+    {
+        rate_ctl_on_loss(&slave->rate, esp_timer_get_time());
+    }
+    espnow_txq_poll(&slave->txq);
+}
+
+static void bs_on_recv(dt_transport_t *, const uint8_t *src_mac, int8_t, const uint8_t *data, size_t len)
+{
+    dt_frame_view_t view;
+    if (dt_frame_decode(data, len, &view) <= 0 || view.hdr->type != DT_TYPE_BATCH)
+    {
+        s_bad_frames++;
+        return;
+    }
+
+    int64_t now = esp_timer_get_time();
+    // a frame whose ACK got lost is sent again, count its records once
+    node_state_t *node = node_table_get(&s_nodes, src_mac);
+    if (node != NULL)
+    {
+        uint32_t duplicates = node->duplicates;
+        node_track_frame(node, view.hdr->node_id, view.hdr->seq, view.hdr->timestamp_us, now);
+        if (node->duplicates != duplicates)
+        {
+            return;
+        }
+    }
+
+    size_t offset = 0;
+    const dt_record_hdr_t *rec;
+    const uint8_t *rec_data;
+    while (dt_record_next(view.payload, view.hdr->len, &offset, &rec, &rec_data))
+    {
+        if (rec->type == DT_TYPE_SENSOR && rec->len == sizeof(dt_sample_t))
+        {
+            dt_sample_t sample;
+            memcpy(&sample, rec_data, sizeof(sample));
+            s_latency_us.push_back((uint32_t)now - (uint32_t)sample.value);
+        }
+    }
+}
+
+// the slave's ESP-NOW frame rate control, same numbers
+static const rate_ctl_config_t s_rate_config =
+{
+    .min_milli = 200,
+    .max_milli = 10 * RATE_CTL_MILLI,
+    .start_milli = 1000000 / SIM_BATCH_LATENCY_MS,
+    .increase_milli = 1 * RATE_CTL_MILLI,
+    .decrease_pct = 70,
+    .rtt_margin_us = 20000,
+    .holdoff_ms = 500,
+};
+
+static void sim_reset(int slaves, double loss, uint32_t seed)
+{
+    dt_sim_config_t config = dt_sim_default_config();
+    config.loss = loss;
+    config.seed = seed;
+    dt_sim_radio_init(&s_radio, slaves + 1, &config);
+
+    dt_transport_t *bs = dt_sim_radio_node(&s_radio, SIM_BS);
+    dt_transport_set_callbacks(bs, bs_on_recv, NULL, NULL);
+    dt_transport_own_mac(bs, s_bs_mac);
+    node_table_init(&s_nodes);
+    s_latency_us.clear();
+    s_offered = 0;
+    s_bad_frames = 0;
+
+    delete[] s_slaves;
+    s_slaves = new sim_slave_t[slaves];
+    s_slave_count = slaves;
+    for (int i = 0; i < slaves; i++)
+    {
+        sim_slave_t *s = &s_slaves[i];
+        s->index = i;
+        s->radio = dt_sim_radio_node(&s_radio, i + 1);
+        dt_transport_set_callbacks(s->radio, NULL, slave_on_sent, s);
+        dt_transport_add_peer(s->radio, s_bs_mac, 1);
+
+        shared_buf_pool_init(&s->pool, s->bufs, s->buf_next, ESPNOW_TXQ_DEPTH);
+        espnow_txq_init(&s->txq, SIM_TX_WINDOW, SIM_TX_ATTEMPTS, slave_raw_send, &s->pool);
+        espnow_batch_init(&s->batch, (uint16_t)(i + 1), SIM_BATCH_LATENCY_MS, slave_batch_send);
+        rate_ctl_init(&s->rate, &s_rate_config);
+        s->congestion = 0;
+    }
+}
+
+// One step of every slave: sample, batch, send
+static void sim_step(uint32_t rate, int64_t now, int64_t duration_us)
+{
+    dt_sim_radio_run_until(&s_radio, now);
+
+    for (int i = 0; i < s_slave_count; i++)
+    {
+        sim_slave_t *s = &s_slaves[i];
+        s_current = i;
+        while (s->next_sample_us <= now && s->next_sample_us < duration_us)
+        {
+            dt_sample_t sample = {0, (int32_t)s->next_sample_us};
+            espnow_batch_add(&s->batch, s_bs_mac, DT_TYPE_SENSOR, &sample, sizeof(sample));
+            s->next_sample_us += 1000000 / rate;
+            s_offered++;
+        }
+        if (s_adaptive)
+        {
+            espnow_batch_set_latency_us(&s->batch, rate_ctl_period_us(&s->rate));
+        }
+        espnow_batch_poll(&s->batch);
+        espnow_txq_poll(&s->txq);
+
+        // callbacks that never came and a full queue are losses too, as in the firmware
+        uint32_t congestion = s->txq.timeouts + s->txq.rejected;
+        if (s_adaptive && congestion != s->congestion)
+        {
+            rate_ctl_on_loss(&s->rate, now);
+        }
+        s->congestion = congestion;
+    }
+}
+
+static void sim_start(void)
+{
+    // The slaves booted at random times in the first second. If they all started within one
+    // sample period their batch deadlines would line up and every frame would go out in one burst
+    for (int i = 0; i < s_slave_count; i++)
+    {
+        s_slaves[i].next_sample_us = dt_sim_random(&s_radio) % 1000000;
+    }
+}
+
+static void sim_run(uint32_t rate, int64_t duration_us)
+{
+    sim_start();
+    for (int64_t now = 0; now < duration_us + SIM_DRAIN_US; now += SIM_STEP_US)
+    {
+        sim_step(rate, now, duration_us);
+    }
+}
+
+static double percentile_ms(const std::vector<uint32_t> &sorted, double p)
+{
+    if (sorted.empty())
+    {
+        return 0.0;
+    }
+    size_t i = (size_t)(p * sorted.size());
+    return sorted[i < sorted.size() ? i : sorted.size() - 1] / 1000.0;
+}
+
+static void print_row(const char *label, int64_t duration_us)
+{
+    uint32_t frames = 0, rejected = 0, gave_up = 0, retries = 0, seq_lost = 0;
+    for (int i = 0; i < s_slave_count; i++)
+    {
+        frames += s_slaves[i].batch.stats.frames;
+        rejected += s_slaves[i].txq.rejected;
+        const espnow_txq_peer_stats_t *st = espnow_txq_peer_stats(&s_slaves[i].txq, 0);
+        if (st != NULL)
+        {
+            gave_up += st->failed;
+            retries += st->retries;
+        }
+    }
+    for (int i = 0; i < NODE_TABLE_SIZE; i++)
+    {
+        seq_lost += s_nodes.nodes[i].used ? s_nodes.nodes[i].lost : 0;
+    }
+
+    std::sort(s_latency_us.begin(), s_latency_us.end());
+    double seconds = duration_us / 1e6;
+    double sim_seconds = dt_sim_clock_us / 1e6;
+    printf("%-8s %9.0f %9.0f %8.2f%% %8.1f %6.1f %6.1f%% %8.1f %8.1f %8.1f %7lu %7lu %7lu %7lu\n",
+           label, s_offered / seconds, s_latency_us.size() / seconds,
+           s_offered ? 100.0 * s_latency_us.size() / s_offered : 0.0,
+           frames / seconds, frames ? (double)s_offered / frames : 0.0,
+           100.0 * s_radio.stats.airtime_us / (sim_seconds * 1e6),
+           percentile_ms(s_latency_us, 0.5), percentile_ms(s_latency_us, 0.99),
+           s_latency_us.empty() ? 0.0 : s_latency_us.back() / 1000.0,
+           (unsigned long)retries, (unsigned long)gave_up, (unsigned long)rejected, (unsigned long)seq_lost);
+}
+
+static void print_header(void)
+{
+    printf("%-8s %9s %9s %9s %8s %6s %7s %8s %8s %8s %7s %7s %7s %7s\n",
+           "", "offered", "deliv", "deliv", "frames/s", "rec/fr", "busy", "p50 ms", "p99 ms", "max ms",
+           "retries", "gave up", "q full", "seq gap");
+}
+
+static void print_phase_header(void)
+{
+    printf("%-8s %5s %9s %9s %8s %8s %6s %8s %8s %8s %8s %8s %6s\n",
+           "time", "kbps", "offered", "deliv", "deliv", "frames/s", "busy", "wait ms", "min", "max", "p50 ms", "p99 ms", "cuts");
+}
+
+/*
+    The bitrate changes at the start of each phase, one row per SIM_SLICE_US. Wait is how
+    long a slave's frame waits to fill (the batch deadline) as the slaves' mean, min and max
+*/
+static void sim_run_phases(uint32_t rate, bool adaptive, int64_t duration_us, const uint32_t *kbps, int phases)
+{
+    s_adaptive = adaptive;
+    sim_start();
+
+    int64_t phase_us = duration_us / phases;
+    int64_t slice_end_us = SIM_SLICE_US;
+    size_t slice_first = 0;
+    uint32_t slice_offered = 0;
+    uint32_t slice_frames = 0;
+    uint32_t slice_cuts = 0;
+    uint64_t slice_airtime_us = 0;
+    char label[32];
+
+    for (int64_t now = 0; now < duration_us; now += SIM_STEP_US)
+    {
+        int phase = (int)(now / phase_us);
+        s_radio.config.bitrate_kbps = kbps[phase < phases ? phase : phases - 1];
+        sim_step(rate, now, duration_us);
+
+        if (now + SIM_STEP_US < slice_end_us)
+        {
+            continue;
+        }
+
+        uint32_t frames = 0, cuts = 0;
+        double wait_sum = 0, wait_min = 1e12, wait_max = 0;
+        for (int i = 0; i < s_slave_count; i++)
+        {
+            double wait = s_slaves[i].batch.max_latency_us / 1000.0;
+            wait_sum += wait;
+            wait_min = wait < wait_min ? wait : wait_min;
+            wait_max = wait > wait_max ? wait : wait_max;
+            frames += s_slaves[i].batch.stats.frames;
+            cuts += s_slaves[i].rate.stats.decreases;
+        }
+
+        std::vector<uint32_t> slice(s_latency_us.begin() + slice_first, s_latency_us.end());
+        std::sort(slice.begin(), slice.end());
+        double seconds = SIM_SLICE_US / 1e6;
+        uint32_t offered = s_offered - slice_offered;
+        snprintf(label, sizeof(label), "%.0f s", slice_end_us / 1e6);
+        printf("%-8s %5u %9.0f %9.0f %7.1f%% %8.1f %5.1f%% %8.0f %8.0f %8.0f %8.1f %8.1f %6lu\n",
+               label, s_radio.config.bitrate_kbps, offered / seconds, slice.size() / seconds,
+               offered ? 100.0 * slice.size() / offered : 0.0,
+               (frames - slice_frames) / seconds,
+               100.0 * (s_radio.stats.airtime_us - slice_airtime_us) / SIM_SLICE_US,
+               wait_sum / s_slave_count, wait_min, wait_max,
+               percentile_ms(slice, 0.5), percentile_ms(slice, 0.99),
+               (unsigned long)(cuts - slice_cuts));
+
+        slice_first = s_latency_us.size();
+        slice_offered = s_offered;
+        slice_frames = frames;
+        slice_cuts = cuts;
+        slice_airtime_us = s_radio.stats.airtime_us;
+        slice_end_us += SIM_SLICE_US;
+    }
+}
+
+int main(int argc, char **argv)
+{
+    int slaves = argc > 1 ? atoi(argv[1]) : 100;
+    int seconds = argc > 2 ? atoi(argv[2]) : 60;
+    uint32_t seed = argc > 3 ? (uint32_t)atol(argv[3]) : 1;
+    int64_t duration_us = (int64_t)seconds * 1000000;
+    char label[32];
+
+    // the txq warns about every frame it gives up on
+    esp_log_level_set("*", ESP_LOG_ERROR);
+
+    if (slaves < 1 || slaves >= NODE_TABLE_SIZE || seconds < 1)
+    {
+        fprintf(stderr, "1 to %d slaves, at least 1 second\n", NODE_TABLE_SIZE - 1);
+        return 1;
+    }
+
+    dt_sim_config_t config = dt_sim_default_config();
+    printf("%d slaves for %d s, %u kbps, %u + %u us latency, batches wait up to %d ms, window %d, %d attempts\n\n",
+           slaves, seconds, config.bitrate_kbps, config.latency_us, config.jitter_us,
+           SIM_BATCH_LATENCY_MS, SIM_TX_WINDOW, SIM_TX_ATTEMPTS);
+
+    printf("samples per second per slave, no loss\n");
+    print_header();
+    static const uint32_t rates[] = {1, 10, 20, 50, 100, 150, 200, 400};
+    for (uint32_t rate : rates)
+    {
+        sim_reset(slaves, 0.0, seed);
+        sim_run(rate, duration_us);
+        snprintf(label, sizeof(label), "%u/s", rate);
+        print_row(label, duration_us);
+    }
+
+    printf("\n20 samples per second per slave, loss\n");
+    print_header();
+    static const double losses[] = {0.0, 0.05, 0.10, 0.20, 0.30};
+    for (double loss : losses)
+    {
+        sim_reset(slaves, loss, seed);
+        sim_run(20, duration_us);
+        snprintf(label, sizeof(label), "%.0f%%", loss * 100);
+        print_row(label, duration_us);
+    }
+
+    static const uint32_t kbps[] = {1000, 250, 500, 1000};
+    printf("\n20 samples per second per slave, bitrate %u -> %u -> %u -> %u kbps, fixed %d ms batch deadline\n",
+           kbps[0], kbps[1], kbps[2], kbps[3], SIM_BATCH_LATENCY_MS);
+    print_phase_header();
+    sim_reset(slaves, 0.0, seed);
+    sim_run_phases(20, false, duration_us * 4, kbps, 4);
+
+    printf("\nthe same, frame rate from rate_ctl, %.1f to %.1f frames/s per slave\n",
+           s_rate_config.min_milli / (float)RATE_CTL_MILLI, s_rate_config.max_milli / (float)RATE_CTL_MILLI);
+    print_phase_header();
+    sim_reset(slaves, 0.0, seed);
+    sim_run_phases(20, true, duration_us * 4, kbps, 4);
+    s_adaptive = false;
+
+    delete[] s_slaves;
+    return 0;
+}
@@ -0,0 +1,336 @@
+/*
+    peer_slots.h on Linux, with a fake ESP-NOW peer table behind the add/del callbacks
+
+    g++ -std=c++17 -O2 -I include -I ../DataTrans_common/include host/peer_slots_test.cpp src/peer_slots.cpp -o peer_slots_test
+    ./peer_slots_test [random ops] [seed]
+
+    lru:      acquiring past max_registered unregisters the registered slave quiet longest,
+              and only registered ones
+    forget:   admitting one more than PEER_SLOTS_MAX_NODES forgets the quietest known slave,
+              unregisters it if it was registered, and the newcomer gets its TDMA slot
+    add fail: an add that fails leaves the slave unregistered, counts register_failures, and
+              whoever was evicted to make room stays evicted
+    random:   admits, touches and acquires at random with adds failing now and then. After
+              every one the fake table and the counts have to agree, and registered never
+              goes past max_registered. Exits 1 if anything is off
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "dt_port.h"
+#include "peer_slots.h"
+
+#define TEST_MAX_REGISTERED 19      // the base station's, ESP_NOW_MAX_TOTAL_PEER_NUM less the broadcast peer
+
+static peer_slots_t s_ps;
+static int s_failures;
+
+// the fake ESP-NOW peer table
+static uint8_t s_table[PEER_SLOTS_MAX_NODES + 1][6];
+static int s_table_count;
+static int s_table_max;
+static bool s_fail_add;
+static uint8_t s_last_del[6];
+
+#define CHECK(cond)                                                         \
+    do                                                                      \
+    {                                                                       \
+        if (!(cond))                                                        \
+        {                                                                   \
+            printf("  FAIL %s:%d: %s\n", __FILE__, __LINE__, #cond);        \
+            s_failures++;                                                   \
+        }                                                                   \
+    } while (0)
+
+static int table_find(const uint8_t *mac)
+{
+    for (int i = 0; i < s_table_count; i++)
+    {
+        if (memcmp(s_table[i], mac, 6) == 0)
+        {
+            return i;
+        }
+    }
+    return -1;
+}
+
+// like esp_now_add_peer: fails on a full table or a peer it already has
+static int fake_add(const uint8_t *mac)
+{
+    if (s_fail_add || s_table_count == s_table_max || table_find(mac) >= 0)
+    {
+        return -1;
+    }
+    memcpy(s_table[s_table_count++], mac, 6);
+    return 0;
+}
+
+static int fake_del(const uint8_t *mac)
+{
+    memcpy(s_last_del, mac, 6);
+    int i = table_find(mac);
+    if (i < 0)
+    {
+        return -1;
+    }
+    memcpy(s_table[i], s_table[--s_table_count], 6);
+    return 0;
+}
+
+static void mac_of(int n, uint8_t *mac)
+{
+    const uint8_t base[6] = { 0x24, 0x0A, 0xC4, 0x00, 0x00, 0x00 };
+    memcpy(mac, base, 6);
+    mac[4] = (uint8_t)(n >> 8);
+    mac[5] = (uint8_t)n;
+}
+
+static void reset(int max_registered)
+{
+    peer_slots_init(&s_ps, max_registered, fake_add, fake_del);
+    s_table_count = 0;
+    s_table_max = max_registered;
+    s_fail_add = false;
+    memset(s_last_del, 0, sizeof(s_last_del));
+}
+
+static peer_entry_t *admit(int n, int64_t now)
+{
+    uint8_t mac[6];
+    mac_of(n, mac);
+    return peer_slots_admit(&s_ps, mac, (uint16_t)n, now);
+}
+
+static int acquire(int n, int64_t now)
+{
+    uint8_t mac[6];
+    mac_of(n, mac);
+    return peer_slots_acquire(&s_ps, mac, now);
+}
+
+static bool touch(int n, int64_t now)
+{
+    uint8_t mac[6];
+    mac_of(n, mac);
+    return peer_slots_touch(&s_ps, mac, now);
+}
+
+static bool in_table(int n)
+{
+    uint8_t mac[6];
+    mac_of(n, mac);
+    return table_find(mac) >= 0;
+}
+
+static bool last_del_was(int n)
+{
+    uint8_t mac[6];
+    mac_of(n, mac);
+    return memcmp(s_last_del, mac, 6) == 0;
+}
+
+// Everything the entries say against the counts and the fake table
+static void check_consistent(void)
+{
+    int known = 0, registered = 0;
+    for (int i = 0; i < PEER_SLOTS_MAX_NODES; i++)
+    {
+        const peer_entry_t *e = &s_ps.entries[i];
+        if (!e->used)
+        {
+            CHECK(!e->registered);
+            continue;
+        }
+        known++;
+        registered += e->registered;
+        CHECK(e->registered == (table_find(e->mac) >= 0));
+    }
+    CHECK(known == s_ps.known);
+    CHECK(registered == s_ps.registered);
+    CHECK(s_table_count == s_ps.registered);
+    CHECK(s_ps.registered <= s_ps.max_registered);
+}
+
+static void test_lru(void)
+{
+    reset(4);
+    for (int n = 1; n <= 6; n++)
+    {
+        CHECK(admit(n, n) != NULL);
+    }
+    for (int n = 1; n <= 4; n++)
+    {
+        CHECK(acquire(n, 10 + n) == 0);
+    }
+    CHECK(s_ps.registered == 4);
+
+    // 1 was registered first but is busy again, 2 is now the quietest registered one.
+    // 5 and 6 are quieter still but not registered, they don't count
+    CHECK(touch(1, 20));
+    CHECK(acquire(5, 21) == 0);
+    CHECK(last_del_was(2));
+    CHECK(!in_table(2) && in_table(5));
+    CHECK(s_ps.registered == 4);
+    CHECK(s_ps.stats.evictions == 1);
+
+    // sending to one that is registered already costs nothing
+    CHECK(acquire(3, 22) == 0);
+    CHECK(s_ps.stats.evictions == 1);
+
+    // 4 is next, then 1
+    CHECK(acquire(6, 23) == 0);
+    CHECK(last_del_was(4));
+    CHECK(acquire(2, 24) == 0);
+    CHECK(last_del_was(1));
+    CHECK(s_ps.stats.registrations == 7);
+    CHECK(s_ps.stats.evictions == 3);
+
+    // never joined
+    CHECK(acquire(99, 25) == -1);
+    CHECK(!touch(99, 25));
+    check_consistent();
+}
+
+static void test_forget(void)
+{
+    reset(TEST_MAX_REGISTERED);
+    for (int n = 1; n <= PEER_SLOTS_MAX_NODES; n++)
+    {
+        CHECK(admit(n, n) != NULL);
+    }
+    CHECK(s_ps.known == PEER_SLOTS_MAX_NODES);
+    CHECK(peer_slots_highest_slot(&s_ps) == PEER_SLOTS_MAX_NODES);
+
+    // everyone speaks again but 7, and 7 is registered
+    CHECK(acquire(7, 100) == 0);
+    for (int n = 1; n <= PEER_SLOTS_MAX_NODES; n++)
+    {
+        if (n != 7)
+        {
+            CHECK(touch(n, 200 + n));
+        }
+    }
+    uint16_t slot_7 = 0;
+    for (int i = 0; i < PEER_SLOTS_MAX_NODES; i++)
+    {
+        if (s_ps.entries[i].node_id == 7)
+        {
+            slot_7 = peer_slots_slot(&s_ps, &s_ps.entries[i]);
+        }
+    }
+
+    peer_entry_t *entry = admit(1000, 300);
+    CHECK(entry != NULL);
+    CHECK(entry != NULL && entry->node_id == 1000 && !entry->registered);
+    CHECK(entry != NULL && peer_slots_slot(&s_ps, entry) == slot_7);
+    CHECK(!touch(7, 301));
+    CHECK(!in_table(7) && last_del_was(7));
+    CHECK(s_ps.known == PEER_SLOTS_MAX_NODES);
+    CHECK(s_ps.stats.forgotten == 1);
+    CHECK(s_ps.stats.evictions == 1);
+
+    // the next to go is 1, quietest of the rest, and it was never registered
+    CHECK(admit(1001, 302) != NULL);
+    CHECK(!touch(1, 303));
+    CHECK(s_ps.stats.forgotten == 2);
+    CHECK(s_ps.stats.evictions == 1);
+
+    // a rejoin is not a new slave and forgets nobody
+    CHECK(admit(1000, 304) == entry);
+    CHECK(s_ps.stats.rejoined == 1);
+    CHECK(s_ps.stats.forgotten == 2);
+    check_consistent();
+}
+
+static void test_add_fail(void)
+{
+    reset(2);
+    for (int n = 1; n <= 3; n++)
+    {
+        CHECK(admit(n, n) != NULL);
+    }
+
+    s_fail_add = true;
+    CHECK(acquire(1, 10) == -1);
+    CHECK(s_ps.stats.register_failures == 1);
+    CHECK(s_ps.registered == 0);
+    check_consistent();
+
+    s_fail_add = false;
+    CHECK(acquire(1, 11) == 0);
+    CHECK(acquire(2, 12) == 0);
+
+    // full: 1 is evicted for 3, then the add fails. 1 stays out, 3 isn't in
+    s_fail_add = true;
+    CHECK(acquire(3, 13) == -1);
+    CHECK(!in_table(1) && !in_table(3) && in_table(2));
+    CHECK(s_ps.registered == 1);
+    CHECK(s_ps.stats.register_failures == 2);
+    check_consistent();
+
+    // and the next try has room without evicting anyone
+    s_fail_add = false;
+    uint32_t evictions = s_ps.stats.evictions;
+    CHECK(acquire(3, 14) == 0);
+    CHECK(s_ps.stats.evictions == evictions);
+    CHECK(s_ps.registered == 2);
+    check_consistent();
+}
+
+static void test_random(uint32_t ops, uint32_t seed)
+{
+    reset(TEST_MAX_REGISTERED);
+    srand(seed);
+    int before = s_failures;
+    for (uint32_t i = 0; i < ops && s_failures == before; i++)
+    {
+        int64_t now = 1000 + i;
+        int n = 1 + rand() % (PEER_SLOTS_MAX_NODES * 2);
+        s_fail_add = rand() % 20 == 0;
+        switch (rand() % 4)
+        {
+        case 0:
+            CHECK(admit(n, now) != NULL);
+            break;
+        case 1:
+            touch(n, now);
+            break;
+        default:
+            acquire(n, now);
+            break;
+        }
+        check_consistent();
+    }
+    printf("random: %lu ops, %lu admitted, %lu forgotten, %lu registrations, %lu evictions, %lu add failures\n",
+           (unsigned long)ops, (unsigned long)s_ps.stats.admitted, (unsigned long)s_ps.stats.forgotten,
+           (unsigned long)s_ps.stats.registrations, (unsigned long)s_ps.stats.evictions,
+           (unsigned long)s_ps.stats.register_failures);
+}
+
+int main(int argc, char **argv)
+{
+    uint32_t ops = argc > 1 ? (uint32_t)atol(argv[1]) : 200000;
+    uint32_t seed = argc > 2 ? (uint32_t)atol(argv[2]) : 1;
+    esp_log_level_set("*", ESP_LOG_ERROR);
+
+    struct
+    {
+        const char *name;
+        void (*run)(void);
+    } tests[] = {
+        { "lru", test_lru },
+        { "forget", test_forget },
+        { "add fail", test_add_fail },
+    };
+    for (auto &t : tests)
+    {
+        int before = s_failures;
+        t.run();
+        printf("%-22s %s\n", t.name, s_failures == before ? "ok" : "FAILED");
+    }
+    test_random(ops, seed);
+
+    printf(s_failures ? "%d checks failed\n" : "all passed\n", s_failures);
+    return s_failures ? 1 : 0;
+}
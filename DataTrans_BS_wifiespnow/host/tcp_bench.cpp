@@ -0,0 +1,558 @@
+/*
+    Load generator and benchmark for the base station TCP server, on Linux
+
+    g++ -std=c++17 -O2 -pthread -I include -I ../DataTrans_common/include \
+        host/tcp_bench.cpp src/tcp_server.cpp src/tcp_requests.cpp src/metrics.cpp src/ts_store.cpp -o tcp_bench
+    ./tcp_bench [-s slaves] [-w window] [-r requests per connection] [-p period ms]
+                [-t seconds] [-W warm up seconds] [-T client threads] [-c host:port]
+                [-m min requests/s] [-l max p99 us]
+
+    Unless -c points it at a server that is already running (e.g. a real base station),
+    the server is this binary forked off: the same tcp_server.cpp / tcp_requests.cpp
+    as the firmware, with POSIX sockets in place of lwIP, its logging sent to /dev/null.
+
+    Each simulated slave does what tcp_client() does: a DT_TYPE_TEXT frame with the same
+    message, up to `window` of them in flight, each answered by a DT_TYPE_RESPONSE with
+    the request's seq. -p 0 (the default) sends as fast as the responses come back,
+    -r N closes and reconnects after every N responses to load accept() as well.
+
+    Reports requests/s, connections/s and request latency (send to response) p50, p99 and
+    p999, once a second and for the whole run. With -m or -l it exits 1 when the run
+    does worse, so it can gate a change before it is flashed.
+*/
+#include <poll.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include <sys/wait.h>
+#include <algorithm>
+#include <atomic>
+#include <thread>
+#include <vector>
+
+#include "dt_frame.h"
+#include "tcp_server.h"
+#include "tcp_requests.h"
+
+#define BENCH_PORT 5055
+#define BENCH_MAX_WINDOW 16
+#define BENCH_RX_SIZE 512
+#define BENCH_POLL_MS 10
+#define BENCH_RETRY_MS 100          // after a refused or dropped connection
+#define BENCH_SERVER_WAIT_MS 2000   // for the forked server to start listening
+
+static const char *MESSAGE = "Message from ESP32 TCP Socket Client";
+
+typedef enum
+{
+    SLAVE_IDLE,
+    SLAVE_CONNECTING,
+    SLAVE_READY,
+} slave_state_t;
+
+typedef struct
+{
+    int sock;
+    uint8_t state;
+    uint16_t node_id;
+    uint32_t seq;
+
+    int64_t connect_start_us;
+    int64_t next_try_us;
+    int64_t next_send_us;
+    uint32_t sent_on_conn;
+    uint32_t done_on_conn;
+    bool answered;              // got a response in the measured part
+
+    // requests waiting for their response, oldest first. Responses come back in order
+    int in_flight;
+    int head;
+    uint32_t sent_seq[BENCH_MAX_WINDOW];
+    int64_t sent_us[BENCH_MAX_WINDOW];
+
+    size_t rx_len;
+    uint8_t rx_buf[BENCH_RX_SIZE];
+} bench_slave_t;
+
+typedef struct
+{
+    std::atomic<uint64_t> requests;
+    std::atomic<uint64_t> connects;
+    std::atomic<uint64_t> errors;           // refused, dropped, or a response that does not match
+
+    // only from the measured part of the run, read once the threads have stopped
+    std::vector<uint32_t> latency_us;
+    std::vector<uint32_t> connect_us;
+    int answered;
+} bench_thread_t;
+
+typedef struct
+{
+    int slaves;
+    int window;
+    uint32_t per_conn;          // 0 = keep the connection
+    int period_ms;              // 0 = flat out
+    int seconds;
+    int warmup_s;
+    int threads;
+    struct sockaddr_in addr;
+    double min_rps;
+    double max_p99_us;
+} bench_config_t;
+
+static bench_config_t s_cfg;
+static std::atomic<bool> s_stop;
+static std::atomic<bool> s_measuring;
+
+static void slave_close(bench_slave_t *slave, int64_t retry_us)
+{
+    if (slave->sock >= 0)
+    {
+        close(slave->sock);
+    }
+    slave->sock = -1;
+    slave->state = SLAVE_IDLE;
+    slave->next_try_us = retry_us;
+    slave->in_flight = 0;
+    slave->rx_len = 0;
+}
+
+static void slave_connect(bench_slave_t *slave, bench_thread_t *t, int64_t now)
+{
+    slave->sock = socket(AF_INET, SOCK_STREAM, IPPROTO_IP);
+    if (slave->sock < 0)
+    {
+        t->errors++;
+        slave_close(slave, now + BENCH_RETRY_MS * 1000);
+        return;
+    }
+    dt_set_nonblocking(slave->sock);
+    int opt = 1;
+    setsockopt(slave->sock, IPPROTO_TCP, TCP_NODELAY, &opt, sizeof(opt));
+
+    slave->connect_start_us = now;
+    slave->sent_on_conn = 0;
+    slave->done_on_conn = 0;
+    if (connect(slave->sock, (struct sockaddr *)&s_cfg.addr, sizeof(s_cfg.addr)) == 0 || errno == EINPROGRESS)
+    {
+        slave->state = SLAVE_CONNECTING;
+        return;
+    }
+    t->errors++;
+    slave_close(slave, now + BENCH_RETRY_MS * 1000);
+}
+
+static void slave_connected(bench_slave_t *slave, bench_thread_t *t, int64_t now)
+{
+    int err = 0;
+    socklen_t len = sizeof(err);
+    getsockopt(slave->sock, SOL_SOCKET, SO_ERROR, &err, &len);
+    if (err != 0)
+    {
+        t->errors++;
+        slave_close(slave, now + BENCH_RETRY_MS * 1000);
+        return;
+    }
+
+    slave->state = SLAVE_READY;
+    slave->next_send_us = now;
+    t->connects++;
+    if (s_measuring.load(std::memory_order_relaxed))
+    {
+        t->connect_us.push_back((uint32_t)(now - slave->connect_start_us));
+    }
+}
+
+static void slave_send(bench_slave_t *slave, bench_thread_t *t, int64_t now)
+{
+    while (slave->in_flight < s_cfg.window && now >= slave->next_send_us &&
+           (s_cfg.per_conn == 0 || slave->sent_on_conn < s_cfg.per_conn))
+    {
+        uint8_t frame[DT_FRAME_MAX_SIZE];
+        size_t frame_len = dt_frame_encode(frame, sizeof(frame), DT_TYPE_TEXT, slave->node_id, slave->seq,
+                                           (uint32_t)now, MESSAGE, strlen(MESSAGE));
+
+        // a frame is far smaller than the socket buffer, half of one is as good as an error
+        if (send(slave->sock, frame, frame_len, 0) != (ssize_t)frame_len)
+        {
+            t->errors++;
+            slave_close(slave, now + BENCH_RETRY_MS * 1000);
+            return;
+        }
+
+        int i = (slave->head + slave->in_flight) % BENCH_MAX_WINDOW;
+        slave->sent_seq[i] = slave->seq++;
+        slave->sent_us[i] = now;
+        slave->in_flight++;
+        slave->sent_on_conn++;
+        if (s_cfg.period_ms > 0)
+        {
+            // on the schedule rather than from now, unless it has fallen a whole period behind
+            slave->next_send_us += s_cfg.period_ms * 1000;
+            if (slave->next_send_us < now)
+            {
+                slave->next_send_us = now + s_cfg.period_ms * 1000;
+            }
+        }
+    }
+}
+
+static void slave_receive(bench_slave_t *slave, bench_thread_t *t, int64_t now)
+{
+    ssize_t n = recv(slave->sock, slave->rx_buf + slave->rx_len, sizeof(slave->rx_buf) - slave->rx_len, 0);
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+    {
+        return;
+    }
+    if (n <= 0)
+    {
+        // turned away (every client slot in use) or dropped
+        t->errors++;
+        slave_close(slave, now + BENCH_RETRY_MS * 1000);
+        return;
+    }
+    slave->rx_len += n;
+
+    size_t used = 0;
+    while (used < slave->rx_len)
+    {
+        dt_frame_view_t resp;
+        int frame_len = dt_frame_decode(slave->rx_buf + used, slave->rx_len - used, &resp);
+        if (frame_len == 0)
+        {
+            break;
+        }
+        if (frame_len < 0 || resp.hdr->type != DT_TYPE_RESPONSE || slave->in_flight == 0 ||
+            resp.hdr->seq != slave->sent_seq[slave->head])
+        {
+            t->errors++;
+            slave_close(slave, now + BENCH_RETRY_MS * 1000);
+            return;
+        }
+
+        if (s_measuring.load(std::memory_order_relaxed))
+        {
+            t->latency_us.push_back((uint32_t)(now - slave->sent_us[slave->head]));
+            slave->answered = true;
+        }
+        slave->head = (slave->head + 1) % BENCH_MAX_WINDOW;
+        slave->in_flight--;
+        slave->done_on_conn++;
+        t->requests.fetch_add(1, std::memory_order_relaxed);
+        used += frame_len;
+    }
+    memmove(slave->rx_buf, slave->rx_buf + used, slave->rx_len - used);
+    slave->rx_len -= used;
+
+    // all of this connection's requests answered, straight on to the next one
+    if (s_cfg.per_conn > 0 && slave->done_on_conn >= s_cfg.per_conn)
+    {
+        slave_close(slave, now);
+    }
+}
+
+static void client_thread(bench_thread_t *t, int first_slave, int count)
+{
+    std::vector<bench_slave_t> slaves(count);
+    std::vector<struct pollfd> fds(count);
+    std::vector<int> which(count);
+
+    for (int i = 0; i < count; i++)
+    {
+        memset(&slaves[i], 0, sizeof(slaves[i]));
+        slaves[i].sock = -1;
+        slaves[i].node_id = (uint16_t)(first_slave + i + 1);
+    }
+
+    while (!s_stop.load(std::memory_order_relaxed))
+    {
+        int64_t now = esp_timer_get_time();
+        int nfds = 0;
+        int64_t wait_us = BENCH_POLL_MS * 1000;
+
+        for (int i = 0; i < count; i++)
+        {
+            bench_slave_t *slave = &slaves[i];
+            if (slave->state == SLAVE_IDLE && now >= slave->next_try_us)
+            {
+                slave_connect(slave, t, now);
+            }
+            if (slave->state == SLAVE_READY)
+            {
+                slave_send(slave, t, now);
+            }
+
+            if (slave->state == SLAVE_IDLE)
+            {
+                wait_us = std::min(wait_us, slave->next_try_us - now);
+                continue;
+            }
+            if (slave->state == SLAVE_READY && slave->in_flight == 0 && s_cfg.period_ms > 0)
+            {
+                wait_us = std::min(wait_us, slave->next_send_us - now);
+            }
+            fds[nfds].fd = slave->sock;
+            fds[nfds].events = slave->state == SLAVE_CONNECTING ? POLLOUT : POLLIN;
+            fds[nfds].revents = 0;
+            which[nfds] = i;
+            nfds++;
+        }
+
+        int ready = poll(fds.data(), nfds, wait_us > 0 ? (int)((wait_us + 999) / 1000) : 0);
+        if (ready <= 0)
+        {
+            continue;
+        }
+
+        now = esp_timer_get_time();
+        for (int k = 0; k < nfds; k++)
+        {
+            if (fds[k].revents == 0)
+            {
+                continue;
+            }
+            bench_slave_t *slave = &slaves[which[k]];
+            if (slave->state == SLAVE_CONNECTING)
+            {
+                slave_connected(slave, t, now);
+            }
+            else if (slave->state == SLAVE_READY)
+            {
+                slave_receive(slave, t, now);
+            }
+        }
+    }
+
+    // a connection the server never got round to accepting (listen backlog overflow) looks
+    // fine from this end, it just never hears anything
+    for (int i = 0; i < count; i++)
+    {
+        t->answered += slaves[i].answered;
+        slave_close(&slaves[i], 0);
+    }
+}
+
+static double percentile(const std::vector<uint32_t> &sorted, double p)
+{
+    if (sorted.empty())
+    {
+        return 0;
+    }
+    size_t i = (size_t)(p * sorted.size());
+    return sorted[i < sorted.size() ? i : sorted.size() - 1];
+}
+
+static pid_t start_server(uint16_t port)
+{
+    pid_t pid = fork();
+    if (pid != 0)
+    {
+        return pid;
+    }
+
+    // the server logs every connection, keep that out of the report
+    int null_fd = open("/dev/null", O_WRONLY);
+    dup2(null_fd, STDOUT_FILENO);
+    signal(SIGPIPE, SIG_IGN);
+    tcp_requests_init();
+    tcp_server_run(port, tcp_handle_request, NULL);
+    _exit(1);
+}
+
+// Until something is listening on the address
+static bool wait_for_server(void)
+{
+    int64_t give_up_us = esp_timer_get_time() + BENCH_SERVER_WAIT_MS * 1000;
+    while (esp_timer_get_time() < give_up_us)
+    {
+        int sock = socket(AF_INET, SOCK_STREAM, IPPROTO_IP);
+        bool up = connect(sock, (struct sockaddr *)&s_cfg.addr, sizeof(s_cfg.addr)) == 0;
+        close(sock);
+        if (up)
+        {
+            return true;
+        }
+        dt_delay_ms(20);
+    }
+    return false;
+}
+
+static void usage(const char *name)
+{
+    fprintf(stderr, "usage: %s [-s slaves] [-w window] [-r requests per connection] [-p period ms] [-t seconds]\n"
+                    "          [-W warm up seconds] [-T client threads] [-c host:port] [-m min req/s] [-l max p99 us]\n", name);
+    exit(2);
+}
+
+int main(int argc, char **argv)
+{
+    const char *server = NULL;
+    s_cfg.slaves = 16;
+    s_cfg.window = 1;
+    s_cfg.per_conn = 0;
+    s_cfg.period_ms = 0;
+    s_cfg.seconds = 5;
+    s_cfg.warmup_s = 1;
+    s_cfg.threads = 1;
+    s_cfg.min_rps = 0;
+    s_cfg.max_p99_us = 0;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "s:w:r:p:t:W:T:c:m:l:")) != -1)
+    {
+        switch (opt)
+        {
+            case 's': s_cfg.slaves = atoi(optarg); break;
+            case 'w': s_cfg.window = atoi(optarg); break;
+            case 'r': s_cfg.per_conn = (uint32_t)atoi(optarg); break;
+            case 'p': s_cfg.period_ms = atoi(optarg); break;
+            case 't': s_cfg.seconds = atoi(optarg); break;
+            case 'W': s_cfg.warmup_s = atoi(optarg); break;
+            case 'T': s_cfg.threads = atoi(optarg); break;
+            case 'c': server = optarg; break;
+            case 'm': s_cfg.min_rps = atof(optarg); break;
+            case 'l': s_cfg.max_p99_us = atof(optarg); break;
+            default: usage(argv[0]);
+        }
+    }
+    if (s_cfg.slaves < 1 || s_cfg.window < 1 || s_cfg.window > BENCH_MAX_WINDOW || s_cfg.seconds < 1 ||
+        s_cfg.warmup_s < 0 || s_cfg.threads < 1)
+    {
+        usage(argv[0]);
+    }
+    s_cfg.threads = std::min(s_cfg.threads, s_cfg.slaves);
+
+    char host[64] = "127.0.0.1";
+    uint16_t port = BENCH_PORT;
+    if (server != NULL)
+    {
+        const char *colon = strchr(server, ':');
+        size_t host_len = colon != NULL ? (size_t)(colon - server) : strlen(server);
+        snprintf(host, sizeof(host), "%.*s", (int)std::min(host_len, sizeof(host) - 1), server);
+        port = colon != NULL ? (uint16_t)atoi(colon + 1) : 5000;
+    }
+    s_cfg.addr.sin_family = AF_INET;
+    s_cfg.addr.sin_port = htons(port);
+    if (inet_pton(AF_INET, host, &s_cfg.addr.sin_addr) != 1)
+    {
+        fprintf(stderr, "bad address %s\n", host);
+        return 2;
+    }
+
+    signal(SIGPIPE, SIG_IGN);
+    pid_t server_pid = server == NULL ? start_server(port) : 0;
+    if (!wait_for_server())
+    {
+        fprintf(stderr, "nothing listening on %s:%u\n", host, port);
+        if (server_pid > 0)
+        {
+            kill(server_pid, SIGTERM);
+        }
+        return 2;
+    }
+
+    printf("%s:%u (%s), %d slaves, window %d, %s, %s, %d client threads\n", host, port,
+           server == NULL ? "forked server" : "external server", s_cfg.slaves, s_cfg.window,
+           s_cfg.per_conn ? "reconnecting" : "one connection each", s_cfg.period_ms ? "paced" : "flat out", s_cfg.threads);
+    if (s_cfg.per_conn)
+    {
+        printf("reconnect every %u responses\n", s_cfg.per_conn);
+    }
+    if (s_cfg.period_ms)
+    {
+        printf("one request every %d ms per slave\n", s_cfg.period_ms);
+    }
+
+    std::vector<bench_thread_t> threads(s_cfg.threads);
+    std::vector<std::thread> workers;
+    for (int i = 0; i < s_cfg.threads; i++)
+    {
+        int first = s_cfg.slaves * i / s_cfg.threads;
+        int last = s_cfg.slaves * (i + 1) / s_cfg.threads;
+        workers.emplace_back(client_thread, &threads[i], first, last - first);
+    }
+
+    // warm up, then the measured part with a line a second
+    dt_delay_ms(s_cfg.warmup_s * 1000);
+    uint64_t start_requests = 0, start_connects = 0, start_errors = 0;
+    for (bench_thread_t &t : threads)
+    {
+        start_requests += t.requests.load();
+        start_connects += t.connects.load();
+        start_errors += t.errors.load();
+    }
+    s_measuring.store(true);
+    int64_t start_us = esp_timer_get_time();
+
+    uint64_t last_requests = start_requests, last_connects = start_connects;
+    for (int s = 1; s <= s_cfg.seconds; s++)
+    {
+        dt_delay_ms((uint32_t)((start_us + s * 1000000LL - esp_timer_get_time()) / 1000));
+        uint64_t requests = 0, connects = 0, errors = 0;
+        for (bench_thread_t &t : threads)
+        {
+            requests += t.requests.load();
+            connects += t.connects.load();
+            errors += t.errors.load();
+        }
+        printf("%3d s: %8llu req/s %7llu conn/s %6llu errors\n", s,
+               (unsigned long long)(requests - last_requests), (unsigned long long)(connects - last_connects),
+               (unsigned long long)(errors - start_errors));
+        last_requests = requests;
+        last_connects = connects;
+    }
+
+    s_measuring.store(false);
+    double elapsed_s = (esp_timer_get_time() - start_us) / 1e6;
+    s_stop.store(true);
+    for (std::thread &w : workers)
+    {
+        w.join();
+    }
+    if (server_pid > 0)
+    {
+        kill(server_pid, SIGTERM);
+        waitpid(server_pid, NULL, 0);
+    }
+
+    std::vector<uint32_t> latency, connect_latency;
+    uint64_t errors = 0;
+    int answered = 0;
+    for (bench_thread_t &t : threads)
+    {
+        answered += t.answered;
+        latency.insert(latency.end(), t.latency_us.begin(), t.latency_us.end());
+        connect_latency.insert(connect_latency.end(), t.connect_us.begin(), t.connect_us.end());
+        errors += t.errors.load();
+    }
+    std::sort(latency.begin(), latency.end());
+    std::sort(connect_latency.begin(), connect_latency.end());
+
+    double rps = latency.size() / elapsed_s;
+    double p99 = percentile(latency, 0.99);
+    printf("\nrequests     %10zu  %9.0f /s\n", latency.size(), rps);
+    printf("connections  %10zu  %9.0f /s\n", connect_latency.size(), connect_latency.size() / elapsed_s);
+    printf("errors       %10llu\n", (unsigned long long)(errors - start_errors));
+    printf("answered     %10d  of %d slaves\n", answered, s_cfg.slaves);
+    printf("latency us   p50 %.0f  p99 %.0f  p999 %.0f  max %.0f\n", percentile(latency, 0.5), p99,
+           percentile(latency, 0.999), latency.empty() ? 0.0 : (double)latency.back());
+    if (!connect_latency.empty())
+    {
+        printf("connect us   p50 %.0f  p99 %.0f  p999 %.0f  max %.0f\n", percentile(connect_latency, 0.5),
+               percentile(connect_latency, 0.99), percentile(connect_latency, 0.999), (double)connect_latency.back());
+    }
+
+    bool failed = false;
+    if (s_cfg.min_rps > 0 && rps < s_cfg.min_rps)
+    {
+        printf("FAIL: %.0f req/s, wanted at least %.0f\n", rps, s_cfg.min_rps);
+        failed = true;
+    }
+    if (s_cfg.max_p99_us > 0 && p99 > s_cfg.max_p99_us)
+    {
+        printf("FAIL: p99 %.0f us, wanted at most %.0f\n", p99, s_cfg.max_p99_us);
+        failed = true;
+    }
+    return failed ? 1 : 0;
+}
@@ -0,0 +1,27 @@
+/*
+    Linux build of the base station TCP server, for load testing without an ESP32
+
+    g++ -std=c++17 -O2 -I include -I ../DataTrans_common/include \
+        host/tcp_server_main.cpp src/tcp_server.cpp src/tcp_requests.cpp src/metrics.cpp src/ts_store.cpp -o bs_tcp_server
+
+    curl http://127.0.0.1:5000/metrics for the metrics page
+*/
+#include <signal.h>
+#include <stdlib.h>
+
+#include "tcp_server.h"
+#include "tcp_requests.h"
+
+#define PORT 5000
+
+int main(int argc, char **argv)
+{
+    uint16_t port = argc > 1 ? (uint16_t)atoi(argv[1]) : PORT;
+
+    // a client going away mid-send should close that connection, not kill the server
+    signal(SIGPIPE, SIG_IGN);
+
+    tcp_requests_init();
+
+    return tcp_server_run(port, tcp_handle_request, NULL) < 0 ? 1 : 0;
+}
@@ -0,0 +1,425 @@
+/*
+    The base station's time series store (ts_store.h) on Linux: how fast samples go in, how
+    long a query takes, and whether its answers are right
+
+    g++ -std=c++17 -O2 -pthread -I include -I ../DataTrans_common/include host/ts_bench.cpp src/ts_store.cpp -o ts_bench
+    ./ts_bench [nodes, up to TS_MAX_SERIES] [samples/s per node] [minutes] [seed]
+
+    Each slave sends a batch every BENCH_BATCH_MS (a random phase each, at least one sample in
+    it), every sample stamped with the batch's send time on the base station's clock, one
+    channel per slave, the way the rx worker calls ts_store_add. Batches arrive up to
+    BENCH_JITTER_MS later and in that order, so a slave's can come in behind another's stamped
+    later. One in BENCH_REPLAY_EVERY is a spool replay and arrives BENCH_REPLAY_MS late. Times
+    are simulated, only the store calls are timed
+
+    ingest:  nodes/4, nodes/2, nodes*3/2 and nodes slaves for `minutes` of samples each. Past
+             TS_MAX_SERIES series get recycled, which the third row always is. "late" are
+             samples the store dropped for being older than their series' open 1 s bucket. For
+             the last row the bench works out on its own which those should be, and keeps only
+             the rest to check the queries against
+    query:   on the `nodes` store, at the end, BENCH_QUERIES queries of random slaves for each
+             range: one bucket for all of it, and DT_TS_MAX_BUCKETS (what fits in one
+             DT_TYPE_TS_RESULT frame). Every bucket is checked against all the samples kept
+             on the side: count, min and max exactly, mean to within 1. "raw" is what the
+             samples in the range would take as DT_TYPE_SENSOR records, "reply" the result frame
+    both:    a writer thread keeps ingesting while a reader thread queries, like the rx worker
+             and the TCP task. Checks every bucket the reader gets is in one piece
+             (min <= mean <= max) and counts how often it had to copy a series again. The
+             writer goes flat out, thousands of times what 64 slaves send, so that is the worst
+             it gets
+    stale:   a slave replays a batch from BENCH_STALE_MIN minutes ago, its 32 bit stamp wrapped
+             into the future, then goes on live. The stamp has to be turned down, the store has
+             to drop the sample if it gets it anyway, and every live one after has to be kept.
+             Exits 1 if not
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <algorithm>
+#include <atomic>
+#include <thread>
+#include <vector>
+
+#include "dt_port.h"
+#include "dt_frame.h"
+#include "ts_store.h"
+
+#define BENCH_BATCH_MS 500              // the slave's batch deadline
+#define BENCH_QUERIES 20000
+#define BENCH_BOTH_SECONDS 2
+#define BENCH_VALUE_START 180000        // free heap, what the slaves send on channel 0
+#define BENCH_JITTER_MS 30              // send to arrival, the send queue and the rx ring
+#define BENCH_REPLAY_EVERY 500
+#define BENCH_REPLAY_MS 3000
+#define BENCH_STALE_MIN 40              // past the 35.8 min a stamp can say
+
+typedef struct
+{
+    int64_t t_ms;                       // the slave's stamp
+    int64_t rx_ms;
+    uint16_t node;
+    int32_t value;
+} bench_event_t;
+
+typedef struct
+{
+    uint32_t t_ms;
+    int32_t value;
+} bench_point_t;
+
+// Every sample sent that the store should have kept, per slave, to check the answers against
+static std::vector<std::vector<bench_point_t>> s_history;
+static std::vector<int64_t> s_open_ms;              // per slave, start of the 1 s bucket still filling
+static uint64_t s_late_expected;
+
+static int64_t bench_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+typedef struct
+{
+    int nodes;
+    int rate;
+    std::vector<int> phase_ms;
+    std::vector<int32_t> value;
+    int64_t second;                     // next simulated second to make
+} bench_load_t;
+
+static void load_init(bench_load_t *load, int nodes, int rate)
+{
+    load->nodes = nodes;
+    load->rate = rate;
+    load->phase_ms.resize(nodes);
+    load->value.resize(nodes);
+    for (int n = 0; n < nodes; n++)
+    {
+        load->phase_ms[n] = (int)(lrand48() % BENCH_BATCH_MS);
+        load->value[n] = BENCH_VALUE_START + (int32_t)(lrand48() % 20000);
+    }
+    load->second = 0;
+}
+
+// One simulated second of batches from every slave, in arrival order. A replay comes in with this second's last ones
+static void load_second(bench_load_t *load, std::vector<bench_event_t> &events)
+{
+    int per_batch = load->rate * BENCH_BATCH_MS / 1000;
+    per_batch = per_batch < 1 ? 1 : per_batch;
+    events.clear();
+    for (int n = 0; n < load->nodes; n++)
+    {
+        for (int b = 0; b < 1000 / BENCH_BATCH_MS; b++)
+        {
+            int64_t t = load->second * 1000 + load->phase_ms[n] + b * BENCH_BATCH_MS;
+            int64_t rx = t + lrand48() % BENCH_JITTER_MS;
+            if (lrand48() % BENCH_REPLAY_EVERY == 0)
+            {
+                t -= BENCH_REPLAY_MS;
+            }
+            for (int i = 0; i < per_batch; i++)
+            {
+                load->value[n] += (int32_t)(lrand48() % 2001) - 1000;
+                events.push_back({ t, rx, (uint16_t)(n + 1), load->value[n] });
+            }
+        }
+    }
+    std::stable_sort(events.begin(), events.end(),
+                     [](const bench_event_t &a, const bench_event_t &b) { return a.rx_ms < b.rx_ms; });
+    load->second++;
+}
+
+// Returns ns per sample
+static double ingest(ts_store_t *store, bench_load_t *load, int seconds, bool keep)
+{
+    std::vector<bench_event_t> events;
+    int64_t ns = 0;
+    uint64_t count = 0;
+    for (int s = 0; s < seconds; s++)
+    {
+        load_second(load, events);
+        int64_t start = bench_ns();
+        for (const bench_event_t &e : events)
+        {
+            ts_store_add(store, e.node, 0, e.value, e.t_ms, e.rx_ms);
+        }
+        ns += bench_ns() - start;
+        count += events.size();
+
+        if (keep)
+        {
+            for (const bench_event_t &e : events)
+            {
+                if (e.t_ms < s_open_ms[e.node])
+                {
+                    s_late_expected++;
+                    continue;
+                }
+                s_open_ms[e.node] = std::max(s_open_ms[e.node], e.t_ms - e.t_ms % 1000);
+                s_history[e.node].push_back({ (uint32_t)e.t_ms, e.value });
+            }
+        }
+    }
+    if (keep)
+    {
+        // a little out of order within a second, expected() wants them sorted
+        for (std::vector<bench_point_t> &h : s_history)
+        {
+            std::stable_sort(h.begin(), h.end(), [](const bench_point_t &a, const bench_point_t &b) { return a.t_ms < b.t_ms; });
+        }
+    }
+    return (double)ns / count;
+}
+
+// What the bucket [from, to) should say, straight from the samples
+static ts_bucket_t expected(uint16_t node, int64_t from_ms, int64_t to_ms)
+{
+    const std::vector<bench_point_t> &h = s_history[node];
+    auto lo = std::lower_bound(h.begin(), h.end(), from_ms,
+                               [](const bench_point_t &p, int64_t t) { return (int64_t)p.t_ms < t; });
+    ts_bucket_t b = { INT32_MAX, INT32_MIN, 0, 0 };
+    int64_t sum = 0;
+    for (auto it = lo; it != h.end() && (int64_t)it->t_ms < to_ms; ++it)
+    {
+        b.min = std::min(b.min, it->value);
+        b.max = std::max(b.max, it->value);
+        sum += it->value;
+        b.count++;
+    }
+    if (b.count == 0)
+    {
+        b.min = b.max = 0;
+    }
+    else
+    {
+        b.mean = (int32_t)((double)sum / b.count + (sum >= 0 ? 0.5 : -0.5));
+    }
+    return b;
+}
+
+static int64_t percentile(std::vector<int64_t> &v, double q)
+{
+    if (v.empty())
+    {
+        return 0;
+    }
+    std::sort(v.begin(), v.end());
+    return v[(size_t)(q * (v.size() - 1))];
+}
+
+static void query_table(ts_store_t *store, int nodes, int64_t now_ms)
+{
+    static const int64_t RANGES_MS[] = { 1000, 10000, 60000, 600000, 3600000, 6600000 };
+    static const char *const RANGE_NAMES[] = { "1 s", "10 s", "1 min", "10 min", "1 h", "1 h 50" };
+
+    printf("\n%-8s %8s %7s %9s %9s %8s %10s %8s %6s\n",
+           "range", "buckets", "step", "p50 ns", "p99 ns", "samples", "raw B", "reply B", "wrong");
+    for (size_t r = 0; r < sizeof(RANGES_MS) / sizeof(RANGES_MS[0]); r++)
+    {
+        for (int whole = 1; whole >= 0; whole--)
+        {
+            std::vector<int64_t> lat;
+            uint64_t samples = 0, wrong = 0;
+            int n = 0;
+            uint32_t step = 0;
+            for (int q = 0; q < BENCH_QUERIES; q++)
+            {
+                uint16_t node = (uint16_t)(1 + lrand48() % nodes);
+                ts_bucket_t out[TS_QUERY_MAX_BUCKETS];
+                int64_t first_ms;
+                uint32_t step_ask = whole ? 0 : (uint32_t)(RANGES_MS[r] / DT_TS_MAX_BUCKETS);
+                int max_out = whole ? 1 : DT_TS_MAX_BUCKETS;
+
+                int64_t start = bench_ns();
+                n = ts_store_query(store, node, 0, now_ms - RANGES_MS[r], now_ms, step_ask, out, max_out, &first_ms, &step);
+                lat.push_back(bench_ns() - start);
+
+                for (int k = 0; k < n; k++)
+                {
+                    ts_bucket_t e = expected(node, first_ms + (int64_t)k * step, first_ms + (int64_t)(k + 1) * step);
+                    samples += e.count;
+                    if (e.count != out[k].count || e.min != out[k].min || e.max != out[k].max ||
+                        abs(e.mean - out[k].mean) > 1)
+                    {
+                        wrong++;
+                    }
+                }
+            }
+            char step_text[16];
+            if (step % 1000 == 0)
+            {
+                snprintf(step_text, sizeof(step_text), "%us", step / 1000);
+            }
+            else
+            {
+                snprintf(step_text, sizeof(step_text), "%ums", step);
+            }
+            uint64_t per_query = samples / BENCH_QUERIES;
+            printf("%-8s %8d %7s %9lld %9lld %8llu %10llu %8d %6llu\n",
+                   whole ? RANGE_NAMES[r] : "", n, step_text,
+                   (long long)percentile(lat, 0.5), (long long)percentile(lat, 0.99),
+                   (unsigned long long)per_query,
+                   (unsigned long long)(per_query * sizeof(dt_sample_t)),
+                   (int)(DT_FRAME_HDR_SIZE + sizeof(dt_ts_result_t) + n * sizeof(dt_ts_bucket_t)),
+                   (unsigned long long)wrong);
+        }
+    }
+}
+
+static void both(ts_store_t *store, bench_load_t *load)
+{
+    std::atomic<bool> stop(false);
+    std::atomic<uint64_t> written(0);
+    uint32_t retries_before = store->stats.query_retries;
+
+    std::thread writer([&]()
+    {
+        std::vector<bench_event_t> events;
+        while (!stop.load(std::memory_order_relaxed))
+        {
+            load_second(load, events);
+            for (const bench_event_t &e : events)
+            {
+                ts_store_add(store, e.node, 0, e.value, e.t_ms, e.rx_ms);
+            }
+            written.fetch_add(events.size(), std::memory_order_relaxed);
+        }
+    });
+
+    std::vector<int64_t> lat;
+    uint64_t torn = 0, missing = 0;
+    int64_t start = bench_ns();
+    while (bench_ns() - start < BENCH_BOTH_SECONDS * 1000000000LL)
+    {
+        uint16_t node = (uint16_t)(1 + lrand48() % load->nodes);
+        int64_t now_ms = load->second * 1000;
+        ts_bucket_t out[TS_QUERY_MAX_BUCKETS];
+        int64_t first_ms;
+        uint32_t step;
+
+        int64_t q_start = bench_ns();
+        int n = ts_store_query(store, node, 0, now_ms - 600000, now_ms, 0, out, DT_TS_MAX_BUCKETS, &first_ms, &step);
+        lat.push_back(bench_ns() - q_start);
+
+        missing += n < 0;
+        for (int k = 0; k < n; k++)
+        {
+            if (out[k].count > 0 && (out[k].min > out[k].mean || out[k].mean > out[k].max))
+            {
+                torn++;
+            }
+        }
+    }
+    stop.store(true);
+    writer.join();
+    double seconds = (bench_ns() - start) / 1e9;
+
+    printf("\nwriter %.1f M samples/s, reader %.0f queries/s p50 %lld ns p99 %lld ns, "
+           "%.2f copies again per query, %llu torn, %llu not found\n",
+           written.load() / seconds / 1e6, lat.size() / seconds,
+           (long long)percentile(lat, 0.5), (long long)percentile(lat, 0.99),
+           (double)(store->stats.query_retries - retries_before) / lat.size(),
+           (unsigned long long)torn, (unsigned long long)missing);
+}
+
+static bool stale_replay(int rate)
+{
+    static ts_store_t store;
+    ts_store_init(&store);
+    int64_t now_us = 3LL * 3600 * 1000000;
+    int64_t period_us = 1000000 / rate;
+    uint32_t live = 0;
+
+    // the way handle_record stores a live sample stamped when sent, arriving 20 ms later
+    auto send_live = [&](int seconds)
+    {
+        for (int i = 0; i < seconds * rate; i++, now_us += period_us)
+        {
+            int64_t t_ms;
+            if (ts_stamp_ms(now_us + 20000, (uint32_t)now_us, &t_ms))
+            {
+                ts_store_add(&store, 1, 0, BENCH_VALUE_START + i, t_ms, (now_us + 20000) / 1000);
+                live++;
+            }
+        }
+    };
+    send_live(10);
+
+    uint32_t stamp_us = (uint32_t)(now_us - BENCH_STALE_MIN * 60 * 1000000LL);
+    int64_t stale_ms = 0;
+    bool turned_down = !ts_stamp_ms(now_us, stamp_us, &stale_ms);
+    // and the store on its own, given what reading the stamp naively says
+    int64_t naive_ms = (now_us - (int32_t)((uint32_t)now_us - stamp_us)) / 1000;
+    ts_store_add(&store, 1, 0, 0, naive_ms, now_us / 1000);
+    int64_t ahead_s = (naive_ms - now_us / 1000) / 1000;
+
+    uint64_t points = store.stats.points;
+    send_live(60);
+    uint64_t kept = store.stats.points - points;
+
+    ts_bucket_t out;
+    int64_t first_ms;
+    uint32_t step;
+    int64_t now_ms = now_us / 1000;
+    int n = ts_store_query(&store, 1, 0, now_ms - 60000, now_ms + 1000, 0, &out, 1, &first_ms, &step);
+    bool ok = turned_down && store.stats.ahead == 1 && store.stats.late == 0 && kept == (uint64_t)(60 * rate) &&
+              n == 1 && out.count >= (uint32_t)(59 * rate);
+    printf("\nstale replay %d min old: stamp reads %lld s ahead, %s; stored anyway %llu dropped as ahead; "
+           "%llu of %d live samples after it kept, %llu late. %s\n",
+           BENCH_STALE_MIN, (long long)ahead_s, turned_down ? "turned down" : "TAKEN",
+           (unsigned long long)store.stats.ahead, (unsigned long long)kept, 60 * rate,
+           (unsigned long long)store.stats.late, ok ? "ok" : "FAILED");
+    return ok;
+}
+
+int main(int argc, char **argv)
+{
+    int nodes = argc > 1 ? atoi(argv[1]) : 64;
+    int rate = argc > 2 ? atoi(argv[2]) : 10;
+    int minutes = argc > 3 ? atoi(argv[3]) : 120;
+    long seed = argc > 4 ? atol(argv[4]) : 1;
+    if (nodes < 4 || nodes > TS_MAX_SERIES || rate < 1 || minutes < 1)
+    {
+        fprintf(stderr, "usage: %s [nodes, up to %d] [samples/s per node] [minutes] [seed]\n", argv[0], TS_MAX_SERIES);
+        return 1;
+    }
+    srand48(seed);
+
+    static ts_store_t store;
+    printf("%d series of %u bytes, %u KB in all. Levels:", TS_MAX_SERIES,
+           (unsigned)sizeof(ts_series_t), (unsigned)(sizeof(ts_store_t) / 1024));
+    for (int l = 0; l < TS_LEVELS; l++)
+    {
+        int buckets = (l + 1 < TS_LEVELS ? ts_level_offset(l + 1) : TS_BUCKETS) - ts_level_offset(l);
+        printf(" %us x %d", ts_level_window_ms(l) / 1000, buckets);
+    }
+    printf("\n\n%-6s %10s %10s %12s %7s %9s %8s\n", "nodes", "samples", "ns/sample", "samples/s", "series", "recycled", "late");
+
+    int rows[] = { nodes / 4, nodes / 2, nodes * 3 / 2, nodes };
+    bench_load_t load;
+    for (int row : rows)
+    {
+        bool main_row = row == nodes;
+        if (main_row)
+        {
+            s_history.assign(nodes + 1, std::vector<bench_point_t>());
+            s_open_ms.assign(nodes + 1, INT64_MIN);
+            s_late_expected = 0;
+        }
+        ts_store_init(&store);
+        load_init(&load, row, rate);
+        double ns = ingest(&store, &load, minutes * 60, main_row);
+        printf("%-6d %10llu %10.1f %11.1fM %7u %9u %8llu\n", row, (unsigned long long)store.stats.points, ns,
+               1000.0 / ns, store.stats.series, store.stats.recycled, (unsigned long long)store.stats.late);
+    }
+    printf("late for %d nodes: %llu dropped, %llu expected\n", nodes,
+           (unsigned long long)store.stats.late, (unsigned long long)s_late_expected);
+
+    // the last row was `nodes`, query it a little after its last batch, part way into a second
+    query_table(&store, nodes, load.second * 1000 + 777);
+
+    both(&store, &load);
+    return stale_replay(rate) ? 0 : 1;
+}
@@ -0,0 +1,112 @@
+#pragma once
+
+#include <stdint.h>
+#include <string.h>
+#include <atomic>
+
+#include "shared_buf.h"
+
+/*
+    Single producer / single consumer ring for received ESP-NOW frames
+        - Producer is on_data_recv (runs on the wifi task, core 0)
+        - Consumer is the espnow rx worker task (core 1)
+        - head is only written by the producer, tail only by the consumer,
+          so no locks are needed. Both are free running counters and the
+          slot index is counter & (ESPNOW_RING_SLOTS - 1)
+        - The frames themselves are shared_buf_t's from a block pool, so the
+          worker can pass one on (to the TCP bridge) by reference
+*/
+
+#define ESPNOW_RING_SLOTS 32            // Must be a power of 2
+#define ESPNOW_MAX_PAYLOAD SHARED_BUF_SIZE
+
+typedef struct
+{
+    shared_buf_t *slots[ESPNOW_RING_SLOTS];
+    block_pool_t *pool;
+
+    std::atomic<uint32_t> head;         // next slot to write
+    std::atomic<uint32_t> tail;         // next slot to read
+
+    // overflow counters, running out of buffers is counted in pool->exhausted
+    std::atomic<uint32_t> dropped;      // ring full when a frame came in
+    std::atomic<uint32_t> truncated;    // payload bigger than ESPNOW_MAX_PAYLOAD
+    uint32_t high_water;                // most frames ever waiting, updated by the consumer
+} espnow_ring_t;
+
+static_assert((ESPNOW_RING_SLOTS & (ESPNOW_RING_SLOTS - 1)) == 0, "ESPNOW_RING_SLOTS must be a power of 2");
+
+static inline void espnow_ring_init(espnow_ring_t *ring, block_pool_t *pool)
+{
+    ring->pool = pool;
+    ring->head.store(0, std::memory_order_relaxed);
+    ring->tail.store(0, std::memory_order_relaxed);
+    ring->dropped.store(0, std::memory_order_relaxed);
+    ring->truncated.store(0, std::memory_order_relaxed);
+    ring->high_water = 0;
+}
+
+// Producer side. Copies the frame into a pool buffer and returns false if the ring or the pool was full
+static inline bool espnow_ring_push(espnow_ring_t *ring, int64_t rx_us, const uint8_t *mac, int8_t rssi, const uint8_t *data, int len)
+{
+    uint32_t head = ring->head.load(std::memory_order_relaxed);
+    uint32_t tail = ring->tail.load(std::memory_order_acquire);
+
+    if (head - tail >= ESPNOW_RING_SLOTS)
+    {
+        ring->dropped.fetch_add(1, std::memory_order_relaxed);
+        return false;
+    }
+
+    if (len < 0)
+    {
+        len = 0;
+    }
+    if (len > ESPNOW_MAX_PAYLOAD)
+    {
+        ring->truncated.fetch_add(1, std::memory_order_relaxed);
+        len = ESPNOW_MAX_PAYLOAD;
+    }
+
+    shared_buf_t *buf = shared_buf_alloc(ring->pool, data, len, rx_us, mac, rssi);
+    if (buf == NULL)
+    {
+        return false;
+    }
+    ring->slots[head & (ESPNOW_RING_SLOTS - 1)] = buf;
+
+    // publish the slot only after it is fully written
+    ring->head.store(head + 1, std::memory_order_release);
+    return true;
+}
+
+// Consumer side. Number of frames ready to be read
+static inline uint32_t espnow_ring_readable(espnow_ring_t *ring)
+{
+    uint32_t head = ring->head.load(std::memory_order_acquire);
+    uint32_t count = head - ring->tail.load(std::memory_order_relaxed);
+
+    if (count > ring->high_water)
+    {
+        ring->high_water = count;
+    }
+    return count;
+}
+
+// Consumer side. i-th readable frame, valid until espnow_ring_consume unless the caller takes a reference
+static inline shared_buf_t *espnow_ring_peek(espnow_ring_t *ring, uint32_t i)
+{
+    uint32_t tail = ring->tail.load(std::memory_order_relaxed);
+    return ring->slots[(tail + i) & (ESPNOW_RING_SLOTS - 1)];
+}
+
+// Consumer side. Drop the ring's reference to n frames and hand the slots back to the producer
+static inline void espnow_ring_consume(espnow_ring_t *ring, uint32_t n)
+{
+    uint32_t tail = ring->tail.load(std::memory_order_relaxed);
+    for (uint32_t i = 0; i < n; i++)
+    {
+        shared_buf_release(ring->slots[(tail + i) & (ESPNOW_RING_SLOTS - 1)]);
+    }
+    ring->tail.store(tail + n, std::memory_order_release);
+}
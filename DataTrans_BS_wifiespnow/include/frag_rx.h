@@ -0,0 +1,118 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <atomic>
+
+#include "dt_frame.h"
+#include "block_pool.h"
+
+/*
+    Putting DT_TYPE_FRAG messages back together
+        - Up to FRAG_RX_MAX_MSGS messages (any mix of slaves) can be half received at once
+        - Each fragment that arrives is stored in a block from a fixed pool, so the memory
+          for reassembly never goes over FRAG_RX_BLOCKS * DT_FRAG_DATA_SIZE however many
+          slaves are sending
+        - A new message reserves all the blocks it will need up front (the count is in
+          every fragment). If they are not there, messages that have stalled for
+          FRAG_RX_STALL_MS are dropped to make room, and failing that the new message is
+          refused. Admitted messages can always finish, two big ones never take turns
+          evicting each other
+        - Status back to the sender (dt_frag_status_t):
+            - DONE as soon as the last missing fragment arrives
+            - MISSING with a bitmap when the last fragment arrives with gaps before it,
+              or when the message has stalled for FRAG_RX_NACK_MS
+            - DROPPED when it is refused, evicted, or times out after FRAG_RX_TIMEOUT_MS
+        - Finished messages are kept (without their blocks) for FRAG_RX_TIMEOUT_MS, so a
+          sender that missed the DONE gets it again instead of starting over
+        - Not thread safe, runs on the ESP-NOW worker task
+*/
+
+#define FRAG_RX_MAX_MSGS 8
+#define FRAG_RX_BLOCKS 128              // ~28 KB, more than one biggest message (DT_FRAG_MAX_COUNT)
+#define FRAG_RX_TIMEOUT_MS 2000
+#define FRAG_RX_NACK_MS 200
+#define FRAG_RX_STALL_MS 1000           // no progress for this long, can be evicted (a few NACK rounds)
+
+static_assert(FRAG_RX_BLOCKS >= DT_FRAG_MAX_COUNT, "one message of DT_FRAG_MAX_MSG_SIZE has to fit");
+
+typedef int (*frag_rx_send_t)(const uint8_t *peer_addr, const uint8_t *frame, size_t len);
+
+typedef enum
+{
+    FRAG_RX_FREE,
+    FRAG_RX_ASSEMBLING,
+    FRAG_RX_DONE,
+} frag_rx_state_t;
+
+typedef struct
+{
+    uint8_t data[DT_FRAG_DATA_SIZE];
+} frag_block_t;
+
+typedef struct
+{
+    uint8_t state;
+    uint8_t mac[6];
+    uint16_t node_id;
+    uint16_t msg_id;
+    uint8_t type;
+    uint32_t total_len;
+    uint16_t count;
+    uint16_t received;
+
+    frag_block_t *blocks[DT_FRAG_MAX_COUNT];    // NULL until that fragment arrives
+
+    int64_t first_us;
+    int64_t last_rx_us;
+    int64_t last_status_us;
+} frag_rx_msg_t;
+
+// A whole message, read it with frag_rx_piece. Only valid during the call
+typedef void (*frag_rx_deliver_t)(const frag_rx_msg_t *msg);
+
+typedef struct
+{
+    uint32_t fragments;
+    uint32_t duplicates;
+    uint32_t invalid;           // header does not add up, or disagrees with earlier fragments
+    uint32_t no_slot;           // FRAG_RX_MAX_MSGS already in progress
+    uint32_t refused;           // not enough blocks left to reserve
+    uint32_t completed;
+    uint32_t timeouts;
+    uint32_t evicted;           // stalled, dropped to free blocks for another message
+    uint32_t nacks;
+    uint64_t bytes;             // of completed messages
+} frag_rx_stats_t;
+
+typedef struct
+{
+    frag_rx_msg_t msgs[FRAG_RX_MAX_MSGS];
+
+    frag_block_t block_mem[FRAG_RX_BLOCKS];
+    std::atomic<uint16_t> block_next[FRAG_RX_BLOCKS];
+    block_pool_t blocks;
+    uint32_t reserved;          // blocks promised to messages in progress
+
+    // last refused message, so its other fragments do not each get a DROPPED
+    uint8_t refused_mac[6];
+    uint16_t refused_msg_id;
+    int64_t refused_us;
+
+    frag_rx_send_t send;
+    frag_rx_deliver_t deliver;
+    uint32_t seq;
+
+    frag_rx_stats_t stats;
+} frag_rx_t;
+
+void frag_rx_init(frag_rx_t *rx, frag_rx_send_t send, frag_rx_deliver_t deliver);
+
+// A DT_TYPE_FRAG frame from mac
+void frag_rx_on_frame(frag_rx_t *rx, const uint8_t *mac, const dt_frame_hdr_t *hdr, const uint8_t *payload, int64_t now_us);
+
+// Timeouts and missing fragment requests. Returns true while messages are in progress
+bool frag_rx_poll(frag_rx_t *rx, int64_t now_us);
+
+// Fragment i of a finished message, with its length
+const uint8_t *frag_rx_piece(const frag_rx_msg_t *msg, uint16_t i, size_t *len);
@@ -0,0 +1,88 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <atomic>
+
+#include "dt_port.h"
+
+/*
+    Counters and gauges for the base station's /metrics endpoint
+        - Registered once at start up, before anything records to them, and never removed
+        - Every metric has one 32 bit slot per core. metrics_add only touches the slot of
+          the core it is running on with a relaxed atomic add, so the hot path never waits
+          on the other core and the two cores never write the same cache line
+        - A scrape adds the slots up. Values wrap at 32 bits, rate() takes a wrap for a
+          counter reset
+        - Stats other modules already keep (node table, TCP server, pools) are not counted
+          twice, collectors copy them out at scrape time
+        - A rate is a gauge worked out from a counter at scrape time: its increase per
+          second since the scrape before (at least METRICS_RATE_MIN_MS ago)
+        - metrics_render writes the Prometheus text format (version 0.0.4)
+*/
+
+#define METRICS_MAX 32              // registered metrics, not samples
+#define METRICS_MAX_COLLECTORS 8
+#define METRICS_RATE_MIN_MS 1000
+
+typedef uint16_t metric_id_t;
+
+typedef enum
+{
+    METRIC_COUNTER,
+    METRIC_GAUGE,
+    METRIC_HISTOGRAM,           // collectors only: the _bucket{le=...}, _sum and _count samples are theirs to write
+} metric_type_t;
+
+// One core's slots, a cache line to itself
+typedef struct
+{
+    alignas(64) std::atomic<uint32_t> values[METRICS_MAX + 1];     // the extra one soaks up metrics that did not fit
+} metrics_core_t;
+
+extern metrics_core_t metrics_cores[DT_NUM_CORES];
+
+typedef struct
+{
+    char *buf;
+    size_t size;
+    size_t len;
+    bool truncated;             // ran out of room, everything after the last whole line is gone
+} metrics_writer_t;
+
+// Called on the scraping task, adds its own families with metrics_family / metrics_sample
+typedef void (*metrics_collector_t)(metrics_writer_t *w);
+
+// labels is the inside of the braces, e.g. "transport=\"espnow\"", or NULL. Only from one task, at start up
+metric_id_t metrics_counter(const char *name, const char *labels, const char *help);
+metric_id_t metrics_gauge(const char *name, const char *labels, const char *help);
+metric_id_t metrics_rate(const char *name, const char *labels, const char *help, metric_id_t counter);
+
+void metrics_add_collector(metrics_collector_t collector);
+
+// Hot path: a few instructions, no locks, safe from any task or callback
+static inline void metrics_add(metric_id_t id, uint32_t n)
+{
+    metrics_cores[dt_core_id()].values[id].fetch_add(n, std::memory_order_relaxed);
+}
+
+static inline void metrics_inc(metric_id_t id)
+{
+    metrics_add(id, 1);
+}
+
+// Gauges only, they live in core 0's slot
+static inline void metrics_set(metric_id_t id, uint32_t value)
+{
+    metrics_cores[0].values[id].store(value, std::memory_order_relaxed);
+}
+
+// Sum over the cores
+uint32_t metrics_value(metric_id_t id);
+
+// For collectors: the # HELP / # TYPE lines, then one metrics_sample per label set
+void metrics_family(metrics_writer_t *w, const char *name, metric_type_t type, const char *help);
+void metrics_sample(metrics_writer_t *w, const char *name, const char *labels, uint64_t value);
+
+// Everything registered, then every collector. Only from one task. Returns the length written
+size_t metrics_render(char *buf, size_t size);
@@ -0,0 +1,94 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+    Per-slave receive state on the base station, keyed by MAC
+        - Fixed size open addressing hash table (linear probing), all static, so the
+          receive path never touches the heap
+        - Tracks the sequence numbers each slave puts in its frames: gaps are counted as
+          lost, a 64 frame bitmap behind the highest seq spots duplicates and late
+          (reordered) frames, which are taken back off the lost count
+        - Jitter is the RFC 3550 estimate from the sender timestamp vs arrival time
+        - Frames stamped with our own clock (DT_FLAG_MASTER_TIME, the slave's time sync) give
+          the one way latency straight off. Each slave keeps a histogram of it, half octave
+          buckets from NODE_LATENCY_MIN_US, whose counts are all halved when one fills up so
+          it follows what the link is doing now. The whole fleet's goes in a plain counting
+          histogram too, for the metrics page
+        - Frames a slave replays from its flash spool (DT_FLAG_REPLAY) carry the seq and stamp
+          they were made with, long behind the live ones. They are only counted, in replayed
+        - Only the ESP-NOW rx worker uses it, so there is no locking
+*/
+
+#define NODE_TABLE_SIZE 128         // Must be a power of 2, keep well above the number of slaves
+#define NODE_SEQ_WINDOW 64          // bits in the duplicate/reorder window
+#define NODE_SEQ_RESTART_GAP 1024   // seq this far below the highest means the slave rebooted
+#define NODE_LATENCY_MIN_US 128     // everything under goes in bucket 0
+#define NODE_LATENCY_BUCKETS 25     // two per octave, the last one is 393 ms and up
+
+typedef struct
+{
+    uint8_t mac[6];
+    bool used;
+    uint16_t node_id;
+
+    uint32_t highest_seq;
+    uint64_t seq_window;            // bit n set = highest_seq - n was received
+
+    uint32_t received;
+    uint32_t lost;                  // gaps not (yet) filled by a late frame
+    uint32_t duplicates;
+    uint32_t reordered;             // arrived after a higher seq
+    uint32_t max_reorder_depth;     // furthest behind the highest seq a late frame was
+    uint32_t stale;                 // too far behind to tell late from duplicate
+    uint32_t restarts;
+    uint32_t replayed;              // DT_FLAG_REPLAY frames, not in any of the above
+
+    int64_t last_rx_us;
+    uint32_t last_sender_us;
+    uint32_t jitter_us_x16;         // jitter * 16, see node_jitter_us
+
+    // one way latency, see node_track_latency
+    uint16_t latency_hist[NODE_LATENCY_BUCKETS];
+    uint32_t latency_frames;
+    uint32_t latency_early;         // stamped after we got it: the slave's sync is off
+    uint32_t latency_max_us;
+} node_state_t;
+
+typedef struct
+{
+    node_state_t nodes[NODE_TABLE_SIZE];
+    int count;
+    uint32_t full;                  // frames from a new MAC that found no free slot
+
+    // every slave's one way latencies, never halved
+    uint32_t latency_hist[NODE_LATENCY_BUCKETS];
+    uint64_t latency_sum_us;
+    uint32_t latency_frames;
+} node_table_t;
+
+void node_table_init(node_table_t *table);
+
+// Find the slave's entry, adding it if it is new. NULL if the table is full
+node_state_t *node_table_get(node_table_t *table, const uint8_t *mac);
+
+// Account for one received frame
+void node_track_frame(node_state_t *node, uint16_t node_id, uint32_t seq, uint32_t sender_us, int64_t rx_us);
+
+// A frame replayed from the slave's spool, see DT_FLAG_REPLAY. Instead of node_track_frame
+void node_track_replay(node_state_t *node, uint16_t node_id);
+
+// A frame stamped with our clock, sender_us being the low 32 bits of it
+void node_track_latency(node_table_t *table, node_state_t *node, uint32_t sender_us, int64_t rx_us);
+
+// Bottom of latency bucket `bucket`, the top is the next one's
+uint32_t node_latency_bucket_us(int bucket);
+
+// The slave's latency quantile (0.5, 0.99 ...) out of its histogram, 0 with nothing in it
+uint32_t node_latency_quantile_us(const node_state_t *node, float q);
+
+static inline uint32_t node_jitter_us(const node_state_t *node)
+{
+    return node->jitter_us_x16 >> 4;
+}
@@ -0,0 +1,76 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+    ESP-NOW peer slot manager for the base station
+        - esp_now_add_peer only takes ESP_NOW_MAX_TOTAL_PEER_NUM (20) peers, but we only
+          need a slave registered while we are sending to it. Receiving works without
+        - Slaves are admitted (remembered) when they broadcast a join request, up to
+          PEER_SLOTS_MAX_NODES of them
+        - peer_slots_acquire registers a slave before we send to it. When every slot
+          is taken the least recently active registered slave is removed to make room
+        - Activity comes from peer_slots_touch, called for every frame a slave sends
+        - Each known slave also owns a TDMA transmit slot (tdma.h): its entry index + 1,
+          which stays the same for as long as the slave is known
+        - The actual add/remove calls are function pointers so this runs on Linux too
+*/
+
+#define PEER_SLOTS_MAX_NODES 64
+
+typedef int (*peer_slots_add_t)(const uint8_t *mac);
+typedef int (*peer_slots_del_t)(const uint8_t *mac);
+
+typedef struct
+{
+    uint8_t mac[6];
+    bool used;
+    bool registered;
+    uint16_t node_id;
+    int64_t admitted_us;
+    int64_t last_active_us;
+} peer_entry_t;
+
+typedef struct
+{
+    uint32_t admitted;
+    uint32_t rejoined;          // join request from a slave we already knew
+    uint32_t forgotten;         // known slaves dropped to admit a new one
+    uint32_t registrations;     // esp_now_add_peer calls
+    uint32_t evictions;         // esp_now_del_peer calls to free a slot
+    uint32_t register_failures;
+} peer_slots_stats_t;
+
+typedef struct
+{
+    peer_entry_t entries[PEER_SLOTS_MAX_NODES];
+    int known;
+    int registered;
+    int max_registered;
+
+    peer_slots_add_t add;
+    peer_slots_del_t del;
+
+    peer_slots_stats_t stats;
+} peer_slots_t;
+
+void peer_slots_init(peer_slots_t *ps, int max_registered, peer_slots_add_t add, peer_slots_del_t del);
+
+// Join request from a slave. Returns its entry, or NULL if it could not be admitted
+peer_entry_t *peer_slots_admit(peer_slots_t *ps, const uint8_t *mac, uint16_t node_id, int64_t now_us);
+
+// A frame came in from the slave. False if it is not known (never joined, or was forgotten)
+bool peer_slots_touch(peer_slots_t *ps, const uint8_t *mac, int64_t now_us);
+
+// Make sure the slave is registered with ESP-NOW so we can send to it. 0 on success
+int peer_slots_acquire(peer_slots_t *ps, const uint8_t *mac, int64_t now_us);
+
+// TDMA slot owned by the slave, slot 0 is the beacon's
+static inline uint16_t peer_slots_slot(const peer_slots_t *ps, const peer_entry_t *entry)
+{
+    return (uint16_t)(entry - ps->entries) + 1;
+}
+
+// Highest slot owned by any known slave
+uint16_t peer_slots_highest_slot(const peer_slots_t *ps);
@@ -0,0 +1,22 @@
+#pragma once
+
+#include "tcp_server.h"
+#include "ts_store.h"
+
+// Base station replies to TCP clients, one DT_TYPE_RESPONSE frame per request frame.
+// A DT_TYPE_SUBSCRIBE request also subscribes the client to forwarded frames.
+// A DT_TYPE_TS_QUERY is answered with a DT_TYPE_TS_RESULT out of the time series store (see ts_store.h).
+// A plain HTTP "GET /metrics" on the same port gets the metrics page (see metrics.h) and is closed,
+// "GET /trace" gets a dump of the trace rings (see trace.h).
+// Shared by the firmware and the Linux build
+
+#define TCP_METRICS_PAGE_SIZE 8192      // biggest metrics page, the rest is cut off
+#define TCP_METRICS_PAGES 2             // scrapes being sent at once
+
+// Registers the TCP metrics, call once before tcp_server_run
+void tcp_requests_init(void);
+
+// Where DT_TYPE_TS_QUERY looks, without one every query finds nothing
+void tcp_requests_set_ts_store(ts_store_t *store);
+
+size_t tcp_handle_request(tcp_conn_t *conn, const uint8_t *data, size_t len);
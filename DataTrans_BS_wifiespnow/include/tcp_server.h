@@ -0,0 +1,105 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "dt_port.h"
+#include "shared_buf.h"
+
+/*
+    Event driven TCP server
+        - One task, one select() over the listen socket and every client socket
+        - Clients stay connected and can send as many requests as they like
+        - Everything is non-blocking, nothing sleeps between requests
+        - Clients can subscribe to forwarded frames. tcp_server_publish queues a reference
+          to the same shared_buf_t on every subscriber, it is never copied per client
+        - Other tasks wake the select() with tcp_server_wake, which sends a byte to a
+          loopback UDP socket (the same trick esp_http_server uses for its control socket)
+        - A response bigger than the tx buffer (the metrics page) is sent straight out of
+          the caller's memory with tcp_conn_send_body
+*/
+
+#ifdef ESP_PLATFORM
+// lwIP sockets taken by the listen socket and the two wake sockets
+#define TCP_SERVER_MAX_CLIENTS (CONFIG_LWIP_MAX_SOCKETS - 3)
+#else
+#define TCP_SERVER_MAX_CLIENTS 512
+#endif
+
+#define TCP_SERVER_BACKLOG 8
+#define TCP_CONN_RX_SIZE 256
+#define TCP_CONN_TX_SIZE 512
+#define TCP_CONN_FWD_DEPTH 16       // forwarded frames waiting per subscriber
+
+typedef struct tcp_conn tcp_conn_t;
+
+/*
+    Called every time new bytes arrive on a connection with everything buffered so far.
+    Returns how many bytes were used up; anything left over is kept for the next call
+    (so a request split over several segments can wait for the rest).
+*/
+typedef size_t (*tcp_request_handler_t)(tcp_conn_t *conn, const uint8_t *data, size_t len);
+
+// Called on the server task after tcp_server_wake
+typedef void (*tcp_wake_handler_t)(void);
+
+// A tcp_conn_send_body buffer is finished with
+typedef void (*tcp_body_release_t)(const void *data);
+
+typedef struct
+{
+    uint32_t accepted;
+    uint32_t rejected;      // turned away because every client slot was in use
+    uint32_t closed;
+    uint32_t active;
+    uint32_t conn_high_water;       // most connections open at once
+    uint32_t requests;      // handler calls that used up bytes
+    uint64_t rx_bytes;
+    uint64_t tx_bytes;
+
+    uint32_t subscribers;
+    uint32_t forwarded;             // frames fully written to a subscriber
+    uint32_t forward_dropped;       // subscriber already had TCP_CONN_FWD_DEPTH waiting
+    uint32_t forward_latency_us_min;    // radio arrival (shared_buf_t.rx_us) to last byte handed to the socket
+    uint32_t forward_latency_us_max;
+    uint64_t forward_latency_us_sum;
+} tcp_server_stats_t;
+
+// Queue a response on the connection. Returns 0, or -1 if it does not fit in the tx buffer
+int tcp_conn_send(tcp_conn_t *conn, const void *data, size_t len);
+
+/*
+    Queue a response too big for the tx buffer. It goes out straight from data, after
+    whatever tcp_conn_send queued before it, and release(data) is called once the last
+    byte is out or the connection closes. One at a time per connection, returns -1 if
+    there is one already going
+*/
+int tcp_conn_send_body(tcp_conn_t *conn, const void *data, size_t len, tcp_body_release_t release);
+
+// Close the connection once everything queued on it has been sent
+void tcp_conn_close_after_send(tcp_conn_t *conn);
+
+bool tcp_conn_closing(const tcp_conn_t *conn);
+
+// One word the request handler can keep its own per-connection state in, 0 on a new connection
+uint32_t *tcp_conn_user(tcp_conn_t *conn);
+
+// Client address as a string, for logging
+const char *tcp_conn_addr(const tcp_conn_t *conn);
+
+// Start forwarding published frames to this connection
+void tcp_conn_subscribe(tcp_conn_t *conn);
+
+// Server task only. Queue the buffer on every subscriber, taking a reference each. Returns how many
+int tcp_server_publish(shared_buf_t *buf);
+
+// From any task. Makes the server task call its wake handler soon
+void tcp_server_wake(void);
+
+// Safe from any task
+uint32_t tcp_server_subscribers(void);
+
+// Blocks serving clients on the port. on_wake can be NULL. Only returns if the listen socket fails
+int tcp_server_run(uint16_t port, tcp_request_handler_t handler, tcp_wake_handler_t on_wake);
+
+void tcp_server_get_stats(tcp_server_stats_t *stats);
@@ -0,0 +1,137 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <atomic>
+
+/*
+    The slaves' samples kept on the base station, so a TCP client can ask for min/max/mean/count
+    over a time range rather than taking every sample as it arrives
+        - One series per (node_id, channel), TS_MAX_SERIES of them, all static. A new one once
+          they are all taken recycles the one written longest ago
+        - Each series has the last TS_RAW_POINTS samples as they came (time and value in two
+          arrays), and rollups at TS_LEVELS window sizes: 1 s, 10 s, 1 min and 10 min, each a
+          ring of buckets on a grid lined up with its window. min, max, mean and count are an
+          array each too, so a query only walks the columns it needs
+        - The newest bucket of each level is still filling: its sum is kept on the side and the
+          mean worked out when the window closes. Windows nobody sent anything in are empty
+          buckets (count 0)
+        - Times are the base station's, milliseconds. The caller gives the frame's stamp when
+          the slave's time sync put it on our clock (DT_FLAG_MASTER_TIME), the arrival time
+          otherwise. Every sample in a batch gets the same time. The stamp is 32 bits of us and
+          wraps every 71.6 min: ts_stamp_ms reads it as the time nearest the arrival, and turns
+          down one that comes out ahead of it (older than 35.8 min, or from before we rebooted)
+        - A sample older than the 1 s bucket still filling is dropped and counted in
+          stats.late: its window is closed, and merging it into the open one would put it in the
+          wrong place. Frames a few ms out of order between slaves are fine, a slave's spool
+          replayed minutes later is not
+        - A sample more than TS_AHEAD_MS after now is dropped too, and counted in stats.ahead.
+          It would open a bucket in the future, and every sample after it, up to that time,
+          would be late
+        - A query picks the finest level (or the raw points) that still goes back to the start
+          of the range, and merges its buckets into output buckets of `step`. Means are weighted
+          by count. Nothing older than the coarsest level's ring can be asked for
+        - About 57 KB with the defaults (64 series of 904 bytes)
+        - Only the ESP-NOW rx worker writes it. Queries come from the TCP task, and copy the
+          series under a sequence lock (odd while the writer is in it), like time_sync in the slave
+*/
+
+#define TS_MAX_SERIES 64                // keep at or above PEER_SLOTS_MAX_NODES times the channels each sends
+#define TS_RAW_POINTS 16
+#define TS_LEVELS 4
+#define TS_LEVEL_WINDOWS_MS { 1000, 10000, 60000, 600000 }
+#define TS_LEVEL_BUCKETS { 12, 12, 10, 12 }     // 12 s, 2 min, 10 min, 2 h
+#define TS_BUCKETS 46                   // sum of TS_LEVEL_BUCKETS
+#define TS_KEY_NONE UINT32_MAX
+#define TS_QUERY_MAX_BUCKETS 16         // most a query hands back, more makes the step longer
+#define TS_AHEAD_MS 1000                // a sample or stamp further than this after now is not on our clock
+
+typedef struct
+{
+    int64_t newest_start_ms;            // of the bucket still filling
+    int64_t open_sum;
+    uint32_t open_count;                // count[] stops at UINT16_MAX, this doesn't
+    uint8_t head;                       // newest bucket, within the level's part of the arrays
+    uint8_t used;                       // buckets with a window in them, empty or not
+} ts_level_t;
+
+// What a query copies out, everything but the lock
+typedef struct
+{
+    uint32_t key;                       // node_id << 16 | channel, TS_KEY_NONE with nothing in it yet
+    int64_t last_ms;
+    uint32_t points;                    // ever added
+
+    uint32_t raw_t_ms[TS_RAW_POINTS];   // low 32 bits, last_ms puts the rest back
+    int32_t raw_value[TS_RAW_POINTS];
+    uint8_t raw_head;                   // next to write
+    uint8_t raw_count;
+
+    ts_level_t levels[TS_LEVELS];
+    int32_t min[TS_BUCKETS];            // level l's buckets start at ts_level_offset(l)
+    int32_t max[TS_BUCKETS];
+    int32_t mean[TS_BUCKETS];           // not written until the window closes, see ts_level_t
+    uint16_t count[TS_BUCKETS];
+} ts_series_data_t;
+
+typedef struct
+{
+    std::atomic<uint32_t> version;
+    ts_series_data_t data;
+} ts_series_t;
+
+typedef struct
+{
+    uint64_t points;
+    uint64_t late;                      // older than the open 1 s bucket, dropped
+    uint64_t ahead;                     // more than TS_AHEAD_MS after now, dropped
+    uint32_t series;                    // in use
+    uint32_t recycled;                  // series thrown out for a new one
+    uint32_t queries;
+    uint32_t query_retries;             // the writer was in the series, copied again
+} ts_store_stats_t;
+
+typedef struct
+{
+    uint32_t keys[TS_MAX_SERIES];       // copy of each series' key, to look for one without touching the rest
+    ts_series_t series[TS_MAX_SERIES];
+    int last_hit;                       // writer's, a batch is mostly the one series
+    ts_store_stats_t stats;
+} ts_store_t;
+
+// One output bucket of a query, count 0 = nothing in that window
+typedef struct
+{
+    int32_t min;
+    int32_t max;
+    int32_t mean;
+    uint32_t count;
+} ts_bucket_t;
+
+void ts_store_init(ts_store_t *store);
+
+/*
+    A sample from t_ms, added at now_ms. Dropped (stats.late) if the series' 1 s bucket for it is
+    closed already, or (stats.ahead) if it is more than TS_AHEAD_MS after now_ms
+*/
+void ts_store_add(ts_store_t *store, uint16_t node_id, uint16_t channel, int32_t value, int64_t t_ms, int64_t now_ms);
+
+/*
+    A frame's stamp (our clock's low 32 bits, in us) as ms on our clock, given when it arrived.
+    False, and *t_ms left alone, if that puts it more than TS_AHEAD_MS after the arrival
+*/
+bool ts_stamp_ms(int64_t rx_us, uint32_t stamp_us, int64_t *t_ms);
+
+/*
+    Aggregates over [from_ms, to_ms) in buckets of step_ms, 0 = the whole range as one. The step
+    is rounded up to what the level used can do, and further if the range would take more than
+    max_out (at most TS_QUERY_MAX_BUCKETS) buckets. Returns how many were written, -1 if there
+    is no such series. *first_ms and *step_out say where the first bucket starts and how long
+    each one is. Any task
+*/
+int ts_store_query(ts_store_t *store, uint16_t node_id, uint16_t channel, int64_t from_ms, int64_t to_ms,
+                   uint32_t step_ms, ts_bucket_t *out, int max_out, int64_t *first_ms, uint32_t *step_out);
+
+// Window of level l, and where its buckets start in min[] etc
+uint32_t ts_level_window_ms(int level);
+int ts_level_offset(int level);
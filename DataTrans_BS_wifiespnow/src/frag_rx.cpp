@@ -0,0 +1,309 @@
+#include <string.h>
+
+#include "dt_port.h"
+#include "frag_rx.h"
+
+static const char *TAG = "frag_rx";
+
+void frag_rx_init(frag_rx_t *rx, frag_rx_send_t send, frag_rx_deliver_t deliver)
+{
+    for (int i = 0; i < FRAG_RX_MAX_MSGS; i++)
+    {
+        memset(&rx->msgs[i], 0, sizeof(rx->msgs[i]));
+    }
+    block_pool_init(&rx->blocks, rx->block_mem, sizeof(frag_block_t), rx->block_next, FRAG_RX_BLOCKS);
+
+    rx->reserved = 0;
+    memset(rx->refused_mac, 0, sizeof(rx->refused_mac));
+    rx->refused_msg_id = 0;
+    rx->refused_us = 0;
+    rx->send = send;
+    rx->deliver = deliver;
+    rx->seq = 0;
+    memset(&rx->stats, 0, sizeof(rx->stats));
+}
+
+static size_t piece_len(uint32_t total_len, uint16_t index)
+{
+    uint32_t offset = (uint32_t)index * DT_FRAG_DATA_SIZE;
+    return total_len - offset < (uint32_t)DT_FRAG_DATA_SIZE ? total_len - offset : DT_FRAG_DATA_SIZE;
+}
+
+const uint8_t *frag_rx_piece(const frag_rx_msg_t *msg, uint16_t i, size_t *len)
+{
+    *len = piece_len(msg->total_len, i);
+    return msg->blocks[i]->data;
+}
+
+// Hand back the blocks and the reservation
+static void free_blocks(frag_rx_t *rx, frag_rx_msg_t *msg)
+{
+    for (uint16_t i = 0; i < msg->count; i++)
+    {
+        if (msg->blocks[i] != NULL)
+        {
+            block_pool_free(&rx->blocks, msg->blocks[i]);
+            msg->blocks[i] = NULL;
+        }
+    }
+    rx->reserved -= msg->count;
+}
+
+static void send_status_to(frag_rx_t *rx, const uint8_t *mac, const dt_frag_status_t *status, int64_t now_us)
+{
+    uint8_t frame[DT_FRAME_MAX_SIZE];
+    size_t frame_len = dt_frame_encode(frame, sizeof(frame), DT_TYPE_FRAG_STATUS, DT_BASE_STATION_NODE_ID,
+                                       rx->seq++, (uint32_t)now_us, status, sizeof(*status));
+    rx->send(mac, frame, frame_len);
+}
+
+static void send_status(frag_rx_t *rx, frag_rx_msg_t *msg, uint8_t state, int64_t now_us)
+{
+    dt_frag_status_t status;
+
+    memset(&status, 0, sizeof(status));
+    status.msg_id = msg->msg_id;
+    status.state = state;
+    if (state == DT_FRAG_MISSING)
+    {
+        for (uint16_t i = 0; i < msg->count; i++)
+        {
+            if (msg->blocks[i] == NULL)
+            {
+                status.missing[i / 8] |= 1 << (i % 8);
+            }
+        }
+        rx->stats.nacks++;
+    }
+
+    send_status_to(rx, msg->mac, &status, now_us);
+    msg->last_status_us = now_us;
+}
+
+// Give up on a message and tell its sender
+static void msg_drop(frag_rx_t *rx, frag_rx_msg_t *msg, int64_t now_us)
+{
+    free_blocks(rx, msg);
+    send_status(rx, msg, DT_FRAG_DROPPED, now_us);
+    msg->state = FRAG_RX_FREE;
+}
+
+// Make room in the block pool by dropping the stalest message that has stopped moving
+static bool evict_one(frag_rx_t *rx, int64_t now_us)
+{
+    frag_rx_msg_t *victim = NULL;
+    for (int i = 0; i < FRAG_RX_MAX_MSGS; i++)
+    {
+        frag_rx_msg_t *msg = &rx->msgs[i];
+        if (msg->state == FRAG_RX_ASSEMBLING && now_us - msg->last_rx_us >= FRAG_RX_STALL_MS * 1000 &&
+            (victim == NULL || msg->last_rx_us < victim->last_rx_us))
+        {
+            victim = msg;
+        }
+    }
+    if (victim == NULL)
+    {
+        return false;
+    }
+
+    ESP_LOGW(TAG, "Out of reassembly memory, dropping node %04X message %u (%u/%u fragments)",
+             victim->node_id, victim->msg_id, victim->received, victim->count);
+    rx->stats.evicted++;
+    msg_drop(rx, victim, now_us);
+    return true;
+}
+
+static frag_rx_msg_t *find_msg(frag_rx_t *rx, const uint8_t *mac, uint16_t msg_id)
+{
+    for (int i = 0; i < FRAG_RX_MAX_MSGS; i++)
+    {
+        frag_rx_msg_t *msg = &rx->msgs[i];
+        if (msg->state != FRAG_RX_FREE && msg->msg_id == msg_id && memcmp(msg->mac, mac, 6) == 0)
+        {
+            return msg;
+        }
+    }
+    return NULL;
+}
+
+// Not enough memory for a new message: tell the sender once, not for every fragment of it
+static void refuse(frag_rx_t *rx, const uint8_t *mac, uint16_t msg_id, int64_t now_us)
+{
+    if (rx->refused_msg_id == msg_id && memcmp(rx->refused_mac, mac, 6) == 0 &&
+        now_us - rx->refused_us < FRAG_RX_NACK_MS * 1000)
+    {
+        return;
+    }
+
+    rx->stats.refused++;
+    memcpy(rx->refused_mac, mac, 6);
+    rx->refused_msg_id = msg_id;
+    rx->refused_us = now_us;
+
+    dt_frag_status_t status;
+    memset(&status, 0, sizeof(status));
+    status.msg_id = msg_id;
+    status.state = DT_FRAG_DROPPED;
+    send_status_to(rx, mac, &status, now_us);
+}
+
+// A free slot, or the oldest finished one
+static frag_rx_msg_t *new_msg(frag_rx_t *rx)
+{
+    frag_rx_msg_t *oldest_done = NULL;
+    for (int i = 0; i < FRAG_RX_MAX_MSGS; i++)
+    {
+        frag_rx_msg_t *msg = &rx->msgs[i];
+        if (msg->state == FRAG_RX_FREE)
+        {
+            return msg;
+        }
+        if (msg->state == FRAG_RX_DONE && (oldest_done == NULL || msg->last_rx_us < oldest_done->last_rx_us))
+        {
+            oldest_done = msg;
+        }
+    }
+    return oldest_done;
+}
+
+void frag_rx_on_frame(frag_rx_t *rx, const uint8_t *mac, const dt_frame_hdr_t *hdr, const uint8_t *payload, int64_t now_us)
+{
+    if (hdr->len < sizeof(dt_frag_hdr_t))
+    {
+        rx->stats.invalid++;
+        return;
+    }
+
+    dt_frag_hdr_t frag;
+    memcpy(&frag, payload, sizeof(frag));
+    const uint8_t *data = payload + sizeof(frag);
+    size_t data_len = hdr->len - sizeof(frag);
+
+    if (frag.total_len == 0 || frag.total_len > DT_FRAG_MAX_MSG_SIZE ||
+        frag.count != (frag.total_len + DT_FRAG_DATA_SIZE - 1) / DT_FRAG_DATA_SIZE ||
+        frag.index >= frag.count || data_len != piece_len(frag.total_len, frag.index))
+    {
+        rx->stats.invalid++;
+        return;
+    }
+    rx->stats.fragments++;
+
+    frag_rx_msg_t *msg = find_msg(rx, mac, frag.msg_id);
+    if (msg != NULL && (msg->count != frag.count || msg->total_len != frag.total_len || msg->type != frag.type))
+    {
+        rx->stats.invalid++;
+        return;
+    }
+
+    if (msg != NULL && msg->state == FRAG_RX_DONE)
+    {
+        // the sender did not hear our DONE
+        rx->stats.duplicates++;
+        send_status(rx, msg, DT_FRAG_DONE, now_us);
+        return;
+    }
+
+    if (msg == NULL)
+    {
+        while (rx->reserved + frag.count > FRAG_RX_BLOCKS && evict_one(rx, now_us))
+        {
+        }
+        if (rx->reserved + frag.count > FRAG_RX_BLOCKS)
+        {
+            refuse(rx, mac, frag.msg_id, now_us);
+            return;
+        }
+
+        msg = new_msg(rx);
+        if (msg == NULL)
+        {
+            rx->stats.no_slot++;
+            return;
+        }
+        rx->reserved += frag.count;
+
+        memset(msg, 0, sizeof(*msg));
+        msg->state = FRAG_RX_ASSEMBLING;
+        memcpy(msg->mac, mac, 6);
+        msg->node_id = hdr->node_id;
+        msg->msg_id = frag.msg_id;
+        msg->type = frag.type;
+        msg->total_len = frag.total_len;
+        msg->count = frag.count;
+        msg->first_us = now_us;
+        msg->last_status_us = now_us;
+    }
+    msg->last_rx_us = now_us;
+
+    if (msg->blocks[frag.index] != NULL)
+    {
+        rx->stats.duplicates++;
+        return;
+    }
+
+    // always there, the message reserved it
+    frag_block_t *block = (frag_block_t *)block_pool_alloc(&rx->blocks);
+    if (block == NULL)
+    {
+        return;
+    }
+
+    memcpy(block->data, data, data_len);
+    msg->blocks[frag.index] = block;
+    msg->received++;
+
+    if (msg->received == msg->count)
+    {
+        rx->stats.completed++;
+        rx->stats.bytes += msg->total_len;
+        send_status(rx, msg, DT_FRAG_DONE, now_us);
+        if (rx->deliver != NULL)
+        {
+            rx->deliver(msg);
+        }
+
+        free_blocks(rx, msg);
+        msg->state = FRAG_RX_DONE;
+    }
+    else if (frag.index == msg->count - 1)
+    {
+        // the sender's first pass is over and there are holes
+        send_status(rx, msg, DT_FRAG_MISSING, now_us);
+    }
+}
+
+bool frag_rx_poll(frag_rx_t *rx, int64_t now_us)
+{
+    bool pending = false;
+
+    for (int i = 0; i < FRAG_RX_MAX_MSGS; i++)
+    {
+        frag_rx_msg_t *msg = &rx->msgs[i];
+
+        if (msg->state == FRAG_RX_DONE && now_us - msg->last_rx_us >= FRAG_RX_TIMEOUT_MS * 1000)
+        {
+            msg->state = FRAG_RX_FREE;
+        }
+        if (msg->state != FRAG_RX_ASSEMBLING)
+        {
+            continue;
+        }
+
+        if (now_us - msg->last_rx_us >= FRAG_RX_TIMEOUT_MS * 1000)
+        {
+            ESP_LOGW(TAG, "Node %04X message %u timed out with %u/%u fragments",
+                     msg->node_id, msg->msg_id, msg->received, msg->count);
+            rx->stats.timeouts++;
+            msg_drop(rx, msg, now_us);
+            continue;
+        }
+
+        // nothing new for a while, ask for everything still missing
+        if (now_us - msg->last_rx_us >= FRAG_RX_NACK_MS * 1000 && now_us - msg->last_status_us >= FRAG_RX_NACK_MS * 1000)
+        {
+            send_status(rx, msg, DT_FRAG_MISSING, now_us);
+        }
+        pending = true;
+    }
+    return pending;
+}
@@ -20,9 +20,28 @@
 #include "lwip/sockets.h"
 #include "lwip/ip_addr.h"
 
+#include "dt_frame.h"
+#include "led_indicator.h"
+#include "espnow_ring.h"
+#include "node_table.h"
+#include "peer_slots.h"
+#include "tdma.h"
+#include "shared_buf.h"
+#include "tcp_server.h"
+#include "tcp_requests.h"
+#include "frag_rx.h"
+#include "metrics.h"
+#include "trace.h"
+#include "dt_transport_espnow.h"
+#include "dt_tasks.h"
+#include "sample_codec.h"
+#include "ts_store.h"
+
 // LED Pins
 #define LED_WIFI GPIO_NUM_13
 #define LED_ESPNOW GPIO_NUM_12
+#define LED_ON_MS 500
+#define LED_OFF_MS 500
 
 // Success/Fail statuses
 #define WIFI_FAIL 0
@@ -30,8 +49,16 @@
 #define TCP_FAIL 0
 #define TCP_SUCC 1
 
+// Event group bits. They can't be the statuses above, setting bit "0" sets nothing and the wait never ended on a failure
+#define WIFI_SUCC_BIT BIT0
+#define WIFI_FAIL_BIT BIT1
+
 static const char *TAG = "Data_Trans";
 
+// Activity LEDs, pulsed by the housekeeping task when the counters move
+static led_indicator_t s_led_wifi;
+static led_indicator_t s_led_espnow;
+
 // event group to contain status information
 static EventGroupHandle_t wifi_event_group;
 #define MAX_FAILURES 10
@@ -39,22 +66,76 @@ static EventGroupHandle_t wifi_event_group;
 // retry tracker
 static int s_retry_num = 0;
 
+// Once up, a lost AP is tried again this often. Every try is a scan over all channels, ESP-NOW hears nothing meanwhile
+#define WIFI_RECONNECT_MS 10000
+static esp_timer_handle_t s_reconnect_timer;
+
 uint8_t CONFIG_ESPNOW_CHANNEL;
 
 #define PORT 5000
 
-extern "C"
-{
-    void blinky(gpio_num_t led_pin)
-    {
-        gpio_set_level(led_pin, 1);
+// Tasks, see dt_tasks.h for which core does what
+#define ESPNOW_RX_PRIO 6
+#define ESPNOW_RX_STACK 4096
+#define TCP_SERVER_PRIO 5
+#define TCP_SERVER_STACK 6144       // bigger than the rest, rendering the metrics page goes through vsnprintf
+#define HOUSEKEEPING_STACK 4096
 
-        vTaskDelay(500 / portTICK_PERIOD_MS);
+// ESP-NOW receive worker
+#define ESPNOW_RX_BATCH 8       // max frames handled per ring read
+#define ESPNOW_STATS_MS 10000   // how often housekeeping logs the counters
 
-        gpio_set_level(led_pin, 0);
-        vTaskDelay(500 / portTICK_PERIOD_MS);   
-    }
+// Every received frame lives in one of these from on_data_recv until the last TCP subscriber has sent it
+#define ESPNOW_RX_BUFS 64
+static shared_buf_t s_rx_bufs[ESPNOW_RX_BUFS];
+static std::atomic<uint16_t> s_rx_buf_next[ESPNOW_RX_BUFS];
+static block_pool_t s_rx_pool;
+
+// The radio, only ever touched through dt_transport_*
+static dt_transport_t *s_radio;
+
+static espnow_ring_t s_espnow_ring;
+static node_table_t s_nodes;
+
+// ESP-NOW peers, one slot kept back for the broadcast peer
+#define PEER_SLOTS_RESERVED 1
+static peer_slots_t s_peers;
+
+// TDMA beacon, sent every superframe
+static esp_timer_handle_t s_beacon_timer;
+static std::atomic<uint16_t> s_slot_count;
+static std::atomic<int64_t> s_beacon_sent_us;   // when the last broadcast's on_sent came back, for the next beacon
+static TaskHandle_t s_espnow_rx_task = NULL;
+
+// ESP-NOW -> TCP bridge: frames go from the rx worker to the TCP task by reference
+static shared_buf_queue_t s_fwd_queue;
+
+// Messages bigger than a frame, put back together on the rx worker
+static frag_rx_t s_frag_rx;
+
+// A compressed sample dump is gathered into one piece, then unpacked. Only the rx worker uses these
+static uint8_t s_dump_in[SAMPLE_LZ_MAX_RAW];
+static uint8_t s_dump_raw[SAMPLE_LZ_MAX_RAW];
+static metric_id_t s_m_bad_samples;
+
+// Every sample that comes in live, for TCP clients to query. Written by the rx worker, read by the TCP task
+static ts_store_t s_ts;
+
+// Counted on the data path, everything else on the metrics page is read out at scrape time
+static metric_id_t s_m_espnow_rx;
+static metric_id_t s_m_espnow_rx_bytes;
+static metric_id_t s_m_espnow_tx;
+static metric_id_t s_m_bad_frames;
+static metric_id_t s_m_fwd_queue_full;
+static metric_id_t s_m_samples_rx;
+static metric_id_t s_m_texts_rx;
+static metric_id_t s_m_stamps_ahead;
 
+// Tasks whose stack head room goes on the metrics page, looked up by name
+static const char *const METRICS_TASKS[] = { "espnow_rx", "tcp_server", "housekeeping", "wifi", "esp_timer", "tiT" };
+
+extern "C"
+{
     void gpio_out_setup(unsigned long led_pin)
     {
         // Configure GPIO
@@ -95,12 +176,12 @@ extern "C"
                 ESP_LOGI(TAG, "Reconnecting to AP...");
                 esp_wifi_connect();
                 s_retry_num++;
-                blinky(LED_ESPNOW);
+                led_pulse(&s_led_espnow);
             } 
             else 
             // Load unable to connect status
             {
-                xEventGroupSetBits(wifi_event_group, WIFI_FAIL);
+                xEventGroupSetBits(wifi_event_group, WIFI_FAIL_BIT);
             }
         }
     }
@@ -115,10 +196,55 @@ extern "C"
             ESP_LOGI(TAG, "STA IP: " IPSTR, IP2STR(&event->ip_info.ip));
 
             s_retry_num = 0; // reset counter so that we wont go thru the connect disconnect again
-            xEventGroupSetBits(wifi_event_group, WIFI_SUCC);
+            xEventGroupSetBits(wifi_event_group, WIFI_SUCC_BIT);
+        }
+    }
+
+    static void reconnect_timer_cb(void *arg)
+    {
+        esp_wifi_connect();
+    }
+
+    /*
+        After boot: the AP went away (rebooted, or moved to another channel). Reconnecting puts the
+        radio on whatever channel the AP is on now, the peers follow (peer_add) and so do the beacons
+        and join acks, which is how the slaves find us again (chan_track.h in the slave)
+    */
+    static void wifi_roam_handler(void* arg, esp_event_base_t event_base, int32_t event_id, void* event_data)
+    {
+        if (event_id == WIFI_EVENT_STA_DISCONNECTED)
+        {
+            if (!esp_timer_is_active(s_reconnect_timer))
+            {
+                esp_timer_start_once(s_reconnect_timer, WIFI_RECONNECT_MS * 1000);
+            }
+        }
+        else if (event_id == WIFI_EVENT_STA_CONNECTED)
+        {
+            const wifi_event_sta_connected_t *event = (const wifi_event_sta_connected_t *)event_data;
+            ESP_LOGI(TAG, "Back on the AP, channel %d (was %d at boot)", event->channel, CONFIG_ESPNOW_CHANNEL);
         }
     }
 
+    // init_wifi's handlers only see it through to the first connect, this one stays
+    static void wifi_keep_connected()
+    {
+        esp_timer_create_args_t reconnect_args = {};
+        reconnect_args.callback = reconnect_timer_cb;
+        reconnect_args.name = "wifi_reconnect";
+        ESP_ERROR_CHECK(esp_timer_create(&reconnect_args, &s_reconnect_timer));
+        ESP_ERROR_CHECK(esp_event_handler_instance_register(WIFI_EVENT, ESP_EVENT_ANY_ID, &wifi_roam_handler, NULL, NULL));
+    }
+
+    // The channel the radio is on now, the AP's. Not always the one from boot, see wifi_roam_handler
+    static uint8_t espnow_channel(void)
+    {
+        uint8_t primary = CONFIG_ESPNOW_CHANNEL;
+        wifi_second_chan_t second;
+        esp_wifi_get_channel(&primary, &second);
+        return primary;
+    }
+
     void init_nvs()
     {
         esp_err_t ret = nvs_flash_init();
@@ -219,12 +345,12 @@ extern "C"
         ESP_LOGI(TAG, "STA initialization complete");
 
         EventBits_t bits = xEventGroupWaitBits(wifi_event_group,
-            WIFI_SUCC | WIFI_FAIL,
+            WIFI_SUCC_BIT | WIFI_FAIL_BIT,
             pdFALSE,
             pdFALSE,
             portMAX_DELAY);
         
-        if (bits & WIFI_SUCC) 
+        if (bits & WIFI_SUCC_BIT) 
         {
             ESP_LOGI(TAG, "Connected to ap");
             wifi_ap_record_t ap_info;
@@ -239,7 +365,7 @@ extern "C"
             CONFIG_ESPNOW_CHANNEL = ap_info.primary;
             curr_status = WIFI_SUCC;
         } 
-        else if (bits & WIFI_FAIL) 
+        else if (bits & WIFI_FAIL_BIT) 
         {
             ESP_LOGI(TAG, "Failed to connect to ap");
             curr_status = WIFI_FAIL;
@@ -254,6 +380,7 @@ extern "C"
         ESP_ERROR_CHECK(esp_event_handler_instance_unregister(IP_EVENT, IP_EVENT_STA_GOT_IP, ip_handler_inst));
         ESP_ERROR_CHECK(esp_event_handler_instance_unregister(WIFI_EVENT, ESP_EVENT_ANY_ID, wifi_handler_inst));
         vEventGroupDelete(wifi_event_group);
+        wifi_keep_connected();
 
         #if CONFIG_ESPNOW_ENABLE_LONG_RANGE
             ESP_ERROR_CHECK( esp_wifi_set_protocol(ESPNOW_WIFI_IF, WIFI_PROTOCOL_11B|WIFI_PROTOCOL_11G|WIFI_PROTOCOL_11N|WIFI_PROTOCOL_LR) );
@@ -261,159 +388,798 @@ extern "C"
         return curr_status;
     }
 
-    static void on_data_recv(const esp_now_recv_info_t *recv_info, const uint8_t *data, int len)
+    // Runs on the wifi task, so only copy the frame out and wake the worker
+    static void on_data_recv(dt_transport_t *t, const uint8_t *src_mac, int8_t rssi, const uint8_t *data, size_t len)
     {
-        uint8_t *mac = recv_info->src_addr;
-        printf("Received from MAC %02X:%02X:%02X:%02X:%02X:%02X: %.*s\n", 
-                mac[0], mac[1], mac[2], mac[3], mac[4], mac[5], 
-                len, 
-                (char *)data);
-        blinky(LED_ESPNOW);
+        trace_frame(TRACE_ESPNOW_RECV, data, len, len);
+        metrics_inc(s_m_espnow_rx);
+        metrics_add(s_m_espnow_rx_bytes, len);
+        if (espnow_ring_push(&s_espnow_ring, esp_timer_get_time(), src_mac, rssi, data, len) && s_espnow_rx_task != NULL)
+        {
+            xTaskNotifyGive(s_espnow_rx_task);
+        }
     }
 
-    void server_esp_now()
+    /*
+        One record out of a slave's frame. Nothing here goes to the console at the default log
+        level: a line per sample is more than 115200 baud carries with a few dozen slaves, and
+        printf blocks the worker while the UART drains. Housekeeping logs the counts instead
+    */
+    static void handle_record(const dt_frame_hdr_t *hdr, int8_t rssi, int64_t rx_us, uint8_t type, const uint8_t *data, size_t len)
     {
-        esp_now_init();
-        ESP_LOGI(TAG , "esp_now initialised");
-        esp_now_register_recv_cb(on_data_recv);
+        // into the store at when the slave sent them if its stamp is our clock, not when the ring got round to them
+        int64_t t_ms = rx_us / 1000;
+        bool store = true;
+        if ((hdr->flags & DT_FLAG_MASTER_TIME) && !ts_stamp_ms(rx_us, hdr->timestamp_us, &t_ms))
+        {
+            // a stamp from the future: a replay old enough to have wrapped, nothing of it can
+            // still be in an open bucket. A live frame's is stale (we rebooted), arrival is near enough
+            metrics_inc(s_m_stamps_ahead);
+            store = !(hdr->flags & DT_FLAG_REPLAY);
+        }
+
+        if (type == DT_TYPE_TEXT)
+        {
+            metrics_inc(s_m_texts_rx);
+            ESP_LOGD(TAG, "Node %04X seq %lu (rssi %d): %.*s",
+                     hdr->node_id, (unsigned long)hdr->seq, rssi, (int)len, (const char *)data);
+        }
+        else if (type == DT_TYPE_SENSOR)
+        {
+            const dt_sample_t *samples = (const dt_sample_t *)data;
+            size_t count = len / sizeof(dt_sample_t);
+            for (size_t j = 0; j < count; j++)
+            {
+                ESP_LOGD(TAG, "Node %04X seq %lu channel %u: %ld",
+                         hdr->node_id, (unsigned long)hdr->seq, samples[j].channel, (long)samples[j].value);
+                if (store)
+                {
+                    ts_store_add(&s_ts, hdr->node_id, samples[j].channel, samples[j].value, t_ms, rx_us / 1000);
+                }
+            }
+            metrics_add(s_m_samples_rx, count);
+        }
+        else if (type == DT_TYPE_SENSOR_PACKED)
+        {
+            sample_unpack_t u;
+            dt_sample_t sample;
+            uint32_t count = 0;
+            sample_unpack_init(&u, data, len);
+            while (sample_unpack_next(&u, &sample))
+            {
+                ESP_LOGD(TAG, "Node %04X seq %lu channel %u: %ld",
+                         hdr->node_id, (unsigned long)hdr->seq, sample.channel, (long)sample.value);
+                if (store)
+                {
+                    ts_store_add(&s_ts, hdr->node_id, sample.channel, sample.value, t_ms, rx_us / 1000);
+                }
+                count++;
+            }
+            metrics_add(s_m_samples_rx, count);
+            if (!sample_unpack_ok(&u))
+            {
+                metrics_inc(s_m_bad_samples);
+            }
+        }
     }
 
-    static void tcp_server_task(void * pvParams)
+    // A whole packed (or packed + LZ) sample dump, summed up rather than printed sample by sample
+    static void unpack_dump(const frag_rx_msg_t *msg)
     {
-        char addr_str[128];
-        char serverIP_str[128];
-        char rx_buffer[128];
-        char string_data[128];
-        char data_to_send[128];
+        if (msg->total_len > sizeof(s_dump_in))
+        {
+            ESP_LOGW(TAG, "Node %04X sample dump of %lu bytes is too big to unpack", msg->node_id, (unsigned long)msg->total_len);
+            return;
+        }
 
-        size_t string_data_len;
-        size_t data_len;
-        
-        struct sockaddr_storage dest_addr;
+        size_t total = 0;
+        for (uint16_t i = 0; i < msg->count; i++)
+        {
+            size_t len;
+            const uint8_t *piece = frag_rx_piece(msg, i, &len);
+            memcpy(s_dump_in + total, piece, len);
+            total += len;
+        }
 
-        struct sockaddr_in *dest_addr_ip4 = (struct sockaddr_in *)&dest_addr;
-        dest_addr_ip4->sin_addr.s_addr = htonl(INADDR_ANY); 
-        /*
-            - htonl 
-                - To convert 32 bytes of native byte order to network byte order  
-            - INADDR_ANY
-                - Defines 0.0.0.0 IPV4 style
-            - Which accepts all incoming addresses
-                - so all client can socket in
-        */
+        const uint8_t *body = s_dump_in;
+        if (msg->type == DT_TYPE_SENSOR_LZ)
+        {
+            int raw_len = sample_lz_decompress(s_dump_in, total, s_dump_raw, sizeof(s_dump_raw));
+            if (raw_len < 0)
+            {
+                metrics_inc(s_m_bad_samples);
+                ESP_LOGW(TAG, "Node %04X sample dump does not decompress", msg->node_id);
+                return;
+            }
+            body = s_dump_raw;
+            total = (size_t)raw_len;
+        }
 
-        dest_addr_ip4->sin_family = AF_INET;
-        dest_addr_ip4->sin_port = htons(PORT); // declare which port the server shuld be in 
-        struct in_addr server_ip_addr = dest_addr_ip4->sin_addr;
-        inet_ntoa_r(server_ip_addr, serverIP_str, sizeof(serverIP_str) - 1);
+        sample_unpack_t u;
+        dt_sample_t sample;
+        uint32_t count = 0;
+        int32_t first = 0, min = INT32_MAX, max = INT32_MIN;
+        sample_unpack_init(&u, body, total);
+        while (sample_unpack_next(&u, &sample))
+        {
+            first = count == 0 ? sample.value : first;
+            min = sample.value < min ? sample.value : min;
+            max = sample.value > max ? sample.value : max;
+            count++;
+        }
+        if (!sample_unpack_ok(&u))
+        {
+            metrics_inc(s_m_bad_samples);
+            ESP_LOGW(TAG, "Node %04X sample dump is corrupt after %lu samples", msg->node_id, (unsigned long)count);
+            return;
+        }
 
-        // Open Socket
-        int listen_socket = socket(AF_INET , SOCK_STREAM , 0);  // 0 for TCP Protocol and SOCK_STREAM for TCP Comms
-        int opt = 1; // option name
-        
-        // set sock option
-        int sock_res = setsockopt(listen_socket ,
-                    SOL_SOCKET, // set at socket level
-                    SO_REUSEADDR, 
-                    &opt, // option enabled
-                    sizeof(opt)
-                    );
-        
-        if(sock_res >= 0)
+        ESP_LOGI(TAG, "Node %04X dump: %lu samples of channel %u in %lu bytes (%.1f per sample), first %ld last %ld min %ld max %ld",
+                 msg->node_id, (unsigned long)count, sample.channel, (unsigned long)msg->total_len,
+                 (float)msg->total_len / count, (long)first, (long)sample.value, (long)min, (long)max);
+    }
+
+    // Everything the base station sends over ESP-NOW, so it gets counted
+    static int espnow_send(const uint8_t *mac, const uint8_t *frame, size_t len)
+    {
+        int err = dt_transport_send(s_radio, mac, frame, len);
+        if (err == 0)
         {
-            ESP_LOGI(TAG, "Socket created");
+            metrics_inc(s_m_espnow_tx);
         }
-        else
+        return err;
+    }
+
+    // frag_rx status frames back to the sending slave
+    static int frag_send(const uint8_t *mac, const uint8_t *frame, size_t len)
+    {
+        if (peer_slots_acquire(&s_peers, mac, esp_timer_get_time()) != 0)
         {
-            ESP_LOGE(TAG, "Socket made unsuccesfully");
+            return -1;
         }
-        
-        // bind sock
-        int bind_sock_res = bind(listen_socket, 
-            (struct sockaddr *)&dest_addr, 
-            sizeof(dest_addr));
-            
-        if(bind_sock_res >= 0)
+        return espnow_send(mac, frame, len);
+    }
+
+    // A whole fragmented message, on the rx worker. Text is counted like a single text record and
+    // only shown at debug level: printing up to 16 KB at 115200 baud here would hold the ring for a
+    // second and more. Sample dumps get their one line summary
+    static void frag_deliver(const frag_rx_msg_t *msg)
+    {
+        ESP_LOGD(TAG, "Node %04X message %u: %lu bytes of type %u in %lu fragments, %lu ms",
+                 msg->node_id, msg->msg_id, (unsigned long)msg->total_len, msg->type, (unsigned long)msg->count,
+                 (unsigned long)((msg->last_rx_us - msg->first_us) / 1000));
+
+        if (msg->type == DT_TYPE_TEXT)
         {
-            ESP_LOGI(TAG, "Socket bound, port %d", PORT);
+            metrics_inc(s_m_texts_rx);
+            for (uint16_t i = 0; i < msg->count; i++)
+            {
+                size_t len;
+                const char *piece = (const char *)frag_rx_piece(msg, i, &len);
+                ESP_LOGD(TAG, "Node %04X message %u piece %u: %.*s", msg->node_id, msg->msg_id, i, (int)len, piece);
+            }
         }
-        else
+        else if (msg->type == DT_TYPE_SENSOR_PACKED || msg->type == DT_TYPE_SENSOR_LZ)
         {
-            ESP_LOGE(TAG, "Socket Not bound, port %d", PORT);
+            unpack_dump(msg);
         }
+    }
 
-        listen(listen_socket , 1);
+    // channel 0 is "the one the radio is on", so the peers move along when the STA reassociates elsewhere
+    static int peer_add(const uint8_t *mac)
+    {
+        return dt_transport_add_peer(s_radio, mac, 0);
+    }
 
-        while(1)
+    static int peer_del(const uint8_t *mac)
+    {
+        return dt_transport_del_peer(s_radio, mac);
+    }
+
+    /*
+        Start of every superframe, on the esp_timer task. The beacon says when the one before it
+        actually went out (its on_sent), the slaves' time sync pairs that with when they heard it.
+        Only if on_sent has come back since: a beacon that never went, or is still queued, has no time
+    */
+    static void beacon_timer_cb(void *arg)
+    {
+        static uint32_t seq = 0;
+        static int64_t queued_us = 0;
+        uint8_t frame[DT_FRAME_MAX_SIZE];
+        dt_beacon_t beacon;
+
+        uint16_t slot_count = s_slot_count.load(std::memory_order_relaxed);
+        beacon.slot_count = slot_count;
+        beacon.slot_us = TDMA_SLOT_US;
+        beacon.superframe_us = slot_count * TDMA_SLOT_US;
+        beacon.channel = espnow_channel();
+        int64_t sent_us = s_beacon_sent_us.load(std::memory_order_relaxed);
+        beacon.prev_tx_us = queued_us != 0 && sent_us >= queued_us ? (uint64_t)sent_us : 0;
+
+        queued_us = esp_timer_get_time();
+        size_t frame_len = dt_frame_encode(frame, sizeof(frame), DT_TYPE_BEACON, DT_BASE_STATION_NODE_ID,
+                                           seq++, (uint32_t)queued_us, &beacon, sizeof(beacon));
+        espnow_send(DT_BROADCAST_MAC, frame, frame_len);
+    }
+
+    // On the wifi task. Only the beacons' times matter, nothing else sent here is retried
+    static void on_data_sent(dt_transport_t *t, const uint8_t *mac_addr, bool success)
+    {
+        if (success && memcmp(mac_addr, DT_BROADCAST_MAC, 6) == 0)
+        {
+            s_beacon_sent_us.store(esp_timer_get_time(), std::memory_order_relaxed);
+        }
+    }
+
+    /*
+        A slave's time sync exchange, answered straight away. t2 is when on_data_recv had it, t3
+        as late as possible before the answer goes: the time in between, on the ring and here,
+        comes off the slave's round trip
+    */
+    static void handle_time_req(const uint8_t *mac, const dt_frame_hdr_t *hdr, const uint8_t *payload, int64_t rx_us)
+    {
+        if (hdr->len < sizeof(dt_time_req_t) || peer_slots_acquire(&s_peers, mac, rx_us) != 0)
+        {
+            return;
+        }
+
+        dt_time_resp_t resp;
+        resp.t1_us = ((const dt_time_req_t *)payload)->t1_us;
+        resp.t2_us = (uint64_t)rx_us;
+        uint8_t frame[DT_FRAME_MAX_SIZE];
+        resp.t3_us = (uint64_t)esp_timer_get_time();
+        size_t frame_len = dt_frame_encode(frame, sizeof(frame), DT_TYPE_TIME_RESP, DT_BASE_STATION_NODE_ID,
+                                           hdr->seq, (uint32_t)resp.t3_us, &resp, sizeof(resp));
+        espnow_send(mac, frame, frame_len);
+    }
+
+    // Stretch or shrink the superframe to fit the highest slot handed out
+    static void update_superframe(void)
+    {
+        uint16_t slot_count = tdma_slot_count(peer_slots_highest_slot(&s_peers));
+
+        if (slot_count != s_slot_count.load(std::memory_order_relaxed))
+        {
+            s_slot_count.store(slot_count, std::memory_order_relaxed);
+            esp_timer_restart(s_beacon_timer, (uint64_t)slot_count * TDMA_SLOT_US);
+            ESP_LOGI(TAG, "Superframe now %u slots (%lu ms)", slot_count, (unsigned long)(slot_count * TDMA_SLOT_US / 1000));
+        }
+    }
+
+    // A slave wants in: remember it, make sure we can send to it and tell it our channel
+    static void handle_join(const uint8_t *mac, const dt_frame_hdr_t *hdr)
+    {
+        int64_t now = esp_timer_get_time();
+        uint8_t frame[DT_FRAME_MAX_SIZE];
+        dt_join_ack_t ack;
+
+        peer_entry_t *entry = peer_slots_admit(&s_peers, mac, hdr->node_id, now);
+        if (entry == NULL)
+        {
+            ESP_LOGW(TAG, "Could not admit node %04X", hdr->node_id);
+            return;
+        }
+        ack.status = DT_JOIN_ACCEPTED;
+        ack.channel = espnow_channel();
+        ack.slot = peer_slots_slot(&s_peers, entry);
+
+        update_superframe();
+
+        if (peer_slots_acquire(&s_peers, mac, now) != 0)
+        {
+            ESP_LOGW(TAG, "No peer slot to answer node %04X's join", hdr->node_id);
+            return;
+        }
+
+        size_t frame_len = dt_frame_encode(frame, sizeof(frame), DT_TYPE_JOIN_ACK, DT_BASE_STATION_NODE_ID,
+                                           hdr->seq, (uint32_t)now, &ack, sizeof(ack));
+        espnow_send(mac, frame, frame_len);
+
+        ESP_LOGI(TAG, "Node %04X joined in slot %u (%d known, %d registered)", hdr->node_id, ack.slot, s_peers.known, s_peers.registered);
+    }
+
+    // rx worker: hand a slave's frame, exactly as it came off the air, to the TCP subscribers
+    static void bridge_forward(shared_buf_t *buf, size_t frame_len)
+    {
+        if (tcp_server_subscribers() == 0)
         {
-            ESP_LOGI(TAG, "Socket listening");
+            return;
+        }
 
-            struct sockaddr_storage source_addr; // Large enough for both IPv4 or IPv6
-            socklen_t addr_len = sizeof(source_addr);
+        // no copy, the TCP task gets its own reference to the buffer the frame was received into.
+        // Nobody else has seen it yet, so the length can still be trimmed to the frame
+        buf->len = (uint16_t)frame_len;
+        shared_buf_ref(buf);
+        if (!shared_buf_queue_push(&s_fwd_queue, buf))
+        {
+            shared_buf_release(buf);
+            metrics_inc(s_m_fwd_queue_full);
+            return;
+        }
+        tcp_server_wake();
+    }
+
+    // TCP task: fan the queued frames out, each subscriber takes its own reference
+    static void on_tcp_wake(void)
+    {
+        shared_buf_t *buf;
+        while ((buf = shared_buf_queue_pop(&s_fwd_queue)) != NULL)
+        {
+            tcp_server_publish(buf);
+            shared_buf_release(buf);
+        }
+    }
 
-            // Accept socket
-            int sock = accept(listen_socket, 
-                            (struct sockaddr *)&source_addr, 
-                            &addr_len);
-            if (sock < 0)
+    static void log_bridge_stats(void)
+    {
+        tcp_server_stats_t stats;
+        tcp_server_get_stats(&stats);
+        if (stats.subscribers == 0 && stats.forwarded == 0)
+        {
+            return;
+        }
+
+        ESP_LOGI(TAG, "Bridge: %lu subscribers, forwarded %lu, dropped %lu (slow client) %lu (queue full), "
+                      "latency min %lu avg %lu max %lu us",
+                 (unsigned long)stats.subscribers,
+                 (unsigned long)stats.forwarded,
+                 (unsigned long)stats.forward_dropped,
+                 (unsigned long)metrics_value(s_m_fwd_queue_full),
+                 (unsigned long)stats.forward_latency_us_min,
+                 (unsigned long)(stats.forwarded ? stats.forward_latency_us_sum / stats.forwarded : 0),
+                 (unsigned long)stats.forward_latency_us_max);
+    }
+
+    static void log_pool_stats(void)
+    {
+        tcp_server_stats_t stats;
+        tcp_server_get_stats(&stats);
+
+        ESP_LOGI(TAG, "Frame buffers: %lu/%d in use, high water %lu, exhausted %lu. Connections: high water %lu/%d",
+                 (unsigned long)block_pool_in_use(&s_rx_pool), ESPNOW_RX_BUFS,
+                 (unsigned long)s_rx_pool.high_water.load(std::memory_order_relaxed),
+                 (unsigned long)s_rx_pool.exhausted.load(std::memory_order_relaxed),
+                 (unsigned long)stats.conn_high_water, TCP_SERVER_MAX_CLIENTS);
+    }
+
+    static void log_frag_stats(void)
+    {
+        const frag_rx_stats_t *stats = &s_frag_rx.stats;
+        if (stats->fragments == 0)
+        {
+            return;
+        }
+
+        ESP_LOGI(TAG, "Fragments: %lu rx, %lu dup, %lu invalid. Messages: %lu done (%llu bytes), %lu timed out, "
+                      "%lu evicted, %lu refused, %lu no slot, %lu nacks. Blocks high water %lu/%d",
+                 (unsigned long)stats->fragments,
+                 (unsigned long)stats->duplicates,
+                 (unsigned long)stats->invalid,
+                 (unsigned long)stats->completed,
+                 (unsigned long long)stats->bytes,
+                 (unsigned long)stats->timeouts,
+                 (unsigned long)stats->evicted,
+                 (unsigned long)stats->refused,
+                 (unsigned long)stats->no_slot,
+                 (unsigned long)stats->nacks,
+                 (unsigned long)s_frag_rx.blocks.high_water.load(std::memory_order_relaxed),
+                 FRAG_RX_BLOCKS);
+    }
+
+    static void log_node_stats(void)
+    {
+        for (int i = 0; i < NODE_TABLE_SIZE; i++)
+        {
+            const node_state_t *node = &s_nodes.nodes[i];
+            if (!node->used)
             {
-                ESP_LOGE(TAG, "Unable to accept connection: errno %d", errno);
-                break;
+                continue;
             }
-            else
+
+            const uint8_t *mac = node->mac;
+            ESP_LOGI(TAG, "Node %04X (%02X:%02X:%02X:%02X:%02X:%02X) seq %lu rx %lu lost %lu dup %lu reorder %lu (depth %lu) jitter %lu us, replayed %lu",
+                     node->node_id,
+                     mac[0], mac[1], mac[2], mac[3], mac[4], mac[5],
+                     (unsigned long)node->highest_seq,
+                     (unsigned long)node->received,
+                     (unsigned long)node->lost,
+                     (unsigned long)node->duplicates,
+                     (unsigned long)node->reordered,
+                     (unsigned long)node->max_reorder_depth,
+                     (unsigned long)node_jitter_us(node),
+                     (unsigned long)node->replayed);
+            if (node->latency_frames > 0)
             {
-                // put ip into string
-                struct sockaddr_in* pV4Addr = (struct sockaddr_in*)&source_addr;
-                struct in_addr ipAddr = pV4Addr->sin_addr;
-                
-                inet_ntoa_r(ipAddr, addr_str, sizeof(addr_str) - 1);
-
-                // receive info
-                int recv_result = recv(sock, 
-                        rx_buffer, 
-                        sizeof(rx_buffer) - 1, 
-                        0);
-
-                if(recv_result > 0)
-                {
-                    ESP_LOGI(TAG , "Server(%s) received msg from client(%s): %s" ,serverIP_str ,addr_str ,rx_buffer);
-                }
-                else if(recv_result == 0)
-                {
-                    ESP_LOGI(TAG , "Server(%s) received msg from client(%s): received and client performed an orderly shutdown" ,serverIP_str ,addr_str);
-                }
-                else
-                {
-                    ESP_LOGI(TAG , "Server(%s) failed to received msg from client(%s): errno %d (%s) " ,serverIP_str ,addr_str , errno, strerror(errno));
-                }
+                ESP_LOGI(TAG, "Node %04X one way latency p50 %lu us p99 %lu us max %lu us, %lu frames (%lu stamped early)",
+                         node->node_id,
+                         (unsigned long)node_latency_quantile_us(node, 0.5f),
+                         (unsigned long)node_latency_quantile_us(node, 0.99f),
+                         (unsigned long)node->latency_max_us,
+                         (unsigned long)node->latency_frames,
+                         (unsigned long)node->latency_early);
+            }
+        }
+        ESP_LOGI(TAG, "Peers: %d known, %d/%d registered, admitted %lu, rejoined %lu, forgotten %lu, evictions %lu, register failures %lu",
+                 s_peers.known, s_peers.registered, s_peers.max_registered,
+                 (unsigned long)s_peers.stats.admitted,
+                 (unsigned long)s_peers.stats.rejoined,
+                 (unsigned long)s_peers.stats.forgotten,
+                 (unsigned long)s_peers.stats.evictions,
+                 (unsigned long)s_peers.stats.register_failures);
+        if (s_nodes.full > 0)
+        {
+            ESP_LOGW(TAG, "Node table full, %lu frames from untracked nodes", (unsigned long)s_nodes.full);
+        }
+    }
 
-                // Send data via socket
-                strcpy(string_data,"Response from ESP32 Base station via Socket connection");
-                string_data_len = strlen(string_data);
-                sprintf(data_to_send, "HTTP/1.1 200 OK\r\nContent-Length: %d\r\n\r\n", string_data_len);
-                strcat(data_to_send, string_data);
-                data_len = strlen(data_to_send);
+    static void espnow_rx_task(void * pvParams)
+    {
+        while(1)
+        {
+            // only wakes up by itself while messages are half received, to chase their missing fragments
+            TickType_t wait = frag_rx_poll(&s_frag_rx, esp_timer_get_time()) ? FRAG_RX_NACK_MS / portTICK_PERIOD_MS : portMAX_DELAY;
+            ulTaskNotifyTake(pdTRUE, wait);
 
-                int send_result = send(sock, data_to_send, data_len, 0);
+            // drain everything that is waiting, a batch at a time
+            uint32_t ready;
+            while ((ready = espnow_ring_readable(&s_espnow_ring)) > 0)
+            {
+                uint32_t batch = ready < ESPNOW_RX_BATCH ? ready : ESPNOW_RX_BATCH;
 
-                if(send_result > -1)
+                for (uint32_t i = 0; i < batch; i++)
                 {
-                    ESP_LOGI(TAG , "Server(%s) send msg from client(%s): %s" ,serverIP_str ,addr_str ,string_data);
-                    blinky(LED_WIFI);
+                    shared_buf_t *frame = espnow_ring_peek(&s_espnow_ring, i);
+                    const uint8_t *mac = frame->mac;
+
+                    dt_frame_view_t view;
+                    int frame_len = dt_frame_decode(frame->data, frame->len, &view);
+                    if (frame_len <= 0)
+                    {
+                        metrics_inc(s_m_bad_frames);
+                        ESP_LOGW(TAG, "Bad frame from MAC %02X:%02X:%02X:%02X:%02X:%02X (%d bytes)",
+                                 mac[0], mac[1], mac[2], mac[3], mac[4], mac[5], frame->len);
+                        continue;
+                    }
+                    trace_frame(TRACE_RX_DECODED, frame->data, frame_len, view.hdr->type);
+
+                    // a slave we forgot about is still sending, give it a slot again
+                    bool known = peer_slots_touch(&s_peers, mac, frame->rx_us);
+                    if (view.hdr->type == DT_TYPE_JOIN_REQ || !known)
+                    {
+                        handle_join(mac, view.hdr);
+                    }
+                    if (view.hdr->type == DT_TYPE_JOIN_REQ)
+                    {
+                        continue;
+                    }
+
+                    // the answer's t2 and t3 are best close together, before anything else is done with it
+                    if (view.hdr->type == DT_TYPE_TIME_REQ)
+                    {
+                        handle_time_req(mac, view.hdr, view.payload, frame->rx_us);
+                    }
+
+                    node_state_t *node = node_table_get(&s_nodes, mac);
+                    if (node != NULL && (view.hdr->flags & DT_FLAG_REPLAY))
+                    {
+                        // from the slave's spool: its seq and stamp are from long ago
+                        node_track_replay(node, view.hdr->node_id);
+                    }
+                    else if (node != NULL)
+                    {
+                        node_track_frame(node, view.hdr->node_id, view.hdr->seq, view.hdr->timestamp_us, frame->rx_us);
+                        if (view.hdr->flags & DT_FLAG_MASTER_TIME)
+                        {
+                            node_track_latency(&s_nodes, node, view.hdr->timestamp_us, frame->rx_us);
+                        }
+                    }
+                    bridge_forward(frame, frame_len);
+
+                    if (view.hdr->type == DT_TYPE_FRAG)
+                    {
+                        frag_rx_on_frame(&s_frag_rx, mac, view.hdr, view.payload, frame->rx_us);
+                    }
+                    else if (view.hdr->type == DT_TYPE_BATCH)
+                    {
+                        // several records packed into the one frame
+                        size_t offset = 0;
+                        const dt_record_hdr_t *rec;
+                        const uint8_t *rec_data;
+                        while (dt_record_next(view.payload, view.hdr->len, &offset, &rec, &rec_data))
+                        {
+                            handle_record(view.hdr, frame->rssi, frame->rx_us, rec->type, rec_data, rec->len);
+                        }
+                    }
+                    else
+                    {
+                        handle_record(view.hdr, frame->rssi, frame->rx_us, view.hdr->type, view.payload, view.hdr->len);
+                    }
+                    trace_frame(TRACE_RX_HANDLED, frame->data, frame_len, 0);
                 }
-                else
+                espnow_ring_consume(&s_espnow_ring, batch);
+            }
+        }
+    }
+
+    /*
+        Bottom priority on the rx worker's core. Everything here reads what the data path
+        counts, without a lock, the same way a metrics scrape does
+    */
+    static void housekeeping_task(void * pvParams)
+    {
+        uint32_t last_espnow = 0;
+        uint32_t last_tcp = 0;
+        uint32_t last_dropped = 0;
+        uint32_t last_samples = 0;
+        uint32_t last_texts = 0;
+        TickType_t last_stats = xTaskGetTickCount();
+
+        while(1)
+        {
+            dt_delay_ms(DT_HOUSEKEEPING_PERIOD_MS);
+
+            // a blink for any frames since last time, the data path never touches a GPIO or a timer
+            uint32_t espnow = metrics_value(s_m_espnow_rx);
+            if (espnow != last_espnow)
+            {
+                led_pulse(&s_led_espnow);
+                last_espnow = espnow;
+            }
+
+            tcp_server_stats_t stats;
+            tcp_server_get_stats(&stats);
+            uint32_t tcp = stats.requests + stats.forwarded;
+            if (tcp != last_tcp)
+            {
+                led_pulse(&s_led_wifi);
+                last_tcp = tcp;
+            }
+
+            trace_console_poll();
+
+            if ((xTaskGetTickCount() - last_stats) * portTICK_PERIOD_MS >= ESPNOW_STATS_MS)
+            {
+                uint32_t dropped = s_espnow_ring.dropped.load(std::memory_order_relaxed);
+                if (dropped != last_dropped)
                 {
-                    ESP_LOGI(TAG , "Server(%s) failed to send msg from client(%s): errno %d (%s)" ,serverIP_str ,addr_str , errno, strerror(errno));
+                    ESP_LOGW(TAG, "esp_now ring overflow: dropped %lu, truncated %lu, high water %lu/%d",
+                             (unsigned long)dropped,
+                             (unsigned long)s_espnow_ring.truncated.load(std::memory_order_relaxed),
+                             (unsigned long)s_espnow_ring.high_water,
+                             ESPNOW_RING_SLOTS);
+                    last_dropped = dropped;
                 }
+                // what handle_record used to print line by line
+                uint32_t samples = metrics_value(s_m_samples_rx);
+                uint32_t texts = metrics_value(s_m_texts_rx);
+                ESP_LOGI(TAG, "esp_now %lu samples, %lu text messages in %d s",
+                         (unsigned long)(samples - last_samples), (unsigned long)(texts - last_texts), ESPNOW_STATS_MS / 1000);
+                last_samples = samples;
+                last_texts = texts;
+
+                log_node_stats();
+                log_bridge_stats();
+                log_pool_stats();
+                log_frag_stats();
+                last_stats = xTaskGetTickCount();
+            }
+        }
+    }
+
+    // One sample per tracked slave, node="0A1B"
+    static void node_samples(metrics_writer_t *w, const char *name, int field)
+    {
+        char labels[16];
+        for (int i = 0; i < NODE_TABLE_SIZE; i++)
+        {
+            const node_state_t *node = &s_nodes.nodes[i];
+            if (!node->used)
+            {
+                continue;
+            }
+
+            uint32_t value = field == 0 ? node->received :
+                             field == 1 ? node->lost :
+                             field == 2 ? node->duplicates :
+                             field == 3 ? node->reordered :
+                             field == 4 ? node_jitter_us(node) :
+                             field == 5 ? node_latency_quantile_us(node, 0.5f) : node_latency_quantile_us(node, 0.99f);
+            snprintf(labels, sizeof(labels), "node=\"%04X\"", node->node_id);
+            metrics_sample(w, name, labels, value);
+        }
+    }
+
+    // The whole fleet's one way latency, a bucket per octave (every other one the node table has)
+    static void latency_histogram(metrics_writer_t *w)
+    {
+        char labels[24];
+        uint32_t count = 0;
+
+        metrics_family(w, "dt_latency_us", METRIC_HISTOGRAM, "One way latency of time stamped frames from every slave");
+        for (int i = 0; i < NODE_LATENCY_BUCKETS - 1; i++)
+        {
+            count += s_nodes.latency_hist[i];
+            if ((i & 1) == 0)
+            {
+                snprintf(labels, sizeof(labels), "le=\"%lu\"", (unsigned long)node_latency_bucket_us(i + 1));
+                metrics_sample(w, "dt_latency_us_bucket", labels, count);
+            }
+        }
+        metrics_sample(w, "dt_latency_us_bucket", "le=\"+Inf\"", s_nodes.latency_frames);
+        metrics_sample(w, "dt_latency_us_sum", NULL, s_nodes.latency_sum_us);
+        metrics_sample(w, "dt_latency_us_count", NULL, s_nodes.latency_frames);
+    }
+
+    // Busy share of each core since the last scrape, from the idle tasks' run time
+    static void cpu_load_samples(metrics_writer_t *w)
+    {
+    #if CONFIG_FREERTOS_GENERATE_RUN_TIME_STATS
+        static uint32_t last_idle[portNUM_PROCESSORS];
+        static uint32_t last_total;
+        char labels[16];
+
+        uint32_t total = (uint32_t)portGET_RUN_TIME_COUNTER_VALUE();
+        uint32_t elapsed = total - last_total;
+        metrics_family(w, "dt_cpu_load_percent", METRIC_GAUGE, "Time each core was not idle since the last scrape");
+        for (int core = 0; core < portNUM_PROCESSORS; core++)
+        {
+            uint32_t idle = (uint32_t)ulTaskGetIdleRunTimeCounterForCore(core);
+            uint32_t idle_elapsed = idle - last_idle[core];
+            last_idle[core] = idle;
+
+            snprintf(labels, sizeof(labels), "core=\"%d\"", core);
+            metrics_sample(w, "dt_cpu_load_percent", labels,
+                           elapsed > 0 && idle_elapsed < elapsed ? 100 - (uint64_t)idle_elapsed * 100 / elapsed : 0);
+        }
+        last_total = total;
+    #endif
+    }
+
+    /*
+        Scrape time, on the TCP task. The node table, peers and frag_rx belong to the rx
+        worker and are read without a lock: every field is a word, so the worst a scrape
+        sees is a slave half way through being added
+    */
+    static void collect_bs_metrics(metrics_writer_t *w)
+    {
+        char labels[32];
+
+        metrics_family(w, "dt_queue_depth", METRIC_GAUGE, "Items waiting in each queue");
+        metrics_sample(w, "dt_queue_depth", "queue=\"espnow_rx\"",
+                       s_espnow_ring.head.load(std::memory_order_relaxed) - s_espnow_ring.tail.load(std::memory_order_relaxed));
+        metrics_sample(w, "dt_queue_depth", "queue=\"tcp_forward\"",
+                       s_fwd_queue.head.load(std::memory_order_relaxed) - s_fwd_queue.tail.load(std::memory_order_relaxed));
+        metrics_family(w, "dt_queue_high_water", METRIC_GAUGE, "Most items ever waiting in each queue");
+        metrics_sample(w, "dt_queue_high_water", "queue=\"espnow_rx\"", s_espnow_ring.high_water);
+
+        metrics_family(w, "dt_espnow_dropped_total", METRIC_COUNTER, "Received ESP-NOW frames lost before the rx worker saw them");
+        metrics_sample(w, "dt_espnow_dropped_total", "reason=\"ring_full\"", s_espnow_ring.dropped.load(std::memory_order_relaxed));
+        metrics_sample(w, "dt_espnow_dropped_total", "reason=\"no_buffer\"", s_rx_pool.exhausted.load(std::memory_order_relaxed));
+        metrics_sample(w, "dt_espnow_dropped_total", "reason=\"truncated\"", s_espnow_ring.truncated.load(std::memory_order_relaxed));
+
+        metrics_family(w, "dt_pool_in_use", METRIC_GAUGE, "Blocks taken from each static pool");
+        metrics_sample(w, "dt_pool_in_use", "pool=\"rx_frames\"", block_pool_in_use(&s_rx_pool));
+        metrics_sample(w, "dt_pool_in_use", "pool=\"frag_blocks\"", block_pool_in_use(&s_frag_rx.blocks));
+        metrics_family(w, "dt_pool_high_water", METRIC_GAUGE, "Most blocks ever taken from each static pool");
+        metrics_sample(w, "dt_pool_high_water", "pool=\"rx_frames\"", s_rx_pool.high_water.load(std::memory_order_relaxed));
+        metrics_sample(w, "dt_pool_high_water", "pool=\"frag_blocks\"", s_frag_rx.blocks.high_water.load(std::memory_order_relaxed));
+
+        metrics_family(w, "dt_frag_messages_total", METRIC_COUNTER, "Fragmented messages by how they ended");
+        metrics_sample(w, "dt_frag_messages_total", "result=\"completed\"", s_frag_rx.stats.completed);
+        metrics_sample(w, "dt_frag_messages_total", "result=\"timeout\"", s_frag_rx.stats.timeouts);
+        metrics_sample(w, "dt_frag_messages_total", "result=\"evicted\"", s_frag_rx.stats.evicted);
+        metrics_sample(w, "dt_frag_messages_total", "result=\"refused\"", s_frag_rx.stats.refused);
+
+        metrics_family(w, "dt_peers", METRIC_GAUGE, "Slaves the base station knows, and how many are registered ESP-NOW peers");
+        metrics_sample(w, "dt_peers", "state=\"known\"", s_peers.known);
+        metrics_sample(w, "dt_peers", "state=\"registered\"", s_peers.registered);
 
-                vTaskDelay(2000 / portTICK_PERIOD_MS);
+        metrics_family(w, "dt_node_frames_total", METRIC_COUNTER, "Frames received from each slave");
+        node_samples(w, "dt_node_frames_total", 0);
+        metrics_family(w, "dt_node_lost_total", METRIC_COUNTER, "Sequence gaps from each slave");
+        node_samples(w, "dt_node_lost_total", 1);
+        metrics_family(w, "dt_node_duplicates_total", METRIC_COUNTER, "Duplicate frames from each slave");
+        node_samples(w, "dt_node_duplicates_total", 2);
+        metrics_family(w, "dt_node_reordered_total", METRIC_COUNTER, "Frames from each slave that arrived after a later one");
+        node_samples(w, "dt_node_reordered_total", 3);
+        metrics_family(w, "dt_node_jitter_us", METRIC_GAUGE, "Arrival jitter of each slave (RFC 3550)");
+        node_samples(w, "dt_node_jitter_us", 4);
+        metrics_family(w, "dt_node_latency_p50_us", METRIC_GAUGE, "Median one way latency of each slave's time stamped frames, lately");
+        node_samples(w, "dt_node_latency_p50_us", 5);
+        metrics_family(w, "dt_node_latency_p99_us", METRIC_GAUGE, "99th percentile one way latency of each slave's time stamped frames, lately");
+        node_samples(w, "dt_node_latency_p99_us", 6);
+        latency_histogram(w);
 
-                // close the accepted connection after each use. Usually for security (like DOS attacks preventiont)
-                shutdown(sock, 0);
-                close(sock); 
+        metrics_family(w, "dt_ts_series", METRIC_GAUGE, "Time series (slave and channel) in the store");
+        metrics_sample(w, "dt_ts_series", NULL, s_ts.stats.series);
+        metrics_family(w, "dt_ts_points_total", METRIC_COUNTER, "Samples put in the time series store");
+        metrics_sample(w, "dt_ts_points_total", NULL, s_ts.stats.points);
+        metrics_family(w, "dt_ts_points_late_total", METRIC_COUNTER, "Samples dropped for being older than their series' open 1 s bucket");
+        metrics_sample(w, "dt_ts_points_late_total", NULL, s_ts.stats.late);
+        metrics_family(w, "dt_ts_points_ahead_total", METRIC_COUNTER, "Samples dropped for being more than a second after now");
+        metrics_sample(w, "dt_ts_points_ahead_total", NULL, s_ts.stats.ahead);
+        metrics_family(w, "dt_ts_series_recycled_total", METRIC_COUNTER, "Time series thrown out to make room for a new one");
+        metrics_sample(w, "dt_ts_series_recycled_total", NULL, s_ts.stats.recycled);
+        metrics_family(w, "dt_ts_queries_total", METRIC_COUNTER, "Time series queries from TCP clients");
+        metrics_sample(w, "dt_ts_queries_total", NULL, s_ts.stats.queries);
+
+        metrics_family(w, "dt_heap_free_bytes", METRIC_GAUGE, "Free heap");
+        metrics_sample(w, "dt_heap_free_bytes", NULL, esp_get_free_heap_size());
+        metrics_family(w, "dt_heap_min_free_bytes", METRIC_GAUGE, "Least free heap since boot");
+        metrics_sample(w, "dt_heap_min_free_bytes", NULL, esp_get_minimum_free_heap_size());
+
+        metrics_family(w, "dt_task_stack_free_bytes", METRIC_GAUGE, "Least stack each task has had left");
+        for (size_t i = 0; i < sizeof(METRICS_TASKS) / sizeof(METRICS_TASKS[0]); i++)
+        {
+            TaskHandle_t task = xTaskGetHandle(METRICS_TASKS[i]);
+            if (task != NULL)
+            {
+                snprintf(labels, sizeof(labels), "task=\"%s\"", METRICS_TASKS[i]);
+                metrics_sample(w, "dt_task_stack_free_bytes", labels, uxTaskGetStackHighWaterMark(task));
             }
         }
-        close(listen_socket);
+
+        cpu_load_samples(w);
+    }
+
+    // Before any task is started, registration is not thread safe
+    static void init_metrics(void)
+    {
+        s_m_espnow_rx = metrics_counter("dt_frames_received_total", "transport=\"espnow\"", "Frames received, per transport");
+        s_m_espnow_tx = metrics_counter("dt_frames_sent_total", "transport=\"espnow\"", "Frames sent, per transport");
+        metrics_rate("dt_frames_per_second", "transport=\"espnow\"", "Frames received per second since the last scrape", s_m_espnow_rx);
+        s_m_espnow_rx_bytes = metrics_counter("dt_espnow_rx_bytes_total", NULL, "ESP-NOW bytes received");
+        s_m_bad_frames = metrics_counter("dt_espnow_bad_frames_total", NULL, "ESP-NOW frames that failed to decode");
+        s_m_bad_samples = metrics_counter("dt_bad_sample_records_total", NULL, "Packed sample records or dumps that failed to decode");
+        s_m_fwd_queue_full = metrics_counter("dt_tcp_forward_queue_full_total", NULL, "Frames not forwarded, the queue to the TCP task was full");
+        s_m_samples_rx = metrics_counter("dt_samples_received_total", NULL, "Sensor samples received live from the slaves");
+        s_m_texts_rx = metrics_counter("dt_text_records_received_total", NULL, "Text records received from the slaves, a fragmented message counts once");
+        s_m_stamps_ahead = metrics_counter("dt_stamps_ahead_total", NULL, "Records stamped on our clock but after they arrived, stored at arrival or (replays) not at all");
+
+        tcp_requests_init();
+        metrics_add_collector(collect_bs_metrics);
+    }
+
+    void server_esp_now()
+    {
+        shared_buf_pool_init(&s_rx_pool, s_rx_bufs, s_rx_buf_next, ESPNOW_RX_BUFS);
+        espnow_ring_init(&s_espnow_ring, &s_rx_pool);
+        node_table_init(&s_nodes);
+        ts_store_init(&s_ts);
+        tcp_requests_set_ts_store(&s_ts);
+        shared_buf_queue_init(&s_fwd_queue);
+        frag_rx_init(&s_frag_rx, frag_send, frag_deliver);
+        peer_slots_init(&s_peers, ESP_NOW_MAX_TOTAL_PEER_NUM - PEER_SLOTS_RESERVED, peer_add, peer_del);
+
+        // worker goes on the other core to the wifi task so draining never holds up the radio
+        dt_task_start(espnow_rx_task, "espnow_rx", ESPNOW_RX_STACK, ESPNOW_RX_PRIO, DT_CORE_RADIO, &s_espnow_rx_task);
+
+        s_radio = dt_transport_espnow_init();
+        ESP_LOGI(TAG , "esp_now initialised");
+        dt_transport_set_callbacks(s_radio, on_data_recv, on_data_sent, NULL);
+
+        // the reserved peer slot, for beacons
+        peer_add(DT_BROADCAST_MAC);
+
+        esp_timer_create_args_t beacon_args = {};
+        beacon_args.callback = beacon_timer_cb;
+        beacon_args.dispatch_method = ESP_TIMER_TASK;
+        beacon_args.name = "beacon";
+        ESP_ERROR_CHECK(esp_timer_create(&beacon_args, &s_beacon_timer));
+
+        s_slot_count.store(TDMA_MIN_SLOTS, std::memory_order_relaxed);
+        ESP_ERROR_CHECK(esp_timer_start_periodic(s_beacon_timer, TDMA_MIN_SLOTS * TDMA_SLOT_US));
+    }
+
+    static void tcp_server_task(void * pvParams)
+    {
+        // only returns if the listen socket fails
+        tcp_server_run(PORT, tcp_handle_request, on_tcp_wake);
+
+        tcp_server_stats_t stats;
+        tcp_server_get_stats(&stats);
+        ESP_LOGE(TAG, "TCP server stopped after %lu connections, %lu requests",
+                 (unsigned long)stats.accepted, (unsigned long)stats.requests);
         vTaskDelete(NULL);
     }
 
@@ -421,17 +1187,17 @@ extern "C"
     {
         gpio_out_setup(LED_WIFI);
         gpio_out_setup(LED_ESPNOW);
+        led_indicator_init(&s_led_wifi, LED_WIFI, LED_ON_MS, LED_OFF_MS);
+        led_indicator_init(&s_led_espnow, LED_ESPNOW, LED_ON_MS, LED_OFF_MS);
 
         init_nvs();
         
         ESP_LOGI(TAG , "Connect wifi: %i" , init_wifi());
+        init_metrics();
         server_esp_now();
 
-        xTaskCreate(tcp_server_task , 
-                    "tcp_server" , 
-                    4096,
-                    (void *)AF_INET ,
-                    5,
-                    NULL);
+        // next to lwIP's tcpip task, every socket call hands over to it
+        dt_task_start(tcp_server_task, "tcp_server", TCP_SERVER_STACK, TCP_SERVER_PRIO, DT_CORE_NET, NULL);
+        dt_task_start(housekeeping_task, "housekeeping", HOUSEKEEPING_STACK, DT_HOUSEKEEPING_PRIO, DT_CORE_RADIO, NULL);
     }
 }
\ No newline at end of file
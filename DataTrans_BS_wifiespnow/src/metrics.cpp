@@ -0,0 +1,191 @@
+#include <stdarg.h>
+#include <string.h>
+
+#include "metrics.h"
+
+static const char *TAG = "metrics";
+
+typedef struct
+{
+    const char *name;
+    const char *labels;
+    const char *help;
+    uint8_t type;
+
+    // rates only
+    metric_id_t counter;
+    uint32_t last_count;
+} metric_desc_t;
+
+metrics_core_t metrics_cores[DT_NUM_CORES];
+
+static metric_desc_t s_metrics[METRICS_MAX];
+static int s_metric_count;
+static metrics_collector_t s_collectors[METRICS_MAX_COLLECTORS];
+static int s_collector_count;
+static int64_t s_rates_us;              // when the rates were last worked out
+
+static metric_id_t metric_register(const char *name, const char *labels, const char *help, metric_type_t type, metric_id_t counter)
+{
+    if (s_metric_count == METRICS_MAX)
+    {
+        ESP_LOGE(TAG, "No room for %s, raise METRICS_MAX", name);
+        return METRICS_MAX;
+    }
+
+    metric_desc_t *desc = &s_metrics[s_metric_count];
+    desc->name = name;
+    desc->labels = labels;
+    desc->help = help;
+    desc->type = type;
+    desc->counter = counter;
+    desc->last_count = counter < METRICS_MAX ? metrics_value(counter) : 0;
+    return (metric_id_t)s_metric_count++;
+}
+
+metric_id_t metrics_counter(const char *name, const char *labels, const char *help)
+{
+    return metric_register(name, labels, help, METRIC_COUNTER, METRICS_MAX);
+}
+
+metric_id_t metrics_gauge(const char *name, const char *labels, const char *help)
+{
+    return metric_register(name, labels, help, METRIC_GAUGE, METRICS_MAX);
+}
+
+metric_id_t metrics_rate(const char *name, const char *labels, const char *help, metric_id_t counter)
+{
+    return metric_register(name, labels, help, METRIC_GAUGE, counter);
+}
+
+static void update_rates(void)
+{
+    int64_t now_us = esp_timer_get_time();
+    int64_t elapsed_us = now_us - s_rates_us;
+    if (elapsed_us < METRICS_RATE_MIN_MS * 1000)
+    {
+        return; // scraped again straight away, keep the last numbers
+    }
+
+    for (int i = 0; i < s_metric_count; i++)
+    {
+        metric_desc_t *desc = &s_metrics[i];
+        if (desc->counter == METRICS_MAX)
+        {
+            continue;
+        }
+
+        uint32_t count = metrics_value(desc->counter);
+        metrics_set((metric_id_t)i, (uint32_t)((uint64_t)(count - desc->last_count) * 1000000 / elapsed_us));
+        desc->last_count = count;
+    }
+    s_rates_us = now_us;
+}
+
+void metrics_add_collector(metrics_collector_t collector)
+{
+    if (s_collector_count == METRICS_MAX_COLLECTORS)
+    {
+        ESP_LOGE(TAG, "No room for another collector, raise METRICS_MAX_COLLECTORS");
+        return;
+    }
+    s_collectors[s_collector_count++] = collector;
+}
+
+uint32_t metrics_value(metric_id_t id)
+{
+    uint32_t sum = 0;
+    for (int core = 0; core < DT_NUM_CORES; core++)
+    {
+        sum += metrics_cores[core].values[id].load(std::memory_order_relaxed);
+    }
+    return sum;
+}
+
+// A whole line or nothing, so a full buffer never ends in half a sample
+static void writer_printf(metrics_writer_t *w, const char *fmt, ...)
+{
+    if (w->truncated)
+    {
+        return;
+    }
+
+    va_list args;
+    va_start(args, fmt);
+    int n = vsnprintf(w->buf + w->len, w->size - w->len, fmt, args);
+    va_end(args);
+
+    if (n < 0 || (size_t)n >= w->size - w->len)
+    {
+        w->buf[w->len] = '\0';
+        w->truncated = true;
+        return;
+    }
+    w->len += n;
+}
+
+void metrics_family(metrics_writer_t *w, const char *name, metric_type_t type, const char *help)
+{
+    static const char *const TYPES[] = { "counter", "gauge", "histogram" };
+    writer_printf(w, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, TYPES[type]);
+}
+
+void metrics_sample(metrics_writer_t *w, const char *name, const char *labels, uint64_t value)
+{
+    if (labels != NULL && labels[0] != '\0')
+    {
+        writer_printf(w, "%s{%s} %llu\n", name, labels, (unsigned long long)value);
+    }
+    else
+    {
+        writer_printf(w, "%s %llu\n", name, (unsigned long long)value);
+    }
+}
+
+size_t metrics_render(char *buf, size_t size)
+{
+    metrics_writer_t w = { buf, size, 0, false };
+    if (size == 0)
+    {
+        return 0;
+    }
+    buf[0] = '\0';
+
+    update_rates();
+
+    // every label set of a name goes together under one # TYPE, whatever order they were registered in
+    for (int i = 0; i < s_metric_count; i++)
+    {
+        const metric_desc_t *desc = &s_metrics[i];
+
+        bool done = false;
+        for (int j = 0; j < i && !done; j++)
+        {
+            done = strcmp(s_metrics[j].name, desc->name) == 0;
+        }
+        if (done)
+        {
+            continue;
+        }
+
+        metrics_family(&w, desc->name, (metric_type_t)desc->type, desc->help);
+        for (int j = i; j < s_metric_count; j++)
+        {
+            if (strcmp(s_metrics[j].name, desc->name) == 0)
+            {
+                metrics_sample(&w, s_metrics[j].name, s_metrics[j].labels, metrics_value((metric_id_t)j));
+            }
+        }
+    }
+
+    for (int i = 0; i < s_collector_count; i++)
+    {
+        s_collectors[i](&w);
+    }
+
+    if (w.truncated)
+    {
+        ESP_LOGW(TAG, "Metrics cut short at %u bytes", (unsigned)w.len);
+    }
+    return w.len;
+}
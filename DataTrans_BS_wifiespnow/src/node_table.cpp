@@ -0,0 +1,216 @@
+#include <string.h>
+
+#include "node_table.h"
+
+static_assert((NODE_TABLE_SIZE & (NODE_TABLE_SIZE - 1)) == 0, "NODE_TABLE_SIZE must be a power of 2");
+
+void node_table_init(node_table_t *table)
+{
+    memset(table, 0, sizeof(*table));
+}
+
+static uint32_t mac_hash(const uint8_t *mac)
+{
+    // FNV-1a
+    uint32_t hash = 2166136261u;
+    for (int i = 0; i < 6; i++)
+    {
+        hash = (hash ^ mac[i]) * 16777619u;
+    }
+    return hash;
+}
+
+node_state_t *node_table_get(node_table_t *table, const uint8_t *mac)
+{
+    uint32_t idx = mac_hash(mac) & (NODE_TABLE_SIZE - 1);
+
+    for (int probe = 0; probe < NODE_TABLE_SIZE; probe++)
+    {
+        node_state_t *node = &table->nodes[idx];
+
+        if (!node->used)
+        {
+            // never deleted from, so the first empty slot means the MAC is not in here
+            if (table->count >= NODE_TABLE_SIZE * 3 / 4)
+            {
+                break; // keep probe chains short
+            }
+
+            memset(node, 0, sizeof(*node));
+            memcpy(node->mac, mac, 6);
+            node->used = true;
+            table->count++;
+            return node;
+        }
+        if (memcmp(node->mac, mac, 6) == 0)
+        {
+            return node;
+        }
+
+        idx = (idx + 1) & (NODE_TABLE_SIZE - 1);
+    }
+
+    table->full++;
+    return NULL;
+}
+
+static void start_sequence(node_state_t *node, uint32_t seq)
+{
+    node->highest_seq = seq;
+    node->seq_window = 1;
+}
+
+void node_track_frame(node_state_t *node, uint16_t node_id, uint32_t seq, uint32_t sender_us, int64_t rx_us)
+{
+    node->node_id = node_id;
+
+    if (node->received == 0)
+    {
+        start_sequence(node, seq);
+    }
+    else if (seq > node->highest_seq)
+    {
+        uint32_t ahead = seq - node->highest_seq;
+
+        node->lost += ahead - 1;
+        node->seq_window = ahead >= NODE_SEQ_WINDOW ? 0 : node->seq_window << ahead;
+        node->seq_window |= 1;
+        node->highest_seq = seq;
+    }
+    else
+    {
+        uint32_t behind = node->highest_seq - seq;
+
+        if (behind >= NODE_SEQ_RESTART_GAP)
+        {
+            node->restarts++;
+            start_sequence(node, seq);
+        }
+        else if (behind >= NODE_SEQ_WINDOW)
+        {
+            node->stale++;
+        }
+        else if (node->seq_window & (1ULL << behind))
+        {
+            node->duplicates++;
+            return; // do not let a copy count towards jitter
+        }
+        else
+        {
+            // a gap we already counted as lost has just been filled
+            node->seq_window |= 1ULL << behind;
+            node->reordered++;
+            if (node->lost > 0)
+            {
+                node->lost--;
+            }
+            if (behind > node->max_reorder_depth)
+            {
+                node->max_reorder_depth = behind;
+            }
+        }
+    }
+
+    // RFC 3550: J += (|D| - J) / 16, D = change in (arrival - send) between frames
+    if (node->received > 0)
+    {
+        int32_t rx_delta = (int32_t)(rx_us - node->last_rx_us);
+        int32_t tx_delta = (int32_t)(sender_us - node->last_sender_us);
+        int32_t d = rx_delta - tx_delta;
+        if (d < 0)
+        {
+            d = -d;
+        }
+        node->jitter_us_x16 += d - (int32_t)(node->jitter_us_x16 >> 4);
+    }
+
+    node->last_rx_us = rx_us;
+    node->last_sender_us = sender_us;
+    node->received++;
+}
+
+uint32_t node_latency_bucket_us(int bucket)
+{
+    if (bucket <= 0)
+    {
+        return 0;
+    }
+    // odd buckets start half way up the octave (times 1.5, near enough to the root of 2)
+    uint32_t octave = NODE_LATENCY_MIN_US << ((bucket - 1) / 2);
+    return (bucket & 1) ? octave : octave + octave / 2;
+}
+
+static int latency_bucket(uint32_t latency_us)
+{
+    int bucket = 0;
+    while (bucket < NODE_LATENCY_BUCKETS - 1 && latency_us >= node_latency_bucket_us(bucket + 1))
+    {
+        bucket++;
+    }
+    return bucket;
+}
+
+void node_track_replay(node_state_t *node, uint16_t node_id)
+{
+    node->node_id = node_id;
+    node->replayed++;
+}
+
+void node_track_latency(node_table_t *table, node_state_t *node, uint32_t sender_us, int64_t rx_us)
+{
+    int32_t latency_us = (int32_t)((uint32_t)rx_us - sender_us);
+    node->latency_frames++;
+    if (latency_us < 0)
+    {
+        node->latency_early++;
+        return;
+    }
+
+    int bucket = latency_bucket((uint32_t)latency_us);
+    if (node->latency_hist[bucket] == UINT16_MAX)
+    {
+        for (int i = 0; i < NODE_LATENCY_BUCKETS; i++)
+        {
+            node->latency_hist[i] >>= 1;
+        }
+    }
+    node->latency_hist[bucket]++;
+    if ((uint32_t)latency_us > node->latency_max_us)
+    {
+        node->latency_max_us = (uint32_t)latency_us;
+    }
+
+    table->latency_hist[bucket]++;
+    table->latency_sum_us += (uint32_t)latency_us;
+    table->latency_frames++;
+}
+
+uint32_t node_latency_quantile_us(const node_state_t *node, float q)
+{
+    uint32_t total = 0;
+    for (int i = 0; i < NODE_LATENCY_BUCKETS; i++)
+    {
+        total += node->latency_hist[i];
+    }
+    if (total == 0)
+    {
+        return 0;
+    }
+
+    // straight line across the bucket the rank falls in
+    float rank = q * total;
+    uint32_t below = 0;
+    for (int i = 0; i < NODE_LATENCY_BUCKETS - 1; i++)
+    {
+        uint32_t n = node->latency_hist[i];
+        if (n > 0 && below + n >= rank)
+        {
+            uint32_t lo = node_latency_bucket_us(i);
+            uint32_t hi = node_latency_bucket_us(i + 1);
+            uint32_t at = lo + (uint32_t)((hi - lo) * ((rank - below) / n));
+            return at < node->latency_max_us ? at : node->latency_max_us;
+        }
+        below += n;
+    }
+    return node->latency_max_us;
+}
@@ -0,0 +1,167 @@
+#include <string.h>
+
+#include "dt_port.h"
+#include "peer_slots.h"
+
+static const char *TAG = "peer_slots";
+
+void peer_slots_init(peer_slots_t *ps, int max_registered, peer_slots_add_t add, peer_slots_del_t del)
+{
+    memset(ps, 0, sizeof(*ps));
+    ps->max_registered = max_registered;
+    ps->add = add;
+    ps->del = del;
+}
+
+static peer_entry_t *find(peer_slots_t *ps, const uint8_t *mac)
+{
+    for (int i = 0; i < PEER_SLOTS_MAX_NODES; i++)
+    {
+        if (ps->entries[i].used && memcmp(ps->entries[i].mac, mac, 6) == 0)
+        {
+            return &ps->entries[i];
+        }
+    }
+    return NULL;
+}
+
+// Least recently active known slave, or registered slave
+static peer_entry_t *least_recent(peer_slots_t *ps, bool registered_only)
+{
+    peer_entry_t *oldest = NULL;
+
+    for (int i = 0; i < PEER_SLOTS_MAX_NODES; i++)
+    {
+        peer_entry_t *entry = &ps->entries[i];
+        if (!entry->used || (registered_only && !entry->registered))
+        {
+            continue;
+        }
+        if (oldest == NULL || entry->last_active_us < oldest->last_active_us)
+        {
+            oldest = entry;
+        }
+    }
+    return oldest;
+}
+
+static void unregister(peer_slots_t *ps, peer_entry_t *entry)
+{
+    ps->del(entry->mac);
+    entry->registered = false;
+    ps->registered--;
+}
+
+peer_entry_t *peer_slots_admit(peer_slots_t *ps, const uint8_t *mac, uint16_t node_id, int64_t now_us)
+{
+    peer_entry_t *entry = find(ps, mac);
+    if (entry != NULL)
+    {
+        ps->stats.rejoined++;
+        entry->node_id = node_id;
+        entry->last_active_us = now_us;
+        return entry;
+    }
+
+    for (int i = 0; i < PEER_SLOTS_MAX_NODES && entry == NULL; i++)
+    {
+        if (!ps->entries[i].used)
+        {
+            entry = &ps->entries[i];
+        }
+    }
+
+    if (entry == NULL)
+    {
+        // table full, forget whoever has been quiet longest
+        peer_entry_t *idle = least_recent(ps, false);
+        if (idle == NULL)
+        {
+            return NULL;
+        }
+
+        if (idle->registered)
+        {
+            unregister(ps, idle);
+            ps->stats.evictions++;
+        }
+        idle->used = false;
+        ps->known--;
+        ps->stats.forgotten++;
+        entry = idle;
+    }
+
+    memset(entry, 0, sizeof(*entry));
+    memcpy(entry->mac, mac, 6);
+    entry->used = true;
+    entry->node_id = node_id;
+    entry->admitted_us = now_us;
+    entry->last_active_us = now_us;
+
+    ps->known++;
+    ps->stats.admitted++;
+    return entry;
+}
+
+bool peer_slots_touch(peer_slots_t *ps, const uint8_t *mac, int64_t now_us)
+{
+    peer_entry_t *entry = find(ps, mac);
+    if (entry == NULL)
+    {
+        return false;
+    }
+
+    entry->last_active_us = now_us;
+    return true;
+}
+
+uint16_t peer_slots_highest_slot(const peer_slots_t *ps)
+{
+    for (int i = PEER_SLOTS_MAX_NODES - 1; i >= 0; i--)
+    {
+        if (ps->entries[i].used)
+        {
+            return peer_slots_slot(ps, &ps->entries[i]);
+        }
+    }
+    return 0;
+}
+
+int peer_slots_acquire(peer_slots_t *ps, const uint8_t *mac, int64_t now_us)
+{
+    peer_entry_t *entry = find(ps, mac);
+    if (entry == NULL)
+    {
+        return -1; // has not joined
+    }
+
+    entry->last_active_us = now_us;
+    if (entry->registered)
+    {
+        return 0;
+    }
+
+    if (ps->registered >= ps->max_registered)
+    {
+        peer_entry_t *lru = least_recent(ps, true);
+        if (lru == NULL)
+        {
+            return -1;
+        }
+
+        ESP_LOGD(TAG, "Evicting node %04X to make room for node %04X", lru->node_id, entry->node_id);
+        unregister(ps, lru);
+        ps->stats.evictions++;
+    }
+
+    if (ps->add(mac) != 0)
+    {
+        ps->stats.register_failures++;
+        return -1;
+    }
+
+    entry->registered = true;
+    ps->registered++;
+    ps->stats.registrations++;
+    return 0;
+}
@@ -0,0 +1,347 @@
+#include <string.h>
+
+#include "tcp_requests.h"
+#include "dt_frame.h"
+#include "metrics.h"
+#include "block_pool.h"
+#include "trace.h"
+
+static const char *TAG = "tcp_requests";
+
+static const char *RESPONSE_BODY = "Response from ESP32 Base station via Socket connection";
+
+// Metrics pages being sent, one per scrape in progress. A scrape that finds none free gets a 503
+typedef struct
+{
+    char text[TCP_METRICS_PAGE_SIZE];
+} metrics_page_t;
+
+static metrics_page_t s_pages[TCP_METRICS_PAGES];
+static std::atomic<uint16_t> s_page_next[TCP_METRICS_PAGES];
+static block_pool_t s_page_pool;
+
+// One trace dump at a time, it is big
+static char s_trace_page[TRACE_DUMP_SIZE];
+static std::atomic<bool> s_trace_busy;
+
+static metric_id_t s_m_frames_rx;
+static metric_id_t s_m_frames_tx;
+static metric_id_t s_m_bad_bytes;
+static metric_id_t s_m_scrapes;
+
+// One way latency of requests stamped with our clock (the slaves' time sync), the TCP task's alone
+static uint32_t s_latency_count;
+static uint64_t s_latency_sum_us;
+static uint32_t s_latency_min_us = UINT32_MAX;
+static uint32_t s_latency_max_us;
+
+static ts_store_t *s_ts_store;
+
+// tcp_conn_user state for a connection speaking HTTP
+#define HTTP_HEADERS 1          // request line seen, waiting for the blank line
+#define HTTP_DONE 2             // answered, anything else it sends is ignored
+#define HTTP_PAGE_METRICS 0x100 // flag, which page it asked for. Neither is a 404
+#define HTTP_PAGE_TRACE 0x200
+
+static void collect_tcp(metrics_writer_t *w)
+{
+    tcp_server_stats_t stats;
+    tcp_server_get_stats(&stats);
+
+    metrics_family(w, "dt_tcp_connections", METRIC_GAUGE, "Open TCP connections");
+    metrics_sample(w, "dt_tcp_connections", NULL, stats.active);
+    metrics_family(w, "dt_tcp_connections_high_water", METRIC_GAUGE, "Most TCP connections open at once");
+    metrics_sample(w, "dt_tcp_connections_high_water", NULL, stats.conn_high_water);
+    metrics_family(w, "dt_tcp_accepted_total", METRIC_COUNTER, "TCP connections accepted");
+    metrics_sample(w, "dt_tcp_accepted_total", NULL, stats.accepted);
+    metrics_family(w, "dt_tcp_rejected_total", METRIC_COUNTER, "TCP connections turned away, every client slot in use");
+    metrics_sample(w, "dt_tcp_rejected_total", NULL, stats.rejected);
+    metrics_family(w, "dt_tcp_bytes_total", METRIC_COUNTER, "Bytes through the TCP server");
+    metrics_sample(w, "dt_tcp_bytes_total", "dir=\"rx\"", stats.rx_bytes);
+    metrics_sample(w, "dt_tcp_bytes_total", "dir=\"tx\"", stats.tx_bytes);
+    metrics_family(w, "dt_tcp_subscribers", METRIC_GAUGE, "TCP clients subscribed to forwarded ESP-NOW frames");
+    metrics_sample(w, "dt_tcp_subscribers", NULL, stats.subscribers);
+    metrics_family(w, "dt_tcp_forwarded_total", METRIC_COUNTER, "ESP-NOW frames forwarded to TCP subscribers");
+    metrics_sample(w, "dt_tcp_forwarded_total", "result=\"sent\"", stats.forwarded);
+    metrics_sample(w, "dt_tcp_forwarded_total", "result=\"dropped\"", stats.forward_dropped);
+    metrics_family(w, "dt_tcp_forward_latency_us", METRIC_GAUGE, "Radio arrival to TCP send for forwarded frames");
+    metrics_sample(w, "dt_tcp_forward_latency_us", "stat=\"min\"", stats.forward_latency_us_min);
+    metrics_sample(w, "dt_tcp_forward_latency_us", "stat=\"avg\"", stats.forwarded ? stats.forward_latency_us_sum / stats.forwarded : 0);
+    metrics_sample(w, "dt_tcp_forward_latency_us", "stat=\"max\"", stats.forward_latency_us_max);
+    metrics_family(w, "dt_tcp_latency_us", METRIC_GAUGE, "Slave to base station one way latency of time stamped TCP requests");
+    metrics_sample(w, "dt_tcp_latency_us", "stat=\"min\"", s_latency_count ? s_latency_min_us : 0);
+    metrics_sample(w, "dt_tcp_latency_us", "stat=\"avg\"", s_latency_count ? s_latency_sum_us / s_latency_count : 0);
+    metrics_sample(w, "dt_tcp_latency_us", "stat=\"max\"", s_latency_max_us);
+}
+
+// A request stamped with our clock: how long it took from the slave's send to here
+static void track_latency(const dt_frame_hdr_t *hdr)
+{
+    int32_t latency_us = (int32_t)((uint32_t)esp_timer_get_time() - hdr->timestamp_us);
+    if (latency_us < 0)
+    {
+        return; // the slave's sync is off, the ESP-NOW side counts those
+    }
+    s_latency_count++;
+    s_latency_sum_us += (uint32_t)latency_us;
+    s_latency_min_us = (uint32_t)latency_us < s_latency_min_us ? (uint32_t)latency_us : s_latency_min_us;
+    s_latency_max_us = (uint32_t)latency_us > s_latency_max_us ? (uint32_t)latency_us : s_latency_max_us;
+}
+
+void tcp_requests_set_ts_store(ts_store_t *store)
+{
+    s_ts_store = store;
+}
+
+// A time series query's answer, the buckets straight after the result header. Returns the payload length
+static size_t ts_query(const dt_ts_query_t *query, uint8_t *payload)
+{
+    dt_ts_result_t *result = (dt_ts_result_t *)payload;
+    dt_ts_bucket_t *out = (dt_ts_bucket_t *)(payload + sizeof(dt_ts_result_t));
+    memset(result, 0, sizeof(*result));
+    result->node_id = query->node_id;
+    result->channel = query->channel;
+
+    int64_t now_ms = esp_timer_get_time() / 1000;
+    ts_bucket_t buckets[DT_TS_MAX_BUCKETS];
+    int64_t first_ms;
+    uint32_t step_ms;
+    int n = -1;
+    if (s_ts_store != NULL)
+    {
+        n = ts_store_query(s_ts_store, query->node_id, query->channel, now_ms - query->from_ago_ms,
+                           now_ms - query->to_ago_ms, query->step_ms, buckets, DT_TS_MAX_BUCKETS, &first_ms, &step_ms);
+    }
+    if (n < 0)
+    {
+        return sizeof(dt_ts_result_t);
+    }
+
+    result->found = 1;
+    result->first_ago_ms = n > 0 ? (uint32_t)(now_ms - first_ms) : 0;
+    result->step_ms = n > 0 ? step_ms : 0;
+    for (int i = 0; i < n; i++)
+    {
+        out[i].min = buckets[i].min;
+        out[i].max = buckets[i].max;
+        out[i].mean = buckets[i].mean;
+        out[i].count = buckets[i].count;
+    }
+    return sizeof(dt_ts_result_t) + n * sizeof(dt_ts_bucket_t);
+}
+
+void tcp_requests_init(void)
+{
+    block_pool_init(&s_page_pool, s_pages, sizeof(metrics_page_t), s_page_next, TCP_METRICS_PAGES);
+
+    s_m_frames_rx = metrics_counter("dt_frames_received_total", "transport=\"tcp\"", "Frames received, per transport");
+    s_m_frames_tx = metrics_counter("dt_frames_sent_total", "transport=\"tcp\"", "Frames sent, per transport");
+    metrics_rate("dt_frames_per_second", "transport=\"tcp\"", "Frames received per second since the last scrape", s_m_frames_rx);
+    s_m_bad_bytes = metrics_counter("dt_tcp_bad_bytes_total", NULL, "Bytes skipped looking for the next frame");
+    s_m_scrapes = metrics_counter("dt_metrics_scrapes_total", NULL, "Times this page was asked for");
+    metrics_add_collector(collect_tcp);
+}
+
+static void page_release(const void *data)
+{
+    block_pool_free(&s_page_pool, (void *)data);
+}
+
+static void trace_release(const void *)
+{
+    s_trace_busy.store(false, std::memory_order_release);
+}
+
+static void http_status(tcp_conn_t *conn, const char *status)
+{
+    char header[96];
+    int n = snprintf(header, sizeof(header), "HTTP/1.1 %s\r\nContent-Length: 0\r\nConnection: close\r\n\r\n", status);
+    tcp_conn_send(conn, header, n);
+    tcp_conn_close_after_send(conn);
+}
+
+// body goes out straight from the caller's memory, release gets it back once it is sent
+static void http_page(tcp_conn_t *conn, const char *content_type, const char *body, size_t len, tcp_body_release_t release)
+{
+    char header[160];
+    int n = snprintf(header, sizeof(header),
+                     "HTTP/1.1 200 OK\r\nContent-Type: %s\r\nContent-Length: %u\r\nConnection: close\r\n\r\n",
+                     content_type, (unsigned)len);
+    if (tcp_conn_send(conn, header, n) < 0 || tcp_conn_send_body(conn, body, len, release) < 0)
+    {
+        release(body);
+    }
+    tcp_conn_close_after_send(conn);
+}
+
+static void http_reply(tcp_conn_t *conn, uint32_t page_flag)
+{
+    if (page_flag == HTTP_PAGE_TRACE)
+    {
+        if (s_trace_busy.exchange(true, std::memory_order_acquire))
+        {
+            http_status(conn, "503 Service Unavailable");
+            return;
+        }
+        size_t len = trace_dump_to_buf(s_trace_page, sizeof(s_trace_page));
+        http_page(conn, "text/plain", s_trace_page, len, trace_release);
+        return;
+    }
+    if (page_flag != HTTP_PAGE_METRICS)
+    {
+        http_status(conn, "404 Not Found");
+        return;
+    }
+
+    metrics_page_t *page = (metrics_page_t *)block_pool_alloc(&s_page_pool);
+    if (page == NULL)
+    {
+        http_status(conn, "503 Service Unavailable");
+        return;
+    }
+
+    metrics_inc(s_m_scrapes);
+    size_t len = metrics_render(page->text, sizeof(page->text));
+    http_page(conn, "text/plain; version=0.0.4", page->text, len, page_release);
+}
+
+/*
+    Just enough HTTP for a Prometheus scraper: GET /metrics (or /trace), headers skipped,
+    answered with the page and closed. Headers are used up as they arrive so they never have to
+    fit in the connection's rx buffer
+*/
+static size_t handle_http(tcp_conn_t *conn, const uint8_t *data, size_t len)
+{
+    uint32_t *state = tcp_conn_user(conn);
+    const char *text = (const char *)data;
+    size_t used = 0;
+
+    if (*state == 0)
+    {
+        const char *eol = (const char *)memchr(text, '\n', len);
+        if (eol == NULL)
+        {
+            return 0; // request line not all here yet
+        }
+
+        // "GET /metrics HTTP/1.1", anything after the path (a query string) is ignored
+        const char *path = text + 4;
+        size_t path_len = strcspn(path, " ?\r\n");
+        uint32_t page_flag = 0;
+        if ((path_len == 8 && memcmp(path, "/metrics", 8) == 0) || (path_len == 1 && path[0] == '/'))
+        {
+            page_flag = HTTP_PAGE_METRICS;
+        }
+        else if (path_len == 6 && memcmp(path, "/trace", 6) == 0)
+        {
+            page_flag = HTTP_PAGE_TRACE;
+        }
+        *state = HTTP_HEADERS | page_flag;
+
+        // the '\n' is kept, so a blank line straight after it still looks like one
+        used = eol - text;
+    }
+
+    if ((*state & 0xFF) == HTTP_DONE)
+    {
+        return len;
+    }
+
+    // headers end with an empty line
+    for (size_t i = used; i < len; i++)
+    {
+        if (text[i] == '\n' && ((i >= 1 && text[i - 1] == '\n') || (i >= 2 && text[i - 1] == '\r' && text[i - 2] == '\n')))
+        {
+            uint32_t page_flag = *state & ~0xFFu;
+            *state = HTTP_DONE;
+            http_reply(conn, page_flag);
+            return len;
+        }
+    }
+
+    // keep the last 3 bytes back in case the "\r\n\r\n" is split over two segments
+    return len - used > 3 ? len - 3 : used;
+}
+
+size_t tcp_handle_request(tcp_conn_t *conn, const uint8_t *data, size_t len)
+{
+    uint8_t frame[DT_FRAME_MAX_SIZE];
+    size_t used = 0;
+
+    if (*tcp_conn_user(conn) != 0 || (len >= 4 && memcmp(data, "GET ", 4) == 0))
+    {
+        return handle_http(conn, data, len);
+    }
+    if (len < 4 && memcmp(data, "GET ", len) == 0)
+    {
+        return 0; // could still be a scrape, wait for more
+    }
+
+    // clients stream binary frames, so several can turn up in one segment
+    while (used < len)
+    {
+        dt_frame_view_t req;
+        int frame_len = dt_frame_decode(data + used, len - used, &req);
+        if (frame_len == 0)
+        {
+            break; // rest of the frame has not arrived yet
+        }
+        if (frame_len < 0)
+        {
+            metrics_inc(s_m_bad_bytes);
+            used++; // not a frame, skip a byte and look for the next magic
+            continue;
+        }
+        metrics_inc(s_m_frames_rx);
+        if (req.hdr->flags & DT_FLAG_MASTER_TIME)
+        {
+            track_latency(req.hdr);
+        }
+
+        ESP_LOGD(TAG, "Client(%s) node %u seq %lu sent %u bytes", tcp_conn_addr(conn),
+                 req.hdr->node_id, (unsigned long)req.hdr->seq, req.hdr->len);
+
+        // from here on the slaves' frames are forwarded to it as they arrive
+        if (req.hdr->type == DT_TYPE_SUBSCRIBE)
+        {
+            tcp_conn_subscribe(conn);
+        }
+
+        // the reply carries the request's seq so the client can match it up
+        size_t resp_len;
+        if (req.hdr->type == DT_TYPE_TIME_REQ && req.hdr->len >= sizeof(dt_time_req_t))
+        {
+            // a slave's time sync over TCP. It only gets here after recv, so t2 and t3 are one
+            dt_time_resp_t resp;
+            resp.t1_us = ((const dt_time_req_t *)req.payload)->t1_us;
+            resp.t2_us = resp.t3_us = (uint64_t)esp_timer_get_time();
+            resp_len = dt_frame_encode(frame, sizeof(frame), DT_TYPE_TIME_RESP, DT_BASE_STATION_NODE_ID,
+                                       req.hdr->seq, (uint32_t)resp.t3_us, &resp, sizeof(resp));
+        }
+        else if (req.hdr->type == DT_TYPE_TS_QUERY && req.hdr->len >= sizeof(dt_ts_query_t))
+        {
+            uint8_t payload[DT_FRAME_MAX_PAYLOAD];
+            size_t payload_len = ts_query((const dt_ts_query_t *)req.payload, payload);
+            resp_len = dt_frame_encode(frame, sizeof(frame), DT_TYPE_TS_RESULT, DT_BASE_STATION_NODE_ID,
+                                       req.hdr->seq, (uint32_t)esp_timer_get_time(), payload, payload_len);
+        }
+        else
+        {
+            resp_len = dt_frame_encode(frame, sizeof(frame), DT_TYPE_RESPONSE, DT_BASE_STATION_NODE_ID,
+                                       req.hdr->seq, (uint32_t)esp_timer_get_time(),
+                                       RESPONSE_BODY, strlen(RESPONSE_BODY));
+        }
+
+        if (tcp_conn_send(conn, frame, resp_len) < 0)
+        {
+            ESP_LOGW(TAG, "Client(%s) tx buffer full, response dropped", tcp_conn_addr(conn));
+        }
+        else
+        {
+            metrics_inc(s_m_frames_tx);
+        }
+        used += frame_len;
+    }
+
+    return used;
+}
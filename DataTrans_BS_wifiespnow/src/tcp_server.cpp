@@ -0,0 +1,641 @@
+#include <string.h>
+
+#include "tcp_server.h"
+#include "trace.h"
+
+static const char *TAG = "tcp_server";
+
+struct tcp_conn
+{
+    int sock;
+    int slot;                   // index in s_conns
+    char addr_str[16];
+
+    size_t rx_len;
+    uint8_t rx_buf[TCP_CONN_RX_SIZE];
+
+    size_t tx_len;
+    uint8_t tx_buf[TCP_CONN_TX_SIZE];
+
+    // forwarded frames, sent straight out of the shared buffers
+    bool subscribed;
+    shared_buf_t *fwd[TCP_CONN_FWD_DEPTH];
+    int fwd_head;
+    int fwd_count;
+    size_t fwd_off;             // bytes of fwd[fwd_head] already sent
+
+    // tcp_conn_send_body, sent from the caller's memory
+    const uint8_t *body;
+    size_t body_len;
+    size_t body_off;
+    tcp_body_release_t body_release;
+
+    bool close_after_send;
+    uint32_t user;
+};
+
+// connection state comes out of a static pool, s_conns[i] is NULL when the slot is free
+static tcp_conn_t s_conn_blocks[TCP_SERVER_MAX_CLIENTS];
+static std::atomic<uint16_t> s_conn_next[TCP_SERVER_MAX_CLIENTS];
+static block_pool_t s_conn_pool;
+static tcp_conn_t *s_conns[TCP_SERVER_MAX_CLIENTS];
+static tcp_server_stats_t s_stats;
+static std::atomic<uint32_t> s_subscribers;
+
+// loopback UDP pair for tcp_server_wake
+static std::atomic<int> s_wake_tx(-1);
+static int s_wake_rx = -1;
+static struct sockaddr_in s_wake_addr;
+static std::atomic<bool> s_wake_pending;
+
+// Last byte of a forwarded frame is out, let go of it
+static void fwd_done(tcp_conn_t *conn)
+{
+    shared_buf_t *buf = conn->fwd[conn->fwd_head];
+    trace_frame(TRACE_FWD_SENT, buf->data, buf->len, conn->slot);
+    uint32_t latency_us = (uint32_t)(esp_timer_get_time() - buf->rx_us);
+
+    if (s_stats.forwarded == 0 || latency_us < s_stats.forward_latency_us_min)
+    {
+        s_stats.forward_latency_us_min = latency_us;
+    }
+    if (latency_us > s_stats.forward_latency_us_max)
+    {
+        s_stats.forward_latency_us_max = latency_us;
+    }
+    s_stats.forward_latency_us_sum += latency_us;
+    s_stats.forwarded++;
+
+    shared_buf_release(buf);
+    conn->fwd_head = (conn->fwd_head + 1) % TCP_CONN_FWD_DEPTH;
+    conn->fwd_count--;
+    conn->fwd_off = 0;
+}
+
+static void body_done(tcp_conn_t *conn)
+{
+    const uint8_t *body = conn->body;
+    conn->body = NULL;
+    conn->body_len = 0;
+    conn->body_off = 0;
+    if (conn->body_release != NULL)
+    {
+        conn->body_release(body);
+    }
+}
+
+// Anything still waiting to go out
+static bool conn_pending(const tcp_conn_t *conn)
+{
+    return conn->tx_len > 0 || conn->fwd_count > 0 || conn->body != NULL;
+}
+
+static void conn_close(tcp_conn_t *conn)
+{
+    ESP_LOGI(TAG, "Client(%s) disconnected", conn->addr_str);
+
+    shutdown(conn->sock, 0);
+    close(conn->sock);
+    conn->sock = -1;
+    conn->rx_len = 0;
+    conn->tx_len = 0;
+
+    while (conn->fwd_count > 0)
+    {
+        shared_buf_release(conn->fwd[conn->fwd_head]);
+        conn->fwd_head = (conn->fwd_head + 1) % TCP_CONN_FWD_DEPTH;
+        conn->fwd_count--;
+    }
+    conn->fwd_off = 0;
+    if (conn->body != NULL)
+    {
+        body_done(conn);
+    }
+    if (conn->subscribed)
+    {
+        conn->subscribed = false;
+        s_subscribers.fetch_sub(1, std::memory_order_relaxed);
+    }
+
+    s_conns[conn->slot] = NULL;
+    block_pool_free(&s_conn_pool, conn);
+
+    s_stats.closed++;
+    s_stats.active--;
+}
+
+// Bytes the socket took, 0 if it is full right now, -1 on error
+static int conn_write(tcp_conn_t *conn, const uint8_t *data, size_t len)
+{
+    int sent = send(conn->sock, data, len, 0);
+    if (sent < 0)
+    {
+        if (errno == EAGAIN || errno == EWOULDBLOCK)
+        {
+            return 0;   // wait for select to say it is writable again
+        }
+        ESP_LOGE(TAG, "Client(%s) send failed: errno %d (%s)", conn->addr_str, errno, strerror(errno));
+        return -1;
+    }
+
+    trace_event(TRACE_TCP_SEND, conn->slot, sent);
+    s_stats.tx_bytes += sent;
+    return sent;
+}
+
+// Push as much of the tx buffer, the body and the forwarded frames out as the socket will take right now
+static int conn_flush(tcp_conn_t *conn)
+{
+    while (conn_pending(conn))
+    {
+        // whatever is partly out has to finish first, then the tx buffer, the body, forwarded frames
+        bool fwd_started = conn->fwd_count > 0 && conn->fwd_off > 0;
+        bool body_started = conn->body != NULL && conn->body_off > 0;
+
+        if (!fwd_started && (body_started || (conn->body != NULL && conn->tx_len == 0)))
+        {
+            int sent = conn_write(conn, conn->body + conn->body_off, conn->body_len - conn->body_off);
+            if (sent <= 0)
+            {
+                return sent;
+            }
+
+            conn->body_off += sent;
+            if (conn->body_off == conn->body_len)
+            {
+                body_done(conn);
+            }
+            continue;
+        }
+
+        if (fwd_started || (conn->fwd_count > 0 && conn->tx_len == 0))
+        {
+            shared_buf_t *buf = conn->fwd[conn->fwd_head];
+            int sent = conn_write(conn, buf->data + conn->fwd_off, buf->len - conn->fwd_off);
+            if (sent <= 0)
+            {
+                return sent;
+            }
+
+            conn->fwd_off += sent;
+            if (conn->fwd_off == buf->len)
+            {
+                fwd_done(conn);
+            }
+            continue;
+        }
+
+        int sent = conn_write(conn, conn->tx_buf, conn->tx_len);
+        if (sent <= 0)
+        {
+            return sent;
+        }
+        memmove(conn->tx_buf, conn->tx_buf + sent, conn->tx_len - sent);
+        conn->tx_len -= sent;
+    }
+    return 0;
+}
+
+int tcp_conn_send(tcp_conn_t *conn, const void *data, size_t len)
+{
+    if (conn->tx_len + len > sizeof(conn->tx_buf))
+    {
+        // make room if the socket can take some of it now
+        if (conn_flush(conn) < 0 || conn->tx_len + len > sizeof(conn->tx_buf))
+        {
+            return -1;
+        }
+    }
+
+    memcpy(conn->tx_buf + conn->tx_len, data, len);
+    conn->tx_len += len;
+    return 0;
+}
+
+int tcp_conn_send_body(tcp_conn_t *conn, const void *data, size_t len, tcp_body_release_t release)
+{
+    if (conn->body != NULL)
+    {
+        return -1;
+    }
+
+    conn->body = (const uint8_t *)data;
+    conn->body_len = len;
+    conn->body_off = 0;
+    conn->body_release = release;
+    if (len == 0)
+    {
+        body_done(conn);
+    }
+    return 0;
+}
+
+void tcp_conn_close_after_send(tcp_conn_t *conn)
+{
+    conn->close_after_send = true;
+}
+
+bool tcp_conn_closing(const tcp_conn_t *conn)
+{
+    return conn->close_after_send;
+}
+
+uint32_t *tcp_conn_user(tcp_conn_t *conn)
+{
+    return &conn->user;
+}
+
+const char *tcp_conn_addr(const tcp_conn_t *conn)
+{
+    return conn->addr_str;
+}
+
+void tcp_server_get_stats(tcp_server_stats_t *stats)
+{
+    *stats = s_stats;
+    stats->subscribers = s_subscribers.load(std::memory_order_relaxed);
+    stats->conn_high_water = s_conn_pool.high_water.load(std::memory_order_relaxed);
+}
+
+void tcp_conn_subscribe(tcp_conn_t *conn)
+{
+    if (conn->subscribed)
+    {
+        return;
+    }
+
+    conn->subscribed = true;
+    uint32_t subscribers = s_subscribers.fetch_add(1, std::memory_order_relaxed) + 1;
+    ESP_LOGI(TAG, "Client(%s) subscribed, %lu subscribers", conn->addr_str, (unsigned long)subscribers);
+}
+
+uint32_t tcp_server_subscribers(void)
+{
+    return s_subscribers.load(std::memory_order_relaxed);
+}
+
+int tcp_server_publish(shared_buf_t *buf)
+{
+    int queued = 0;
+
+    for (int i = 0; i < TCP_SERVER_MAX_CLIENTS; i++)
+    {
+        tcp_conn_t *conn = s_conns[i];
+        if (conn == NULL || !conn->subscribed)
+        {
+            continue;
+        }
+
+        // a slow subscriber loses frames rather than holding up everyone else
+        if (conn->fwd_count == TCP_CONN_FWD_DEPTH)
+        {
+            s_stats.forward_dropped++;
+            continue;
+        }
+
+        shared_buf_ref(buf);
+        conn->fwd[(conn->fwd_head + conn->fwd_count) % TCP_CONN_FWD_DEPTH] = buf;
+        conn->fwd_count++;
+        queued++;
+
+        // straight out if the socket has room, select picks up whatever is left
+        if (conn_flush(conn) < 0)
+        {
+            conn_close(conn);
+        }
+    }
+    return queued;
+}
+
+void tcp_server_wake(void)
+{
+    int sock = s_wake_tx.load(std::memory_order_acquire);
+
+    // one byte is enough however many wakes pile up before the server gets to it
+    if (sock < 0 || s_wake_pending.exchange(true))
+    {
+        return;
+    }
+
+    uint8_t byte = 0;
+    sendto(sock, &byte, 1, 0, (struct sockaddr *)&s_wake_addr, sizeof(s_wake_addr));
+}
+
+static int wake_open(void)
+{
+    int rx = socket(AF_INET, SOCK_DGRAM, 0);
+    if (rx < 0)
+    {
+        ESP_LOGE(TAG, "Unable to create wake socket: errno %d", errno);
+        return -1;
+    }
+
+    struct sockaddr_in addr = {};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = 0;  // any free port
+
+    socklen_t addr_len = sizeof(addr);
+    if (bind(rx, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+        getsockname(rx, (struct sockaddr *)&addr, &addr_len) < 0)
+    {
+        ESP_LOGE(TAG, "Wake socket not bound: errno %d", errno);
+        close(rx);
+        return -1;
+    }
+    dt_set_nonblocking(rx);
+
+    int tx = socket(AF_INET, SOCK_DGRAM, 0);
+    if (tx < 0)
+    {
+        ESP_LOGE(TAG, "Unable to create wake socket: errno %d", errno);
+        close(rx);
+        return -1;
+    }
+
+    s_wake_rx = rx;
+    s_wake_addr = addr;
+    s_wake_pending.store(false);
+    s_wake_tx.store(tx, std::memory_order_release);
+    return 0;
+}
+
+static void wake_close(void)
+{
+    int tx = s_wake_tx.exchange(-1);
+    if (tx >= 0)
+    {
+        close(tx);
+    }
+    if (s_wake_rx >= 0)
+    {
+        close(s_wake_rx);
+        s_wake_rx = -1;
+    }
+}
+
+static void accept_clients(int listen_socket)
+{
+    while (1)
+    {
+        struct sockaddr_storage source_addr; // Large enough for both IPv4 or IPv6
+        socklen_t addr_len = sizeof(source_addr);
+
+        int sock = accept(listen_socket, (struct sockaddr *)&source_addr, &addr_len);
+        if (sock < 0)
+        {
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+            {
+                ESP_LOGE(TAG, "Unable to accept connection: errno %d", errno);
+            }
+            return;
+        }
+
+        // the pool is exactly TCP_SERVER_MAX_CLIENTS big, so a block means a free slot
+        tcp_conn_t *conn = (tcp_conn_t *)block_pool_alloc(&s_conn_pool);
+        if (conn == NULL)
+        {
+            ESP_LOGW(TAG, "All %d client slots in use, rejecting connection", TCP_SERVER_MAX_CLIENTS);
+            close(sock);
+            s_stats.rejected++;
+            continue;
+        }
+
+        dt_set_nonblocking(sock);
+
+        // responses are small, send them straight away instead of waiting to coalesce
+        int opt = 1;
+        setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &opt, sizeof(opt));
+
+        struct sockaddr_in *pV4Addr = (struct sockaddr_in *)&source_addr;
+        inet_ntoa_r(pV4Addr->sin_addr, conn->addr_str, sizeof(conn->addr_str) - 1);
+
+        for (int i = 0; i < TCP_SERVER_MAX_CLIENTS; i++)
+        {
+            if (s_conns[i] == NULL)
+            {
+                s_conns[i] = conn;
+                conn->slot = i;
+                break;
+            }
+        }
+
+        conn->sock = sock;
+        conn->rx_len = 0;
+        conn->tx_len = 0;
+        conn->subscribed = false;
+        conn->fwd_head = 0;
+        conn->fwd_count = 0;
+        conn->fwd_off = 0;
+        conn->body = NULL;
+        conn->body_len = 0;
+        conn->body_off = 0;
+        conn->body_release = NULL;
+        conn->close_after_send = false;
+        conn->user = 0;
+
+        trace_event(TRACE_TCP_ACCEPT, conn->slot, 0);
+        s_stats.accepted++;
+        s_stats.active++;
+        ESP_LOGI(TAG, "Client(%s) connected, %lu active", conn->addr_str, (unsigned long)s_stats.active);
+    }
+}
+
+// Read whatever has arrived and hand it to the request handler. Returns -1 if the connection should close
+static int serve_client(tcp_conn_t *conn, tcp_request_handler_t handler)
+{
+    int recv_result = recv(conn->sock,
+                           conn->rx_buf + conn->rx_len,
+                           sizeof(conn->rx_buf) - conn->rx_len,
+                           0);
+
+    if (recv_result == 0)
+    {
+        return -1; // client performed an orderly shutdown
+    }
+    if (recv_result < 0)
+    {
+        if (errno == EAGAIN || errno == EWOULDBLOCK)
+        {
+            return 0;
+        }
+        ESP_LOGE(TAG, "Client(%s) recv failed: errno %d (%s)", conn->addr_str, errno, strerror(errno));
+        return -1;
+    }
+
+    trace_event(TRACE_TCP_RECV, conn->slot, recv_result);
+    conn->rx_len += recv_result;
+    s_stats.rx_bytes += recv_result;
+
+    size_t used = handler(conn, conn->rx_buf, conn->rx_len);
+    trace_event(TRACE_TCP_HANDLED, conn->slot, used);
+    if (used > 0)
+    {
+        s_stats.requests++;
+        memmove(conn->rx_buf, conn->rx_buf + used, conn->rx_len - used);
+        conn->rx_len -= used;
+    }
+    else if (conn->rx_len == sizeof(conn->rx_buf))
+    {
+        ESP_LOGE(TAG, "Client(%s) request bigger than %d bytes", conn->addr_str, TCP_CONN_RX_SIZE);
+        return -1;
+    }
+
+    return conn_flush(conn);
+}
+
+int tcp_server_run(uint16_t port, tcp_request_handler_t handler, tcp_wake_handler_t on_wake)
+{
+    struct sockaddr_in dest_addr = {};
+    dest_addr.sin_addr.s_addr = htonl(INADDR_ANY); // accept all incoming addresses
+    dest_addr.sin_family = AF_INET;
+    dest_addr.sin_port = htons(port);
+
+    block_pool_init(&s_conn_pool, s_conn_blocks, sizeof(tcp_conn_t), s_conn_next, TCP_SERVER_MAX_CLIENTS);
+    for (int i = 0; i < TCP_SERVER_MAX_CLIENTS; i++)
+    {
+        s_conns[i] = NULL;
+    }
+
+    if (on_wake != NULL && wake_open() < 0)
+    {
+        return -1;
+    }
+
+    // Open Socket
+    int listen_socket = socket(AF_INET, SOCK_STREAM, 0);
+    if (listen_socket < 0)
+    {
+        ESP_LOGE(TAG, "Socket made unsuccesfully: errno %d", errno);
+        wake_close();
+        return -1;
+    }
+
+    int opt = 1;
+    setsockopt(listen_socket, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+
+    if (bind(listen_socket, (struct sockaddr *)&dest_addr, sizeof(dest_addr)) < 0)
+    {
+        ESP_LOGE(TAG, "Socket Not bound, port %d: errno %d", port, errno);
+        close(listen_socket);
+        wake_close();
+        return -1;
+    }
+
+    if (listen(listen_socket, TCP_SERVER_BACKLOG) < 0)
+    {
+        ESP_LOGE(TAG, "Socket listen failed: errno %d", errno);
+        close(listen_socket);
+        wake_close();
+        return -1;
+    }
+    dt_set_nonblocking(listen_socket);
+
+    ESP_LOGI(TAG, "Socket listening on port %d, up to %d clients", port, TCP_SERVER_MAX_CLIENTS);
+
+    while (1)
+    {
+        fd_set read_fds;
+        fd_set write_fds;
+        FD_ZERO(&read_fds);
+        FD_ZERO(&write_fds);
+
+        FD_SET(listen_socket, &read_fds);
+        int max_fd = listen_socket;
+
+        if (s_wake_rx >= 0)
+        {
+            FD_SET(s_wake_rx, &read_fds);
+            if (s_wake_rx > max_fd)
+            {
+                max_fd = s_wake_rx;
+            }
+        }
+
+        for (int i = 0; i < TCP_SERVER_MAX_CLIENTS; i++)
+        {
+            tcp_conn_t *conn = s_conns[i];
+            if (conn == NULL)
+            {
+                continue;
+            }
+
+            FD_SET(conn->sock, &read_fds);
+            if (conn_pending(conn))
+            {
+                FD_SET(conn->sock, &write_fds); // still has a response or frame waiting to go out
+            }
+            if (conn->sock > max_fd)
+            {
+                max_fd = conn->sock;
+            }
+        }
+
+        int ready = select(max_fd + 1, &read_fds, &write_fds, NULL, NULL);
+        if (ready < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            ESP_LOGE(TAG, "select failed: errno %d (%s)", errno, strerror(errno));
+            break;
+        }
+
+        if (s_wake_rx >= 0 && FD_ISSET(s_wake_rx, &read_fds))
+        {
+            uint8_t drain[16];
+            while (recv(s_wake_rx, drain, sizeof(drain), 0) > 0)
+            {
+            }
+
+            // clear first, so a wake that comes in while the handler runs is not lost
+            s_wake_pending.store(false);
+            on_wake();
+        }
+
+        for (int i = 0; i < TCP_SERVER_MAX_CLIENTS; i++)
+        {
+            tcp_conn_t *conn = s_conns[i];
+            if (conn == NULL)
+            {
+                continue;
+            }
+
+            int res = 0;
+            if (FD_ISSET(conn->sock, &write_fds))
+            {
+                res = conn_flush(conn);
+            }
+            if (res == 0 && FD_ISSET(conn->sock, &read_fds))
+            {
+                res = serve_client(conn, handler);
+            }
+            if (res == 0 && conn->close_after_send && !conn_pending(conn))
+            {
+                res = -1;   // all sent, as asked
+            }
+            if (res < 0)
+            {
+                conn_close(conn);
+            }
+        }
+
+        // new clients last so they do not get served off a stale fd_set
+        if (FD_ISSET(listen_socket, &read_fds))
+        {
+            accept_clients(listen_socket);
+        }
+    }
+
+    for (int i = 0; i < TCP_SERVER_MAX_CLIENTS; i++)
+    {
+        if (s_conns[i] != NULL)
+        {
+            conn_close(s_conns[i]);
+        }
+    }
+    close(listen_socket);
+    wake_close();
+    return -1;
+}
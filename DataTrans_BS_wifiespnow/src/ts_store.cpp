@@ -0,0 +1,352 @@
+#include <string.h>
+
+#include "ts_store.h"
+
+static const uint32_t LEVEL_WINDOW_MS[TS_LEVELS] = TS_LEVEL_WINDOWS_MS;
+static constexpr uint8_t LEVEL_BUCKETS[TS_LEVELS] = TS_LEVEL_BUCKETS;
+
+static constexpr int bucket_total(void)
+{
+    int total = 0;
+    for (int l = 0; l < TS_LEVELS; l++)
+    {
+        total += LEVEL_BUCKETS[l];
+    }
+    return total;
+}
+static_assert(bucket_total() == TS_BUCKETS, "TS_BUCKETS must be the sum of TS_LEVEL_BUCKETS");
+static_assert(TS_RAW_POINTS <= 255, "raw ring indexes are uint8_t");
+
+uint32_t ts_level_window_ms(int level)
+{
+    return LEVEL_WINDOW_MS[level];
+}
+
+int ts_level_offset(int level)
+{
+    int offset = 0;
+    for (int l = 0; l < level; l++)
+    {
+        offset += LEVEL_BUCKETS[l];
+    }
+    return offset;
+}
+
+static int32_t div_round(int64_t sum, int64_t count)
+{
+    return (int32_t)(sum >= 0 ? (sum + count / 2) / count : (sum - count / 2) / count);
+}
+
+void ts_store_init(ts_store_t *store)
+{
+    memset(store->keys, 0xFF, sizeof(store->keys));
+    for (int i = 0; i < TS_MAX_SERIES; i++)
+    {
+        store->series[i].version.store(0, std::memory_order_relaxed);
+        memset(&store->series[i].data, 0, sizeof(ts_series_data_t));
+        store->series[i].data.key = TS_KEY_NONE;
+    }
+    store->last_hit = 0;
+    memset(&store->stats, 0, sizeof(store->stats));
+}
+
+static int find_series(const ts_store_t *store, uint32_t key)
+{
+    for (int i = 0; i < TS_MAX_SERIES; i++)
+    {
+        if (store->keys[i] == key)
+        {
+            return i;
+        }
+    }
+    return -1;
+}
+
+// The series to write `key` into: its own, a free one, or the one written longest ago wiped for it
+static int series_for_write(ts_store_t *store, uint32_t key)
+{
+    if (store->keys[store->last_hit] == key)
+    {
+        return store->last_hit;
+    }
+
+    int idx = find_series(store, key);
+    if (idx < 0)
+    {
+        idx = find_series(store, TS_KEY_NONE);
+        if (idx >= 0)
+        {
+            store->stats.series++;
+        }
+        else
+        {
+            idx = 0;
+            for (int i = 1; i < TS_MAX_SERIES; i++)
+            {
+                if (store->series[i].data.last_ms < store->series[idx].data.last_ms)
+                {
+                    idx = i;
+                }
+            }
+            store->stats.recycled++;
+        }
+    }
+    store->last_hit = idx;
+    return idx;
+}
+
+static void bucket_open(ts_series_data_t *d, ts_level_t *lv, int b, int32_t value, int64_t start_ms)
+{
+    d->min[b] = d->max[b] = d->mean[b] = value;
+    d->count[b] = 1;
+    lv->open_sum = value;
+    lv->open_count = 1;
+    lv->newest_start_ms = start_ms;
+}
+
+static void level_add(ts_series_data_t *d, int level, int offset, int32_t value, int64_t t_ms)
+{
+    ts_level_t *lv = &d->levels[level];
+    uint32_t window = LEVEL_WINDOW_MS[level];
+    uint8_t n = LEVEL_BUCKETS[level];
+    int64_t start_ms = t_ms - t_ms % window;
+
+    if (lv->used == 0)
+    {
+        lv->head = 0;
+        lv->used = 1;
+        bucket_open(d, lv, offset, value, start_ms);
+        return;
+    }
+
+    // ts_store_add let it through, so it is in the open bucket: coarser ones start no later than the 1 s one
+    if (start_ms <= lv->newest_start_ms)
+    {
+        int b = offset + lv->head;
+        d->min[b] = value < d->min[b] ? value : d->min[b];
+        d->max[b] = value > d->max[b] ? value : d->max[b];
+        lv->open_sum += value;
+        lv->open_count++;
+        d->count[b] = lv->open_count < UINT16_MAX ? (uint16_t)lv->open_count : UINT16_MAX;
+        return;
+    }
+
+    // the window is over, and so are any in between that nothing came in
+    d->mean[offset + lv->head] = div_round(lv->open_sum, lv->open_count);
+    int64_t windows = (start_ms - lv->newest_start_ms) / window;
+    for (int64_t i = 1; i < windows && i < n; i++)
+    {
+        lv->head = (uint8_t)((lv->head + 1) % n);
+        int b = offset + lv->head;
+        d->min[b] = d->max[b] = d->mean[b] = 0;
+        d->count[b] = 0;
+    }
+    lv->used = (uint8_t)(lv->used + windows < n ? lv->used + windows : n);
+    lv->head = (uint8_t)((lv->head + 1) % n);
+    bucket_open(d, lv, offset + lv->head, value, start_ms);
+}
+
+void ts_store_add(ts_store_t *store, uint16_t node_id, uint16_t channel, int32_t value, int64_t t_ms, int64_t now_ms)
+{
+    if (t_ms > now_ms + TS_AHEAD_MS)
+    {
+        store->stats.ahead++;
+        return;
+    }
+
+    uint32_t key = (uint32_t)node_id << 16 | channel;
+    int idx = series_for_write(store, key);
+    ts_series_t *s = &store->series[idx];
+    ts_series_data_t *d = &s->data;
+
+    if (d->key == key && d->levels[0].used != 0 && t_ms < d->levels[0].newest_start_ms)
+    {
+        store->stats.late++;
+        return;
+    }
+
+    uint32_t version = s->version.load(std::memory_order_relaxed);
+    s->version.store(version + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+
+    if (d->key != key)
+    {
+        memset(d, 0, sizeof(*d));
+        d->key = key;
+        store->keys[idx] = key;
+    }
+    // within the open second it can be a little older than the last one
+    d->last_ms = t_ms > d->last_ms ? t_ms : d->last_ms;
+    d->points++;
+
+    d->raw_t_ms[d->raw_head] = (uint32_t)t_ms;
+    d->raw_value[d->raw_head] = value;
+    d->raw_head = (uint8_t)((d->raw_head + 1) % TS_RAW_POINTS);
+    d->raw_count = d->raw_count < TS_RAW_POINTS ? d->raw_count + 1 : TS_RAW_POINTS;
+
+    int offset = 0;
+    for (int l = 0; l < TS_LEVELS; l++)
+    {
+        level_add(d, l, offset, value, t_ms);
+        offset += LEVEL_BUCKETS[l];
+    }
+
+    s->version.store(version + 2, std::memory_order_release);
+    store->stats.points++;
+}
+
+bool ts_stamp_ms(int64_t rx_us, uint32_t stamp_us, int64_t *t_ms)
+{
+    // how long before the arrival it was stamped, negative if after
+    int32_t age_us = (int32_t)((uint32_t)rx_us - stamp_us);
+    if (age_us < -TS_AHEAD_MS * 1000)
+    {
+        return false;
+    }
+    *t_ms = (rx_us - age_us) / 1000;
+    return true;
+}
+
+// Copy of the series, -1 if there is none (or it was recycled for another while we looked)
+static int snapshot(ts_store_t *store, uint32_t key, ts_series_data_t *d)
+{
+    int idx = find_series(store, key);
+    if (idx < 0)
+    {
+        return -1;
+    }
+
+    ts_series_t *s = &store->series[idx];
+    uint32_t version;
+    for (;;)
+    {
+        version = s->version.load(std::memory_order_acquire);
+        memcpy(d, &s->data, sizeof(*d));
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if ((version & 1) == 0 && s->version.load(std::memory_order_relaxed) == version)
+        {
+            break;
+        }
+        store->stats.query_retries++;
+    }
+    return d->key == key ? 0 : -1;
+}
+
+// The oldest time everything since is still in raw points (level -1) or level l
+static int64_t covered_from(const ts_series_data_t *d, int level)
+{
+    if (level < 0)
+    {
+        if (d->raw_count < TS_RAW_POINTS)
+        {
+            return INT64_MIN; // all of it, the series is that young
+        }
+        int oldest = d->raw_head; // the ring is full, the next to write is the oldest
+        return d->last_ms - (uint32_t)((uint32_t)d->last_ms - d->raw_t_ms[oldest]);
+    }
+    const ts_level_t *lv = &d->levels[level];
+    if (lv->used < LEVEL_BUCKETS[level])
+    {
+        return INT64_MIN;
+    }
+    return lv->newest_start_ms - (int64_t)(lv->used - 1) * LEVEL_WINDOW_MS[level];
+}
+
+static void merge(ts_bucket_t *out, int64_t *sums, int k, int32_t min, int32_t max, int64_t sum, uint32_t count)
+{
+    if (out[k].count == 0)
+    {
+        out[k].min = min;
+        out[k].max = max;
+    }
+    else
+    {
+        out[k].min = min < out[k].min ? min : out[k].min;
+        out[k].max = max > out[k].max ? max : out[k].max;
+    }
+    out[k].count += count;
+    sums[k] += sum;
+}
+
+int ts_store_query(ts_store_t *store, uint16_t node_id, uint16_t channel, int64_t from_ms, int64_t to_ms,
+                   uint32_t step_ms, ts_bucket_t *out, int max_out, int64_t *first_ms, uint32_t *step_out)
+{
+    ts_series_data_t d;
+    uint32_t key = (uint32_t)node_id << 16 | channel;
+    store->stats.queries++;
+    if (snapshot(store, key, &d) < 0)
+    {
+        return -1;
+    }
+
+    from_ms = from_ms < 0 ? 0 : from_ms;
+    max_out = max_out < TS_QUERY_MAX_BUCKETS ? max_out : TS_QUERY_MAX_BUCKETS;
+    if (to_ms <= from_ms || max_out <= 0)
+    {
+        return 0;
+    }
+
+    // the finest that goes back far enough, or failing that the one that goes back furthest
+    int level = -1;
+    while (level < TS_LEVELS - 1 && covered_from(&d, level) > from_ms)
+    {
+        level++;
+    }
+    uint32_t window = level < 0 ? 1 : LEVEL_WINDOW_MS[level];
+
+    // buckets on the level's grid, as many as fit
+    from_ms -= from_ms % window;
+    int64_t span = to_ms - from_ms;
+    int64_t step = step_ms == 0 || step_ms > span ? span : step_ms;
+    if ((span + step - 1) / step > max_out)
+    {
+        step = (span + max_out - 1) / max_out;
+    }
+    step = (step + window - 1) / window * window;
+    int n_out = (int)((span + step - 1) / step);
+
+    int64_t sums[TS_QUERY_MAX_BUCKETS];
+    memset(out, 0, sizeof(ts_bucket_t) * n_out);
+    memset(sums, 0, sizeof(sums));
+
+    if (level < 0)
+    {
+        for (int i = 0; i < d.raw_count; i++)
+        {
+            int p = (d.raw_head - 1 - i + TS_RAW_POINTS) % TS_RAW_POINTS;
+            int64_t t = d.last_ms - (uint32_t)((uint32_t)d.last_ms - d.raw_t_ms[p]);
+            if (t >= from_ms && t < to_ms)
+            {
+                int32_t v = d.raw_value[p];
+                merge(out, sums, (int)((t - from_ms) / step), v, v, v, 1);
+            }
+        }
+    }
+    else
+    {
+        const ts_level_t *lv = &d.levels[level];
+        int offset = ts_level_offset(level);
+        uint8_t n = LEVEL_BUCKETS[level];
+        for (int i = 0; i < lv->used; i++)
+        {
+            int b = offset + (lv->head - i + n) % n;
+            int64_t start = lv->newest_start_ms - (int64_t)i * window;
+            if (d.count[b] == 0 || start < from_ms || start >= to_ms)
+            {
+                continue;
+            }
+            // the newest is still filling, its mean isn't written yet
+            uint32_t count = i == 0 ? lv->open_count : d.count[b];
+            int64_t sum = i == 0 ? lv->open_sum : (int64_t)d.mean[b] * count;
+            merge(out, sums, (int)((start - from_ms) / step), d.min[b], d.max[b], sum, count);
+        }
+    }
+
+    for (int k = 0; k < n_out; k++)
+    {
+        out[k].mean = out[k].count ? div_round(sums[k], out[k].count) : 0;
+    }
+    *first_ms = from_ms;
+    *step_out = (uint32_t)step;
+    return n_out;
+}
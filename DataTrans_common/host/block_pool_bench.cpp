@@ -0,0 +1,143 @@
+/*
+    block_pool_t against malloc/free for frame sized blocks, on Linux
+
+    g++ -std=c++17 -O2 -pthread -I include host/block_pool_bench.cpp -o block_pool_bench
+    ./block_pool_bench [iterations]
+
+    single:  alloc then free straight away, the best case for both
+    burst:   alloc a ring's worth of frames then free them all, like a drained ESP-NOW ring
+    handoff: one thread allocs and queues, another frees, like on_data_recv -> worker
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <thread>
+
+#include "dt_port.h"
+#include "shared_buf.h"
+
+#define BENCH_BLOCKS 64
+#define BENCH_BURST 32
+
+static shared_buf_t s_bufs[BENCH_BLOCKS];
+static std::atomic<uint16_t> s_next[BENCH_BLOCKS];
+static block_pool_t s_pool;
+
+static void *pool_alloc(void)
+{
+    return block_pool_alloc(&s_pool);
+}
+
+static void pool_free(void *p)
+{
+    block_pool_free(&s_pool, p);
+}
+
+static void *heap_alloc(void)
+{
+    return malloc(sizeof(shared_buf_t));
+}
+
+static void heap_free(void *p)
+{
+    free(p);
+}
+
+typedef void *(*alloc_fn_t)(void);
+typedef void (*free_fn_t)(void *);
+
+static double ns_per_op(int64_t start_us, long ops)
+{
+    return (esp_timer_get_time() - start_us) * 1000.0 / ops;
+}
+
+static double bench_single(alloc_fn_t alloc_fn, free_fn_t free_fn, long iterations)
+{
+    int64_t start_us = esp_timer_get_time();
+    for (long i = 0; i < iterations; i++)
+    {
+        uint8_t *p = (uint8_t *)alloc_fn();
+        p[0] = (uint8_t)i;  // touch it so nothing is optimised away
+        free_fn(p);
+    }
+    return ns_per_op(start_us, iterations);
+}
+
+static double bench_burst(alloc_fn_t alloc_fn, free_fn_t free_fn, long iterations)
+{
+    void *held[BENCH_BURST];
+    long rounds = iterations / BENCH_BURST;
+
+    int64_t start_us = esp_timer_get_time();
+    for (long r = 0; r < rounds; r++)
+    {
+        for (int i = 0; i < BENCH_BURST; i++)
+        {
+            held[i] = alloc_fn();
+            ((uint8_t *)held[i])[0] = (uint8_t)i;
+        }
+        for (int i = 0; i < BENCH_BURST; i++)
+        {
+            free_fn(held[i]);
+        }
+    }
+    return ns_per_op(start_us, rounds * BENCH_BURST);
+}
+
+static double bench_handoff(alloc_fn_t alloc_fn, free_fn_t free_fn, long iterations)
+{
+    static shared_buf_queue_t queue;
+    shared_buf_queue_init(&queue);
+
+    int64_t start_us = esp_timer_get_time();
+    std::thread consumer([&]
+    {
+        for (long done = 0; done < iterations;)
+        {
+            shared_buf_t *buf = shared_buf_queue_pop(&queue);
+            if (buf == NULL)
+            {
+                std::this_thread::yield();
+                continue;
+            }
+            free_fn(buf);
+            done++;
+        }
+    });
+
+    for (long i = 0; i < iterations; i++)
+    {
+        shared_buf_t *buf;
+        while ((buf = (shared_buf_t *)alloc_fn()) == NULL)
+        {
+            std::this_thread::yield();
+        }
+        buf->len = (uint16_t)i;
+        while (!shared_buf_queue_push(&queue, buf))
+        {
+            std::this_thread::yield();
+        }
+    }
+    consumer.join();
+    return ns_per_op(start_us, iterations);
+}
+
+int main(int argc, char **argv)
+{
+    long iterations = argc > 1 ? atol(argv[1]) : 2000000;
+
+    shared_buf_pool_init(&s_pool, s_bufs, s_next, BENCH_BLOCKS);
+
+    printf("%zu byte blocks, %ld iterations, ns per alloc + free\n\n", sizeof(shared_buf_t), iterations);
+    printf("%-8s  %10s  %10s\n", "", "block_pool", "malloc");
+    printf("%-8s  %10.1f  %10.1f\n", "single",
+           bench_single(pool_alloc, pool_free, iterations), bench_single(heap_alloc, heap_free, iterations));
+    printf("%-8s  %10.1f  %10.1f\n", "burst",
+           bench_burst(pool_alloc, pool_free, iterations), bench_burst(heap_alloc, heap_free, iterations));
+    printf("%-8s  %10.1f  %10.1f\n", "handoff",
+           bench_handoff(pool_alloc, pool_free, iterations / 4), bench_handoff(heap_alloc, heap_free, iterations / 4));
+
+    printf("\npool high water %lu/%d, exhausted %lu (handoff producer waits when it runs dry)\n",
+           (unsigned long)s_pool.high_water.load(), BENCH_BLOCKS, (unsigned long)s_pool.exhausted.load());
+    return block_pool_in_use(&s_pool) == 0 ? 0 : 1;
+}
@@ -0,0 +1,429 @@
+/*
+    dt_frame.h fed everything but the frames it expects, on Linux, then how fast it goes
+
+    g++ -std=c++17 -O2 -I include host/dt_frame_fuzz.cpp -o dt_frame_fuzz
+    ./dt_frame_fuzz [iterations] [seed]
+
+    Worth a run with -O1 -g -fsanitize=address,undefined too: every buffer handed to the
+    decoder is malloc'd to exactly its length, so a read past the end is caught
+
+    roundtrip: random headers and payloads through dt_frame_encode / dt_frame_finish_flags and
+               back, every field compared. Batch records through dt_record_append / _next
+    stream:    valid frames with junk between them, cut into random TCP segment sizes and read
+               the way tcp_handle_request does (0 = wait for more, < 0 = skip a byte). Every
+               frame has to come out, in order
+    mutate:    valid frames with bits flipped, bytes changed, cut short or run on. Whatever
+               decode accepts has to be a whole frame inside the buffer with a good CRC
+    random:    plain random bytes into dt_frame_decode and dt_record_next
+    speed:     encode (copying and in place) and decode MB/s for a full and a small payload
+    Exits 1 if anything is off
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <vector>
+
+#include "dt_port.h"
+#include "dt_frame.h"
+
+#define FUZZ_MAX_JUNK 64
+#define FUZZ_STREAM_FRAMES 2000
+#define SPEED_BYTES (64 * 1024 * 1024)
+
+static int s_failures;
+
+#define CHECK(cond)                                                         \
+    do                                                                      \
+    {                                                                       \
+        if (!(cond))                                                        \
+        {                                                                   \
+            if (s_failures < 20)                                            \
+            {                                                               \
+                printf("  FAIL %s:%d: %s\n", __FILE__, __LINE__, #cond);    \
+            }                                                               \
+            s_failures++;                                                   \
+        }                                                                   \
+    } while (0)
+
+typedef struct
+{
+    uint8_t type;
+    uint8_t flags;
+    uint16_t node_id;
+    uint32_t seq;
+    uint32_t timestamp_us;
+    size_t len;
+    uint8_t payload[DT_FRAME_MAX_PAYLOAD];
+} fuzz_frame_t;
+
+static void random_frame(fuzz_frame_t *f, size_t max_len)
+{
+    f->type = (uint8_t)lrand48();
+    f->flags = (uint8_t)lrand48();
+    f->node_id = (uint16_t)lrand48();
+    f->seq = (uint32_t)mrand48();
+    f->timestamp_us = (uint32_t)mrand48();
+    f->len = (size_t)(lrand48() % (max_len + 1));
+    for (size_t i = 0; i < f->len; i++)
+    {
+        f->payload[i] = (uint8_t)lrand48();
+    }
+}
+
+static size_t encode(const fuzz_frame_t *f, uint8_t *buf)
+{
+    memcpy(dt_frame_payload(buf), f->payload, f->len);
+    return dt_frame_finish_flags(buf, f->type, f->flags, f->node_id, f->seq, f->timestamp_us, f->len);
+}
+
+static bool same(const fuzz_frame_t *f, const dt_frame_view_t *v)
+{
+    return v->hdr->type == f->type && v->hdr->flags == f->flags && v->hdr->node_id == f->node_id &&
+           v->hdr->seq == f->seq && v->hdr->timestamp_us == f->timestamp_us && v->hdr->len == f->len &&
+           memcmp(v->payload, f->payload, f->len) == 0;
+}
+
+// A copy of data on its own in the heap, so a read one byte past len is a read past the allocation
+static uint8_t *exact(const uint8_t *data, size_t len)
+{
+    uint8_t *p = (uint8_t *)malloc(len ? len : 1);
+    memcpy(p, data, len);
+    return p;
+}
+
+// What decode says has to hold together
+static void check_view(const uint8_t *buf, size_t len, int ret, const dt_frame_view_t *v)
+{
+    if (ret <= 0)
+    {
+        return;
+    }
+    CHECK((size_t)ret <= len);
+    CHECK(v->hdr == (const dt_frame_hdr_t *)buf);
+    CHECK(v->payload == buf + DT_FRAME_HDR_SIZE);
+    CHECK((size_t)ret == DT_FRAME_HDR_SIZE + (size_t)v->hdr->len);
+    CHECK(v->hdr->len <= DT_FRAME_MAX_PAYLOAD);
+    CHECK(v->hdr->magic == DT_FRAME_MAGIC && v->hdr->version == DT_FRAME_VERSION);
+    CHECK(v->hdr->crc == dt_frame_crc(buf, v->hdr->len));
+}
+
+static void test_roundtrip(long iterations)
+{
+    uint8_t buf[DT_FRAME_MAX_SIZE];
+    for (long i = 0; i < iterations; i++)
+    {
+        fuzz_frame_t f;
+        random_frame(&f, DT_FRAME_MAX_PAYLOAD);
+
+        size_t len;
+        if (i & 1)
+        {
+            len = encode(&f, buf);
+        }
+        else
+        {
+            f.flags = 0;
+            len = dt_frame_encode(buf, sizeof(buf), f.type, f.node_id, f.seq, f.timestamp_us, f.payload, f.len);
+        }
+        CHECK(len == DT_FRAME_HDR_SIZE + f.len);
+
+        uint8_t *copy = exact(buf, len);
+        dt_frame_view_t v;
+        int ret = dt_frame_decode(copy, len, &v);
+        CHECK(ret == (int)len);
+        if (ret > 0)
+        {
+            CHECK(same(&f, &v));
+        }
+        // every shorter prefix is "not all here yet"
+        size_t cut = (size_t)(lrand48() % len);
+        CHECK(dt_frame_decode(copy, cut, &v) == 0);
+
+        // flagged afterwards, the way the slave marks a frame it replays from its spool
+        dt_frame_add_flags(copy, DT_FLAG_REPLAY);
+        f.flags |= DT_FLAG_REPLAY;
+        CHECK(dt_frame_decode(copy, len, &v) == (int)len && same(&f, &v));
+        free(copy);
+    }
+
+    // too big for a frame, or for the caller's buffer
+    uint8_t payload[DT_FRAME_MAX_PAYLOAD + 1] = {};
+    CHECK(dt_frame_encode(buf, sizeof(buf), DT_TYPE_TEXT, 1, 1, 1, payload, DT_FRAME_MAX_PAYLOAD + 1) == 0);
+    CHECK(dt_frame_encode(buf, 40, DT_TYPE_TEXT, 1, 1, 1, payload, 30) == 0);
+
+    // batch records, out and back
+    for (long i = 0; i < iterations / 10; i++)
+    {
+        uint8_t batch[DT_FRAME_MAX_PAYLOAD];
+        uint8_t types[DT_FRAME_MAX_PAYLOAD];
+        size_t lens[DT_FRAME_MAX_PAYLOAD];
+        uint8_t data[255];
+        size_t used = 0;
+        int n = 0;
+        for (;;)
+        {
+            size_t len = (size_t)(lrand48() % 40);
+            for (size_t j = 0; j < len; j++)
+            {
+                data[j] = (uint8_t)(n + j);
+            }
+            if (!dt_record_append(batch, sizeof(batch), &used, (uint8_t)n, data, len))
+            {
+                CHECK(used + sizeof(dt_record_hdr_t) + len > sizeof(batch));
+                break;
+            }
+            types[n] = (uint8_t)n;
+            lens[n] = len;
+            n++;
+        }
+
+        uint8_t *copy = exact(batch, used);
+        size_t offset = 0;
+        const dt_record_hdr_t *rec;
+        const uint8_t *rec_data;
+        int got = 0;
+        while (dt_record_next(copy, used, &offset, &rec, &rec_data))
+        {
+            CHECK(got < n && rec->type == types[got] && rec->len == lens[got]);
+            for (size_t j = 0; got < n && j < lens[got]; j++)
+            {
+                CHECK(rec_data[j] == (uint8_t)(got + j));
+            }
+            got++;
+        }
+        CHECK(got == n && offset == used);
+        free(copy);
+    }
+}
+
+static void test_stream(long rounds)
+{
+    std::vector<fuzz_frame_t> frames(FUZZ_STREAM_FRAMES);
+    std::vector<uint8_t> stream;
+    uint64_t frames_out = 0, skipped = 0, junk_total = 0, extra = 0;
+
+    for (long r = 0; r < rounds; r++)
+    {
+        stream.clear();
+        size_t junk_bytes = 0;
+        for (fuzz_frame_t &f : frames)
+        {
+            // junk first, sometimes with the magic byte in it to make the reader wait for nothing
+            int junk = (int)(lrand48() % (FUZZ_MAX_JUNK + 1)) * (lrand48() % 4 == 0);
+            for (int j = 0; j < junk; j++)
+            {
+                stream.push_back(lrand48() % 8 == 0 ? DT_FRAME_MAGIC : (uint8_t)lrand48());
+            }
+            junk_bytes += junk;
+
+            random_frame(&f, DT_FRAME_MAX_PAYLOAD);
+            uint8_t buf[DT_FRAME_MAX_SIZE];
+            size_t len = encode(&f, buf);
+            stream.insert(stream.end(), buf, buf + len);
+        }
+        junk_total += junk_bytes;
+
+        // read it in random segment sizes, keeping what isn't used, like a connection's rx buffer
+        std::vector<uint8_t> rx;
+        size_t fed = 0;
+        size_t next = 0;
+        bool in_order = true;
+        while (fed < stream.size() || !rx.empty())
+        {
+            size_t seg = 1 + (size_t)(lrand48() % 600);
+            seg = std::min(seg, stream.size() - fed);
+            rx.insert(rx.end(), stream.begin() + fed, stream.begin() + fed + seg);
+            fed += seg;
+
+            uint8_t *copy = exact(rx.data(), rx.size());
+            size_t used = 0;
+            while (used < rx.size())
+            {
+                dt_frame_view_t v;
+                int ret = dt_frame_decode(copy + used, rx.size() - used, &v);
+                check_view(copy + used, rx.size() - used, ret, &v);
+                if (ret == 0)
+                {
+                    break;
+                }
+                if (ret < 0)
+                {
+                    skipped++;
+                    used++;
+                    continue;
+                }
+                if (next < frames.size() && same(&frames[next], &v))
+                {
+                    next++;
+                    frames_out++;
+                }
+                else
+                {
+                    extra++; // junk that made a valid frame, or one out of order
+                    in_order = false;
+                }
+                used += ret;
+            }
+            free(copy);
+            rx.erase(rx.begin(), rx.begin() + used);
+
+            // the end of the stream: a magic byte in the junk waiting for more that won't come
+            if (fed == stream.size() && !rx.empty())
+            {
+                rx.erase(rx.begin());
+                skipped++;
+            }
+        }
+        CHECK(next == frames.size());
+        CHECK(in_order);
+    }
+    printf("stream:    %llu frames out of %llu junk bytes between them, %llu bytes skipped, %llu extra\n",
+           (unsigned long long)frames_out, (unsigned long long)junk_total,
+           (unsigned long long)skipped, (unsigned long long)extra);
+}
+
+static void test_mutate(long iterations)
+{
+    uint64_t accepted = 0, rejected = 0, waiting = 0;
+    for (long i = 0; i < iterations; i++)
+    {
+        fuzz_frame_t f;
+        random_frame(&f, DT_FRAME_MAX_PAYLOAD);
+        uint8_t buf[DT_FRAME_MAX_SIZE + 32];
+        size_t len = encode(&f, buf);
+
+        switch (lrand48() % 4)
+        {
+        case 0: // a few bits flipped
+            for (int n = 1 + (int)(lrand48() % 3); n > 0; n--)
+            {
+                size_t bit = (size_t)(lrand48() % (len * 8));
+                buf[bit / 8] ^= (uint8_t)(1 << (bit % 8));
+            }
+            break;
+        case 1: // a byte changed, anywhere including the length
+            buf[lrand48() % len] = (uint8_t)lrand48();
+            break;
+        case 2: // cut short
+            len = (size_t)(lrand48() % len);
+            break;
+        default: // more bytes than the frame
+            for (int n = (int)(lrand48() % 32); n > 0; n--)
+            {
+                buf[len++] = (uint8_t)lrand48();
+            }
+            break;
+        }
+
+        uint8_t *copy = exact(buf, len);
+        dt_frame_view_t v;
+        int ret = dt_frame_decode(copy, len, &v);
+        check_view(copy, len, ret, &v);
+        accepted += ret > 0;
+        rejected += ret < 0;
+        waiting += ret == 0;
+        free(copy);
+    }
+    printf("mutate:    %llu accepted, %llu rejected, %llu waiting for more\n",
+           (unsigned long long)accepted, (unsigned long long)rejected, (unsigned long long)waiting);
+}
+
+static void test_random(long iterations)
+{
+    uint64_t accepted = 0;
+    for (long i = 0; i < iterations; i++)
+    {
+        uint8_t buf[DT_FRAME_MAX_SIZE + 32];
+        size_t len = (size_t)(lrand48() % sizeof(buf));
+        for (size_t j = 0; j < len; j++)
+        {
+            buf[j] = (uint8_t)lrand48();
+        }
+        // half of them get a plausible start so they reach the length and CRC checks
+        if (len >= 2 && (i & 1))
+        {
+            buf[0] = DT_FRAME_MAGIC;
+            buf[1] = DT_FRAME_VERSION;
+        }
+
+        uint8_t *copy = exact(buf, len);
+        dt_frame_view_t v;
+        int ret = dt_frame_decode(copy, len, &v);
+        check_view(copy, len, ret, &v);
+        accepted += ret > 0;
+
+        size_t offset = 0;
+        const dt_record_hdr_t *rec;
+        const uint8_t *rec_data;
+        while (dt_record_next(copy, len, &offset, &rec, &rec_data))
+        {
+            CHECK(rec_data + rec->len <= copy + len);
+        }
+        CHECK(offset <= len);
+        free(copy);
+    }
+    printf("random:    %llu of %ld accepted\n", (unsigned long long)accepted, iterations);
+}
+
+static void speed(size_t payload_len)
+{
+    fuzz_frame_t f;
+    random_frame(&f, 0);
+    f.len = payload_len;
+    for (size_t i = 0; i < payload_len; i++)
+    {
+        f.payload[i] = (uint8_t)i;
+    }
+
+    uint8_t buf[DT_FRAME_MAX_SIZE];
+    size_t frame_len = DT_FRAME_HDR_SIZE + payload_len;
+    long n = SPEED_BYTES / (long)frame_len;
+    volatile uint32_t sink = 0;
+
+    int64_t start = esp_timer_get_time();
+    for (long i = 0; i < n; i++)
+    {
+        sink += (uint32_t)dt_frame_encode(buf, sizeof(buf), f.type, f.node_id, (uint32_t)i, 0, f.payload, payload_len);
+    }
+    double copy_s = (esp_timer_get_time() - start) / 1e6;
+
+    start = esp_timer_get_time();
+    for (long i = 0; i < n; i++)
+    {
+        dt_frame_payload(buf)[0] = (uint8_t)i;
+        sink += (uint32_t)dt_frame_finish(buf, f.type, f.node_id, (uint32_t)i, 0, payload_len);
+    }
+    double in_place_s = (esp_timer_get_time() - start) / 1e6;
+
+    start = esp_timer_get_time();
+    dt_frame_view_t v;
+    for (long i = 0; i < n; i++)
+    {
+        sink += (uint32_t)dt_frame_decode(buf, frame_len, &v);
+    }
+    double decode_s = (esp_timer_get_time() - start) / 1e6;
+    CHECK(dt_frame_decode(buf, frame_len, &v) == (int)frame_len);
+
+    double mb = (double)n * frame_len / 1e6;
+    printf("speed:     %3u byte payload: encode %6.0f MB/s (in place %6.0f), decode %6.0f MB/s, %4.0f ns a frame to decode\n",
+           (unsigned)payload_len, mb / copy_s, mb / in_place_s, mb / decode_s, decode_s * 1e9 / n);
+}
+
+int main(int argc, char **argv)
+{
+    long iterations = argc > 1 ? atol(argv[1]) : 200000;
+    long seed = argc > 2 ? atol(argv[2]) : 1;
+    srand48(seed);
+
+    test_roundtrip(iterations);
+    printf("roundtrip: %ld frames\n", iterations);
+    test_stream(iterations / 20000 + 1);
+    test_mutate(iterations);
+    test_random(iterations);
+    speed(DT_FRAME_MAX_PAYLOAD);
+    speed(20);
+
+    printf(s_failures ? "%d checks failed\n" : "all passed\n", s_failures);
+    return s_failures ? 1 : 0;
+}
@@ -0,0 +1,231 @@
+/*
+    sample_codec.h on made up sensor streams, on Linux: how much smaller, and what it costs
+
+    g++ -std=c++17 -O2 -I include host/sample_codec_bench.cpp -o sample_codec_bench
+    ./sample_codec_bench [samples]
+
+    raw:      a DT_TYPE_SENSOR record per sample in a batch frame, what the slave sent before
+    packed:   DT_TYPE_SENSOR_PACKED, one record per frame grown a delta at a time
+    lz:       packed, then sample_lz, in chunks the size of the slave's history dump
+    per frame is how many samples fit in one 250 byte ESP-NOW frame. Every stream is
+    decoded again and checked. Times are per sample on this machine; cycles are TSC ticks,
+    only printed on x86
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <vector>
+
+#include "dt_port.h"
+#include "dt_frame.h"
+#include "sample_codec.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define BENCH_TSC 1
+#else
+#define BENCH_TSC 0
+#endif
+
+#define BENCH_DUMP_SAMPLES 600          // the slave's ESPNOW_HISTORY_SAMPLES
+#define BENCH_RUNS 20
+
+typedef struct
+{
+    int64_t ns;
+    uint64_t ticks;
+} bench_time_t;
+
+static bench_time_t bench_now(void)
+{
+    bench_time_t t;
+    t.ns = esp_timer_get_time() * 1000;
+#if BENCH_TSC
+    t.ticks = __rdtsc();
+#else
+    t.ticks = 0;
+#endif
+    return t;
+}
+
+static void make_stream(const char *name, std::vector<int32_t> &v, size_t n)
+{
+    srand48(7);
+    v.resize(n);
+    int32_t x = 180000;
+    for (size_t i = 0; i < n; i++)
+    {
+        if (strcmp(name, "heap") == 0)
+        {
+            // free heap: flat, with a step now and then when something is allocated
+            if (drand48() < 0.02)
+            {
+                x += (int32_t)(drand48() * 4096) - 2048;
+            }
+            v[i] = x;
+        }
+        else if (strcmp(name, "temp") == 0)
+        {
+            // centi-degrees, a slow swing plus a little noise
+            v[i] = 2500 + (int32_t)(300 * sin(i / 500.0)) + (int32_t)(drand48() * 5) - 2;
+        }
+        else if (strcmp(name, "walk") == 0)
+        {
+            x += (int32_t)(drand48() * 41) - 20;
+            v[i] = x;
+        }
+        else
+        {
+            // nothing to find, 16 bit noise
+            v[i] = (int32_t)(drand48() * 65536) - 32768;
+        }
+    }
+}
+
+// Frames the way espnow_batch_add_sample fills them: one packed record, grown until the payload is full
+static size_t pack_frames(const std::vector<int32_t> &v, std::vector<std::vector<uint8_t>> &frames)
+{
+    size_t bytes = 0;
+    size_t i = 0;
+    while (i < v.size())
+    {
+        std::vector<uint8_t> body(DT_FRAME_MAX_PAYLOAD - sizeof(dt_record_hdr_t));
+        sample_pack_t p;
+        if (!sample_pack_begin(&p, body.data(), body.size(), 0, v[i++]))
+        {
+            break;
+        }
+        while (i < v.size() && sample_pack_add(&p, v[i]))
+        {
+            i++;
+        }
+        body.resize(p.len);
+        bytes += sizeof(dt_record_hdr_t) + p.len;
+        frames.push_back(body);
+    }
+    return bytes;
+}
+
+static bool unpack_frames(const std::vector<std::vector<uint8_t>> &frames, const std::vector<int32_t> &v)
+{
+    size_t i = 0;
+    for (const std::vector<uint8_t> &body : frames)
+    {
+        sample_unpack_t u;
+        dt_sample_t s;
+        sample_unpack_init(&u, body.data(), body.size());
+        while (sample_unpack_next(&u, &s))
+        {
+            if (i >= v.size() || s.value != v[i++])
+            {
+                return false;
+            }
+        }
+        if (!sample_unpack_ok(&u))
+        {
+            return false;
+        }
+    }
+    return i == v.size();
+}
+
+static void run(const char *name, size_t n)
+{
+    std::vector<int32_t> v;
+    make_stream(name, v, n);
+
+    // packed, and the encode / decode times
+    std::vector<std::vector<uint8_t>> frames;
+    size_t packed_bytes = 0;
+    bench_time_t t0 = bench_now();
+    for (int r = 0; r < BENCH_RUNS; r++)
+    {
+        frames.clear();
+        packed_bytes = pack_frames(v, frames);
+    }
+    bench_time_t t1 = bench_now();
+    bool ok = true;
+    for (int r = 0; r < BENCH_RUNS; r++)
+    {
+        ok = unpack_frames(frames, v) && ok;
+    }
+    bench_time_t t2 = bench_now();
+
+    // lz over dump sized chunks
+    static uint8_t body[SAMPLE_PACK_HEADER_MAX + BENCH_DUMP_SAMPLES * SAMPLE_VARINT_MAX];
+    static uint8_t lz[sizeof(body)];
+    static uint8_t back[sizeof(body)];
+    static sample_lz_state_t state;
+    size_t lz_bytes = 0;
+    int64_t lz_ns = 0, unlz_ns = 0;
+    uint64_t lz_ticks = 0, unlz_ticks = 0;
+    for (size_t at = 0; at < v.size(); at += BENCH_DUMP_SAMPLES)
+    {
+        size_t end = at + BENCH_DUMP_SAMPLES < v.size() ? at + BENCH_DUMP_SAMPLES : v.size();
+        sample_pack_t p;
+        if (!sample_pack_begin(&p, body, sizeof(body), 0, v[at]))
+        {
+            break;
+        }
+        for (size_t i = at + 1; i < end; i++)
+        {
+            sample_pack_add(&p, v[i]);
+        }
+
+        bench_time_t a = bench_now();
+        size_t len = sample_lz_compress(&state, body, p.len, lz, p.len - 1);
+        bench_time_t b = bench_now();
+        int back_len = len > 0 ? sample_lz_decompress(lz, len, back, sizeof(back)) : (int)p.len;
+        bench_time_t c = bench_now();
+
+        // no gain and the slave sends it packed
+        if (len == 0)
+        {
+            len = p.len;
+            memcpy(back, body, p.len);
+        }
+        ok = ok && back_len == (int)p.len && memcmp(back, body, p.len) == 0;
+        lz_bytes += len;
+        lz_ns += b.ns - a.ns;
+        unlz_ns += c.ns - b.ns;
+        lz_ticks += b.ticks - a.ticks;
+        unlz_ticks += c.ticks - b.ticks;
+    }
+
+    double runs = (double)BENCH_RUNS * n;
+    size_t raw_bytes = n * (sizeof(dt_record_hdr_t) + sizeof(dt_sample_t));
+    printf("%-6s %6.2f %7.2f %6.2f %8.1f%% %6d %7.1f %7.1f %7.1f %7.1f %7.1f %7.1f %7.1f %7.1f %7.1f  %s\n",
+           name,
+           (double)raw_bytes / n, (double)packed_bytes / n, (double)lz_bytes / n,
+           100.0 * lz_bytes / raw_bytes,
+           (int)(DT_FRAME_MAX_PAYLOAD / (sizeof(dt_record_hdr_t) + sizeof(dt_sample_t))),
+           (double)n / frames.size(),
+           (t1.ns - t0.ns) / runs, (t2.ns - t1.ns) / runs,
+           (double)lz_ns / n, (double)unlz_ns / n,
+           BENCH_TSC ? (t1.ticks - t0.ticks) / runs : 0.0, BENCH_TSC ? (t2.ticks - t1.ticks) / runs : 0.0,
+           BENCH_TSC ? (double)lz_ticks / n : 0.0, BENCH_TSC ? (double)unlz_ticks / n : 0.0,
+           ok ? "ok" : "MISMATCH");
+}
+
+int main(int argc, char **argv)
+{
+    size_t n = argc > 1 ? (size_t)atol(argv[1]) : 120000;
+    if (n < 1)
+    {
+        fprintf(stderr, "need at least one sample\n");
+        return 1;
+    }
+
+    printf("%zu samples per stream, lz in chunks of %d\n\n", n, BENCH_DUMP_SAMPLES);
+    printf("%-6s %-22s %9s %-14s %-31s %s\n", "", "bytes/sample", "", "per frame", "ns/sample", "cycles/sample");
+    printf("%-6s %6s %7s %6s %9s %6s %7s %7s %7s %7s %7s %7s %7s %7s %7s\n",
+           "stream", "raw", "packed", "lz", "lz/raw", "raw", "packed", "pack", "unpack", "lz", "un-lz", "pack", "unpack", "lz", "un-lz");
+
+    static const char *const streams[] = { "heap", "temp", "walk", "noise" };
+    for (const char *name : streams)
+    {
+        run(name, n);
+    }
+    return 0;
+}
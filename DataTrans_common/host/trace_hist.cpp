@@ -0,0 +1,281 @@
+/*
+    Latency per stage out of trace dumps (see trace.h), on Linux
+
+    g++ -std=c++17 -O2 -I include host/trace_hist.cpp -o trace_hist
+    curl -s http://<base station ip>:5000/trace > bs.trace     (or a serial log after pressing 't')
+    ./trace_hist bs.trace [more dumps ...]
+    ./trace_hist -b                                            what one trace_event costs here
+
+    Only the last whole dump in each file is used. Events with the same id (in the same tag
+    group) are put in time order and every step from one to the next is a sample for that
+    stage, e.g. espnow_recv -> rx_decoded. A step longer than PAIR_MAX_US is taken as the id
+    being reused and left out. Dumps from different files are never paired with each other,
+    the devices' clocks are not in step
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <algorithm>
+#include <map>
+#include <utility>
+#include <vector>
+
+#include "dt_port.h"
+#include "trace.h"
+
+#define PAIR_MAX_US 1000000.0
+#define BENCH_EVENTS 10000000
+#define HIST_BUCKETS 24             // powers of 2 from 1 us
+#define HIST_WIDTH 40
+#define MAX_CORES 16                // in a dump, the Linux build has DT_NUM_CORES of them
+
+typedef struct
+{
+    uint32_t cycles;
+    uint16_t tag;
+    uint32_t id;
+} event_t;
+
+typedef struct
+{
+    unsigned long mhz;
+    long long now_us;
+    std::vector<event_t> cores[MAX_CORES];
+} dump_t;
+
+typedef std::pair<uint16_t, uint16_t> stage_t;
+
+static std::map<stage_t, std::vector<double>> s_stages;
+
+// The last complete dump in the file
+static bool read_dump(FILE *f, dump_t *out)
+{
+    char line[256];
+    dump_t cur;
+    bool in_dump = false;
+    bool found = false;
+
+    while (fgets(line, sizeof(line), f) != NULL)
+    {
+        const char *begin = strstr(line, "DT_TRACE BEGIN");
+        if (begin != NULL)
+        {
+            int cores = 0;
+            cur = dump_t();
+            in_dump = sscanf(begin, "DT_TRACE BEGIN cores=%d events=%*d mhz=%lu now_us=%lld", &cores, &cur.mhz, &cur.now_us) == 3 &&
+                      cur.mhz > 0 && cores > 0 && cores <= MAX_CORES;
+            continue;
+        }
+        if (!in_dump)
+        {
+            continue;
+        }
+        if (strstr(line, "DT_TRACE END") != NULL)
+        {
+            *out = cur;
+            found = true;
+            in_dump = false;
+            continue;
+        }
+
+        // anything else in a serial log (the firmware's own printing) is skipped
+        int core;
+        unsigned long cycles, id;
+        unsigned tag, arg;
+        if (line[0] != 'T' || sscanf(line, "T %d %lx %u %lx %u", &core, &cycles, &tag, &id, &arg) != 5 || core < 0 || core >= MAX_CORES)
+        {
+            continue;
+        }
+        cur.cores[core].push_back({ (uint32_t)cycles, (uint16_t)tag, (uint32_t)id });
+    }
+    return found;
+}
+
+/*
+    Every event onto the dump's microsecond clock, through the nearest TRACE_SYNC on the
+    same core (the one before it, or the first one after if there is none before)
+*/
+static void add_dump(const dump_t *dump, const char *name)
+{
+    std::map<uint64_t, std::vector<std::pair<double, uint16_t>>> by_id;
+    int used = 0;
+
+    for (int core = 0; core < MAX_CORES; core++)
+    {
+        const std::vector<event_t> &events = dump->cores[core];
+        int sync = -1;
+        for (size_t i = 0; i < events.size() && sync < 0; i++)
+        {
+            if (events[i].tag == TRACE_SYNC)
+            {
+                sync = (int)i;
+            }
+        }
+        if (sync < 0)
+        {
+            if (!events.empty())
+            {
+                fprintf(stderr, "%s: core %d has no sync, %zu events skipped\n", name, core, events.size());
+            }
+            continue;
+        }
+
+        for (size_t i = 0; i < events.size(); i++)
+        {
+            const event_t *ev = &events[i];
+            if (ev->tag == TRACE_SYNC)
+            {
+                sync = (int)i;
+                continue;
+            }
+
+            // sync ids are the low 32 bits of esp_timer_get_time(), put back next to now_us
+            const event_t *s = &events[sync];
+            double sync_us = (double)(dump->now_us - (uint32_t)((uint32_t)dump->now_us - s->id));
+            double t_us = sync_us + (double)(int32_t)(ev->cycles - s->cycles) / dump->mhz;
+
+            // a frame id of 0 is not a frame
+            if (ev->id == 0 && ev->tag < 16)
+            {
+                continue;
+            }
+            by_id[((uint64_t)(ev->tag / 16) << 32) | ev->id].push_back({ t_us, ev->tag });
+            used++;
+        }
+    }
+
+    for (auto &entry : by_id)
+    {
+        std::vector<std::pair<double, uint16_t>> &steps = entry.second;
+        std::stable_sort(steps.begin(), steps.end(),
+                         [](const std::pair<double, uint16_t> &a, const std::pair<double, uint16_t> &b) { return a.first < b.first; });
+        for (size_t i = 1; i < steps.size(); i++)
+        {
+            // an accept is a new connection in a slot an old one used
+            double dt = steps[i].first - steps[i - 1].first;
+            if (dt < PAIR_MAX_US && steps[i].second != TRACE_TCP_ACCEPT)
+            {
+                s_stages[{ steps[i - 1].second, steps[i].second }].push_back(dt);
+            }
+        }
+    }
+    printf("%s: %d events, %zu ids\n", name, used, by_id.size());
+}
+
+static double percentile(const std::vector<double> &sorted, double p)
+{
+    size_t i = (size_t)ceil(p * sorted.size());
+    return sorted[i > 0 ? i - 1 : 0];
+}
+
+static void print_stages(void)
+{
+    printf("\n%-28s %8s %9s %9s %9s %9s %9s %9s  (us)\n", "stage", "count", "min", "p50", "p90", "p99", "p999", "max");
+    for (auto &entry : s_stages)
+    {
+        std::vector<double> &v = entry.second;
+        std::sort(v.begin(), v.end());
+
+        char stage[64];
+        snprintf(stage, sizeof(stage), "%s -> %s", trace_tag_name(entry.first.first), trace_tag_name(entry.first.second));
+        printf("%-28s %8zu %9.1f %9.1f %9.1f %9.1f %9.1f %9.1f\n", stage, v.size(),
+               v.front(), percentile(v, 0.5), percentile(v, 0.9), percentile(v, 0.99), percentile(v, 0.999), v.back());
+    }
+
+    for (auto &entry : s_stages)
+    {
+        const std::vector<double> &v = entry.second;
+        size_t buckets[HIST_BUCKETS] = {};
+        size_t most = 0;
+        for (double us : v)
+        {
+            int b = us < 1.0 ? 0 : 1 + (int)log2(us);
+            b = b < HIST_BUCKETS ? b : HIST_BUCKETS - 1;
+            buckets[b]++;
+            most = buckets[b] > most ? buckets[b] : most;
+        }
+
+        printf("\n%s -> %s\n", trace_tag_name(entry.first.first), trace_tag_name(entry.first.second));
+        int last = HIST_BUCKETS - 1;
+        while (last > 0 && buckets[last] == 0)
+        {
+            last--;
+        }
+        int first = 0;
+        while (first < last && buckets[first] == 0)
+        {
+            first++;
+        }
+        for (int b = first; b <= last; b++)
+        {
+            char range[32];
+            if (b == 0)
+            {
+                snprintf(range, sizeof(range), "< 1");
+            }
+            else
+            {
+                snprintf(range, sizeof(range), "%lu - %lu", 1ul << (b - 1), 1ul << b);
+            }
+            int bar = (int)(buckets[b] * HIST_WIDTH / most);
+            printf("  %15s us %8zu %.*s\n", range, buckets[b], bar, "########################################");
+        }
+    }
+}
+
+// One thread, so the ring's cache line never moves. On Linux most of it is clock_gettime and sched_getcpu,
+// the ESP32 reads both out of a register
+static void bench(void)
+{
+    int64_t start = esp_timer_get_time();
+    for (uint32_t i = 0; i < BENCH_EVENTS; i++)
+    {
+        trace_event(TRACE_TCP_RECV, i, 0);
+    }
+    int64_t elapsed = esp_timer_get_time() - start;
+    printf("%d events in %lld us, %.1f ns each\n", BENCH_EVENTS, (long long)elapsed, elapsed * 1000.0 / BENCH_EVENTS);
+}
+
+int main(int argc, char **argv)
+{
+    if (argc > 1 && strcmp(argv[1], "-b") == 0)
+    {
+        bench();
+        return 0;
+    }
+
+    for (int i = 1; i < argc || i == 1; i++)
+    {
+        const char *name = i < argc ? argv[i] : "stdin";
+        FILE *f = i < argc ? fopen(argv[i], "r") : stdin;
+        if (f == NULL)
+        {
+            perror(argv[i]);
+            return 1;
+        }
+
+        dump_t *dump = new dump_t();
+        if (read_dump(f, dump))
+        {
+            add_dump(dump, name);
+        }
+        else
+        {
+            fprintf(stderr, "%s: no complete DT_TRACE dump\n", name);
+        }
+        delete dump;
+        if (f != stdin)
+        {
+            fclose(f);
+        }
+    }
+
+    if (s_stages.empty())
+    {
+        fprintf(stderr, "nothing to pair up\n");
+        return 1;
+    }
+    print_stages();
+    return 0;
+}
@@ -0,0 +1,103 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <atomic>
+
+/*
+    Fixed size block pool
+        - The blocks are a static array the owner hands over, nothing comes from the heap
+          so frames and connections can come and go without fragmenting it
+        - Free blocks form a stack linked through next[]. The head carries a tag that
+          goes up on every change, so a pop racing a pop + push of the same block
+          (ABA) fails its CAS instead of corrupting the list
+        - Lock free: safe to alloc and free from any task and from the wifi callbacks,
+          on either core
+*/
+
+#define BLOCK_POOL_NONE 0xFFFF      // end of the free list
+#define BLOCK_POOL_MAX_BLOCKS 0xFFFF
+
+typedef struct
+{
+    uint8_t *mem;
+    size_t block_size;
+    uint16_t count;
+
+    std::atomic<uint16_t> *next;    // free list links, one per block
+    std::atomic<uint32_t> head;     // free block index in the low 16 bits, tag in the high 16
+
+    std::atomic<uint32_t> in_use;
+    std::atomic<uint32_t> high_water;   // most blocks ever in use at once
+    std::atomic<uint32_t> exhausted;    // allocs that found no free block
+} block_pool_t;
+
+static inline void block_pool_init(block_pool_t *pool, void *blocks, size_t block_size, std::atomic<uint16_t> *next, uint16_t count)
+{
+    pool->mem = (uint8_t *)blocks;
+    pool->block_size = block_size;
+    pool->count = count;
+    pool->next = next;
+
+    for (uint16_t i = 0; i < count; i++)
+    {
+        next[i].store(i + 1 < count ? i + 1 : BLOCK_POOL_NONE, std::memory_order_relaxed);
+    }
+    pool->head.store(count > 0 ? 0 : BLOCK_POOL_NONE, std::memory_order_release);
+
+    pool->in_use.store(0, std::memory_order_relaxed);
+    pool->high_water.store(0, std::memory_order_relaxed);
+    pool->exhausted.store(0, std::memory_order_relaxed);
+}
+
+// A free block, or NULL if they are all in use
+static inline void *block_pool_alloc(block_pool_t *pool)
+{
+    uint32_t head = pool->head.load(std::memory_order_acquire);
+    uint16_t index;
+
+    do
+    {
+        index = head & 0xFFFF;
+        if (index == BLOCK_POOL_NONE)
+        {
+            pool->exhausted.fetch_add(1, std::memory_order_relaxed);
+            return NULL;
+        }
+
+        uint32_t next = pool->next[index].load(std::memory_order_relaxed);
+        uint32_t tag = (head >> 16) + 1;
+        if (pool->head.compare_exchange_weak(head, next | (tag << 16), std::memory_order_acquire, std::memory_order_acquire))
+        {
+            break;
+        }
+    } while (1);
+
+    uint32_t in_use = pool->in_use.fetch_add(1, std::memory_order_relaxed) + 1;
+    uint32_t high_water = pool->high_water.load(std::memory_order_relaxed);
+    while (in_use > high_water &&
+           !pool->high_water.compare_exchange_weak(high_water, in_use, std::memory_order_relaxed))
+    {
+    }
+
+    return pool->mem + (size_t)index * pool->block_size;
+}
+
+static inline void block_pool_free(block_pool_t *pool, void *block)
+{
+    uint16_t index = (uint16_t)(((uint8_t *)block - pool->mem) / pool->block_size);
+    uint32_t head = pool->head.load(std::memory_order_relaxed);
+
+    do
+    {
+        pool->next[index].store(head & 0xFFFF, std::memory_order_relaxed);
+    } while (!pool->head.compare_exchange_weak(head, index | (((head >> 16) + 1) << 16),
+                                               std::memory_order_release, std::memory_order_relaxed));
+
+    pool->in_use.fetch_sub(1, std::memory_order_relaxed);
+}
+
+static inline uint32_t block_pool_in_use(const block_pool_t *pool)
+{
+    return pool->in_use.load(std::memory_order_relaxed);
+}
@@ -0,0 +1,233 @@
+#pragma once
+
+/*
+    Raw flash: a data partition on the ESP32, a plain file on Linux (see spool.h for the user)
+        - NOR rules: erasing sets a whole DT_FLASH_SECTOR_SIZE sector to 0xFF, writing can only
+          clear bits. The Linux version ANDs every write into what is already there, so code
+          that forgets to erase breaks the same way it would on the chip
+        - Counts what was done to it. Programs are counted in DT_FLASH_PAGE_SIZE pages touched,
+          which is what a write costs the chip, however few bytes of the page it changed
+        - On the ESP32 a write or erase turns the flash cache off, both cores stall on anything
+          not in IRAM until it is done. Writes want to be few and big
+        - Linux can pull the plug (dt_flash_power_cut): after that many more bytes the write
+          that crosses it lands only partly, and every call fails until reopened
+        - 0 on success, -1 on failure
+*/
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "dt_port.h"
+
+#ifdef ESP_PLATFORM
+#include "esp_partition.h"
+#endif
+
+#define DT_FLASH_SECTOR_SIZE 4096
+#define DT_FLASH_PAGE_SIZE 256
+
+typedef struct
+{
+    uint64_t read_bytes;
+    uint64_t write_bytes;
+    uint32_t writes;
+    uint32_t pages;             // program pages touched
+    uint32_t erases;
+} dt_flash_stats_t;
+
+typedef struct
+{
+#ifdef ESP_PLATFORM
+    const esp_partition_t *part;
+#else
+    int fd;
+    int64_t power_cut_bytes;    // -1 = never
+#endif
+    uint32_t size;
+    dt_flash_stats_t stats;
+} dt_flash_t;
+
+static inline void dt_flash_count_write(dt_flash_t *flash, uint32_t offset, size_t len)
+{
+    flash->stats.writes++;
+    flash->stats.write_bytes += len;
+    flash->stats.pages += (offset + len - 1) / DT_FLASH_PAGE_SIZE - offset / DT_FLASH_PAGE_SIZE + 1;
+}
+
+static inline bool dt_flash_in_range(const dt_flash_t *flash, uint32_t offset, size_t len)
+{
+    return len > 0 && offset < flash->size && len <= flash->size - offset;
+}
+
+#ifdef ESP_PLATFORM
+
+// `name` is the partition label, size comes from the partition table
+static inline int dt_flash_open(dt_flash_t *flash, const char *name, uint32_t size)
+{
+    memset(flash, 0, sizeof(*flash));
+    flash->part = esp_partition_find_first(ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_ANY, name);
+    if (flash->part == NULL)
+    {
+        return -1;
+    }
+    flash->size = flash->part->size - flash->part->size % DT_FLASH_SECTOR_SIZE;
+    return 0;
+}
+
+static inline void dt_flash_close(dt_flash_t *flash)
+{
+    flash->part = NULL;
+}
+
+static inline int dt_flash_read(dt_flash_t *flash, uint32_t offset, void *buf, size_t len)
+{
+    if (!dt_flash_in_range(flash, offset, len) || esp_partition_read(flash->part, offset, buf, len) != ESP_OK)
+    {
+        return -1;
+    }
+    flash->stats.read_bytes += len;
+    return 0;
+}
+
+static inline int dt_flash_write(dt_flash_t *flash, uint32_t offset, const void *buf, size_t len)
+{
+    if (!dt_flash_in_range(flash, offset, len) || esp_partition_write(flash->part, offset, buf, len) != ESP_OK)
+    {
+        return -1;
+    }
+    dt_flash_count_write(flash, offset, len);
+    return 0;
+}
+
+static inline int dt_flash_erase_sector(dt_flash_t *flash, uint32_t offset)
+{
+    if (offset % DT_FLASH_SECTOR_SIZE != 0 || !dt_flash_in_range(flash, offset, DT_FLASH_SECTOR_SIZE) ||
+        esp_partition_erase_range(flash->part, offset, DT_FLASH_SECTOR_SIZE) != ESP_OK)
+    {
+        return -1;
+    }
+    flash->stats.erases++;
+    return 0;
+}
+
+#else
+
+// `name` is a file. A new one is made `size` bytes long and erased, an old one keeps what it had
+static inline int dt_flash_open(dt_flash_t *flash, const char *name, uint32_t size)
+{
+    memset(flash, 0, sizeof(*flash));
+    flash->power_cut_bytes = -1;
+    flash->size = size - size % DT_FLASH_SECTOR_SIZE;
+    flash->fd = open(name, O_RDWR | O_CREAT, 0644);
+    if (flash->fd < 0 || flash->size == 0)
+    {
+        return -1;
+    }
+
+    off_t have = lseek(flash->fd, 0, SEEK_END);
+    uint8_t erased[DT_FLASH_SECTOR_SIZE];
+    memset(erased, 0xFF, sizeof(erased));
+    for (off_t at = have - have % DT_FLASH_SECTOR_SIZE; at < (off_t)flash->size; at += DT_FLASH_SECTOR_SIZE)
+    {
+        if (pwrite(flash->fd, erased, sizeof(erased), at) != (ssize_t)sizeof(erased))
+        {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static inline void dt_flash_close(dt_flash_t *flash)
+{
+    if (flash->fd >= 0)
+    {
+        close(flash->fd);
+    }
+    flash->fd = -1;
+}
+
+// Everything after the next `bytes` written fails, as if the power went
+static inline void dt_flash_power_cut(dt_flash_t *flash, int64_t bytes)
+{
+    flash->power_cut_bytes = bytes;
+}
+
+static inline bool dt_flash_dead(const dt_flash_t *flash)
+{
+    return flash->power_cut_bytes == 0;
+}
+
+static inline int dt_flash_read(dt_flash_t *flash, uint32_t offset, void *buf, size_t len)
+{
+    if (dt_flash_dead(flash) || !dt_flash_in_range(flash, offset, len) ||
+        pread(flash->fd, buf, len, offset) != (ssize_t)len)
+    {
+        return -1;
+    }
+    flash->stats.read_bytes += len;
+    return 0;
+}
+
+static inline int dt_flash_write(dt_flash_t *flash, uint32_t offset, const void *buf, size_t len)
+{
+    if (dt_flash_dead(flash) || !dt_flash_in_range(flash, offset, len))
+    {
+        return -1;
+    }
+
+    // bits only go from 1 to 0, and maybe not all of them get there
+    size_t land = len;
+    if (flash->power_cut_bytes >= 0 && (int64_t)len > flash->power_cut_bytes)
+    {
+        land = (size_t)flash->power_cut_bytes;
+    }
+    uint8_t cell[DT_FLASH_PAGE_SIZE];
+    for (size_t done = 0; done < land; )
+    {
+        size_t n = land - done < sizeof(cell) ? land - done : sizeof(cell);
+        if (pread(flash->fd, cell, n, offset + done) != (ssize_t)n)
+        {
+            return -1;
+        }
+        for (size_t i = 0; i < n; i++)
+        {
+            cell[i] &= ((const uint8_t *)buf)[done + i];
+        }
+        if (pwrite(flash->fd, cell, n, offset + done) != (ssize_t)n)
+        {
+            return -1;
+        }
+        done += n;
+    }
+
+    if (flash->power_cut_bytes >= 0)
+    {
+        flash->power_cut_bytes -= land;
+        if (land < len)
+        {
+            return -1;
+        }
+    }
+    dt_flash_count_write(flash, offset, len);
+    return 0;
+}
+
+static inline int dt_flash_erase_sector(dt_flash_t *flash, uint32_t offset)
+{
+    if (dt_flash_dead(flash) || offset % DT_FLASH_SECTOR_SIZE != 0 || !dt_flash_in_range(flash, offset, DT_FLASH_SECTOR_SIZE))
+    {
+        return -1;
+    }
+
+    uint8_t erased[DT_FLASH_SECTOR_SIZE];
+    memset(erased, 0xFF, sizeof(erased));
+    if (pwrite(flash->fd, erased, sizeof(erased), offset) != (ssize_t)sizeof(erased))
+    {
+        return -1;
+    }
+    flash->stats.erases++;
+    return 0;
+}
+
+#endif
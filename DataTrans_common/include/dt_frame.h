@@ -0,0 +1,390 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+/*
+    Binary frame format shared by the slave and the base station, used on both ESP-NOW and TCP
+
+    | magic | version | type | flags | node_id | len | seq | timestamp_us | crc | payload ... |
+    |   1   |    1    |  1   |   1   |    2    |  2  |  4  |      4       |  2  |    len      |
+
+        - Little endian (both the ESP32 and x86 are), 18 byte header
+        - One frame always fits in one ESP-NOW packet (250 bytes), so payload is at most 232
+        - On TCP frames are just sent back to back. magic + len + crc let the reader find
+          where each one ends and skip over garbage
+        - crc is CRC-16/CCITT over the header (minus the crc itself) and the payload
+        - Nothing is copied on decode, dt_frame_view_t points into the receive buffer
+*/
+
+#define DT_FRAME_MAGIC 0xD7
+#define DT_FRAME_VERSION 1
+#define DT_FRAME_MAX_SIZE 250           // ESP_NOW_MAX_DATA_LEN
+
+#define DT_BASE_STATION_NODE_ID 0       // node_id in frames the base station sends
+
+static const uint8_t DT_BROADCAST_MAC[6] = {0xff, 0xff, 0xff, 0xff, 0xff, 0xff};
+
+typedef enum
+{
+    DT_TYPE_TEXT = 1,                   // utf-8 text, not null terminated
+    DT_TYPE_SENSOR = 2,                 // array of dt_sample_t
+    DT_TYPE_RESPONSE = 3,               // base station reply to a TCP request, text
+    DT_TYPE_BATCH = 4,                  // several records back to back, see dt_record_hdr_t
+    DT_TYPE_JOIN_REQ = 5,               // slave -> broadcast, asking a base station to take it
+    DT_TYPE_JOIN_ACK = 6,               // base station -> slave, dt_join_ack_t
+    DT_TYPE_BEACON = 7,                 // base station -> broadcast at the start of every superframe, dt_beacon_t
+    DT_TYPE_SUBSCRIBE = 8,              // TCP client -> base station, send me every ESP-NOW frame from now on
+    DT_TYPE_FRAG = 9,                   // slave -> base station, piece of a message too big for one frame, dt_frag_hdr_t + data
+    DT_TYPE_FRAG_STATUS = 10,           // base station -> slave, dt_frag_status_t
+    DT_TYPE_BLOB = 11,                  // raw bytes, e.g. a sensor dump sent with fragmentation
+    DT_TYPE_SENSOR_PACKED = 12,         // one channel's samples as varint deltas, see sample_codec.h
+    DT_TYPE_SENSOR_LZ = 13,             // a DT_TYPE_SENSOR_PACKED body put through sample_lz_compress
+    DT_TYPE_TIME_REQ = 14,              // slave -> base station, ESP-NOW or TCP, dt_time_req_t. See time_sync.h in the slave
+    DT_TYPE_TIME_RESP = 15,             // base station -> slave, dt_time_resp_t
+    DT_TYPE_TS_QUERY = 16,              // TCP client -> base station, dt_ts_query_t. See ts_store.h in the base station
+    DT_TYPE_TS_RESULT = 17,             // base station -> TCP client, dt_ts_result_t then dt_ts_bucket_t for each bucket
+} dt_frame_type_t;
+
+// dt_frame_hdr_t.flags
+#define DT_FLAG_MASTER_TIME 0x01        // timestamp_us is the base station's clock (time sync), not the sender's own
+#define DT_FLAG_REPLAY 0x02             // sent again from the slave's flash spool, seq and timestamp_us are from when it was made
+
+typedef struct __attribute__((packed))
+{
+    uint8_t magic;
+    uint8_t version;
+    uint8_t type;
+    uint8_t flags;
+    uint16_t node_id;
+    uint16_t len;
+    uint32_t seq;
+    uint32_t timestamp_us;
+    uint16_t crc;
+} dt_frame_hdr_t;
+
+typedef struct __attribute__((packed))
+{
+    uint16_t channel;
+    int32_t value;
+} dt_sample_t;
+
+// One record inside a DT_TYPE_BATCH payload, type is the dt_frame_type_t of the data
+typedef struct __attribute__((packed))
+{
+    uint8_t type;
+    uint8_t len;
+} dt_record_hdr_t;
+
+typedef enum
+{
+    DT_JOIN_ACCEPTED = 0,
+} dt_join_status_t;
+
+typedef struct __attribute__((packed))
+{
+    uint8_t status;                     // dt_join_status_t
+    uint8_t channel;                    // channel the base station is on
+    uint16_t slot;                      // transmit slot in the superframe, see tdma.h
+} dt_join_ack_t;
+
+typedef struct __attribute__((packed))
+{
+    uint32_t superframe_us;
+    uint32_t slot_us;
+    uint16_t slot_count;
+    uint8_t channel;                    // channel the base station is on now, see chan_track.h in the slave
+    uint64_t prev_tx_us;                // base station time the previous beacon went on the air, 0 = it doesn't know
+} dt_beacon_t;
+
+// Beacons from base stations older than the channel field stop here
+#define DT_BEACON_MIN_SIZE offsetof(dt_beacon_t, channel)
+
+// Whether a beacon `len` long goes as far as `field`, older base stations send shorter ones
+#define DT_BEACON_HAS(len, field) ((len) >= offsetof(dt_beacon_t, field) + sizeof(((dt_beacon_t *)0)->field))
+
+// NTP style, all in microseconds: t1 the slave sent, t2 the base station received, t3 it answered. t4 is when it arrives
+typedef struct __attribute__((packed))
+{
+    uint64_t t1_us;
+    uint8_t pad[16];                    // as long as the response, so both ways take as long on the air
+} dt_time_req_t;
+
+typedef struct __attribute__((packed))
+{
+    uint64_t t1_us;                     // copied from the request
+    uint64_t t2_us;
+    uint64_t t3_us;
+} dt_time_resp_t;
+
+// Aggregates of one slave's channel, times are how long ago on the base station's clock
+typedef struct __attribute__((packed))
+{
+    uint16_t node_id;
+    uint16_t channel;
+    uint32_t from_ago_ms;
+    uint32_t to_ago_ms;                 // 0 = up to now
+    uint32_t step_ms;                   // 0 = one bucket for the whole range
+} dt_ts_query_t;
+
+typedef struct __attribute__((packed))
+{
+    uint16_t node_id;
+    uint16_t channel;
+    uint8_t found;                      // 0 = the base station has nothing from that channel, no buckets follow
+    uint32_t first_ago_ms;              // start of the first bucket
+    uint32_t step_ms;                   // maybe longer than asked for, see ts_store_query
+} dt_ts_result_t;
+
+typedef struct __attribute__((packed))
+{
+    int32_t min;
+    int32_t max;
+    int32_t mean;
+    uint32_t count;                     // 0 = nothing came in that bucket
+} dt_ts_bucket_t;
+
+// Messages bigger than one frame are split into DT_TYPE_FRAG frames, at most DT_FRAG_MAX_MSG_SIZE in total
+#define DT_FRAG_MAX_MSG_SIZE 16384
+
+typedef struct __attribute__((packed))
+{
+    uint16_t msg_id;                    // per sender, wraps
+    uint16_t index;                     // 0 .. count - 1
+    uint16_t count;
+    uint32_t total_len;
+    uint8_t type;                       // dt_frame_type_t of the whole message
+} dt_frag_hdr_t;
+
+typedef enum
+{
+    DT_FRAG_DONE = 0,                   // whole message received
+    DT_FRAG_MISSING = 1,                // send the fragments set in missing again
+    DT_FRAG_DROPPED = 2,                // base station gave up on it (timed out or out of memory)
+} dt_frag_state_t;
+
+#define DT_FRAME_HDR_SIZE ((int)sizeof(dt_frame_hdr_t))
+#define DT_FRAME_MAX_PAYLOAD (DT_FRAME_MAX_SIZE - DT_FRAME_HDR_SIZE)
+#define DT_FRAME_MAX_SAMPLES (DT_FRAME_MAX_PAYLOAD / (int)sizeof(dt_sample_t))
+
+#define DT_TS_MAX_BUCKETS ((DT_FRAME_MAX_PAYLOAD - (int)sizeof(dt_ts_result_t)) / (int)sizeof(dt_ts_bucket_t))
+#define DT_FRAG_DATA_SIZE (DT_FRAME_MAX_PAYLOAD - (int)sizeof(dt_frag_hdr_t))
+#define DT_FRAG_MAX_COUNT ((DT_FRAG_MAX_MSG_SIZE + DT_FRAG_DATA_SIZE - 1) / DT_FRAG_DATA_SIZE)
+
+typedef struct __attribute__((packed))
+{
+    uint16_t msg_id;
+    uint8_t state;                      // dt_frag_state_t
+    uint8_t missing[(DT_FRAG_MAX_COUNT + 7) / 8];   // bit i set = fragment i not received
+} dt_frag_status_t;
+
+static_assert(sizeof(dt_frame_hdr_t) == 18, "dt_frame_hdr_t must be packed");
+
+typedef struct
+{
+    const dt_frame_hdr_t *hdr;
+    const uint8_t *payload;
+} dt_frame_view_t;
+
+static const uint16_t DT_CRC16_TABLE[256] = {
+    0x0000, 0x1021, 0x2042, 0x3063, 0x4084, 0x50A5, 0x60C6, 0x70E7,
+    0x8108, 0x9129, 0xA14A, 0xB16B, 0xC18C, 0xD1AD, 0xE1CE, 0xF1EF,
+    0x1231, 0x0210, 0x3273, 0x2252, 0x52B5, 0x4294, 0x72F7, 0x62D6,
+    0x9339, 0x8318, 0xB37B, 0xA35A, 0xD3BD, 0xC39C, 0xF3FF, 0xE3DE,
+    0x2462, 0x3443, 0x0420, 0x1401, 0x64E6, 0x74C7, 0x44A4, 0x5485,
+    0xA56A, 0xB54B, 0x8528, 0x9509, 0xE5EE, 0xF5CF, 0xC5AC, 0xD58D,
+    0x3653, 0x2672, 0x1611, 0x0630, 0x76D7, 0x66F6, 0x5695, 0x46B4,
+    0xB75B, 0xA77A, 0x9719, 0x8738, 0xF7DF, 0xE7FE, 0xD79D, 0xC7BC,
+    0x48C4, 0x58E5, 0x6886, 0x78A7, 0x0840, 0x1861, 0x2802, 0x3823,
+    0xC9CC, 0xD9ED, 0xE98E, 0xF9AF, 0x8948, 0x9969, 0xA90A, 0xB92B,
+    0x5AF5, 0x4AD4, 0x7AB7, 0x6A96, 0x1A71, 0x0A50, 0x3A33, 0x2A12,
+    0xDBFD, 0xCBDC, 0xFBBF, 0xEB9E, 0x9B79, 0x8B58, 0xBB3B, 0xAB1A,
+    0x6CA6, 0x7C87, 0x4CE4, 0x5CC5, 0x2C22, 0x3C03, 0x0C60, 0x1C41,
+    0xEDAE, 0xFD8F, 0xCDEC, 0xDDCD, 0xAD2A, 0xBD0B, 0x8D68, 0x9D49,
+    0x7E97, 0x6EB6, 0x5ED5, 0x4EF4, 0x3E13, 0x2E32, 0x1E51, 0x0E70,
+    0xFF9F, 0xEFBE, 0xDFDD, 0xCFFC, 0xBF1B, 0xAF3A, 0x9F59, 0x8F78,
+    0x9188, 0x81A9, 0xB1CA, 0xA1EB, 0xD10C, 0xC12D, 0xF14E, 0xE16F,
+    0x1080, 0x00A1, 0x30C2, 0x20E3, 0x5004, 0x4025, 0x7046, 0x6067,
+    0x83B9, 0x9398, 0xA3FB, 0xB3DA, 0xC33D, 0xD31C, 0xE37F, 0xF35E,
+    0x02B1, 0x1290, 0x22F3, 0x32D2, 0x4235, 0x5214, 0x6277, 0x7256,
+    0xB5EA, 0xA5CB, 0x95A8, 0x8589, 0xF56E, 0xE54F, 0xD52C, 0xC50D,
+    0x34E2, 0x24C3, 0x14A0, 0x0481, 0x7466, 0x6447, 0x5424, 0x4405,
+    0xA7DB, 0xB7FA, 0x8799, 0x97B8, 0xE75F, 0xF77E, 0xC71D, 0xD73C,
+    0x26D3, 0x36F2, 0x0691, 0x16B0, 0x6657, 0x7676, 0x4615, 0x5634,
+    0xD94C, 0xC96D, 0xF90E, 0xE92F, 0x99C8, 0x89E9, 0xB98A, 0xA9AB,
+    0x5844, 0x4865, 0x7806, 0x6827, 0x18C0, 0x08E1, 0x3882, 0x28A3,
+    0xCB7D, 0xDB5C, 0xEB3F, 0xFB1E, 0x8BF9, 0x9BD8, 0xABBB, 0xBB9A,
+    0x4A75, 0x5A54, 0x6A37, 0x7A16, 0x0AF1, 0x1AD0, 0x2AB3, 0x3A92,
+    0xFD2E, 0xED0F, 0xDD6C, 0xCD4D, 0xBDAA, 0xAD8B, 0x9DE8, 0x8DC9,
+    0x7C26, 0x6C07, 0x5C64, 0x4C45, 0x3CA2, 0x2C83, 0x1CE0, 0x0CC1,
+    0xEF1F, 0xFF3E, 0xCF5D, 0xDF7C, 0xAF9B, 0xBFBA, 0x8FD9, 0x9FF8,
+    0x6E17, 0x7E36, 0x4E55, 0x5E74, 0x2E93, 0x3EB2, 0x0ED1, 0x1EF0,
+};
+
+static inline uint16_t dt_crc16(uint16_t crc, const uint8_t *data, size_t len)
+{
+    for (size_t i = 0; i < len; i++)
+    {
+        crc = (uint16_t)(crc << 8) ^ DT_CRC16_TABLE[(uint8_t)(crc >> 8) ^ data[i]];
+    }
+    return crc;
+}
+
+static inline uint16_t dt_frame_crc(const uint8_t *frame, size_t payload_len)
+{
+    uint16_t crc = dt_crc16(0xFFFF, frame, offsetof(dt_frame_hdr_t, crc));
+    return dt_crc16(crc, frame + DT_FRAME_HDR_SIZE, payload_len);
+}
+
+/*
+    Encoding in place: write the payload straight into dt_frame_payload(buf),
+    then dt_frame_finish fills in the header. Returns the full frame length
+*/
+static inline uint8_t *dt_frame_payload(uint8_t *buf)
+{
+    return buf + DT_FRAME_HDR_SIZE;
+}
+
+static inline size_t dt_frame_finish_flags(uint8_t *buf, uint8_t type, uint8_t flags, uint16_t node_id,
+                                           uint32_t seq, uint32_t timestamp_us, size_t payload_len)
+{
+    dt_frame_hdr_t *hdr = (dt_frame_hdr_t *)buf;
+    hdr->magic = DT_FRAME_MAGIC;
+    hdr->version = DT_FRAME_VERSION;
+    hdr->type = type;
+    hdr->flags = flags;
+    hdr->node_id = node_id;
+    hdr->len = (uint16_t)payload_len;
+    hdr->seq = seq;
+    hdr->timestamp_us = timestamp_us;
+    hdr->crc = dt_frame_crc(buf, payload_len);
+
+    return DT_FRAME_HDR_SIZE + payload_len;
+}
+
+// Add flags to a finished frame, the CRC is worked out again
+static inline void dt_frame_add_flags(uint8_t *buf, uint8_t flags)
+{
+    dt_frame_hdr_t *hdr = (dt_frame_hdr_t *)buf;
+    hdr->flags |= flags;
+    hdr->crc = dt_frame_crc(buf, hdr->len);
+}
+
+static inline size_t dt_frame_finish(uint8_t *buf, uint8_t type, uint16_t node_id,
+                                     uint32_t seq, uint32_t timestamp_us, size_t payload_len)
+{
+    return dt_frame_finish_flags(buf, type, 0, node_id, seq, timestamp_us, payload_len);
+}
+
+/*
+    What goes in timestamp_us for a frame made at local_us on the sender's clock. A clock that
+    gives the base station's time sets DT_FLAG_MASTER_TIME in *flags
+*/
+typedef uint32_t (*dt_frame_clock_t)(int64_t local_us, uint8_t *flags);
+
+// dt_frame_finish stamped by `clock`, or with local_us as it is if that is NULL
+static inline size_t dt_frame_finish_at(uint8_t *buf, uint8_t type, uint16_t node_id, uint32_t seq,
+                                        dt_frame_clock_t clock, int64_t local_us, size_t payload_len)
+{
+    uint8_t flags = 0;
+    uint32_t timestamp_us = clock != NULL ? clock(local_us, &flags) : (uint32_t)local_us;
+    return dt_frame_finish_flags(buf, type, flags, node_id, seq, timestamp_us, payload_len);
+}
+
+// Copying version for payloads that already sit somewhere else. Returns 0 if it does not fit
+static inline size_t dt_frame_encode(uint8_t *buf, size_t buf_size, uint8_t type, uint16_t node_id,
+                                     uint32_t seq, uint32_t timestamp_us, const void *payload, size_t payload_len)
+{
+    if (payload_len > DT_FRAME_MAX_PAYLOAD || DT_FRAME_HDR_SIZE + payload_len > buf_size)
+    {
+        return 0;
+    }
+
+    memcpy(dt_frame_payload(buf), payload, payload_len);
+    return dt_frame_finish(buf, type, node_id, seq, timestamp_us, payload_len);
+}
+
+/*
+    Decode the frame at the start of buf
+        - > 0: length of a valid frame, view points into buf
+        - 0:   not all of it has arrived yet (TCP), read more and try again
+        - < 0: not a valid frame. On a stream, drop one byte and try again to resync
+*/
+static inline int dt_frame_decode(const uint8_t *buf, size_t len, dt_frame_view_t *view)
+{
+    if (len < 1)
+    {
+        return 0;
+    }
+    if (buf[0] != DT_FRAME_MAGIC)
+    {
+        return -1;
+    }
+    if (len < (size_t)DT_FRAME_HDR_SIZE)
+    {
+        return 0;
+    }
+
+    const dt_frame_hdr_t *hdr = (const dt_frame_hdr_t *)buf;
+    if (hdr->version != DT_FRAME_VERSION || hdr->len > DT_FRAME_MAX_PAYLOAD)
+    {
+        return -1;
+    }
+
+    size_t frame_len = DT_FRAME_HDR_SIZE + hdr->len;
+    if (len < frame_len)
+    {
+        return 0;
+    }
+    if (hdr->crc != dt_frame_crc(buf, hdr->len))
+    {
+        return -1;
+    }
+
+    view->hdr = hdr;
+    view->payload = buf + DT_FRAME_HDR_SIZE;
+    return (int)frame_len;
+}
+
+/*
+    Batch payloads: records are packed one after another as | type | len | data ... |
+    so one ESP-NOW frame can carry many small samples instead of one
+*/
+static inline bool dt_record_append(uint8_t *payload, size_t payload_size, size_t *used,
+                                    uint8_t type, const void *data, size_t len)
+{
+    if (len > 255 || *used + sizeof(dt_record_hdr_t) + len > payload_size)
+    {
+        return false;
+    }
+
+    dt_record_hdr_t *rec = (dt_record_hdr_t *)(payload + *used);
+    rec->type = type;
+    rec->len = (uint8_t)len;
+    memcpy(payload + *used + sizeof(dt_record_hdr_t), data, len);
+
+    *used += sizeof(dt_record_hdr_t) + len;
+    return true;
+}
+
+// Walk the records of a batch payload. Returns false at the end (or on a record that runs past it)
+static inline bool dt_record_next(const uint8_t *payload, size_t len, size_t *offset,
+                                  const dt_record_hdr_t **rec, const uint8_t **data)
+{
+    if (*offset + sizeof(dt_record_hdr_t) > len)
+    {
+        return false;
+    }
+
+    const dt_record_hdr_t *hdr = (const dt_record_hdr_t *)(payload + *offset);
+    if (*offset + sizeof(dt_record_hdr_t) + hdr->len > len)
+    {
+        return false;
+    }
+
+    *rec = hdr;
+    *data = payload + *offset + sizeof(dt_record_hdr_t);
+    *offset += sizeof(dt_record_hdr_t) + hdr->len;
+    return true;
+}
@@ -0,0 +1,145 @@
+#pragma once
+
+/*
+    Small portability layer so the data path can be built for the ESP32 (ESP-IDF + lwIP)
+    and as a plain POSIX program on Linux for load testing.
+        - ESP_PLATFORM is defined by ESP-IDF builds
+        - On Linux the ESP_LOGx macros go to stdout and sockets come from the OS
+*/
+
+#include <stdint.h>
+#include <stdio.h>
+#include <errno.h>
+#include <fcntl.h>
+
+#ifdef ESP_PLATFORM
+
+#include "sdkconfig.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_cpu.h"
+#include "esp_rom_sys.h"
+
+#include "lwip/inet.h"
+#include "lwip/netdb.h"
+#include "lwip/sockets.h"
+
+static inline void dt_delay_ms(uint32_t ms)
+{
+    vTaskDelay(ms / portTICK_PERIOD_MS);
+}
+
+#define DT_NUM_CORES portNUM_PROCESSORS
+
+// Core the caller is running on right now. A task can move straight after, which is fine for per-core counters
+static inline int dt_core_id(void)
+{
+    return xPortGetCoreID();
+}
+
+// CCOUNT of the core it runs on. Each core has its own, they are not in step, and wrap at 32 bits
+static inline uint32_t dt_cycles(void)
+{
+    return esp_cpu_get_cycle_count();
+}
+
+static inline uint32_t dt_cycles_per_us(void)
+{
+    return esp_rom_get_cpu_ticks_per_us();
+}
+
+#else
+
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sched.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/select.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+
+typedef enum
+{
+    ESP_LOG_NONE,
+    ESP_LOG_ERROR,
+    ESP_LOG_WARN,
+    ESP_LOG_INFO,
+} esp_log_level_t;
+
+inline esp_log_level_t dt_log_level = ESP_LOG_INFO;
+
+// Only the global level, the tag is ignored. A simulation with a hundred slaves does not want every warning
+static inline void esp_log_level_set(const char *, esp_log_level_t level)
+{
+    dt_log_level = level;
+}
+
+#define ESP_LOGE(tag, fmt, ...) do { if (dt_log_level >= ESP_LOG_ERROR) printf("E (%s) " fmt "\n", tag, ##__VA_ARGS__); } while (0)
+#define ESP_LOGW(tag, fmt, ...) do { if (dt_log_level >= ESP_LOG_WARN) printf("W (%s) " fmt "\n", tag, ##__VA_ARGS__); } while (0)
+#define ESP_LOGI(tag, fmt, ...) do { if (dt_log_level >= ESP_LOG_INFO) printf("I (%s) " fmt "\n", tag, ##__VA_ARGS__); } while (0)
+#define ESP_LOGD(tag, fmt, ...) do { if (0) printf("D (%s) " fmt "\n", tag, ##__VA_ARGS__); } while (0)
+
+#ifdef DT_SIM_CLOCK
+// Simulations run on their own clock, moved on by the simulation (see dt_transport_sim.h)
+inline int64_t dt_sim_clock_us;
+
+static inline int64_t esp_timer_get_time(void)
+{
+    return dt_sim_clock_us;
+}
+#else
+// same meaning as on the ESP32, microseconds since boot
+static inline int64_t esp_timer_get_time(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+#endif
+
+static inline void dt_delay_ms(uint32_t ms)
+{
+    struct timespec ts = { (time_t)(ms / 1000), (long)(ms % 1000) * 1000000 };
+    nanosleep(&ts, NULL);
+}
+
+// Per-core slots on Linux are shared out over this many, sched_getcpu() modulo
+#define DT_NUM_CORES 8
+
+static inline int dt_core_id(void)
+{
+    int cpu = sched_getcpu();
+    return cpu < 0 ? 0 : cpu % DT_NUM_CORES;
+}
+
+// No portable cycle counter, nanoseconds do the same job (and are the same on every core)
+static inline uint32_t dt_cycles(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint32_t)((uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec);
+}
+
+static inline uint32_t dt_cycles_per_us(void)
+{
+    return 1000;
+}
+
+static inline char *inet_ntoa_r(struct in_addr addr, char *buf, int buflen)
+{
+    return (char *)inet_ntop(AF_INET, &addr, buf, buflen);
+}
+
+#endif
+
+static inline int dt_set_nonblocking(int sock)
+{
+    int flags = fcntl(sock, F_GETFL, 0);
+    return fcntl(sock, F_SETFL, flags | O_NONBLOCK);
+}
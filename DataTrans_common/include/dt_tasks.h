@@ -0,0 +1,39 @@
+#pragma once
+
+#include <stdlib.h>
+
+#include "esp_log.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+
+/*
+    Which core does what, the same on the slave and the base station
+        - Core 0 (DT_CORE_NET) has what IDF already puts there: the wifi task (prio 23),
+          esp_timer (22) and lwIP's tcpip task (18, pinned by sdkconfig). The TCP task goes
+          with them, so every socket call hands over to tcpip without crossing cores
+        - Core 1 (DT_CORE_RADIO) is the ESP-NOW data path: the base station's rx worker, the
+          slave's sender. It has the core to itself, a burst of frames never waits on TCP
+        - Housekeeping (LEDs, the periodic stats logging, the trace console) is one task at
+          the bottom priority on core 1. It only runs when the data path has nothing to do,
+          and printing to the UART, which takes a good fraction of a second for a page of
+          stats, no longer holds up frames
+        - Between the cores data only goes through the lock-free queues: espnow_ring (wifi
+          task -> rx worker), the forward queue (rx worker -> TCP task) and the slave's event
+          queue (wifi task -> sender). Housekeeping only reads counters, nobody waits on it
+*/
+
+#define DT_CORE_NET 0
+#define DT_CORE_RADIO 1
+
+#define DT_HOUSEKEEPING_PRIO 1          // above idle, below everything else
+#define DT_HOUSEKEEPING_PERIOD_MS 50    // LED and console response time
+
+// Every task the firmware starts goes through here. Stack in bytes, as IDF counts it
+static inline void dt_task_start(TaskFunction_t fn, const char *name, uint32_t stack, UBaseType_t prio, BaseType_t core, TaskHandle_t *handle)
+{
+    if (xTaskCreatePinnedToCore(fn, name, stack, NULL, prio, handle, core) != pdPASS)
+    {
+        ESP_LOGE("dt_tasks", "No memory for task %s (%lu bytes of stack)", name, (unsigned long)stack);
+        abort();
+    }
+}
@@ -0,0 +1,88 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+    The radio link between the slaves and the base station, whatever is underneath
+        - The data path only talks to the radio through a dt_transport_t: send, peers,
+          and two callbacks. Backends fill in the ops table
+            - dt_transport_espnow.h: ESP-NOW on the ESP32, what both firmwares use
+            - dt_transport_sim.h: a simulated multi-node radio on Linux, with loss,
+              latency, jitter and a shared channel of limited bandwidth
+        - on_recv and on_sent run in the backend's context (the wifi task on the ESP32),
+          same rules as the esp_now callbacks: copy out what is needed and return
+        - send returns 0 once the backend has taken the frame. on_sent says later whether
+          it got there (for a broadcast, only that it went out). Results for one peer come
+          back in the order the frames were sent
+        - set_channel moves the radio. Peers are added on a channel and don't follow,
+          whoever moves the radio moves them (delete and add again)
+        - TCP already goes through POSIX sockets on both (lwIP on the ESP32, see
+          dt_port.h), so only the radio needs this
+*/
+
+#define DT_TRANSPORT_MAX_FRAME 250      // ESP_NOW_MAX_DATA_LEN
+
+typedef struct dt_transport dt_transport_t;
+
+typedef void (*dt_transport_recv_cb_t)(dt_transport_t *t, const uint8_t *src_mac, int8_t rssi, const uint8_t *data, size_t len);
+typedef void (*dt_transport_sent_cb_t)(dt_transport_t *t, const uint8_t *dst_mac, bool success);
+
+typedef struct
+{
+    const char *name;
+
+    // 0 if taken, -1 if not (unknown peer, too long, backend queue full)
+    int (*send)(dt_transport_t *t, const uint8_t *dst_mac, const uint8_t *data, size_t len);
+
+    // Unicast only goes to peers that were added, broadcast needs DT_BROADCAST_MAC added too
+    int (*add_peer)(dt_transport_t *t, const uint8_t *mac, uint8_t channel);
+    int (*del_peer)(dt_transport_t *t, const uint8_t *mac);
+
+    void (*own_mac)(dt_transport_t *t, uint8_t *mac);
+
+    // 0 if the radio is on it now. Can fail on the ESP32 while the STA is scanning or connecting
+    int (*set_channel)(dt_transport_t *t, uint8_t channel);
+} dt_transport_ops_t;
+
+struct dt_transport
+{
+    const dt_transport_ops_t *ops;
+    void *impl;                         // backend state
+
+    dt_transport_recv_cb_t on_recv;
+    dt_transport_sent_cb_t on_sent;
+    void *user;                         // for the callbacks
+};
+
+static inline void dt_transport_set_callbacks(dt_transport_t *t, dt_transport_recv_cb_t on_recv, dt_transport_sent_cb_t on_sent, void *user)
+{
+    t->on_recv = on_recv;
+    t->on_sent = on_sent;
+    t->user = user;
+}
+
+static inline int dt_transport_send(dt_transport_t *t, const uint8_t *dst_mac, const uint8_t *data, size_t len)
+{
+    return t->ops->send(t, dst_mac, data, len);
+}
+
+static inline int dt_transport_add_peer(dt_transport_t *t, const uint8_t *mac, uint8_t channel)
+{
+    return t->ops->add_peer(t, mac, channel);
+}
+
+static inline int dt_transport_del_peer(dt_transport_t *t, const uint8_t *mac)
+{
+    return t->ops->del_peer(t, mac);
+}
+
+static inline void dt_transport_own_mac(dt_transport_t *t, uint8_t *mac)
+{
+    t->ops->own_mac(t, mac);
+}
+
+static inline int dt_transport_set_channel(dt_transport_t *t, uint8_t channel)
+{
+    return t->ops->set_channel(t, channel);
+}
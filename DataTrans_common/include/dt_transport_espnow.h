@@ -0,0 +1,99 @@
+#pragma once
+
+#include <string.h>
+
+#include "esp_idf_version.h"
+#include "esp_mac.h"
+#include "esp_now.h"
+#include "esp_wifi.h"
+
+#include "dt_transport.h"
+
+/*
+    dt_transport_t over ESP-NOW
+        - ESP-NOW is one per chip and its callbacks carry no context, so there is just the
+          one transport: dt_transport_espnow_init() starts esp_now and hands it back
+        - Wifi has to be started first. Peers go on the station interface, unencrypted
+        - The callbacks run on the wifi task, like the esp_now ones they wrap
+*/
+
+inline dt_transport_t dt_espnow_transport;
+
+static inline void dt_espnow_recv_cb(const esp_now_recv_info_t *recv_info, const uint8_t *data, int len)
+{
+    dt_transport_t *t = &dt_espnow_transport;
+    if (t->on_recv != NULL && len > 0)
+    {
+        t->on_recv(t, recv_info->src_addr, recv_info->rx_ctrl->rssi, data, (size_t)len);
+    }
+}
+
+// 5.5 passes the whole tx info instead of just the destination
+#if ESP_IDF_VERSION >= ESP_IDF_VERSION_VAL(5, 5, 0)
+static inline void dt_espnow_sent_cb(const esp_now_send_info_t *tx_info, esp_now_send_status_t status)
+{
+    const uint8_t *mac_addr = tx_info->des_addr;
+#else
+static inline void dt_espnow_sent_cb(const uint8_t *mac_addr, esp_now_send_status_t status)
+{
+#endif
+    dt_transport_t *t = &dt_espnow_transport;
+    if (t->on_sent != NULL)
+    {
+        t->on_sent(t, mac_addr, status == ESP_NOW_SEND_SUCCESS);
+    }
+}
+
+static inline int dt_espnow_send(dt_transport_t *t, const uint8_t *dst_mac, const uint8_t *data, size_t len)
+{
+    return esp_now_send(dst_mac, data, len) == ESP_OK ? 0 : -1;
+}
+
+static inline int dt_espnow_add_peer(dt_transport_t *t, const uint8_t *mac, uint8_t channel)
+{
+    esp_now_peer_info_t peer = {};
+    memcpy(peer.peer_addr, mac, 6);
+    peer.channel = channel;
+    peer.ifidx = WIFI_IF_STA;
+    peer.encrypt = false;
+
+    // already there is as good as added
+    esp_err_t err = esp_now_add_peer(&peer);
+    return err == ESP_OK || err == ESP_ERR_ESPNOW_EXIST ? 0 : -1;
+}
+
+static inline int dt_espnow_del_peer(dt_transport_t *t, const uint8_t *mac)
+{
+    return esp_now_del_peer(mac) == ESP_OK ? 0 : -1;
+}
+
+static inline void dt_espnow_own_mac(dt_transport_t *t, uint8_t *mac)
+{
+    esp_read_mac(mac, ESP_MAC_WIFI_STA);
+}
+
+static inline int dt_espnow_set_channel(dt_transport_t *t, uint8_t channel)
+{
+    return esp_wifi_set_channel(channel, WIFI_SECOND_CHAN_NONE) == ESP_OK ? 0 : -1;
+}
+
+static inline dt_transport_t *dt_transport_espnow_init(void)
+{
+    static const dt_transport_ops_t ops = {
+        "espnow",
+        dt_espnow_send,
+        dt_espnow_add_peer,
+        dt_espnow_del_peer,
+        dt_espnow_own_mac,
+        dt_espnow_set_channel,
+    };
+
+    dt_transport_t *t = &dt_espnow_transport;
+    t->ops = &ops;
+    t->impl = NULL;
+
+    ESP_ERROR_CHECK(esp_now_init());
+    esp_now_register_recv_cb(dt_espnow_recv_cb);
+    esp_now_register_send_cb(dt_espnow_sent_cb);
+    return t;
+}
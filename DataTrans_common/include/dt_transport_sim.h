@@ -0,0 +1,390 @@
+#pragma once
+
+#include <stdint.h>
+#include <string.h>
+#include <queue>
+#include <vector>
+
+#include "dt_port.h"
+#include "dt_frame.h"
+#include "dt_transport.h"
+
+#ifndef DT_SIM_CLOCK
+#error "dt_transport_sim.h moves the clock itself, build with -DDT_SIM_CLOCK"
+#endif
+
+/*
+    Simulated ESP-NOW for Linux: any number of nodes, each one a dt_transport_t
+        - Discrete event on its own clock: dt_sim_radio_run_until() moves dt_sim_clock_us
+          (what esp_timer_get_time() returns with DT_SIM_CLOCK) from event to event, so a
+          minute of 100 nodes takes well under a second and is the same every run for one seed
+        - One shared channel: a frame is on the air for its airtime and frames go out one after
+          another in the order they were sent. That is perfect carrier sense, nothing collides
+          (tdma_sim.cpp is the one that looks at collisions)
+        - Every node starts on DT_SIM_CHANNEL and set_channel moves it. Only nodes on the
+          sender's channel when the frame comes off the air get a copy, a unicast to a node on
+          another channel is on_sent(false). The channels still share the one air, the
+          scenarios that move nodes around have little traffic for it to matter
+        - Every receiver loses a frame on its own with probability `loss`. A unicast that is
+          lost comes back as on_sent(false), like ESP-NOW once its retries are used up.
+          A broadcast is always on_sent(true)
+        - The frame arrives latency_us + up to jitter_us after it left the air, never ahead of
+          an earlier one to the same node (ESP-NOW does not reorder)
+        - DT_SIM_TX_QUEUE frames per node can wait for the channel, after that send fails,
+          like esp_now_send running out of buffers
+        - Callbacks run inside dt_sim_radio_run_until() with the clock at the event's time.
+          Sending from them is fine
+*/
+
+#define DT_SIM_TX_QUEUE 8
+#define DT_SIM_MAX_PEERS 20         // ESP_NOW_MAX_TOTAL_PEER_NUM
+#define DT_SIM_MAC_OVERHEAD 43      // 802.11 vendor action framing, as in espnow_airtime_us
+#define DT_SIM_CHANNEL 1
+
+typedef struct
+{
+    double loss;                    // 0..1, per frame per receiver
+    uint32_t latency_us;            // air to on_recv, the receiving driver and wifi task
+    uint32_t jitter_us;             // up to this much more, uniform
+    uint32_t bitrate_kbps;          // 1000 is the ESP-NOW default rate
+    uint32_t overhead_us;           // per frame on the air regardless of size: preamble, SIFS + ACK
+    uint32_t seed;
+} dt_sim_config_t;
+
+typedef struct
+{
+    uint32_t sent;                  // frames that went on the air
+    uint32_t send_errors;           // send refused: queue full, unknown peer, too long
+    uint32_t delivered;             // frame copies handed to an on_recv
+    uint32_t lost;
+    uint32_t off_channel;           // unicasts to a node that was on another channel
+    uint64_t airtime_us;
+} dt_sim_stats_t;
+
+typedef struct dt_sim_radio dt_sim_radio_t;
+
+typedef struct
+{
+    dt_transport_t transport;
+    dt_sim_radio_t *radio;
+    int index;
+    uint8_t mac[6];
+    uint8_t channel;
+    uint8_t peers[DT_SIM_MAX_PEERS][6];
+    int peer_count;
+    int queued;                     // frames waiting for or on the air
+    int64_t last_rx_us;             // keeps arrivals in order
+} dt_sim_node_t;
+
+typedef enum
+{
+    DT_SIM_EVT_TX_END,              // frame off the air: on_sent, and the copies start travelling
+    DT_SIM_EVT_RX,                  // one copy reaches one node
+} dt_sim_event_kind_t;
+
+typedef struct
+{
+    int64_t at_us;
+    uint64_t order;                 // events at the same time go in the order they were made
+    uint8_t kind;
+    uint8_t channel;                // the sender's when it sent
+    int src;
+    int dst;                        // DT_SIM_EVT_RX: receiving node. TX_END: -1 for broadcast
+    uint8_t dst_mac[6];
+    uint16_t len;
+    uint8_t data[DT_TRANSPORT_MAX_FRAME];
+} dt_sim_event_t;
+
+struct dt_sim_event_later
+{
+    bool operator()(const dt_sim_event_t &a, const dt_sim_event_t &b) const
+    {
+        return a.at_us != b.at_us ? a.at_us > b.at_us : a.order > b.order;
+    }
+};
+
+struct dt_sim_radio
+{
+    dt_sim_config_t config;
+    std::vector<dt_sim_node_t> nodes;
+    std::priority_queue<dt_sim_event_t, std::vector<dt_sim_event_t>, dt_sim_event_later> events;
+    uint64_t next_order;
+    uint32_t rng;
+    int64_t channel_free_us;        // when the frame on the air now finishes
+    dt_sim_stats_t stats;
+};
+
+static inline dt_sim_config_t dt_sim_default_config(void)
+{
+    dt_sim_config_t config;
+    config.loss = 0.0;
+    config.latency_us = 100;
+    config.jitter_us = 50;
+    config.bitrate_kbps = 1000;
+    config.overhead_us = 192 + 10 + 192 + 14 * 8;   // same numbers as espnow_airtime_us
+    config.seed = 1;
+    return config;
+}
+
+// Node i's MAC: locally administered, "SIM", then i
+static inline void dt_sim_node_mac(int i, uint8_t *mac)
+{
+    const uint8_t base[6] = {0x02, 'S', 'I', 'M', (uint8_t)(i >> 8), (uint8_t)i};
+    memcpy(mac, base, 6);
+}
+
+// xorshift32, the sim's own so runs do not depend on anyone else calling rand()
+static inline uint32_t dt_sim_random(dt_sim_radio_t *radio)
+{
+    uint32_t x = radio->rng;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    radio->rng = x;
+    return x;
+}
+
+static inline double dt_sim_random_unit(dt_sim_radio_t *radio)
+{
+    return (dt_sim_random(radio) >> 8) / 16777216.0;
+}
+
+static inline uint32_t dt_sim_airtime_us(const dt_sim_config_t *config, size_t len)
+{
+    return config->overhead_us + (uint32_t)((DT_SIM_MAC_OVERHEAD + len) * 8 * 1000 / config->bitrate_kbps);
+}
+
+static inline int dt_sim_find_node(dt_sim_radio_t *radio, const uint8_t *mac)
+{
+    // MACs are made by dt_sim_node_mac, so the index is in them
+    uint8_t expect[6];
+    int i = (mac[4] << 8) | mac[5];
+    dt_sim_node_mac(i, expect);
+    return i < (int)radio->nodes.size() && memcmp(mac, expect, 6) == 0 ? i : -1;
+}
+
+static inline int dt_sim_find_peer(const dt_sim_node_t *node, const uint8_t *mac)
+{
+    for (int i = 0; i < node->peer_count; i++)
+    {
+        if (memcmp(node->peers[i], mac, 6) == 0)
+        {
+            return i;
+        }
+    }
+    return -1;
+}
+
+static inline void dt_sim_push(dt_sim_radio_t *radio, dt_sim_event_t *ev)
+{
+    ev->order = radio->next_order++;
+    radio->events.push(*ev);
+}
+
+static inline int dt_sim_send(dt_transport_t *t, const uint8_t *dst_mac, const uint8_t *data, size_t len)
+{
+    dt_sim_node_t *node = (dt_sim_node_t *)t->impl;
+    dt_sim_radio_t *radio = node->radio;
+
+    if (len == 0 || len > DT_TRANSPORT_MAX_FRAME || node->queued >= DT_SIM_TX_QUEUE || dt_sim_find_peer(node, dst_mac) < 0)
+    {
+        radio->stats.send_errors++;
+        return -1;
+    }
+
+    int64_t now = dt_sim_clock_us;
+    int64_t start = radio->channel_free_us > now ? radio->channel_free_us : now;
+    uint32_t airtime = dt_sim_airtime_us(&radio->config, len);
+    radio->channel_free_us = start + airtime;
+    radio->stats.sent++;
+    radio->stats.airtime_us += airtime;
+    node->queued++;
+
+    dt_sim_event_t ev;
+    ev.at_us = start + airtime;
+    ev.kind = DT_SIM_EVT_TX_END;
+    ev.channel = node->channel;
+    ev.src = node->index;
+    ev.dst = memcmp(dst_mac, DT_BROADCAST_MAC, 6) == 0 ? -1 : dt_sim_find_node(radio, dst_mac);
+    memcpy(ev.dst_mac, dst_mac, 6);
+    ev.len = (uint16_t)len;
+    memcpy(ev.data, data, len);
+    dt_sim_push(radio, &ev);
+    return 0;
+}
+
+static inline int dt_sim_add_peer(dt_transport_t *t, const uint8_t *mac, uint8_t)
+{
+    dt_sim_node_t *node = (dt_sim_node_t *)t->impl;
+    if (dt_sim_find_peer(node, mac) >= 0)
+    {
+        return 0;
+    }
+    if (node->peer_count == DT_SIM_MAX_PEERS)
+    {
+        return -1;
+    }
+    memcpy(node->peers[node->peer_count++], mac, 6);
+    return 0;
+}
+
+static inline int dt_sim_del_peer(dt_transport_t *t, const uint8_t *mac)
+{
+    dt_sim_node_t *node = (dt_sim_node_t *)t->impl;
+    int i = dt_sim_find_peer(node, mac);
+    if (i < 0)
+    {
+        return -1;
+    }
+    node->peer_count--;
+    memcpy(node->peers[i], node->peers[node->peer_count], 6);
+    return 0;
+}
+
+static inline void dt_sim_own_mac(dt_transport_t *t, uint8_t *mac)
+{
+    memcpy(mac, ((dt_sim_node_t *)t->impl)->mac, 6);
+}
+
+static inline int dt_sim_set_channel(dt_transport_t *t, uint8_t channel)
+{
+    ((dt_sim_node_t *)t->impl)->channel = channel;
+    return 0;
+}
+
+static inline void dt_sim_radio_init(dt_sim_radio_t *radio, int node_count, const dt_sim_config_t *config)
+{
+    static const dt_transport_ops_t ops = {
+        "sim",
+        dt_sim_send,
+        dt_sim_add_peer,
+        dt_sim_del_peer,
+        dt_sim_own_mac,
+        dt_sim_set_channel,
+    };
+
+    radio->config = *config;
+    radio->nodes.assign(node_count, dt_sim_node_t());
+    radio->events = decltype(radio->events)();
+    radio->next_order = 0;
+    radio->rng = config->seed != 0 ? config->seed : 1;
+    radio->channel_free_us = 0;
+    memset(&radio->stats, 0, sizeof(radio->stats));
+
+    // the nodes vector never grows after this, so the impl pointers stay good
+    for (int i = 0; i < node_count; i++)
+    {
+        dt_sim_node_t *node = &radio->nodes[i];
+        memset(node, 0, sizeof(*node));
+        node->transport.ops = &ops;
+        node->transport.impl = node;
+        node->radio = radio;
+        node->index = i;
+        node->channel = DT_SIM_CHANNEL;
+        dt_sim_node_mac(i, node->mac);
+    }
+    dt_sim_clock_us = 0;
+}
+
+static inline dt_transport_t *dt_sim_radio_node(dt_sim_radio_t *radio, int i)
+{
+    return &radio->nodes[i].transport;
+}
+
+// One copy of the frame on its way to node `to`, unless it is lost
+static inline bool dt_sim_deliver(dt_sim_radio_t *radio, const dt_sim_event_t *tx, int to)
+{
+    if (dt_sim_random_unit(radio) < radio->config.loss)
+    {
+        radio->stats.lost++;
+        return false;
+    }
+
+    dt_sim_node_t *node = &radio->nodes[to];
+    int64_t at = tx->at_us + radio->config.latency_us;
+    if (radio->config.jitter_us > 0)
+    {
+        at += dt_sim_random(radio) % (radio->config.jitter_us + 1);
+    }
+    if (at <= node->last_rx_us)
+    {
+        at = node->last_rx_us + 1;
+    }
+    node->last_rx_us = at;
+
+    dt_sim_event_t ev = *tx;
+    ev.at_us = at;
+    ev.kind = DT_SIM_EVT_RX;
+    ev.dst = to;
+    dt_sim_push(radio, &ev);
+    return true;
+}
+
+static inline void dt_sim_dispatch(dt_sim_radio_t *radio, const dt_sim_event_t *ev)
+{
+    if (ev->kind == DT_SIM_EVT_RX)
+    {
+        radio->stats.delivered++;
+        dt_transport_t *t = &radio->nodes[ev->dst].transport;
+        if (t->on_recv != NULL)
+        {
+            int8_t rssi = -50 - (int8_t)(dt_sim_random(radio) % 20);
+            t->on_recv(t, radio->nodes[ev->src].mac, rssi, ev->data, ev->len);
+        }
+        return;
+    }
+
+    bool success = true;
+    if (ev->dst < 0 && memcmp(ev->dst_mac, DT_BROADCAST_MAC, 6) == 0)
+    {
+        for (int i = 0; i < (int)radio->nodes.size(); i++)
+        {
+            if (i != ev->src && radio->nodes[i].channel == ev->channel)
+            {
+                dt_sim_deliver(radio, ev, i);
+            }
+        }
+    }
+    else if (ev->dst >= 0 && radio->nodes[ev->dst].channel != ev->channel)
+    {
+        radio->stats.off_channel++;
+        success = false;
+    }
+    else
+    {
+        // nobody with that MAC, nothing ACKs it
+        success = ev->dst >= 0 && dt_sim_deliver(radio, ev, ev->dst);
+    }
+
+    dt_sim_node_t *node = &radio->nodes[ev->src];
+    node->queued--;
+    if (node->transport.on_sent != NULL)
+    {
+        node->transport.on_sent(&node->transport, ev->dst_mac, success);
+    }
+}
+
+// When the next event is, INT64_MAX if there are none
+static inline int64_t dt_sim_radio_next_event(const dt_sim_radio_t *radio)
+{
+    return radio->events.empty() ? INT64_MAX : radio->events.top().at_us;
+}
+
+// Run every event up to and including until_us, then leave the clock there
+static inline void dt_sim_radio_run_until(dt_sim_radio_t *radio, int64_t until_us)
+{
+    while (!radio->events.empty() && radio->events.top().at_us <= until_us)
+    {
+        dt_sim_event_t ev = radio->events.top();
+        radio->events.pop();
+        if (ev.at_us > dt_sim_clock_us)
+        {
+            dt_sim_clock_us = ev.at_us;
+        }
+        dt_sim_dispatch(radio, &ev);
+    }
+    if (until_us > dt_sim_clock_us)
+    {
+        dt_sim_clock_us = until_us;
+    }
+}
@@ -0,0 +1,87 @@
+#pragma once
+
+#include <stdint.h>
+#include <atomic>
+
+#include "driver/gpio.h"
+#include "esp_timer.h"
+
+/*
+    Non-blocking activity LED
+        - led_pulse() only sets the pin and arms a one-shot esp_timer, it never waits
+        - The timer turns the LED off after on_ms, then keeps it dark for off_ms so the
+          blink can be seen
+        - Pulses that come in while a blink is already going are merged into it, so a
+          burst of frames shows as one blink instead of queueing up seconds of blinking
+*/
+
+typedef enum
+{
+    LED_IDLE,
+    LED_ON,
+    LED_OFF_HOLD,
+} led_phase_t;
+
+typedef struct
+{
+    gpio_num_t pin;
+    uint32_t on_us;
+    uint32_t off_us;
+    esp_timer_handle_t timer;
+
+    std::atomic<uint8_t> phase;
+    std::atomic<uint32_t> pulses;
+    std::atomic<uint32_t> merged;   // pulses folded into a blink already in progress
+} led_indicator_t;
+
+// esp_timer task: step ON -> OFF_HOLD -> IDLE
+static void led_indicator_timer_cb(void *arg)
+{
+    led_indicator_t *led = (led_indicator_t *)arg;
+
+    if (led->phase.load() == LED_ON)
+    {
+        gpio_set_level(led->pin, 0);
+        led->phase.store(LED_OFF_HOLD);
+        esp_timer_start_once(led->timer, led->off_us);
+    }
+    else
+    {
+        led->phase.store(LED_IDLE);
+    }
+}
+
+static inline void led_indicator_init(led_indicator_t *led, gpio_num_t pin, uint32_t on_ms, uint32_t off_ms)
+{
+    led->pin = pin;
+    led->on_us = on_ms * 1000;
+    led->off_us = off_ms * 1000;
+    led->phase.store(LED_IDLE);
+    led->pulses.store(0);
+    led->merged.store(0);
+
+    esp_timer_create_args_t args = {};
+    args.callback = led_indicator_timer_cb;
+    args.arg = led;
+    args.dispatch_method = ESP_TIMER_TASK;
+    args.name = "led";
+    ESP_ERROR_CHECK(esp_timer_create(&args, &led->timer));
+
+    gpio_set_level(pin, 0);
+}
+
+// Safe to call from any task, returns straight away
+static inline void led_pulse(led_indicator_t *led)
+{
+    led->pulses.fetch_add(1, std::memory_order_relaxed);
+
+    uint8_t idle = LED_IDLE;
+    if (!led->phase.compare_exchange_strong(idle, LED_ON))
+    {
+        led->merged.fetch_add(1, std::memory_order_relaxed);
+        return;
+    }
+
+    gpio_set_level(led->pin, 1);
+    esp_timer_start_once(led->timer, led->on_us);
+}
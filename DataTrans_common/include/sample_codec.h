@@ -0,0 +1,385 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "dt_frame.h"
+
+/*
+    Compact encoding for sensor samples, shared by the slave (encode) and the base station (decode)
+        - DT_TYPE_SENSOR_PACKED is one channel's samples in order:
+              | channel | first value | value[1] - value[0] | value[2] - value[1] | ...
+          every field a varint, the values zig-zagged first so small negative steps stay
+          small too. A reading that moves by less than 64 between samples costs 1 byte
+          instead of the 8 a DT_TYPE_SENSOR record takes
+        - It streams: sample_pack_add appends one delta at a time, so the slave's batcher
+          can keep growing the record already in the frame (espnow_batch_add_sample). The
+          count is whatever fits in the record's length
+        - Every record starts from an absolute value, so a lost frame never breaks the
+          next one
+        - sample_lz is a small LZ77 pass (LZ4-like tokens, no entropy coding) for bigger
+          messages such as the history dump, where the same pattern of steps repeats. A
+          250 byte frame is too short for it to pay off
+*/
+
+#define SAMPLE_VARINT_MAX 5             // bytes of a uint32
+#define SAMPLE_PACK_HEADER_MAX (2 * SAMPLE_VARINT_MAX)
+#define SAMPLE_LZ_MIN_MATCH 4
+#define SAMPLE_LZ_HASH_BITS 9
+#define SAMPLE_LZ_MAX_INPUT 0xFFFF      // positions and offsets are 16 bit
+#define SAMPLE_LZ_MAX_RAW 4096          // biggest decompressed message the base station takes
+
+static inline uint32_t sample_zigzag(int32_t v)
+{
+    return ((uint32_t)v << 1) ^ (uint32_t)(v >> 31);
+}
+
+static inline int32_t sample_unzigzag(uint32_t v)
+{
+    return (int32_t)(v >> 1) ^ -(int32_t)(v & 1);
+}
+
+// Bytes written, out needs SAMPLE_VARINT_MAX
+static inline size_t sample_varint_put(uint8_t *out, uint32_t v)
+{
+    size_t n = 0;
+    while (v >= 0x80)
+    {
+        out[n++] = (uint8_t)(v | 0x80);
+        v >>= 7;
+    }
+    out[n++] = (uint8_t)v;
+    return n;
+}
+
+// false if it runs past len or is longer than a uint32
+static inline bool sample_varint_get(const uint8_t *data, size_t len, size_t *offset, uint32_t *v)
+{
+    uint32_t result = 0;
+    for (int shift = 0; shift < 7 * SAMPLE_VARINT_MAX; shift += 7)
+    {
+        if (*offset >= len)
+        {
+            return false;
+        }
+        uint8_t b = data[(*offset)++];
+        result |= (uint32_t)(b & 0x7F) << shift;
+        if ((b & 0x80) == 0)
+        {
+            *v = result;
+            return true;
+        }
+    }
+    return false;
+}
+
+/*
+    Encoder for one DT_TYPE_SENSOR_PACKED body. Writes straight into out, len is what is
+    used so far. Deltas are taken in uint32 so a jump across the whole int32 range wraps
+    the same way on both ends
+*/
+typedef struct
+{
+    uint8_t *out;
+    size_t cap;
+    size_t len;
+    uint16_t channel;
+    int32_t last;
+    uint32_t count;
+} sample_pack_t;
+
+// First sample, written in full. false if out is too small
+static inline bool sample_pack_begin(sample_pack_t *p, uint8_t *out, size_t cap, uint16_t channel, int32_t value)
+{
+    uint8_t tmp[SAMPLE_PACK_HEADER_MAX];
+    size_t n = sample_varint_put(tmp, channel);
+    n += sample_varint_put(tmp + n, sample_zigzag(value));
+    if (n > cap)
+    {
+        return false;
+    }
+
+    memcpy(out, tmp, n);
+    p->out = out;
+    p->cap = cap;
+    p->len = n;
+    p->channel = channel;
+    p->last = value;
+    p->count = 1;
+    return true;
+}
+
+// Bytes the next sample would take
+static inline size_t sample_pack_cost(const sample_pack_t *p, int32_t value)
+{
+    uint32_t z = sample_zigzag((int32_t)((uint32_t)value - (uint32_t)p->last));
+    size_t n = 1;
+    while (z >= 0x80)
+    {
+        z >>= 7;
+        n++;
+    }
+    return n;
+}
+
+// false (and nothing written) if it does not fit
+static inline bool sample_pack_add(sample_pack_t *p, int32_t value)
+{
+    if (p->len + sample_pack_cost(p, value) > p->cap)
+    {
+        return false;
+    }
+    p->len += sample_varint_put(p->out + p->len, sample_zigzag((int32_t)((uint32_t)value - (uint32_t)p->last)));
+    p->last = value;
+    p->count++;
+    return true;
+}
+
+// Decoder, one sample per call to sample_unpack_next
+typedef struct
+{
+    const uint8_t *data;
+    size_t len;
+    size_t offset;
+    uint16_t channel;
+    int32_t last;
+    bool started;
+} sample_unpack_t;
+
+static inline void sample_unpack_init(sample_unpack_t *u, const uint8_t *data, size_t len)
+{
+    u->data = data;
+    u->len = len;
+    u->offset = 0;
+    u->channel = 0;
+    u->last = 0;
+    u->started = false;
+}
+
+// false at the end, or on a body that does not decode (check sample_unpack_ok)
+static inline bool sample_unpack_next(sample_unpack_t *u, dt_sample_t *sample)
+{
+    uint32_t v;
+    if (!u->started)
+    {
+        uint32_t channel;
+        if (!sample_varint_get(u->data, u->len, &u->offset, &channel) ||
+            !sample_varint_get(u->data, u->len, &u->offset, &v) || channel > 0xFFFF)
+        {
+            return false;
+        }
+        u->channel = (uint16_t)channel;
+        u->last = sample_unzigzag(v);
+        u->started = true;
+    }
+    else
+    {
+        if (u->offset >= u->len || !sample_varint_get(u->data, u->len, &u->offset, &v))
+        {
+            return false;
+        }
+        u->last = (int32_t)((uint32_t)u->last + (uint32_t)sample_unzigzag(v));
+    }
+
+    sample->channel = u->channel;
+    sample->value = u->last;
+    return true;
+}
+
+// After sample_unpack_next returned false: was that the clean end of the body
+static inline bool sample_unpack_ok(const sample_unpack_t *u)
+{
+    return u->started && u->offset == u->len;
+}
+
+/*
+    LZ pass
+        - Sequences of | token | literal length ext | literals | offset (2, LE) | match length ext |
+          token high nibble = literal count, low nibble = match length - SAMPLE_LZ_MIN_MATCH,
+          15 in either means more follows in 255 steps, like LZ4
+        - The last sequence is literals only (possibly none) and ends the input
+        - Greedy, one hash probe per position: a few hundred bytes of state, fast enough
+          for a dump every minute on the slave
+*/
+typedef struct
+{
+    uint16_t table[1 << SAMPLE_LZ_HASH_BITS];   // last position + 1 of each 4 byte hash, 0 = none
+} sample_lz_state_t;
+
+static inline uint32_t sample_lz_hash(const uint8_t *p)
+{
+    uint32_t v;
+    memcpy(&v, p, 4);
+    return (v * 2654435761u) >> (32 - SAMPLE_LZ_HASH_BITS);
+}
+
+static inline bool sample_lz_put_len(uint8_t *out, size_t cap, size_t *op, size_t len)
+{
+    while (len >= 255)
+    {
+        if (*op >= cap)
+        {
+            return false;
+        }
+        out[(*op)++] = 255;
+        len -= 255;
+    }
+    if (*op >= cap)
+    {
+        return false;
+    }
+    out[(*op)++] = (uint8_t)len;
+    return true;
+}
+
+static inline bool sample_lz_put_sequence(uint8_t *out, size_t cap, size_t *op, const uint8_t *lit, size_t lit_len,
+                                          size_t offset, size_t match_len)
+{
+    size_t m = match_len > 0 ? match_len - SAMPLE_LZ_MIN_MATCH : 0;
+    if (*op >= cap)
+    {
+        return false;
+    }
+    out[(*op)++] = (uint8_t)(((lit_len < 15 ? lit_len : 15) << 4) | (m < 15 ? m : 15));
+    if (lit_len >= 15 && !sample_lz_put_len(out, cap, op, lit_len - 15))
+    {
+        return false;
+    }
+    if (*op + lit_len > cap)
+    {
+        return false;
+    }
+    memcpy(out + *op, lit, lit_len);
+    *op += lit_len;
+
+    if (match_len == 0)
+    {
+        return true;
+    }
+    if (*op + 2 > cap)
+    {
+        return false;
+    }
+    out[(*op)++] = (uint8_t)offset;
+    out[(*op)++] = (uint8_t)(offset >> 8);
+    return m < 15 || sample_lz_put_len(out, cap, op, m - 15);
+}
+
+/*
+    Compressed length, or 0 if it did not fit in cap (pass in_len - 1 to only take a
+    result that is smaller) or the input is too long
+*/
+static inline size_t sample_lz_compress(sample_lz_state_t *state, const uint8_t *in, size_t in_len, uint8_t *out, size_t cap)
+{
+    if (in_len > SAMPLE_LZ_MAX_INPUT)
+    {
+        return 0;
+    }
+    memset(state->table, 0, sizeof(state->table));
+
+    size_t op = 0;
+    size_t anchor = 0;
+    size_t ip = 0;
+    while (ip + SAMPLE_LZ_MIN_MATCH <= in_len)
+    {
+        uint32_t h = sample_lz_hash(in + ip);
+        size_t candidate = state->table[h];
+        state->table[h] = (uint16_t)(ip + 1);
+
+        if (candidate == 0 || memcmp(in + candidate - 1, in + ip, SAMPLE_LZ_MIN_MATCH) != 0)
+        {
+            ip++;
+            continue;
+        }
+
+        size_t ref = candidate - 1;
+        size_t len = SAMPLE_LZ_MIN_MATCH;
+        while (ip + len < in_len && in[ref + len] == in[ip + len])
+        {
+            len++;
+        }
+
+        if (!sample_lz_put_sequence(out, cap, &op, in + anchor, ip - anchor, ip - ref, len))
+        {
+            return 0;
+        }
+        ip += len;
+        anchor = ip;
+    }
+
+    if (!sample_lz_put_sequence(out, cap, &op, in + anchor, in_len - anchor, 0, 0))
+    {
+        return 0;
+    }
+    return op;
+}
+
+static inline bool sample_lz_get_len(const uint8_t *in, size_t in_len, size_t *ip, size_t *len)
+{
+    uint8_t b;
+    do
+    {
+        if (*ip >= in_len)
+        {
+            return false;
+        }
+        b = in[(*ip)++];
+        *len += b;
+    } while (b == 255);
+    return true;
+}
+
+// Decompressed length, -1 if the input is malformed or out is too small
+static inline int sample_lz_decompress(const uint8_t *in, size_t in_len, uint8_t *out, size_t cap)
+{
+    size_t ip = 0;
+    size_t op = 0;
+    while (ip < in_len)
+    {
+        uint8_t token = in[ip++];
+
+        size_t lit_len = token >> 4;
+        if (lit_len == 15 && !sample_lz_get_len(in, in_len, &ip, &lit_len))
+        {
+            return -1;
+        }
+        if (ip + lit_len > in_len || op + lit_len > cap)
+        {
+            return -1;
+        }
+        memcpy(out + op, in + ip, lit_len);
+        ip += lit_len;
+        op += lit_len;
+
+        // the last sequence has no match
+        if (ip == in_len)
+        {
+            break;
+        }
+
+        if (ip + 2 > in_len)
+        {
+            return -1;
+        }
+        size_t offset = in[ip] | (in[ip + 1] << 8);
+        ip += 2;
+        size_t match_len = token & 15;
+        if (match_len == 15 && !sample_lz_get_len(in, in_len, &ip, &match_len))
+        {
+            return -1;
+        }
+        match_len += SAMPLE_LZ_MIN_MATCH;
+        if (offset == 0 || offset > op || op + match_len > cap)
+        {
+            return -1;
+        }
+
+        // byte by byte, the match can overlap what it is writing
+        for (size_t i = 0; i < match_len; i++, op++)
+        {
+            out[op] = out[op - offset];
+        }
+    }
+    return (int)op;
+}
@@ -0,0 +1,126 @@
+#pragma once
+
+#include <stdint.h>
+#include <string.h>
+#include <atomic>
+
+#include "dt_frame.h"
+#include "block_pool.h"
+
+/*
+    Reference counted frame buffers out of a block_pool_t
+        - A received frame is copied into a buffer once, in the receive callback. Every
+          stage after that (worker, forwarding, each subscriber's send queue) holds a
+          reference to the same buffer instead of its own copy
+        - The buffer goes back to its pool when the last reference is dropped, from
+          whichever task that happens to be
+        - shared_buf_queue_t hands buffers from one task to another, single producer /
+          single consumer like espnow_ring_t
+*/
+
+#define SHARED_BUF_SIZE DT_FRAME_MAX_SIZE
+#define SHARED_BUF_QUEUE_LEN 16         // Must be a power of 2
+
+typedef struct
+{
+    std::atomic<uint16_t> refs;
+    uint16_t len;
+    int64_t rx_us;                      // when the radio got it, for end to end latency
+    uint8_t mac[6];                     // sender
+    int8_t rssi;
+    block_pool_t *pool;
+    uint8_t data[SHARED_BUF_SIZE];
+} shared_buf_t;
+
+typedef struct
+{
+    shared_buf_t *slots[SHARED_BUF_QUEUE_LEN];
+    std::atomic<uint32_t> head;
+    std::atomic<uint32_t> tail;
+} shared_buf_queue_t;
+
+static_assert((SHARED_BUF_QUEUE_LEN & (SHARED_BUF_QUEUE_LEN - 1)) == 0, "SHARED_BUF_QUEUE_LEN must be a power of 2");
+
+// bufs and next are the owner's static arrays, count long
+static inline void shared_buf_pool_init(block_pool_t *pool, shared_buf_t *bufs, std::atomic<uint16_t> *next, uint16_t count)
+{
+    block_pool_init(pool, bufs, sizeof(shared_buf_t), next, count);
+}
+
+/*
+    Copy a frame into a free buffer, the caller holds the one reference. NULL if the frame
+    is too big or the pool is empty (counted in pool->exhausted). mac can be NULL
+*/
+static inline shared_buf_t *shared_buf_alloc(block_pool_t *pool, const uint8_t *data, size_t len, int64_t rx_us, const uint8_t *mac, int8_t rssi)
+{
+    if (len > SHARED_BUF_SIZE)
+    {
+        return NULL;
+    }
+
+    shared_buf_t *buf = (shared_buf_t *)block_pool_alloc(pool);
+    if (buf == NULL)
+    {
+        return NULL;
+    }
+
+    buf->refs.store(1, std::memory_order_relaxed);
+    buf->pool = pool;
+    buf->len = (uint16_t)len;
+    buf->rx_us = rx_us;
+    buf->rssi = rssi;
+    if (mac != NULL)
+    {
+        memcpy(buf->mac, mac, 6);
+    }
+    memcpy(buf->data, data, len);
+    return buf;
+}
+
+static inline void shared_buf_ref(shared_buf_t *buf)
+{
+    buf->refs.fetch_add(1, std::memory_order_relaxed);
+}
+
+// Drop a reference, the buffer goes back to the pool with the last one
+static inline void shared_buf_release(shared_buf_t *buf)
+{
+    if (buf->refs.fetch_sub(1, std::memory_order_acq_rel) == 1)
+    {
+        block_pool_free(buf->pool, buf);
+    }
+}
+
+static inline void shared_buf_queue_init(shared_buf_queue_t *q)
+{
+    q->head.store(0, std::memory_order_relaxed);
+    q->tail.store(0, std::memory_order_relaxed);
+}
+
+// Producer side. Hands the caller's reference over, returns false (keeping it) if full
+static inline bool shared_buf_queue_push(shared_buf_queue_t *q, shared_buf_t *buf)
+{
+    uint32_t head = q->head.load(std::memory_order_relaxed);
+    if (head - q->tail.load(std::memory_order_acquire) >= SHARED_BUF_QUEUE_LEN)
+    {
+        return false;
+    }
+
+    q->slots[head & (SHARED_BUF_QUEUE_LEN - 1)] = buf;
+    q->head.store(head + 1, std::memory_order_release);
+    return true;
+}
+
+// Consumer side. Next buffer with its reference, or NULL if empty
+static inline shared_buf_t *shared_buf_queue_pop(shared_buf_queue_t *q)
+{
+    uint32_t tail = q->tail.load(std::memory_order_relaxed);
+    if (tail == q->head.load(std::memory_order_acquire))
+    {
+        return NULL;
+    }
+
+    shared_buf_t *buf = q->slots[tail & (SHARED_BUF_QUEUE_LEN - 1)];
+    q->tail.store(tail + 1, std::memory_order_release);
+    return buf;
+}
@@ -0,0 +1,97 @@
+#pragma once
+
+#include <stdint.h>
+
+#include "dt_frame.h"
+
+/*
+    Time slotted ESP-NOW transmission
+        - The base station broadcasts a DT_TYPE_BEACON at the start of every superframe
+        - A superframe is slot_count slots of slot_us each. Slot 0 is the beacon's own,
+          every admitted slave gets one of the others in its join ack
+        - A slave takes the time it heard the beacon as the superframe start and only
+          hands frames to the radio inside its own slot, less a guard time either side
+          to cover clock drift and beacon delay
+        - If beacons stop (base station gone, channel changed) the slave falls back to
+          sending whenever it likes after TDMA_BEACON_TIMEOUT superframes
+*/
+
+#define TDMA_SLOT_US 5000
+#define TDMA_GUARD_US 300
+#define TDMA_MIN_SLOTS 8
+#define TDMA_BEACON_TIMEOUT 4
+
+typedef struct
+{
+    uint16_t slot;              // 0 = no slot yet
+    bool synced;
+
+    int64_t superframe_start_us;
+    uint32_t superframe_us;
+    uint32_t slot_us;
+
+    uint32_t beacons;
+} tdma_sched_t;
+
+// Superframe length the base station uses for a given highest slot in use
+static inline uint16_t tdma_slot_count(uint16_t highest_slot)
+{
+    return highest_slot + 1 < TDMA_MIN_SLOTS ? TDMA_MIN_SLOTS : highest_slot + 1;
+}
+
+static inline void tdma_init(tdma_sched_t *t)
+{
+    t->slot = 0;
+    t->synced = false;
+    t->superframe_start_us = 0;
+    t->superframe_us = 0;
+    t->slot_us = 0;
+    t->beacons = 0;
+}
+
+static inline void tdma_on_beacon(tdma_sched_t *t, const dt_beacon_t *beacon, int64_t rx_us)
+{
+    if (beacon->superframe_us == 0 || beacon->slot_us == 0)
+    {
+        return;
+    }
+
+    t->superframe_start_us = rx_us;
+    t->superframe_us = beacon->superframe_us;
+    t->slot_us = beacon->slot_us;
+    t->synced = true;
+    t->beacons++;
+}
+
+// Whether slotted sending applies right now, false means send freely
+static inline bool tdma_active(const tdma_sched_t *t, int64_t now_us)
+{
+    return t->synced && t->slot != 0 &&
+           now_us - t->superframe_start_us < (int64_t)t->superframe_us * TDMA_BEACON_TIMEOUT;
+}
+
+/*
+    How long until a frame taking airtime_us may start: 0 if it fits in the slot right now.
+    Missed beacons are covered by extending the last superframe start
+*/
+static inline int64_t tdma_wait_us(const tdma_sched_t *t, int64_t now_us, uint32_t airtime_us)
+{
+    if (!tdma_active(t, now_us))
+    {
+        return 0;
+    }
+
+    int64_t into_frame = (now_us - t->superframe_start_us) % t->superframe_us;
+    int64_t open_at = (int64_t)t->slot * t->slot_us + TDMA_GUARD_US;
+    int64_t close_at = (int64_t)(t->slot + 1) * t->slot_us - TDMA_GUARD_US;
+
+    if (into_frame >= open_at && into_frame + airtime_us <= close_at)
+    {
+        return 0;
+    }
+    if (into_frame < open_at)
+    {
+        return open_at - into_frame;
+    }
+    return t->superframe_us - into_frame + open_at; // this superframe's slot is gone, wait for the next
+}
@@ -0,0 +1,325 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <atomic>
+
+#include "dt_port.h"
+#include "dt_frame.h"
+
+#ifdef ESP_PLATFORM
+#include <unistd.h>
+#endif
+
+/*
+    Hot path latency tracing
+        - trace_event(tag, id, arg) puts {cycle count, tag, id, arg} in the ring of the core
+          it is running on: a relaxed fetch_add, the cycle counter and a handful of stores.
+          No locks and nothing that can block, so it is fine in the wifi callbacks and is
+          meant to stay on in production
+        - Each core keeps its last TRACE_RING_EVENTS, the oldest are overwritten. A slot
+          is stamped with its event number after everything else is written, so a dump
+          taken while the ring is busy skips half written slots instead of printing garbage
+        - Cycle counters are per core, not in step with each other, and wrap at 32 bits
+          (every ~27 s at 160 MHz). Once every TRACE_SYNC_CYCLES a core adds a TRACE_SYNC
+          event carrying esp_timer_get_time(), which puts all the cores on the one
+          microsecond clock. The latest one is kept aside too, so every dump has one
+        - id is what ties the stages of one thing together: trace_frame_id() (node_id and
+          seq) on the ESP-NOW path, the connection slot in the TCP server
+        - trace_dump writes the rings out as text. DataTrans_common/host/trace_hist.cpp
+          turns that into latency histograms per stage. Ask for one by pressing 't' on
+          the serial console (trace_console_poll) or with GET /trace on the base station
+        - A task that moves core between reading the counter and writing the slot leaves
+          one event with the other core's count. Rare, and it only skews that one sample
+        - -DDT_TRACE=0 compiles every trace point out
+*/
+
+#ifndef DT_TRACE
+#define DT_TRACE 1
+#endif
+
+#define TRACE_RING_EVENTS 256           // per core, must be a power of 2
+#define TRACE_DUMP_LINE_MAX 32          // "T core cycles tag id arg\n" at its longest
+#define TRACE_DUMP_SIZE (DT_NUM_CORES * (TRACE_RING_EVENTS + 1) * TRACE_DUMP_LINE_MAX + 128)
+
+#ifdef ESP_PLATFORM
+#define TRACE_SYNC_CYCLES (CONFIG_ESP_DEFAULT_CPU_FREQ_MHZ * 1000000u)     // a second
+#else
+#define TRACE_SYNC_CYCLES 1000000000u   // dt_cycles is in nanoseconds on Linux
+#endif
+
+static_assert((TRACE_RING_EVENTS & (TRACE_RING_EVENTS - 1)) == 0, "TRACE_RING_EVENTS must be a power of 2");
+
+// Grouped by what their id means (tag / 16), trace_hist only pairs events up inside a group
+typedef enum
+{
+    TRACE_SYNC = 0,                     // id = esp_timer_get_time(), low 32 bits
+
+    // ESP-NOW path, id = trace_frame_id()
+    TRACE_TXQ_PUSH = 1,                 // slave: frame queued for the radio
+    TRACE_ESPNOW_SEND = 2,              // slave: handed to esp_now_send
+    TRACE_ESPNOW_SENT = 3,              // slave: on_data_sent, acked
+    TRACE_ESPNOW_RECV = 4,              // base station: on_data_recv, arg = length
+    TRACE_RX_DECODED = 5,               // base station: worker has it decoded, arg = type
+    TRACE_RX_HANDLED = 6,               // base station: printed, reassembled or queued for TCP
+    TRACE_FWD_SENT = 7,                 // base station: last byte of it went to a TCP subscriber
+
+    // TCP server, id = connection slot
+    TRACE_TCP_ACCEPT = 16,
+    TRACE_TCP_RECV = 17,                // arg = bytes
+    TRACE_TCP_HANDLED = 18,             // request handler returned, arg = bytes it used
+    TRACE_TCP_SEND = 19,                // send() took some, arg = bytes
+} trace_tag_t;
+
+static inline const char *trace_tag_name(uint16_t tag)
+{
+    switch (tag)
+    {
+        case TRACE_SYNC: return "sync";
+        case TRACE_TXQ_PUSH: return "txq_push";
+        case TRACE_ESPNOW_SEND: return "espnow_send";
+        case TRACE_ESPNOW_SENT: return "espnow_sent";
+        case TRACE_ESPNOW_RECV: return "espnow_recv";
+        case TRACE_RX_DECODED: return "rx_decoded";
+        case TRACE_RX_HANDLED: return "rx_handled";
+        case TRACE_FWD_SENT: return "fwd_sent";
+        case TRACE_TCP_ACCEPT: return "tcp_accept";
+        case TRACE_TCP_RECV: return "tcp_recv";
+        case TRACE_TCP_HANDLED: return "tcp_handled";
+        case TRACE_TCP_SEND: return "tcp_send";
+        default: return "?";
+    }
+}
+
+typedef struct
+{
+    std::atomic<uint32_t> stamp;        // event number + 1 once written, 0 while it is being written
+    uint32_t cycles;
+    uint32_t id;
+    uint16_t tag;
+    uint16_t arg;
+} trace_slot_t;
+
+typedef struct
+{
+    uint32_t cycles;
+    uint32_t id;
+    uint16_t tag;
+    uint16_t arg;
+} trace_record_t;
+
+// One core's events, a cache line apart from the other cores'
+typedef struct
+{
+    alignas(64) std::atomic<uint32_t> head;     // events ever added
+    std::atomic<uint32_t> sync_cycles;          // when the last TRACE_SYNC went in
+    trace_slot_t last_sync;
+    trace_slot_t slots[TRACE_RING_EVENTS];
+} trace_ring_t;
+
+// inline, so there is one set however many files include this
+inline trace_ring_t trace_rings[DT_NUM_CORES];
+
+static inline void trace_fill(trace_slot_t *slot, uint32_t stamp, uint32_t cycles, uint16_t tag, uint32_t id, uint16_t arg)
+{
+    slot->stamp.store(0, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    slot->cycles = cycles;
+    slot->id = id;
+    slot->tag = tag;
+    slot->arg = arg;
+    slot->stamp.store(stamp, std::memory_order_release);
+}
+
+// Copy a slot out if it holds a whole event, and event number stamp - 1 if stamp is not 0
+static inline bool trace_read(const trace_slot_t *slot, uint32_t stamp, trace_record_t *rec)
+{
+    uint32_t before = slot->stamp.load(std::memory_order_acquire);
+    if (before == 0 || (stamp != 0 && before != stamp))
+    {
+        return false;
+    }
+    rec->cycles = slot->cycles;
+    rec->id = slot->id;
+    rec->tag = slot->tag;
+    rec->arg = slot->arg;
+    std::atomic_thread_fence(std::memory_order_acquire);
+    return slot->stamp.load(std::memory_order_relaxed) == before;
+}
+
+static inline void trace_sync(trace_ring_t *ring)
+{
+    uint32_t cycles = dt_cycles();
+    uint32_t us = (uint32_t)esp_timer_get_time();
+
+    ring->sync_cycles.store(cycles, std::memory_order_relaxed);
+    uint32_t n = ring->head.fetch_add(1, std::memory_order_relaxed);
+    trace_fill(&ring->slots[n & (TRACE_RING_EVENTS - 1)], n + 1, cycles, TRACE_SYNC, us, 0);
+    trace_fill(&ring->last_sync, n + 1, cycles, TRACE_SYNC, us, 0);
+}
+
+static inline void trace_event(uint16_t tag, uint32_t id, uint16_t arg)
+{
+#if DT_TRACE
+    trace_ring_t *ring = &trace_rings[dt_core_id()];
+    uint32_t cycles = dt_cycles();
+
+    if (cycles - ring->sync_cycles.load(std::memory_order_relaxed) >= TRACE_SYNC_CYCLES ||
+        ring->last_sync.stamp.load(std::memory_order_relaxed) == 0)
+    {
+        trace_sync(ring);
+    }
+
+    uint32_t n = ring->head.fetch_add(1, std::memory_order_relaxed);
+    trace_fill(&ring->slots[n & (TRACE_RING_EVENTS - 1)], n + 1, cycles, tag, id, arg);
+#else
+    (void)tag;
+    (void)id;
+    (void)arg;
+#endif
+}
+
+// node_id and the low 16 bits of seq, the same at every stage a frame goes through. 0 if it is not a frame
+static inline uint32_t trace_frame_id(const uint8_t *frame, size_t len)
+{
+    dt_frame_hdr_t hdr;
+    if (len < sizeof(hdr))
+    {
+        return 0;
+    }
+    memcpy(&hdr, frame, sizeof(hdr));
+    if (hdr.magic != DT_FRAME_MAGIC)
+    {
+        return 0;
+    }
+    return ((uint32_t)hdr.node_id << 16) | (hdr.seq & 0xFFFF);
+}
+
+static inline void trace_frame(uint16_t tag, const uint8_t *frame, size_t len, uint16_t arg)
+{
+#if DT_TRACE
+    trace_event(tag, trace_frame_id(frame, len), arg);
+#else
+    (void)tag;
+    (void)frame;
+    (void)len;
+    (void)arg;
+#endif
+}
+
+typedef void (*trace_write_t)(void *ctx, const char *text, size_t len);
+
+static inline void trace_dump_line(trace_write_t write, void *ctx, int core, const trace_record_t *rec)
+{
+    char line[TRACE_DUMP_LINE_MAX + 1];
+    int n = snprintf(line, sizeof(line), "T %d %08lx %u %lx %u\n", core,
+                     (unsigned long)rec->cycles, rec->tag, (unsigned long)rec->id, rec->arg);
+    write(ctx, line, n);
+}
+
+/*
+    Every core's ring, oldest first, one line per event:
+        DT_TRACE BEGIN cores=2 events=256 mhz=160 now_us=123456789
+        T <core> <cycles, hex> <tag> <id, hex> <arg>
+        DT_TRACE END
+    Each core starts with its latest TRACE_SYNC if that has already left the ring. Safe
+    to call while events are still being added, from any one task
+*/
+static inline void trace_dump(trace_write_t write, void *ctx)
+{
+    char line[80];
+    int n = snprintf(line, sizeof(line), "DT_TRACE BEGIN cores=%d events=%d mhz=%lu now_us=%lld\n",
+                     DT_NUM_CORES, TRACE_RING_EVENTS, (unsigned long)dt_cycles_per_us(), (long long)esp_timer_get_time());
+    write(ctx, line, n);
+
+    for (int core = 0; core < DT_NUM_CORES; core++)
+    {
+        trace_ring_t *ring = &trace_rings[core];
+        uint32_t head = ring->head.load(std::memory_order_acquire);
+        uint32_t first = head > TRACE_RING_EVENTS ? head - TRACE_RING_EVENTS : 0;
+        trace_record_t rec;
+
+        uint32_t sync_stamp = ring->last_sync.stamp.load(std::memory_order_relaxed);
+        if (sync_stamp != 0 && sync_stamp - 1 < first && trace_read(&ring->last_sync, sync_stamp, &rec))
+        {
+            trace_dump_line(write, ctx, core, &rec);
+        }
+
+        for (uint32_t i = first; i != head; i++)
+        {
+            // overwritten since head was read, or still being written
+            if (!trace_read(&ring->slots[i & (TRACE_RING_EVENTS - 1)], i + 1, &rec))
+            {
+                continue;
+            }
+            trace_dump_line(write, ctx, core, &rec);
+        }
+    }
+
+    write(ctx, "DT_TRACE END\n", 13);
+}
+
+typedef struct
+{
+    char *buf;
+    size_t size;
+    size_t len;
+} trace_buf_writer_t;
+
+// Whole lines only, whatever does not fit is left off the end
+static inline void trace_buf_write(void *ctx, const char *text, size_t len)
+{
+    trace_buf_writer_t *w = (trace_buf_writer_t *)ctx;
+    if (w->size - w->len > len)
+    {
+        memcpy(w->buf + w->len, text, len);
+        w->len += len;
+        w->buf[w->len] = '\0';
+    }
+}
+
+static inline size_t trace_dump_to_buf(char *buf, size_t size)
+{
+    trace_buf_writer_t w = { buf, size, 0 };
+    if (size > 0)
+    {
+        buf[0] = '\0';
+    }
+    trace_dump(trace_buf_write, &w);
+    return w.len;
+}
+
+static inline void trace_stdout_write(void *ctx, const char *text, size_t len)
+{
+    (void)ctx;
+    fwrite(text, 1, len, stdout);
+}
+
+#ifdef ESP_PLATFORM
+/*
+    Dump the trace rings to the serial console if 't' was typed since the last call. Reads the
+    console without the UART driver, which returns straight away when nothing was typed.
+    Each firmware calls this from its housekeeping task
+*/
+static inline void trace_console_poll(void)
+{
+    static bool nonblocking = false;
+    if (!nonblocking)
+    {
+        dt_set_nonblocking(fileno(stdin));
+        nonblocking = true;
+    }
+
+    char c;
+    while (read(fileno(stdin), &c, 1) == 1)
+    {
+        if (c == 't' || c == 'T')
+        {
+            trace_dump(trace_stdout_write, NULL);
+            fflush(stdout);
+        }
+    }
+}
+#endif
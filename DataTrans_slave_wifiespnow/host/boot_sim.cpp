@@ -0,0 +1,439 @@
+/*
+    Boot to first delivered frame, the cached path (assoc_cache.h) against the cold one, on the
+    simulated radio (dt_transport_sim.h). The slaves run the firmware's boot and join logic cut
+    down to what decides the time, with the real channel tracker (chan_track.h)
+
+    g++ -std=c++17 -O2 -DDT_SIM_CLOCK -I include -I ../DataTrans_common/include \
+        host/boot_sim.cpp src/chan_track.cpp -o boot_sim
+    ./boot_sim [slaves] [seed]
+
+    Every slave powers on at 0 (a power cut, all of them at once) with the base station
+    already up, beaconing and answering joins. Wifi is not on the simulated radio, only how
+    long it takes: SIM_INIT_MS to app_main's init_wifi, then a scan, the association and
+    DHCP. Rough ESP32 figures, the real ones depend on the AP
+        - cold:   the old path. app_main waits for wifi (a scan of every channel), ESP-NOW
+                  starts on the AP's channel and broadcasts join requests until the base
+                  station answers
+        - cached: the channel and base station from the last boot. The sender starts on
+                  that channel straight after init_wifi and sends to that base station, wifi
+                  connects in the background pinned to the cached AP (one channel to scan) and
+                  hints the tracker if it ends up elsewhere. A join only if the cached base
+                  station took nothing in ASSOC_RESUME_TIMEOUT_MS
+    The first data frame goes when the first batch closes, SIM_SEND_MS after the sender
+    started (or straight after a join that took longer), then one every SIM_SEND_MS.
+    Scenarios, the cache always says channel 6 and the base station from last time:
+        - same:        nothing changed since
+        - loss 30%:    the same, every frame lost with 30%
+        - AP 6->11:    the router moved to 11 and the base station with it
+        - AP 6->13:    the same to 13, the last channel a sweep tries
+        - new BS:      another base station (another MAC) on the same channel
+    Columns: boot to the first frame the base station took over all slaves, median, 90th and
+    worst ("never" if one isn't there after SIM_RUN_S), when wifi was up (median), join requests
+    and channel sweeps per slave
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <vector>
+
+#include "dt_port.h"
+#include "dt_frame.h"
+#include "dt_transport_sim.h"
+#include "tdma.h"
+#include "assoc_cache.h"
+#include "chan_track.h"
+
+#define SIM_STEP_US 1000            // how often the slaves' sender tasks get to run
+#define SIM_RUN_S 40
+#define SIM_INIT_MS 300             // boot, NVS and netif up to esp_wifi_start
+#define SIM_INIT_JITTER_MS 100
+#define SIM_SCAN_CHANNEL_MS 120     // active scan of one channel, IDF's default scan time
+#define SIM_ASSOC_MS 250            // auth, association and the WPA2 handshake
+#define SIM_DHCP_MS 800             // discover to ack, lwIP's DHCP client against a home router
+#define SIM_DHCP_JITTER_MS 400
+#define SIM_SEND_MS 500             // the slave's ESPNOW_BATCH_LATENCY_MS
+#define SIM_CACHED_CHANNEL 6
+
+// The firmware's, src/main.cpp
+#define ASSOC_RESUME_TIMEOUT_MS 2000
+#define WIFI_PINNED_RETRIES 2
+#define ESPNOW_JOIN_RETRY_MS 1000
+#define ESPNOW_JOIN_TIMEOUT_MS 10000
+#define ESPNOW_JOIN_PAUSE_MS 2000
+
+#define SIM_BS 0
+#define SIM_OLD_BS 999              // node index for the MAC of a base station that is gone
+
+typedef struct
+{
+    const char *label;
+    uint8_t channel;                // the AP's and the base station's now
+    bool replaced;                  // the cached base station isn't there, another one is
+    double loss;
+} sim_scenario_t;
+
+typedef struct
+{
+    int index;
+    dt_transport_t *radio;
+    chan_track_t track;
+    bool cached;
+    int64_t start_us;               // esp_now_sender starts
+    int64_t wifi_us;                // wifi_wait_connected returns
+    bool wifi_seen;
+    uint8_t dest[6];                // mac_destination
+    bool has_dest;
+    bool joining;                   // inside espnow_join
+    int64_t give_up_us;
+    int64_t next_req_us;
+    uint8_t asked;
+    int64_t join_us;                // look for a base station from here, 0 = joined
+    int64_t next_send_us;
+    int64_t first_us;               // first frame the base station took, 0 = none yet
+    uint32_t join_reqs;
+    uint32_t seq;
+} sim_slave_t;
+
+static dt_sim_radio_t s_radio;
+static std::vector<sim_slave_t> s_slaves;
+static uint8_t s_bs_mac[6];
+static uint8_t s_bs_channel;
+
+static void bs_on_recv(dt_transport_t *t, const uint8_t *src_mac, int8_t, const uint8_t *data, size_t len)
+{
+    dt_frame_view_t view;
+    if (dt_frame_decode(data, len, &view) <= 0 || view.hdr->type != DT_TYPE_JOIN_REQ)
+    {
+        return;
+    }
+
+    // every slave is a peer already, peer_slots would make it one
+    dt_join_ack_t ack = { DT_JOIN_ACCEPTED, s_bs_channel, view.hdr->node_id };
+    uint8_t frame[DT_FRAME_MAX_SIZE];
+    size_t frame_len = dt_frame_encode(frame, sizeof(frame), DT_TYPE_JOIN_ACK, DT_BASE_STATION_NODE_ID,
+                                       view.hdr->seq, (uint32_t)esp_timer_get_time(), &ack, sizeof(ack));
+    dt_transport_send(t, src_mac, frame, frame_len);
+}
+
+static void bs_beacon(uint32_t seq)
+{
+    uint16_t slots = tdma_slot_count((uint16_t)s_slaves.size());
+    dt_beacon_t beacon = {};
+    beacon.superframe_us = (uint32_t)slots * TDMA_SLOT_US;
+    beacon.slot_us = TDMA_SLOT_US;
+    beacon.slot_count = slots;
+    beacon.channel = s_bs_channel;
+    uint8_t frame[DT_FRAME_MAX_SIZE];
+    size_t frame_len = dt_frame_encode(frame, sizeof(frame), DT_TYPE_BEACON, DT_BASE_STATION_NODE_ID,
+                                       seq, (uint32_t)esp_timer_get_time(), &beacon, sizeof(beacon));
+    dt_transport_send(dt_sim_radio_node(&s_radio, SIM_BS), DT_BROADCAST_MAC, frame, frame_len);
+}
+
+static void slave_send_join_req(sim_slave_t *s, int64_t now)
+{
+    uint8_t frame[DT_FRAME_MAX_SIZE];
+    size_t frame_len = dt_frame_encode(frame, sizeof(frame), DT_TYPE_JOIN_REQ, (uint16_t)(s->index + 1),
+                                       s->seq++, (uint32_t)now, NULL, 0);
+    dt_transport_send(s->radio, DT_BROADCAST_MAC, frame, frame_len);
+    s->join_reqs++;
+}
+
+// handle_join_ack while joining, handle_espnow_frame's tracker half otherwise
+static void slave_on_recv(dt_transport_t *t, const uint8_t *src_mac, int8_t, const uint8_t *data, size_t len)
+{
+    sim_slave_t *s = (sim_slave_t *)t->user;
+    dt_frame_view_t view;
+    if (dt_frame_decode(data, len, &view) <= 0)
+    {
+        return;
+    }
+
+    int64_t now = esp_timer_get_time();
+    if (s->joining)
+    {
+        if (view.hdr->type != DT_TYPE_JOIN_ACK || view.hdr->len < sizeof(dt_join_ack_t) ||
+            ((const dt_join_ack_t *)view.payload)->status != DT_JOIN_ACCEPTED)
+        {
+            return;
+        }
+        chan_track_on_heard(&s->track, ((const dt_join_ack_t *)view.payload)->channel, 0, now);
+        memcpy(s->dest, src_mac, 6);
+        dt_transport_add_peer(s->radio, s->dest, 0);
+        s->has_dest = true;
+        s->joining = false;
+        s->join_us = 0;
+        return;
+    }
+
+    if (!s->has_dest || memcmp(src_mac, s->dest, 6) != 0)
+    {
+        return;
+    }
+    if (view.hdr->type == DT_TYPE_BEACON && view.hdr->len >= DT_BEACON_MIN_SIZE)
+    {
+        const dt_beacon_t *beacon = (const dt_beacon_t *)view.payload;
+        uint8_t announced = DT_BEACON_HAS(view.hdr->len, channel) ? beacon->channel : 0;
+        chan_track_on_heard(&s->track, announced, beacon->superframe_us, now);
+    }
+    else if (view.hdr->type == DT_TYPE_JOIN_ACK && view.hdr->len >= sizeof(dt_join_ack_t))
+    {
+        chan_track_on_heard(&s->track, ((const dt_join_ack_t *)view.payload)->channel, 0, now);
+    }
+}
+
+static void slave_on_sent(dt_transport_t *t, const uint8_t *dst_mac, bool success)
+{
+    sim_slave_t *s = (sim_slave_t *)t->user;
+    if (memcmp(dst_mac, DT_BROADCAST_MAC, 6) == 0)
+    {
+        return;
+    }
+
+    int64_t now = esp_timer_get_time();
+    chan_track_on_sent(&s->track, success, now);
+    if (success && s->first_us == 0)
+    {
+        s->first_us = now;
+    }
+}
+
+// Wifi times for one slave, by path and whether the AP is still where the cache says
+static void slave_plan(sim_slave_t *s, const sim_scenario_t *sc)
+{
+    int64_t init_ms = SIM_INIT_MS + dt_sim_random(&s_radio) % (SIM_INIT_JITTER_MS + 1);
+    int64_t connect_ms = SIM_ASSOC_MS + SIM_DHCP_MS + dt_sim_random(&s_radio) % (SIM_DHCP_JITTER_MS + 1);
+    int64_t scan_ms = CHAN_TRACK_MAX_CHANNEL * SIM_SCAN_CHANNEL_MS;
+    if (s->cached)
+    {
+        // pinned to the cached BSSID and channel, WIFI_PINNED_RETRIES more tries at it before a full scan
+        scan_ms = sc->channel == SIM_CACHED_CHANNEL ? SIM_SCAN_CHANNEL_MS :
+                  (WIFI_PINNED_RETRIES + 1) * SIM_SCAN_CHANNEL_MS + scan_ms;
+    }
+    s->wifi_us = (init_ms + scan_ms + connect_ms) * 1000;
+    s->start_us = s->cached ? init_ms * 1000 : s->wifi_us;
+}
+
+// esp_now_client and the start of esp_now_sender
+static void slave_start(sim_slave_t *s, const sim_scenario_t *sc, int64_t now)
+{
+    uint8_t channel = s->cached ? SIM_CACHED_CHANNEL : sc->channel;
+    dt_transport_set_channel(s->radio, channel);
+    dt_transport_add_peer(s->radio, DT_BROADCAST_MAC, 0);
+    chan_track_init(&s->track, channel, (uint32_t)(s->index + 1), now);
+
+    s->join_us = now;
+    s->wifi_seen = !s->cached;
+    if (s->cached)
+    {
+        // espnow_resume
+        dt_sim_node_mac(sc->replaced ? SIM_OLD_BS : SIM_BS, s->dest);
+        dt_transport_add_peer(s->radio, s->dest, 0);
+        s->has_dest = true;
+        s->join_us += ASSOC_RESUME_TIMEOUT_MS * 1000;
+    }
+    s->next_send_us = now + SIM_SEND_MS * 1000;
+}
+
+// espnow_track_channel, no wifi reassociations after boot here
+static void slave_track(sim_slave_t *s, int64_t now)
+{
+    bool probe = chan_track_poll(&s->track, now);
+    dt_transport_set_channel(s->radio, chan_track_channel(&s->track));
+    if (probe)
+    {
+        slave_send_join_req(s, now);
+    }
+}
+
+// One pass of the sender loop, or of espnow_join's while it is in one
+static void slave_step(sim_slave_t *s, const sim_scenario_t *sc, int64_t now)
+{
+    if (now < s->start_us)
+    {
+        return;
+    }
+    if (now == s->start_us)
+    {
+        slave_start(s, sc, now);
+    }
+
+    // espnow_check_wifi: on a cached boot the AP may have turned up somewhere else
+    if (!s->wifi_seen && now >= s->wifi_us)
+    {
+        s->wifi_seen = true;
+        if (sc->channel != chan_track_channel(&s->track))
+        {
+            chan_track_hint(&s->track, sc->channel, now);
+        }
+    }
+
+    if (s->joining)
+    {
+        if (now >= s->give_up_us)
+        {
+            s->joining = false;
+            s->join_us = now + ESPNOW_JOIN_PAUSE_MS * 1000;
+            return;
+        }
+        slave_track(s, now);
+        if (!chan_track_sweeping(&s->track) && now >= s->next_req_us)
+        {
+            if (s->asked == chan_track_channel(&s->track) && chan_track_no_answer(&s->track, now))
+            {
+                return;
+            }
+            slave_send_join_req(s, now);
+            s->asked = chan_track_channel(&s->track);
+            s->next_req_us = now + ESPNOW_JOIN_RETRY_MS * 1000;
+        }
+        return;
+    }
+
+    if (s->join_us != 0 && s->first_us == 0 && now >= s->join_us)
+    {
+        s->joining = true;
+        s->give_up_us = now + ESPNOW_JOIN_TIMEOUT_MS * 1000;
+        s->next_req_us = now;
+        s->asked = 0;
+        return;
+    }
+
+    slave_track(s, now);
+    if (s->has_dest && now >= s->next_send_us && !chan_track_sweeping(&s->track))
+    {
+        uint8_t payload[40] = {};
+        uint8_t frame[DT_FRAME_MAX_SIZE];
+        size_t frame_len = dt_frame_encode(frame, sizeof(frame), DT_TYPE_BATCH, (uint16_t)(s->index + 1),
+                                           s->seq++, (uint32_t)now, payload, sizeof(payload));
+        dt_transport_send(s->radio, s->dest, frame, frame_len);
+        s->next_send_us = now + SIM_SEND_MS * 1000;
+    }
+}
+
+static void sim_reset(const sim_scenario_t *sc, int slaves, bool cached, uint32_t seed)
+{
+    dt_sim_config_t config = dt_sim_default_config();
+    config.loss = sc->loss;
+    config.seed = seed;
+    dt_sim_radio_init(&s_radio, slaves + 1, &config);
+
+    s_bs_channel = sc->channel;
+    dt_transport_t *bs = dt_sim_radio_node(&s_radio, SIM_BS);
+    dt_transport_set_callbacks(bs, bs_on_recv, NULL, NULL);
+    dt_transport_own_mac(bs, s_bs_mac);
+    dt_transport_set_channel(bs, s_bs_channel);
+    dt_transport_add_peer(bs, DT_BROADCAST_MAC, s_bs_channel);
+
+    s_slaves.assign(slaves, sim_slave_t());
+    for (int i = 0; i < slaves; i++)
+    {
+        sim_slave_t *s = &s_slaves[i];
+        s->index = i;
+        s->radio = dt_sim_radio_node(&s_radio, i + 1);
+        s->cached = cached;
+        slave_plan(s, sc);
+        dt_transport_set_callbacks(s->radio, slave_on_recv, slave_on_sent, s);
+        dt_transport_set_channel(s->radio, 0);     // off until esp_now_client
+
+        uint8_t mac[6];
+        dt_transport_own_mac(s->radio, mac);
+        dt_transport_add_peer(bs, mac, s_bs_channel);
+    }
+}
+
+static double percentile_ms(const std::vector<int64_t> &sorted, double p)
+{
+    size_t i = (size_t)(p * sorted.size());
+    return sorted[i < sorted.size() ? i : sorted.size() - 1] / 1000.0;
+}
+
+static void print_ms(double ms)
+{
+    if (ms < 0)
+    {
+        printf(" %8s", "never");
+    }
+    else
+    {
+        printf(" %8.0f", ms);
+    }
+}
+
+static void run(const sim_scenario_t *sc, int slaves, bool cached, uint32_t seed)
+{
+    sim_reset(sc, slaves, cached, seed);
+
+    uint32_t beacon_seq = 0;
+    int64_t next_beacon_us = 0;
+    int64_t superframe_us = tdma_slot_count((uint16_t)slaves) * TDMA_SLOT_US;
+    for (int64_t now = 0; now < SIM_RUN_S * 1000000LL; now += SIM_STEP_US)
+    {
+        dt_sim_radio_run_until(&s_radio, now);
+        if (now >= next_beacon_us)
+        {
+            bs_beacon(beacon_seq++);
+            next_beacon_us += superframe_us;
+        }
+        for (sim_slave_t &s : s_slaves)
+        {
+            slave_step(&s, sc, now);
+        }
+    }
+
+    std::vector<int64_t> first, wifi;
+    uint32_t never = 0, join_reqs = 0, sweeps = 0;
+    for (const sim_slave_t &s : s_slaves)
+    {
+        if (s.first_us == 0)
+        {
+            never++;
+        }
+        else
+        {
+            first.push_back(s.first_us);
+        }
+        wifi.push_back(s.wifi_us);
+        join_reqs += s.join_reqs;
+        sweeps += s.track.stats.sweeps;
+    }
+    std::sort(first.begin(), first.end());
+    std::sort(wifi.begin(), wifi.end());
+
+    printf("%-12s %-7s %5d/%-3d", sc->label, cached ? "cached" : "cold", (int)first.size(), slaves);
+    print_ms(first.empty() ? -1 : percentile_ms(first, 0.5));
+    print_ms(never > (uint32_t)slaves / 10 ? -1 : percentile_ms(first, 0.9));
+    print_ms(never > 0 ? -1 : first.back() / 1000.0);
+    printf(" %8.0f %7.1f %7.1f\n", percentile_ms(wifi, 0.5), (double)join_reqs / slaves, (double)sweeps / slaves);
+}
+
+int main(int argc, char **argv)
+{
+    int slaves = argc > 1 ? atoi(argv[1]) : 10;
+    uint32_t seed = argc > 2 ? (uint32_t)atoi(argv[2]) : 1;
+    if (slaves < 1 || slaves + 1 > DT_SIM_MAX_PEERS)
+    {
+        printf("1 to %d slaves, the base station keeps them all as peers\n", DT_SIM_MAX_PEERS - 1);
+        return 1;
+    }
+
+    printf("%d slaves powered on at once, cache says channel %d, first batch %d ms after the sender starts\n\n",
+           slaves, SIM_CACHED_CHANNEL, SIM_SEND_MS);
+    printf("%-12s %-7s %9s %8s %8s %8s %8s %7s %7s\n",
+           "scenario", "boot", "sent", "p50 ms", "p90 ms", "max ms", "wifi ms", "joins", "sweeps");
+
+    static const sim_scenario_t scenarios[] =
+    {
+        { "same", SIM_CACHED_CHANNEL, false, 0.0 },
+        { "loss 30%", SIM_CACHED_CHANNEL, false, 0.3 },
+        { "AP 6->11", 11, false, 0.0 },
+        { "AP 6->13", 13, false, 0.0 },
+        { "new BS", SIM_CACHED_CHANNEL, true, 0.0 },
+    };
+    for (const sim_scenario_t &sc : scenarios)
+    {
+        run(&sc, slaves, false, seed);
+        run(&sc, slaves, true, seed);
+    }
+    return 0;
+}
@@ -0,0 +1,349 @@
+/*
+    The base station changing channel under its slaves, on the simulated radio (dt_transport_sim.h).
+    Every slave runs the real channel tracker (chan_track.h) the way the firmware feeds it,
+    against the old behaviour of staying on the channel it joined on until someone reboots it
+
+    g++ -std=c++17 -O2 -DDT_SIM_CLOCK -I include -I ../DataTrans_common/include \
+        host/chan_sim.cpp src/chan_track.cpp -o chan_sim
+    ./chan_sim [slaves] [seed]
+
+    The base station beacons every superframe (a slot per slave) with its channel in it and
+    answers join requests with a join ack. Each slave sends one frame to it every
+    SIM_SEND_MS (a batch at the default deadline) and counts it delivered when on_sent says
+    so. SIM_EVENT_AT_S in, one of:
+        - move:       the base station goes from channel 6 to another and stays there
+        - move+wifi:  the same, and every slave's own wifi reconnects to the AP on the new
+                      channel SIM_WIFI_REJOIN_MS later (the tracker gets it as a hint; without
+                      the tracker the old firmware stops listening to wifi after boot)
+        - reboot:     the base station is gone for 10 s and comes back on the same channel
+        - burst:      everything lost for 3 s, nobody moves
+        - loss 30%:   nothing happens, only loss all along. Sweeps here are false alarms
+    Outage is from the event (the end of it for reboot and burst) to the slave's first
+    delivered frame after it, over all slaves: median, 90th and worst. "never" is a slave
+    still not back at the end of the run. Sweeps and probes are per slave
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <vector>
+
+#include "dt_port.h"
+#include "dt_frame.h"
+#include "dt_transport_sim.h"
+#include "tdma.h"
+#include "chan_track.h"
+
+#define SIM_STEP_US 1000            // how often the slaves' sender tasks get to run
+#define SIM_SEND_MS 500             // the slave's ESPNOW_BATCH_LATENCY_MS
+#define SIM_EVENT_AT_S 5
+#define SIM_AFTER_S 60              // run on for this long after the event
+#define SIM_WIFI_REJOIN_MS 1500     // beacon loss, scan and association on the new channel
+#define SIM_HOME_CHANNEL 6
+#define SIM_BS 0
+
+typedef struct
+{
+    int index;
+    dt_transport_t *radio;
+    chan_track_t track;
+    bool tracking;                  // false: the old firmware, never leaves its channel
+    int64_t next_send_us;
+    int64_t back_us;                // first delivery after the event, 0 = not yet
+    uint32_t seq;
+} sim_slave_t;
+
+typedef enum
+{
+    SIM_MOVE,
+    SIM_MOVE_WIFI,
+    SIM_REBOOT,
+    SIM_BURST,
+    SIM_LOSS,
+} sim_event_t;
+
+static dt_sim_radio_t s_radio;
+static std::vector<sim_slave_t> s_slaves;
+static uint8_t s_bs_mac[6];
+static uint8_t s_bs_channel;
+static int64_t s_event_end_us;      // outage is counted from here
+
+static void bs_on_recv(dt_transport_t *t, const uint8_t *src_mac, int8_t, const uint8_t *data, size_t len)
+{
+    dt_frame_view_t view;
+    if (dt_frame_decode(data, len, &view) <= 0 || view.hdr->type != DT_TYPE_JOIN_REQ)
+    {
+        return;
+    }
+
+    // every slave is a peer already, as it would be from its first join
+    dt_join_ack_t ack = { DT_JOIN_ACCEPTED, s_bs_channel, 1 };
+    uint8_t frame[DT_FRAME_MAX_SIZE];
+    size_t frame_len = dt_frame_encode(frame, sizeof(frame), DT_TYPE_JOIN_ACK, DT_BASE_STATION_NODE_ID,
+                                       view.hdr->seq, (uint32_t)esp_timer_get_time(), &ack, sizeof(ack));
+    dt_transport_send(t, src_mac, frame, frame_len);
+}
+
+static void bs_beacon(uint32_t seq)
+{
+    uint16_t slots = tdma_slot_count((uint16_t)s_slaves.size());
+    dt_beacon_t beacon = {};
+    beacon.superframe_us = (uint32_t)slots * TDMA_SLOT_US;
+    beacon.slot_us = TDMA_SLOT_US;
+    beacon.slot_count = slots;
+    beacon.channel = s_bs_channel;
+    uint8_t frame[DT_FRAME_MAX_SIZE];
+    size_t frame_len = dt_frame_encode(frame, sizeof(frame), DT_TYPE_BEACON, DT_BASE_STATION_NODE_ID,
+                                       seq, (uint32_t)esp_timer_get_time(), &beacon, sizeof(beacon));
+    dt_transport_send(dt_sim_radio_node(&s_radio, SIM_BS), DT_BROADCAST_MAC, frame, frame_len);
+}
+
+// handle_espnow_frame in the firmware, the tracker's half of it
+static void slave_on_recv(dt_transport_t *t, const uint8_t *src_mac, int8_t, const uint8_t *data, size_t len)
+{
+    sim_slave_t *slave = (sim_slave_t *)t->user;
+    dt_frame_view_t view;
+    if (!slave->tracking || dt_frame_decode(data, len, &view) <= 0 || memcmp(src_mac, s_bs_mac, 6) != 0)
+    {
+        return;
+    }
+
+    int64_t now = esp_timer_get_time();
+    if (view.hdr->type == DT_TYPE_BEACON && view.hdr->len >= DT_BEACON_MIN_SIZE)
+    {
+        const dt_beacon_t *beacon = (const dt_beacon_t *)view.payload;
+        uint8_t announced = DT_BEACON_HAS(view.hdr->len, channel) ? beacon->channel : 0;
+        chan_track_on_heard(&slave->track, announced, beacon->superframe_us, now);
+    }
+    else if (view.hdr->type == DT_TYPE_JOIN_ACK && view.hdr->len >= sizeof(dt_join_ack_t))
+    {
+        chan_track_on_heard(&slave->track, ((const dt_join_ack_t *)view.payload)->channel, 0, now);
+    }
+}
+
+static void slave_on_sent(dt_transport_t *t, const uint8_t *dst_mac, bool success)
+{
+    sim_slave_t *slave = (sim_slave_t *)t->user;
+    if (memcmp(dst_mac, DT_BROADCAST_MAC, 6) == 0)
+    {
+        return;
+    }
+
+    int64_t now = esp_timer_get_time();
+    if (slave->tracking)
+    {
+        chan_track_on_sent(&slave->track, success, now);
+    }
+    if (success && slave->back_us == 0 && now >= s_event_end_us)
+    {
+        slave->back_us = now;
+    }
+}
+
+static void sim_reset(int slaves, bool tracking, double loss, uint32_t seed)
+{
+    dt_sim_config_t config = dt_sim_default_config();
+    config.loss = loss;
+    config.seed = seed;
+    dt_sim_radio_init(&s_radio, slaves + 1, &config);
+
+    s_bs_channel = SIM_HOME_CHANNEL;
+    dt_transport_t *bs = dt_sim_radio_node(&s_radio, SIM_BS);
+    dt_transport_set_callbacks(bs, bs_on_recv, NULL, NULL);
+    dt_transport_own_mac(bs, s_bs_mac);
+    dt_transport_set_channel(bs, s_bs_channel);
+    dt_transport_add_peer(bs, DT_BROADCAST_MAC, s_bs_channel);
+
+    s_slaves.assign(slaves, sim_slave_t());
+    for (int i = 0; i < slaves; i++)
+    {
+        sim_slave_t *s = &s_slaves[i];
+        s->index = i;
+        s->radio = dt_sim_radio_node(&s_radio, i + 1);
+        s->tracking = tracking;
+        s->next_send_us = dt_sim_random(&s_radio) % (SIM_SEND_MS * 1000);
+        dt_transport_set_callbacks(s->radio, slave_on_recv, slave_on_sent, s);
+        dt_transport_set_channel(s->radio, SIM_HOME_CHANNEL);
+        dt_transport_add_peer(s->radio, s_bs_mac, SIM_HOME_CHANNEL);
+        dt_transport_add_peer(s->radio, DT_BROADCAST_MAC, SIM_HOME_CHANNEL);
+        chan_track_init(&s->track, SIM_HOME_CHANNEL, (uint32_t)(i + 1), 0);
+
+        uint8_t mac[6];
+        dt_transport_own_mac(s->radio, mac);
+        dt_transport_add_peer(bs, mac, s_bs_channel);
+    }
+}
+
+// The sender task's loop, cut down to what the tracker needs
+static void slave_step(sim_slave_t *s, int64_t now)
+{
+    if (s->tracking)
+    {
+        if (chan_track_poll(&s->track, now))
+        {
+            dt_transport_set_channel(s->radio, chan_track_channel(&s->track));
+            uint8_t frame[DT_FRAME_MAX_SIZE];
+            size_t frame_len = dt_frame_encode(frame, sizeof(frame), DT_TYPE_JOIN_REQ, (uint16_t)(s->index + 1),
+                                               s->seq++, (uint32_t)now, NULL, 0);
+            dt_transport_send(s->radio, DT_BROADCAST_MAC, frame, frame_len);
+        }
+        dt_transport_set_channel(s->radio, chan_track_channel(&s->track));
+    }
+
+    // the tx gate holds data back while sweeping, the frame waits for the channel to be found
+    if (now >= s->next_send_us && !(s->tracking && chan_track_sweeping(&s->track)))
+    {
+        uint8_t payload[40] = {};
+        uint8_t frame[DT_FRAME_MAX_SIZE];
+        size_t frame_len = dt_frame_encode(frame, sizeof(frame), DT_TYPE_BATCH, (uint16_t)(s->index + 1),
+                                           s->seq++, (uint32_t)now, payload, sizeof(payload));
+        dt_transport_send(s->radio, s_bs_mac, frame, frame_len);
+        s->next_send_us += SIM_SEND_MS * 1000;
+    }
+}
+
+static double percentile_ms(const std::vector<int64_t> &sorted, double p)
+{
+    size_t i = (size_t)(p * sorted.size());
+    return sorted[i < sorted.size() ? i : sorted.size() - 1] / 1000.0;
+}
+
+static void print_ms(double ms)
+{
+    if (ms < 0)
+    {
+        printf(" %8s", "never");
+    }
+    else
+    {
+        printf(" %8.0f", ms);
+    }
+}
+
+static void run(const char *label, sim_event_t event, uint8_t to, int slaves, bool tracking, uint32_t seed)
+{
+    sim_reset(slaves, tracking, event == SIM_LOSS ? 0.3 : 0.0, seed);
+
+    int64_t event_us = SIM_EVENT_AT_S * 1000000LL;
+    int64_t end_us = event_us + SIM_AFTER_S * 1000000LL;
+    int64_t event_len_us = event == SIM_REBOOT ? 10000000 : event == SIM_BURST ? 3000000 : 0;
+    s_event_end_us = event == SIM_LOSS ? INT64_MAX : event_us + event_len_us;
+    dt_transport_t *bs = dt_sim_radio_node(&s_radio, SIM_BS);
+
+    bool wifi_moved = false;
+    uint32_t beacon_seq = 0;
+    int64_t next_beacon_us = 0;
+    int64_t superframe_us = tdma_slot_count((uint16_t)slaves) * TDMA_SLOT_US;
+    for (int64_t now = 0; now < end_us; now += SIM_STEP_US)
+    {
+        dt_sim_radio_run_until(&s_radio, now);
+
+        if (now == event_us)
+        {
+            if (event == SIM_MOVE || event == SIM_MOVE_WIFI)
+            {
+                s_bs_channel = to;
+                dt_transport_set_channel(bs, to);
+            }
+            else if (event == SIM_REBOOT)
+            {
+                dt_transport_set_channel(bs, 0);    // nobody's channel
+            }
+            else if (event == SIM_BURST)
+            {
+                s_radio.config.loss = 1.0;
+            }
+        }
+        if (now == s_event_end_us)
+        {
+            dt_transport_set_channel(bs, s_bs_channel);
+            s_radio.config.loss = 0.0;
+        }
+        if (event == SIM_MOVE_WIFI && !wifi_moved && tracking && now >= event_us + SIM_WIFI_REJOIN_MS * 1000)
+        {
+            wifi_moved = true;
+            for (sim_slave_t &s : s_slaves)
+            {
+                chan_track_hint(&s.track, to, now);
+            }
+        }
+
+        // a base station that is off doesn't beacon
+        if (now >= next_beacon_us)
+        {
+            if (!(event == SIM_REBOOT && now >= event_us && now < s_event_end_us))
+            {
+                bs_beacon(beacon_seq++);
+            }
+            next_beacon_us += superframe_us;
+        }
+
+        for (sim_slave_t &s : s_slaves)
+        {
+            slave_step(&s, now);
+        }
+    }
+
+    std::vector<int64_t> outage;
+    uint32_t never = 0, sweeps = 0, probes = 0;
+    for (const sim_slave_t &s : s_slaves)
+    {
+        if (s.back_us == 0)
+        {
+            never++;
+        }
+        else
+        {
+            outage.push_back(s.back_us - s_event_end_us);
+        }
+        sweeps += s.track.stats.sweeps;
+        probes += s.track.stats.probes;
+    }
+    std::sort(outage.begin(), outage.end());
+
+    printf("%-16s %-8s %5d/%-3d", label, tracking ? "tracker" : "fixed", (int)outage.size(), slaves);
+    if (event == SIM_LOSS)
+    {
+        printf(" %8s %8s %8s", "-", "-", "-");
+    }
+    else
+    {
+        print_ms(outage.empty() ? -1 : percentile_ms(outage, 0.5));
+        print_ms(never > (uint32_t)slaves / 10 ? -1 : percentile_ms(outage, 0.9));
+        print_ms(never > 0 ? -1 : outage.back() / 1000.0);
+    }
+    printf(" %7.1f %7.1f %8lu\n", (double)sweeps / slaves, (double)probes / slaves, (unsigned long)s_radio.stats.off_channel);
+}
+
+int main(int argc, char **argv)
+{
+    int slaves = argc > 1 ? atoi(argv[1]) : 20;
+    uint32_t seed = argc > 2 ? (uint32_t)atoi(argv[2]) : 1;
+
+    printf("%d slaves, a frame every %d ms each, base station on channel %d, event at %d s, %d s after it\n\n",
+           slaves, SIM_SEND_MS, SIM_HOME_CHANNEL, SIM_EVENT_AT_S, SIM_AFTER_S);
+    printf("%-16s %-8s %9s %8s %8s %8s %7s %7s %8s\n",
+           "event", "slaves", "back", "p50 ms", "p90 ms", "max ms", "sweeps", "probes", "off-chan");
+
+    static const struct
+    {
+        const char *label;
+        sim_event_t event;
+        uint8_t to;
+    } runs[] =
+    {
+        { "move 6->1", SIM_MOVE, 1 },
+        { "move 6->11", SIM_MOVE, 11 },
+        { "move 6->13", SIM_MOVE, 13 },
+        { "move+wifi 6->13", SIM_MOVE_WIFI, 13 },
+        { "reboot 10 s", SIM_REBOOT, 0 },
+        { "burst 3 s", SIM_BURST, 0 },
+        { "loss 30%", SIM_LOSS, 0 },
+    };
+    for (const auto &r : runs)
+    {
+        run(r.label, r.event, r.to, slaves, false, seed);
+        run(r.label, r.event, r.to, slaves, true, seed);
+    }
+    return 0;
+}
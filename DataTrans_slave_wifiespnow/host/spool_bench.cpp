@@ -0,0 +1,278 @@
+/*
+    The slave's flash spool (spool.h) on a file instead of the partition: write amplification,
+    drain speed and what survives the power going
+
+    g++ -std=c++17 -O2 -I include -I ../DataTrans_common/include host/spool_bench.cpp src/spool.cpp -o spool_bench
+    ./spool_bench [file] [power cuts]
+
+    write:  an outage long enough to go twice round the ring, then everything drained, for a
+            few record sizes and write buffer sizes (0 = a flash write per record)
+            amp is bytes written to flash over record bytes, pages and erases are per KB of records
+            dev us/rec puts the page programs and erases at BENCH_PAGE_PROGRAM_US and
+            BENCH_SECTOR_ERASE_US, typical datasheet numbers for the SPI NOR on ESP32 modules
+    drain:  a full spool of 250 byte frames, reopened (what a reboot costs) and read back out.
+            The device estimate reads at BENCH_READ_MB_S
+    power:  appends and drains with the plug pulled after a random number of bytes, then
+            reopened and drained. Nothing drained-but-unmarked may be missing, nothing that was
+            synced may be lost, and records come back intact and in order
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "dt_port.h"
+#include "dt_flash.h"
+#include "spool.h"
+
+#define BENCH_PARTITION_SIZE 0xE0000    // the spool partition in partitions.csv
+#define BENCH_PAGE_PROGRAM_US 700
+#define BENCH_SECTOR_ERASE_US 45000
+#define BENCH_READ_MB_S 10
+#define BENCH_FRAME 250
+
+static const char *s_path = "spool_bench.bin";
+
+// Record `id`: the id, then bytes that depend on it, so a mixed up record shows
+static void make_record(uint8_t *rec, size_t len, uint32_t id)
+{
+    memcpy(rec, &id, sizeof(id));
+    for (size_t i = sizeof(id); i < len; i++)
+    {
+        rec[i] = (uint8_t)(id * 31 + i);
+    }
+}
+
+static bool check_record(const uint8_t *rec, int len, size_t want_len, uint32_t *id)
+{
+    uint8_t expect[SPOOL_MAX_RECORD];
+    if (len != (int)want_len)
+    {
+        return false;
+    }
+    memcpy(id, rec, sizeof(*id));
+    make_record(expect, want_len, *id);
+    return memcmp(expect, rec, want_len) == 0;
+}
+
+static bool fresh(dt_flash_t *flash, spool_t *spool, uint32_t sync_bytes)
+{
+    unlink(s_path);
+    spool_config_t config = { .sync_bytes = sync_bytes };
+    return dt_flash_open(flash, s_path, BENCH_PARTITION_SIZE) == 0 && spool_open(spool, flash, &config) == 0;
+}
+
+static void run_write(size_t len, uint32_t sync_bytes)
+{
+    static dt_flash_t flash;
+    static spool_t spool;
+    if (!fresh(&flash, &spool, sync_bytes))
+    {
+        printf("could not open %s\n", s_path);
+        exit(1);
+    }
+
+    uint8_t rec[SPOOL_MAX_RECORD];
+    uint32_t n = spool_capacity(&spool, len) * 2;
+    int64_t t0 = esp_timer_get_time();
+    for (uint32_t id = 0; id < n; id++)
+    {
+        make_record(rec, len, id);
+        spool_append(&spool, rec, len);
+    }
+    spool_sync(&spool);
+    int64_t t1 = esp_timer_get_time();
+
+    bool ok = true;
+    uint32_t next_id = spool.stats.dropped;
+    int got;
+    while ((got = spool_peek(&spool, rec, sizeof(rec))) > 0)
+    {
+        uint32_t id;
+        ok = ok && check_record(rec, got, len, &id) && id == next_id++;
+        spool_pop(&spool);
+    }
+    ok = ok && next_id == n;
+
+    const dt_flash_stats_t *st = &flash.stats;
+    double kb = spool.stats.bytes / 1024.0;
+    double dev_us = (double)st->pages * BENCH_PAGE_PROGRAM_US + (double)st->erases * BENCH_SECTOR_ERASE_US;
+    uint32_t wear_min, wear_max;
+    spool_wear(&spool, &wear_min, &wear_max);
+    printf("%5zu %6lu %8lu %7lu %6.3f %7.2f %7.3f %8.0f %8.0f %5lu-%-5lu %s\n",
+           len, (unsigned long)sync_bytes, (unsigned long)n, (unsigned long)spool.stats.dropped,
+           (double)st->write_bytes / spool.stats.bytes,
+           st->pages / kb, st->erases / kb,
+           (double)(t1 - t0) * 1000 / n, dev_us / n,
+           (unsigned long)wear_min, (unsigned long)wear_max,
+           ok ? "ok" : "MISMATCH");
+    dt_flash_close(&flash);
+}
+
+static void run_drain(void)
+{
+    static dt_flash_t flash;
+    static spool_t spool;
+    if (!fresh(&flash, &spool, SPOOL_WRITE_BUF))
+    {
+        exit(1);
+    }
+
+    uint8_t rec[SPOOL_MAX_RECORD];
+    uint32_t n = spool_capacity(&spool, BENCH_FRAME);
+    for (uint32_t id = 0; id < n; id++)
+    {
+        make_record(rec, BENCH_FRAME, id);
+        spool_append(&spool, rec, BENCH_FRAME);
+    }
+    spool_sync(&spool);
+    dt_flash_close(&flash);
+
+    // as after a reboot
+    spool_config_t config = { .sync_bytes = SPOOL_WRITE_BUF };
+    int64_t t0 = esp_timer_get_time();
+    dt_flash_open(&flash, s_path, BENCH_PARTITION_SIZE);
+    spool_open(&spool, &flash, &config);
+    int64_t t1 = esp_timer_get_time();
+    uint64_t open_read = flash.stats.read_bytes;
+
+    bool ok = spool_count(&spool) == n;
+    uint32_t next_id = 0;
+    int got;
+    while ((got = spool_peek(&spool, rec, sizeof(rec))) > 0)
+    {
+        uint32_t id;
+        ok = ok && check_record(rec, got, BENCH_FRAME, &id) && id == next_id++;
+        spool_pop(&spool);
+    }
+    int64_t t2 = esp_timer_get_time();
+    ok = ok && next_id == n;
+
+    double mb = (double)n * BENCH_FRAME / (1024 * 1024);
+    double drain_read_mb = (double)(flash.stats.read_bytes - open_read) / (1024 * 1024);
+    double dev_s = drain_read_mb / BENCH_READ_MB_S + flash.stats.pages * BENCH_PAGE_PROGRAM_US / 1e6;
+    printf("%lu frames of %d bytes (%.2f MB)\n", (unsigned long)n, BENCH_FRAME, mb);
+    printf("  reopen:  %.1f ms here, reads %.0f KB, ~%.0f ms on the device\n",
+           (t1 - t0) / 1000.0, open_read / 1024.0, open_read / (1024.0 * 1024) / BENCH_READ_MB_S * 1000);
+    printf("  drain:   %.0f frames/s, %.1f MB/s here; %lu drain marks (%lu pages), ~%.0f frames/s on the device  %s\n",
+           n / ((t2 - t1) / 1e6), mb / ((t2 - t1) / 1e6),
+           (unsigned long)spool.stats.marks, (unsigned long)flash.stats.pages,
+           n / dev_s, ok ? "ok" : "MISMATCH");
+    dt_flash_close(&flash);
+}
+
+static void run_power_cuts(int trials)
+{
+    static dt_flash_t flash;
+    static spool_t spool;
+    uint8_t rec[SPOOL_MAX_RECORD];
+    int bad = 0;
+    uint32_t torn = 0;
+    uint32_t max_lost = 0, max_dups = 0;
+    uint64_t lost = 0, dups = 0;
+
+    // every cut fails a write or two, and says so
+    esp_log_level_set("*", ESP_LOG_NONE);
+    srand48(3);
+    for (int t = 0; t < trials; t++)
+    {
+        size_t len = 20 + (size_t)(drand48() * (BENCH_FRAME - 20));
+        if (!fresh(&flash, &spool, (uint32_t)(drand48() * SPOOL_WRITE_BUF)))
+        {
+            exit(1);
+        }
+        dt_flash_power_cut(&flash, (int64_t)(drand48() * BENCH_PARTITION_SIZE / 2));
+
+        // about a third drained as it goes, like a link that comes and goes
+        uint32_t appended = 0, durable = 0, drained = 0;
+        while (!dt_flash_dead(&flash) && appended < spool_capacity(&spool, len) / 2)
+        {
+            make_record(rec, len, appended);
+            if (spool_append(&spool, rec, len) != 0)
+            {
+                break;
+            }
+            appended++;
+            if (spool.buf_len == 0)
+            {
+                durable = appended;
+            }
+            if (drand48() < 0.35 && spool_peek(&spool, rec, sizeof(rec)) > 0)
+            {
+                spool_pop(&spool);
+                drained++;
+            }
+        }
+        dt_flash_close(&flash);
+
+        spool_config_t config = { .sync_bytes = SPOOL_WRITE_BUF };
+        dt_flash_open(&flash, s_path, BENCH_PARTITION_SIZE);
+        spool_open(&spool, &flash, &config);
+        torn += spool.stats.torn;
+
+        bool ok = true;
+        uint32_t first = UINT32_MAX, next_id = 0;
+        int got;
+        while ((got = spool_peek(&spool, rec, sizeof(rec))) > 0)
+        {
+            uint32_t id = 0;
+            ok = ok && check_record(rec, got, len, &id) && (first == UINT32_MAX || id == next_id);
+            first = first == UINT32_MAX ? id : first;
+            next_id = id + 1;
+            spool_pop(&spool);
+        }
+        if (first == UINT32_MAX)
+        {
+            first = next_id = drained;
+        }
+
+        // nothing undrained skipped, nothing synced lost
+        ok = ok && first <= drained && next_id >= durable;
+        uint32_t trial_lost = appended > next_id ? appended - next_id : 0;
+        uint32_t trial_dups = drained - first;
+        lost += trial_lost;
+        dups += trial_dups;
+        max_lost = trial_lost > max_lost ? trial_lost : max_lost;
+        max_dups = trial_dups > max_dups ? trial_dups : max_dups;
+        if (!ok)
+        {
+            bad++;
+            printf("  trial %d: %zu byte records, appended %lu, synced %lu, drained %lu; got back %lu..%lu\n",
+                   t, len, (unsigned long)appended, (unsigned long)durable, (unsigned long)drained,
+                   (unsigned long)first, (unsigned long)next_id);
+        }
+        dt_flash_close(&flash);
+    }
+
+    printf("%d power cuts, %lu torn writes found: %d broken; unsynced records lost avg %.1f max %lu, "
+           "drained ones sent again avg %.1f max %lu\n",
+           trials, (unsigned long)torn, bad, (double)lost / trials, (unsigned long)max_lost,
+           (double)dups / trials, (unsigned long)max_dups);
+}
+
+int main(int argc, char **argv)
+{
+    esp_log_level_set("*", ESP_LOG_ERROR);
+    s_path = argc > 1 ? argv[1] : s_path;
+    int trials = argc > 2 ? atoi(argv[2]) : 200;
+
+    printf("%u KB spool, %d byte sectors\n\n", BENCH_PARTITION_SIZE / 1024, SPOOL_SECTOR_SIZE);
+    printf("%5s %6s %8s %7s %6s %7s %7s %8s %8s %11s\n",
+           "len", "buffer", "records", "dropped", "amp", "pg/KB", "er/KB", "ns/rec", "dev us", "wear");
+    static const size_t lens[] = { 24, 120, BENCH_FRAME };
+    static const uint32_t bufs[] = { 0, 256, SPOOL_WRITE_BUF };
+    for (size_t len : lens)
+    {
+        for (uint32_t buf : bufs)
+        {
+            run_write(len, buf);
+        }
+    }
+
+    printf("\n");
+    run_drain();
+    printf("\n");
+    run_power_cuts(trials);
+
+    unlink(s_path);
+    return 0;
+}
@@ -0,0 +1,71 @@
+/*
+    Linux build of the slave's TCP link, to see how many messages per second one
+    connection reaches against the base station's Linux server (or the real thing)
+
+    g++ -std=c++17 -O2 -I include -I ../DataTrans_common/include \
+        host/tcp_client_main.cpp src/tcp_link.cpp -o slave_tcp_client
+    ./slave_tcp_client [host] [port] [window] [seconds]
+*/
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "dt_frame.h"
+#include "tcp_link.h"
+
+static const char *TAG = "tcp_client";
+
+int main(int argc, char **argv)
+{
+    const char *host_ip = argc > 1 ? argv[1] : "127.0.0.1";
+    uint16_t port = argc > 2 ? (uint16_t)atoi(argv[2]) : 5000;
+    int window = argc > 3 ? atoi(argv[3]) : 4;
+    int seconds = argc > 4 ? atoi(argv[4]) : 10;
+
+    static const char *message = "Message from ESP32 TCP Socket Client";
+    static tcp_link_t link;
+    uint8_t frame[DT_FRAME_MAX_SIZE];
+    uint32_t seq = 0;
+
+    signal(SIGPIPE, SIG_IGN);
+    tcp_link_init(&link, host_ip, port, window);
+
+    int64_t start_us = esp_timer_get_time();
+    int64_t end_us = start_us + (int64_t)seconds * 1000000;
+    int64_t next_report_us = start_us + 1000000;
+
+    // no send period here, keep the window full the whole time
+    while (esp_timer_get_time() < end_us)
+    {
+        while (tcp_link_can_send(&link))
+        {
+            size_t frame_len = dt_frame_encode(frame, sizeof(frame), DT_TYPE_TEXT, 1, seq,
+                                               (uint32_t)esp_timer_get_time(), message, strlen(message));
+            if (tcp_link_send(&link, frame, frame_len) < 0)
+            {
+                break;
+            }
+            seq++;
+        }
+        tcp_link_poll(&link, 100);
+
+        if (esp_timer_get_time() >= next_report_us)
+        {
+            ESP_LOGI(TAG, "%.0f msg/s (window %d)", tcp_link_rate(&link), window);
+            next_report_us += 1000000;
+        }
+    }
+
+    double elapsed_s = (esp_timer_get_time() - start_us) / 1e6;
+    ESP_LOGI(TAG, "window %d: %lu responses in %.1f s = %.0f msg/s, connects %lu, failures %lu, lost %lu",
+             window,
+             (unsigned long)link.stats.completed,
+             elapsed_s,
+             link.stats.completed / elapsed_s,
+             (unsigned long)link.stats.connects,
+             (unsigned long)link.stats.connect_failures,
+             (unsigned long)link.stats.lost);
+
+    tcp_link_close(&link);
+    return 0;
+}
@@ -0,0 +1,345 @@
+/*
+    Discrete event simulation of N slaves sharing one ESP-NOW channel, to compare
+    the old free running senders with TDMA slots (tdma.h)
+
+    Every slave makes one frame of frame_len bytes each period_ms, as the batcher does
+    with ESPNOW_BATCH_LATENCY_MS, and pushes it into the real send queue (espnow_txq.h)
+    with the firmware's window and attempts. The queue's frames go to a driver that puts
+    them on the air one after another and reports each one back through on_sent.
+    Frames that overlap on air are both lost: there is no carrier sense or capture here,
+    so free running is the worst case (hidden nodes). A lost frame is on_sent(false) and
+    the queue sends it again.
+        - free: no gate, a frame goes as soon as it is made and the window has room, each
+          slave on its own drifting clock with a random phase. The periods are all the same,
+          so two slaves that land on top of each other stay that way for a long time, which
+          is why the free running numbers jump around between node counts
+        - tdma: the queue's gate is the firmware's espnow_tx_gate, every frame has to fit in
+          what is left of the slave's slot together with the frames still on air ahead of
+          it. Slots are timed off beacons the base station sends every superframe
+    "late" counts frames that were still on the air when their slot closed, there should
+    be none
+
+    g++ -std=c++17 -O2 -DDT_SIM_CLOCK -I include -I ../DataTrans_common/include \
+        host/tdma_sim.cpp src/espnow_txq.cpp -o tdma_sim
+    ./tdma_sim [period_ms] [frame_len] [seconds]
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+
+#include "dt_port.h"
+#include "dt_frame.h"
+#include "tdma.h"
+#include "espnow_batch.h"
+#include "espnow_txq.h"
+#include "shared_buf.h"
+
+#define SIM_TICK_US 10
+#define SIM_CLOCK_PPM 40            // crystal tolerance either way
+#define SIM_BEACON_DELAY_US 150     // most time from beacon on air to the receive callback
+#define SIM_SEND_JITTER_US 1000     // task scheduling before esp_now_send
+#define SIM_POLL_US 10000           // the sender task wakes at least this often
+#define SIM_DRIVER_QUEUE 4          // frames the driver takes before esp_now_send fails
+#define SIM_TX_WINDOW 2             // the slave's ESPNOW_TX_WINDOW
+#define SIM_TX_ATTEMPTS 3           // the slave's ESPNOW_TX_ATTEMPTS
+
+typedef struct
+{
+    double clock_scale;             // local time = true time * clock_scale
+    int64_t next_frame_us;          // true time the next frame is made
+    int64_t push_at_us;             // and handed to the send queue, after the task gets to it
+    int64_t wake_us;                // true time the slot timer fires, 0 = not set
+    int64_t next_poll_us;
+
+    espnow_txq_t txq;
+    shared_buf_t bufs[ESPNOW_TXQ_DEPTH];
+    std::atomic<uint16_t> buf_next[ESPNOW_TXQ_DEPTH];
+    block_pool_t pool;
+
+    size_t driver_len[SIM_DRIVER_QUEUE];    // taken by esp_now_send, not on the air yet
+    int64_t driver_made[SIM_DRIVER_QUEUE];
+    int driver_count;
+    bool on_air;
+
+    tdma_sched_t tdma;
+
+    uint32_t made;
+    uint32_t dropped;               // queue full
+} sim_node_t;
+
+typedef struct
+{
+    int node;                       // -1 for the beacon
+    int64_t start_us;
+    int64_t end_us;
+    int64_t made_us;
+    bool collided;
+} sim_tx_t;
+
+typedef struct
+{
+    uint32_t made;
+    uint32_t sent;
+    uint32_t delivered;
+    uint32_t collided;
+    uint32_t dropped;
+    uint32_t gave_up;
+    uint32_t late;
+    uint32_t beacons_lost;
+    double latency_us_sum;
+} sim_result_t;
+
+static const uint8_t BS_MAC[6] = { 0x24, 0x0A, 0xC4, 0x00, 0x00, 0x00 };
+
+static sim_node_t *s_node;          // slave whose queue is running, its callbacks take no context
+static int64_t s_now;
+
+static int64_t rand_range(int64_t n)
+{
+    return n > 0 ? (int64_t)(drand48() * n) : 0;
+}
+
+// esp_now_send: the frame waits its turn for the slave's radio
+static int sim_send(const uint8_t *, const uint8_t *frame, size_t len)
+{
+    if (s_node->driver_count == SIM_DRIVER_QUEUE)
+    {
+        return -1;
+    }
+    int64_t made_us;
+    memcpy(&made_us, frame, sizeof(made_us));
+    s_node->driver_len[s_node->driver_count] = len;
+    s_node->driver_made[s_node->driver_count] = made_us;
+    s_node->driver_count++;
+    return 0;
+}
+
+// espnow_tx_gate in the slave, on the slave's own clock, with the slot timer for when it says wait
+static int64_t sim_gate(size_t len, int in_flight, size_t in_flight_bytes)
+{
+    uint32_t airtime_us = espnow_airtime_us(len) + in_flight * espnow_airtime_us(0) +
+                          (uint32_t)(in_flight_bytes * 8 / ESPNOW_PHY_RATE_MBPS);
+    int64_t wait_us = tdma_wait_us(&s_node->tdma, (int64_t)(s_now * s_node->clock_scale), airtime_us);
+    if (wait_us > 0 && in_flight == 0 && s_node->wake_us == 0)
+    {
+        s_node->wake_us = s_now + (int64_t)(wait_us / s_node->clock_scale);
+    }
+    return wait_us;
+}
+
+static void air_start(std::vector<sim_tx_t> &air, int node, int64_t now, uint32_t airtime_us, int64_t made_us)
+{
+    sim_tx_t tx = {node, now, now + airtime_us, made_us, false};
+    for (sim_tx_t &other : air)
+    {
+        if (other.end_us > now)
+        {
+            other.collided = true;
+            tx.collided = true;
+        }
+    }
+    air.push_back(tx);
+}
+
+// Whether a frame that went on the air at start_us (true time) and ended at end_us stayed inside the node's slot
+static bool in_slot(const sim_node_t *n, int64_t start_us, int64_t end_us)
+{
+    const tdma_sched_t *t = &n->tdma;
+    int64_t local_start = (int64_t)(start_us * n->clock_scale);
+    if (!tdma_active(t, local_start))
+    {
+        return true;
+    }
+    int64_t into_frame = (local_start - t->superframe_start_us) % t->superframe_us;
+    int64_t into_end = into_frame + (int64_t)((end_us - start_us) * n->clock_scale);
+    return into_frame >= (int64_t)t->slot * t->slot_us && into_end <= (int64_t)(t->slot + 1) * t->slot_us;
+}
+
+static sim_result_t simulate(int nodes, bool slotted, int period_ms, size_t frame_len, int seconds)
+{
+    sim_result_t res = {};
+    std::vector<sim_node_t> node(nodes);
+    std::vector<sim_tx_t> air;
+
+    uint32_t beacon_airtime_us = espnow_airtime_us(DT_FRAME_HDR_SIZE + sizeof(dt_beacon_t));
+    uint32_t superframe_us = tdma_slot_count(nodes) * TDMA_SLOT_US;
+    int64_t period_us = (int64_t)period_ms * 1000;
+    int64_t end_us = (int64_t)seconds * 1000000;
+    std::vector<uint8_t> frame(frame_len, 0);
+
+    srand48(nodes);
+    for (int i = 0; i < nodes; i++)
+    {
+        sim_node_t *n = &node[i];
+        n->clock_scale = 1.0 + (rand_range(2 * SIM_CLOCK_PPM + 1) - SIM_CLOCK_PPM) * 1e-6;
+        n->next_frame_us = rand_range(period_us);
+        n->push_at_us = n->next_frame_us + rand_range(SIM_SEND_JITTER_US);
+        n->wake_us = 0;
+        n->next_poll_us = 0;
+        n->driver_count = 0;
+        n->on_air = false;
+        n->made = 0;
+        n->dropped = 0;
+        shared_buf_pool_init(&n->pool, n->bufs, n->buf_next, ESPNOW_TXQ_DEPTH);
+        espnow_txq_init(&n->txq, SIM_TX_WINDOW, SIM_TX_ATTEMPTS, sim_send, &n->pool);
+        espnow_txq_set_gate(&n->txq, slotted ? sim_gate : NULL);
+        tdma_init(&n->tdma);
+        n->tdma.slot = slotted ? i + 1 : 0;
+    }
+
+    int64_t next_beacon_us = 0;
+
+    for (int64_t now = 0; now < end_us; now += SIM_TICK_US)
+    {
+        s_now = now;
+        dt_sim_clock_us = now;
+
+        // frames that finished on air
+        for (size_t k = 0; k < air.size();)
+        {
+            sim_tx_t tx = air[k];
+            if (tx.end_us > now)
+            {
+                k++;
+                continue;
+            }
+            air[k] = air.back();
+            air.pop_back();
+
+            if (tx.node < 0)
+            {
+                if (tx.collided)
+                {
+                    res.beacons_lost++;
+                }
+                else
+                {
+                    dt_beacon_t beacon = {};
+                    beacon.superframe_us = superframe_us;
+                    beacon.slot_us = TDMA_SLOT_US;
+                    beacon.slot_count = tdma_slot_count(nodes);
+                    for (sim_node_t &n : node)
+                    {
+                        // the slave stamps the beacon with its own clock, a little late
+                        int64_t rx_us = tx.start_us + rand_range(SIM_BEACON_DELAY_US);
+                        tdma_on_beacon(&n.tdma, &beacon, (int64_t)(rx_us * n.clock_scale));
+                    }
+                }
+                continue;
+            }
+
+            sim_node_t *n = &node[tx.node];
+            res.late += !in_slot(n, tx.start_us, tx.end_us);
+            if (tx.collided)
+            {
+                res.collided++;
+            }
+            else
+            {
+                res.delivered++;
+                res.latency_us_sum += tx.end_us - tx.made_us;
+            }
+            n->on_air = false;
+            s_node = n;
+            espnow_txq_on_sent(&n->txq, BS_MAC, !tx.collided);
+        }
+
+        if (slotted && now >= next_beacon_us)
+        {
+            air_start(air, -1, now, beacon_airtime_us, now);
+            next_beacon_us += superframe_us;
+        }
+
+        for (int i = 0; i < nodes; i++)
+        {
+            sim_node_t *n = &node[i];
+            s_node = n;
+
+            if (now >= n->push_at_us)
+            {
+                n->made++;
+                memcpy(frame.data(), &now, sizeof(now));
+                if (espnow_txq_push(&n->txq, BS_MAC, frame.data(), frame_len) != 0)
+                {
+                    n->dropped++;
+                }
+                // the slave's timer runs on its own crystal
+                n->next_frame_us += (int64_t)(period_us / n->clock_scale);
+                n->push_at_us = n->next_frame_us + rand_range(SIM_SEND_JITTER_US);
+            }
+
+            // the slot timer, or the sender task waking for something else
+            if ((n->wake_us != 0 && now >= n->wake_us) || now >= n->next_poll_us)
+            {
+                n->wake_us = 0;
+                n->next_poll_us = now + SIM_POLL_US;
+                espnow_txq_poll(&n->txq);
+            }
+
+            if (n->on_air || n->driver_count == 0)
+            {
+                continue;
+            }
+            uint32_t airtime_us = espnow_airtime_us(n->driver_len[0]);
+            air_start(air, i, now, airtime_us, n->driver_made[0]);
+            n->on_air = true;
+            res.sent++;
+
+            n->driver_count--;
+            for (int q = 0; q < n->driver_count; q++)
+            {
+                n->driver_len[q] = n->driver_len[q + 1];
+                n->driver_made[q] = n->driver_made[q + 1];
+            }
+        }
+    }
+
+    for (sim_node_t &n : node)
+    {
+        res.made += n.made;
+        res.dropped += n.dropped;
+        const espnow_txq_peer_stats_t *st = espnow_txq_peer_stats(&n.txq, 0);
+        res.gave_up += st != NULL ? st->failed : 0;
+    }
+    return res;
+}
+
+int main(int argc, char **argv)
+{
+    int period_ms = argc > 1 ? atoi(argv[1]) : 500;
+    size_t frame_len = argc > 2 ? (size_t)atoi(argv[2]) : DT_FRAME_MAX_SIZE;
+    int seconds = argc > 3 ? atoi(argv[3]) : 20;
+
+    if (period_ms <= 0 || frame_len < (size_t)DT_FRAME_HDR_SIZE || frame_len > DT_FRAME_MAX_SIZE || seconds <= 0)
+    {
+        printf("usage: %s [period_ms] [frame_len %d..%d] [seconds]\n", argv[0], DT_FRAME_HDR_SIZE, DT_FRAME_MAX_SIZE);
+        return 1;
+    }
+    esp_log_level_set("*", ESP_LOG_ERROR);
+
+    printf("one %u byte frame per node every %d ms, %u us on air, window %d, %d attempts, %d s simulated\n\n",
+           (unsigned)frame_len, period_ms, (unsigned)espnow_airtime_us(frame_len), SIM_TX_WINDOW, SIM_TX_ATTEMPTS, seconds);
+    printf("nodes  mode  offered/s  delivered/s  delivery%%  collision%%  queue drops  gave up   late  latency ms\n");
+
+    static const int node_counts[] = {1, 2, 4, 8, 16, 32, 48, 64};
+    for (int nodes : node_counts)
+    {
+        for (int slotted = 0; slotted <= 1; slotted++)
+        {
+            sim_result_t r = simulate(nodes, slotted, period_ms, frame_len, seconds);
+            printf("%5d  %-4s  %9.1f  %11.1f  %9.1f  %10.1f  %11lu  %7lu  %5lu  %10.1f\n",
+                   nodes,
+                   slotted ? "tdma" : "free",
+                   (double)r.made / seconds,
+                   (double)r.delivered / seconds,
+                   r.made ? 100.0 * r.delivered / r.made : 0.0,
+                   r.sent ? 100.0 * r.collided / r.sent : 0.0,
+                   (unsigned long)r.dropped,
+                   (unsigned long)r.gave_up,
+                   (unsigned long)r.late,
+                   r.delivered ? r.latency_us_sum / r.delivered / 1000.0 : 0.0);
+        }
+    }
+    return 0;
+}
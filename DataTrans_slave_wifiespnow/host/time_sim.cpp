@@ -0,0 +1,476 @@
+/*
+    Time sync (time_sync.h) on the simulated radio (dt_transport_sim.h), every clock with its own
+    skew. Checks how close each slave's idea of the base station's time is, and how close the
+    one way latencies the base station works out from the stamps are to the real ones
+
+    g++ -std=c++17 -O2 -DDT_SIM_CLOCK -I include -I ../DataTrans_common/include \
+        host/time_sim.cpp src/time_sync.cpp -o time_sim
+    ./time_sim [slaves] [seed]
+
+    The base station beacons every superframe with the time its previous beacon's on_sent came
+    back, and answers DT_TYPE_TIME_REQ straight away. Every clock, the base station's too, runs
+    fast or slow by its own ppm from a random start: the base station's is the one the slaves
+    have to match. Each slave sends a frame every SIM_SEND_MS stamped with what it thinks the
+    base station's time is, carrying the true send time for the base station to check against.
+    After SIM_WARMUP_S, every SIM_SAMPLE_MS:
+        - sync error: the slave's estimate of the base station's clock minus the real thing,
+          |median|, 99th and worst over every slave and sample, in us. "synced" is the share
+          of samples the slave had an estimate at all
+        - latency error: the one way latency from the stamp minus the real one, per frame
+    Runs: skews of 0, +-20 ppm and +-100 ppm, +-20 ppm with every slave drifting another 0.3 ppm
+    a second (warming up), 30% loss, a base station that doesn't put times in its beacons
+    (exchanges only), TCP only (1-20 ms each way, no ESP-NOW at all), TCP alongside ESP-NOW,
+    the same with ESP-NOW gone from SIM_OUTAGE_S for SIM_OUTAGE_LEN_S, and a base station
+    reboot at SIM_REBOOT_S (its clock starts from 0, errors in the SIM_RESYNC_S after are left
+    out and "resync" is the worst time any slave took to get back under SIM_RESYNC_US).
+    The base station can only have DT_SIM_MAX_PEERS peers, the broadcast one and one per slave,
+    so there are at most DT_SIM_MAX_PEERS - 1 slaves
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <vector>
+
+#include "dt_port.h"
+#include "dt_frame.h"
+#include "dt_transport_sim.h"
+#include "tdma.h"
+#include "time_sync.h"
+
+#define SIM_STEP_US 1000
+#define SIM_SEND_MS 500
+#define SIM_RUN_S 120
+#define SIM_WARMUP_S 20
+#define SIM_SAMPLE_MS 100
+#define SIM_REBOOT_S 60
+#define SIM_RESYNC_S 10
+#define SIM_RESYNC_US 1000
+#define SIM_TCP_MIN_US 1000
+#define SIM_TCP_MAX_US 20000
+#define SIM_OUTAGE_S 50
+#define SIM_OUTAGE_LEN_S 30
+#define SIM_BS 0
+#define SIM_MAX_SLAVES (DT_SIM_MAX_PEERS - 1)
+
+// Reads sim time as a clock that started at offset_us and runs ppm fast, plus ramp_ppm every second since
+typedef struct
+{
+    double offset_us;
+    double ppm;
+    double ramp_ppm;
+} sim_clock_t;
+
+static int64_t clock_at(const sim_clock_t *c, int64_t sim_us)
+{
+    double t = (double)sim_us;
+    return (int64_t)(c->offset_us + t + (c->ppm * t + c->ramp_ppm * t * t / 2e6) * 1e-6);
+}
+
+typedef struct
+{
+    int index;
+    dt_transport_t *radio;
+    sim_clock_t clock;
+    time_sync_t ts;
+    int64_t next_send_us;
+    int64_t next_tcp_us;            // the TCP task's own schedule, sim time
+    uint32_t seq;
+    int64_t resynced_us;            // first sample back under SIM_RESYNC_US after the reboot
+} sim_slave_t;
+
+// One exchange on its way over TCP
+typedef struct
+{
+    int64_t at_us;
+    int slave;
+    bool answer;                    // false: request on its way to the base station
+    dt_time_resp_t resp;
+} sim_tcp_t;
+
+typedef struct
+{
+    const char *label;
+    double skew_ppm;                // each slave anywhere within +-
+    double ramp_ppm;
+    double loss;
+    bool beacon_time;
+    bool espnow;                    // exchanges and beacons over ESP-NOW at all
+    bool tcp;
+    bool outage;                    // ESP-NOW gone for a while
+    bool reboot;
+} sim_run_t;
+
+// The payload of the slaves' data frames, the truth to check the stamp against
+typedef struct __attribute__((packed))
+{
+    int64_t sent_sim_us;
+} sim_data_t;
+
+static dt_sim_radio_t s_radio;
+static sim_slave_t s_slaves[SIM_MAX_SLAVES];   // time_sync_t doesn't copy, it has an atomic in it
+static int s_slave_count;
+static std::vector<sim_tcp_t> s_tcp;
+static uint8_t s_bs_mac[6];
+static sim_clock_t s_bs_clock;
+static int64_t s_beacon_queued_us;  // base station time the last beacon was handed over
+static int64_t s_beacon_sent_us;    // and its on_sent came back
+static std::vector<int64_t> s_latency_err;
+static uint32_t s_unstamped;
+
+static int64_t bs_now(void)
+{
+    return clock_at(&s_bs_clock, esp_timer_get_time());
+}
+
+static void bs_on_recv(dt_transport_t *t, const uint8_t *src_mac, int8_t, const uint8_t *data, size_t len)
+{
+    int64_t rx_us = bs_now();
+    dt_frame_view_t view;
+    if (dt_frame_decode(data, len, &view) <= 0)
+    {
+        return;
+    }
+
+    if (view.hdr->type == DT_TYPE_TIME_REQ && view.hdr->len >= sizeof(dt_time_req_t))
+    {
+        dt_time_resp_t resp;
+        resp.t1_us = ((const dt_time_req_t *)view.payload)->t1_us;
+        resp.t2_us = (uint64_t)rx_us;
+        resp.t3_us = (uint64_t)bs_now();
+        uint8_t frame[DT_FRAME_MAX_SIZE];
+        size_t frame_len = dt_frame_encode(frame, sizeof(frame), DT_TYPE_TIME_RESP, DT_BASE_STATION_NODE_ID,
+                                           view.hdr->seq, (uint32_t)resp.t3_us, &resp, sizeof(resp));
+        dt_transport_send(t, src_mac, frame, frame_len);
+    }
+    else if (view.hdr->type == DT_TYPE_BATCH && view.hdr->len >= sizeof(sim_data_t))
+    {
+        if (!(view.hdr->flags & DT_FLAG_MASTER_TIME))
+        {
+            s_unstamped++;
+            return;
+        }
+        // what node_track_latency works out, against how long it really took
+        int32_t latency_us = (int32_t)((uint32_t)rx_us - view.hdr->timestamp_us);
+        int64_t true_us = esp_timer_get_time() - ((const sim_data_t *)view.payload)->sent_sim_us;
+        if (esp_timer_get_time() >= SIM_WARMUP_S * 1000000LL)
+        {
+            s_latency_err.push_back(latency_us - true_us);
+        }
+    }
+}
+
+static void bs_on_sent(dt_transport_t *, const uint8_t *dst_mac, bool success)
+{
+    if (memcmp(dst_mac, DT_BROADCAST_MAC, 6) == 0 && success)
+    {
+        s_beacon_sent_us = bs_now();
+    }
+}
+
+static void bs_beacon(uint32_t seq, bool with_time)
+{
+    uint16_t slots = tdma_slot_count((uint16_t)s_slave_count);
+    dt_beacon_t beacon = {};
+    beacon.superframe_us = (uint32_t)slots * TDMA_SLOT_US;
+    beacon.slot_us = TDMA_SLOT_US;
+    beacon.slot_count = slots;
+    beacon.channel = DT_SIM_CHANNEL;
+    // only if the last beacon's on_sent came back since it was handed over
+    if (with_time && s_beacon_queued_us != 0 && s_beacon_sent_us >= s_beacon_queued_us)
+    {
+        beacon.prev_tx_us = (uint64_t)s_beacon_sent_us;
+    }
+    s_beacon_queued_us = bs_now();
+
+    uint8_t frame[DT_FRAME_MAX_SIZE];
+    size_t frame_len = dt_frame_encode(frame, sizeof(frame), DT_TYPE_BEACON, DT_BASE_STATION_NODE_ID,
+                                       seq, (uint32_t)s_beacon_queued_us, &beacon, sizeof(beacon));
+    dt_transport_send(dt_sim_radio_node(&s_radio, SIM_BS), DT_BROADCAST_MAC, frame, frame_len);
+}
+
+static void slave_on_recv(dt_transport_t *t, const uint8_t *src_mac, int8_t, const uint8_t *data, size_t len)
+{
+    sim_slave_t *slave = (sim_slave_t *)t->user;
+    int64_t rx_us = clock_at(&slave->clock, esp_timer_get_time());
+    dt_frame_view_t view;
+    if (dt_frame_decode(data, len, &view) <= 0 || memcmp(src_mac, s_bs_mac, 6) != 0)
+    {
+        return;
+    }
+
+    if (view.hdr->type == DT_TYPE_BEACON && DT_BEACON_HAS(view.hdr->len, prev_tx_us))
+    {
+        time_sync_on_beacon(&slave->ts, view.hdr->seq, ((const dt_beacon_t *)view.payload)->prev_tx_us, rx_us);
+    }
+    else if (view.hdr->type == DT_TYPE_TIME_RESP && view.hdr->len >= sizeof(dt_time_resp_t))
+    {
+        time_sync_on_response(&slave->ts, (const dt_time_resp_t *)view.payload, rx_us, TIME_SYNC_VIA_ESPNOW);
+    }
+}
+
+static uint32_t tcp_delay_us(void)
+{
+    return SIM_TCP_MIN_US + dt_sim_random(&s_radio) % (SIM_TCP_MAX_US - SIM_TCP_MIN_US);
+}
+
+static void sim_reset(int slaves, const sim_run_t *run, uint32_t seed)
+{
+    dt_sim_config_t config = dt_sim_default_config();
+    config.loss = run->loss;
+    config.seed = seed;
+    dt_sim_radio_init(&s_radio, slaves + 1, &config);
+
+    s_bs_clock.offset_us = 3600e6 + dt_sim_random(&s_radio) % 1000000;
+    s_bs_clock.ppm = 13;
+    s_bs_clock.ramp_ppm = 0;
+    s_beacon_queued_us = 0;
+    s_beacon_sent_us = 0;
+    s_tcp.clear();
+    s_latency_err.clear();
+    s_unstamped = 0;
+
+    dt_transport_t *bs = dt_sim_radio_node(&s_radio, SIM_BS);
+    dt_transport_set_callbacks(bs, bs_on_recv, bs_on_sent, NULL);
+    dt_transport_own_mac(bs, s_bs_mac);
+    dt_transport_add_peer(bs, DT_BROADCAST_MAC, DT_SIM_CHANNEL);
+
+    s_slave_count = slaves;
+    for (int i = 0; i < slaves; i++)
+    {
+        sim_slave_t *s = &s_slaves[i];
+        s->index = i;
+        s->radio = dt_sim_radio_node(&s_radio, i + 1);
+        s->clock.offset_us = dt_sim_random(&s_radio) % 10000000;
+        s->clock.ppm = (dt_sim_random_unit(&s_radio) * 2 - 1) * run->skew_ppm;
+        s->clock.ramp_ppm = run->ramp_ppm;
+        s->next_send_us = dt_sim_random(&s_radio) % (SIM_SEND_MS * 1000);
+        s->next_tcp_us = dt_sim_random(&s_radio) % (TIME_SYNC_PERIOD_MS * 1000);
+        s->resynced_us = 0;
+        time_sync_init(&s->ts, (uint32_t)(i + 1), clock_at(&s->clock, 0));
+        dt_transport_set_callbacks(s->radio, slave_on_recv, NULL, s);
+        dt_transport_add_peer(s->radio, s_bs_mac, DT_SIM_CHANNEL);
+
+        uint8_t mac[6];
+        dt_transport_own_mac(s->radio, mac);
+        dt_transport_add_peer(bs, mac, DT_SIM_CHANNEL);
+    }
+}
+
+// The sender task: exchanges when due, and the data frames stamped with the base station's time
+static void slave_step(sim_slave_t *s, const sim_run_t *run, int64_t now)
+{
+    int64_t local_us = clock_at(&s->clock, now);
+    uint8_t frame[DT_FRAME_MAX_SIZE];
+
+    dt_time_req_t req;
+    if (run->espnow && time_sync_due(&s->ts, local_us))
+    {
+        time_sync_request(&req, local_us);
+        size_t frame_len = dt_frame_encode(frame, sizeof(frame), DT_TYPE_TIME_REQ, (uint16_t)(s->index + 1),
+                                           s->seq++, (uint32_t)local_us, &req, sizeof(req));
+        dt_transport_send(s->radio, s_bs_mac, frame, frame_len);
+    }
+
+    // as the TCP task does it, every TIME_SYNC_PERIOD_MS while ESP-NOW isn't answering
+    if (run->tcp && now >= s->next_tcp_us)
+    {
+        if (time_sync_want_tcp(&s->ts, local_us))
+        {
+            time_sync_request(&req, local_us);
+            sim_tcp_t ex = { now + tcp_delay_us(), s->index, false, { req.t1_us, 0, 0 } };
+            s_tcp.push_back(ex);
+        }
+        s->next_tcp_us += TIME_SYNC_PERIOD_MS * 1000;
+    }
+
+    if (run->espnow && now >= s->next_send_us)
+    {
+        sim_data_t data = { now };
+        int64_t master_us;
+        bool synced = time_sync_master_us(&s->ts, local_us, &master_us);
+        memcpy(dt_frame_payload(frame), &data, sizeof(data));
+        size_t frame_len = dt_frame_finish_flags(frame, DT_TYPE_BATCH, synced ? DT_FLAG_MASTER_TIME : 0, (uint16_t)(s->index + 1),
+                                                 s->seq++, (uint32_t)(synced ? master_us : local_us), sizeof(data));
+        dt_transport_send(s->radio, s_bs_mac, frame, frame_len);
+        s->next_send_us += SIM_SEND_MS * 1000;
+    }
+}
+
+// Both ends of the TCP exchanges that are due, the base station answering as tcp_requests does
+static void tcp_step(int64_t now)
+{
+    for (size_t i = 0; i < s_tcp.size(); )
+    {
+        sim_tcp_t *ex = &s_tcp[i];
+        if (ex->at_us > now)
+        {
+            i++;
+            continue;
+        }
+        if (!ex->answer)
+        {
+            ex->resp.t2_us = ex->resp.t3_us = (uint64_t)clock_at(&s_bs_clock, ex->at_us);
+            ex->answer = true;
+            ex->at_us += tcp_delay_us();
+            i++;
+            continue;
+        }
+        sim_slave_t *s = &s_slaves[ex->slave];
+        time_sync_on_response(&s->ts, &ex->resp, clock_at(&s->clock, ex->at_us), TIME_SYNC_VIA_TCP);
+        s_tcp.erase(s_tcp.begin() + i);
+    }
+}
+
+static int64_t percentile(const std::vector<int64_t> &sorted, double p)
+{
+    if (sorted.empty())
+    {
+        return 0;
+    }
+    size_t i = (size_t)(p * sorted.size());
+    return sorted[i < sorted.size() ? i : sorted.size() - 1];
+}
+
+static void run(const sim_run_t *r, int slaves, uint32_t seed)
+{
+    sim_reset(slaves, r, seed);
+
+    int64_t end_us = SIM_RUN_S * 1000000LL;
+    int64_t reboot_us = r->reboot ? SIM_REBOOT_S * 1000000LL : INT64_MAX;
+    int64_t superframe_us = tdma_slot_count((uint16_t)slaves) * TDMA_SLOT_US;
+    int64_t next_beacon_us = 0;
+    int64_t next_sample_us = SIM_WARMUP_S * 1000000LL;
+    uint32_t beacon_seq = 0;
+    std::vector<int64_t> errors;
+    uint32_t samples = 0, unsynced = 0;
+
+    for (int64_t now = 0; now < end_us; now += SIM_STEP_US)
+    {
+        dt_sim_radio_run_until(&s_radio, now);
+
+        if (r->outage)
+        {
+            bool out = now >= SIM_OUTAGE_S * 1000000LL && now < (SIM_OUTAGE_S + SIM_OUTAGE_LEN_S) * 1000000LL;
+            s_radio.config.loss = out ? 1.0 : r->loss;
+        }
+
+        if (now == reboot_us)
+        {
+            // back from a reboot: its clock starts again from nothing, and so do the beacons
+            s_bs_clock.offset_us = -(double)now;
+            beacon_seq = 0;
+            s_beacon_queued_us = 0;
+        }
+        if (r->espnow && now >= next_beacon_us)
+        {
+            bs_beacon(beacon_seq++, r->beacon_time);
+            next_beacon_us += superframe_us;
+        }
+        tcp_step(now);
+        for (int i = 0; i < s_slave_count; i++)
+        {
+            slave_step(&s_slaves[i], r, now);
+        }
+
+        if (now >= next_sample_us)
+        {
+            bool settling = now >= reboot_us && now < reboot_us + SIM_RESYNC_S * 1000000LL;
+            int64_t master_us = bs_now();
+            for (int i = 0; i < s_slave_count; i++)
+            {
+                sim_slave_t &s = s_slaves[i];
+                int64_t estimate_us;
+                bool synced = time_sync_master_us(&s.ts, clock_at(&s.clock, now), &estimate_us);
+                int64_t error = synced ? estimate_us - master_us : INT64_MAX;
+                if (synced && error > -SIM_RESYNC_US && error < SIM_RESYNC_US && s.resynced_us == 0 && now >= reboot_us)
+                {
+                    s.resynced_us = now;
+                }
+                if (settling)
+                {
+                    continue;
+                }
+                samples++;
+                if (!synced)
+                {
+                    unsynced++;
+                    continue;
+                }
+                errors.push_back(error < 0 ? -error : error);
+            }
+            next_sample_us += SIM_SAMPLE_MS * 1000;
+        }
+    }
+
+    std::sort(errors.begin(), errors.end());
+    std::vector<int64_t> latency = s_latency_err;
+    for (int64_t &e : latency)
+    {
+        e = e < 0 ? -e : e;
+    }
+    std::sort(latency.begin(), latency.end());
+
+    uint32_t exchanges = 0, tcp_exchanges = 0, steps = 0;
+    int64_t resync_us = 0;
+    for (int i = 0; i < s_slave_count; i++)
+    {
+        const sim_slave_t &s = s_slaves[i];
+        exchanges += s.ts.stats.exchanges;
+        tcp_exchanges += s.ts.stats.tcp_exchanges;
+        steps += s.ts.stats.steps;
+        int64_t took = s.resynced_us != 0 ? s.resynced_us - reboot_us : end_us - reboot_us;
+        resync_us = took > resync_us ? took : resync_us;
+    }
+
+    printf("%-22s %6.1f%% %7lld %7lld %8lld",
+           r->label, samples ? 100.0 * (samples - unsynced) / samples : 0.0,
+           (long long)percentile(errors, 0.5), (long long)percentile(errors, 0.99),
+           (long long)(errors.empty() ? 0 : errors.back()));
+    if (latency.empty())
+    {
+        printf(" %7s %7s", "-", "-"); // no ESP-NOW data frames
+    }
+    else
+    {
+        printf(" %7lld %7lld", (long long)percentile(latency, 0.5), (long long)percentile(latency, 0.99));
+    }
+    printf(" %7.1f %7.1f %6.1f", exchanges * 60.0 / SIM_RUN_S / slaves, tcp_exchanges * 60.0 / SIM_RUN_S / slaves,
+           (double)steps / slaves);
+    if (r->reboot)
+    {
+        printf(" %7.1f s", resync_us / 1e6);
+    }
+    printf("\n");
+}
+
+int main(int argc, char **argv)
+{
+    int slaves = argc > 1 ? atoi(argv[1]) : SIM_MAX_SLAVES;
+    slaves = slaves < SIM_MAX_SLAVES ? slaves : SIM_MAX_SLAVES;
+    uint32_t seed = argc > 2 ? (uint32_t)atoi(argv[2]) : 1;
+
+    printf("%d slaves, %d s each, measured after %d s, base station clock +13 ppm\n\n", slaves, SIM_RUN_S, SIM_WARMUP_S);
+    printf("%-22s %7s %-25s %-15s %7s %7s %6s %9s\n", "", "", "      sync error us", "latency err us", "exch/", "tcp/", "", "");
+    printf("%-22s %7s %7s %7s %8s %7s %7s %7s %7s %6s %9s\n",
+           "run", "synced", "p50", "p99", "max", "p50", "p99", "min", "min", "steps", "resync");
+
+    static const sim_run_t runs[] =
+    {
+        { "no skew", 0, 0, 0.0, true, true, false, false, false },
+        { "+-20 ppm", 20, 0, 0.0, true, true, false, false, false },
+        { "+-100 ppm", 100, 0, 0.0, true, true, false, false, false },
+        { "+-20 ppm, warming", 20, 0.3, 0.0, true, true, false, false, false },
+        { "+-20 ppm, loss 30%", 20, 0, 0.3, true, true, false, false, false },
+        { "+-20 ppm, no beacon t", 20, 0, 0.0, false, true, false, false, false },
+        { "+-20 ppm, TCP only", 20, 0, 0.0, false, false, true, false, false },
+        { "+-20 ppm, ESP-NOW+TCP", 20, 0, 0.0, true, true, true, false, false },
+        { "+-20 ppm, ESP-NOW out", 20, 0, 0.0, true, true, true, true, false },
+        { "+-20 ppm, BS reboot", 20, 0, 0.0, true, true, false, false, true },
+    };
+    for (const sim_run_t &r : runs)
+    {
+        run(&r, slaves, seed);
+    }
+    return 0;
+}
@@ -0,0 +1,193 @@
+/*
+    One slave's send path on the simulated radio (dt_transport_sim.h): samples into espnow_batch,
+    frames into espnow_txq, the txq onto the radio, and a base station counting every record
+    that gets there
+
+    g++ -std=c++17 -O2 -DDT_SIM_CLOCK -I include -I ../DataTrans_common/include \
+        host/txq_sim.cpp src/espnow_batch.cpp src/espnow_txq.cpp -o txq_sim
+    ./txq_sim [seconds] [seed]
+
+    Each sample's value is its number, so the base station knows exactly which ones came.
+    One row per run:
+        - offered: samples made. refused: espnow_batch_add said -1, the caller knows those
+          didn't go in. accepted: the rest
+        - held: frames the txq was full for (batch send_errors). Each one stays in the batch
+          and goes again on the next poll, where it used to be thrown away
+        - gave up: frames the txq dropped after SIM_TX_ATTEMPTS sends, and the records in them
+        - lost: accepted records that neither arrived nor were in a frame the txq gave up on.
+          Has to be 0, and every record that arrived must have arrived once. Exits 1 if not
+    Runs: loss 0, 10% and 30% at the default rate, then the bitrate cut until the queue backs
+    up, with and without loss
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+
+#include "dt_port.h"
+#include "dt_frame.h"
+#include "dt_transport_sim.h"
+#include "espnow_batch.h"
+#include "espnow_txq.h"
+#include "shared_buf.h"
+
+#define SIM_STEP_US 1000            // how often the sender task gets to run
+#define SIM_DRAIN_US 5000000        // after the last sample, for what is still queued to get there
+#define SIM_BATCH_LATENCY_MS 50
+#define SIM_TX_WINDOW 2             // the slave's ESPNOW_TX_WINDOW
+#define SIM_TX_ATTEMPTS 3           // the slave's ESPNOW_TX_ATTEMPTS
+#define SIM_BS 0
+#define SIM_SLAVE 1
+
+static dt_sim_radio_t s_radio;
+static dt_transport_t *s_slave_radio;
+static uint8_t s_bs_mac[6];
+
+static espnow_batch_t s_batch;
+static espnow_txq_t s_txq;
+static shared_buf_t s_bufs[ESPNOW_TXQ_DEPTH];
+static std::atomic<uint16_t> s_buf_next[ESPNOW_TXQ_DEPTH];
+static block_pool_t s_pool;
+
+static std::vector<uint8_t> s_accepted;     // per sample number: 1 if the batch took it
+static std::vector<uint8_t> s_arrived;      // times it got to the base station
+static std::vector<uint8_t> s_dropped;      // in a frame the txq gave up on
+static uint32_t s_bad_frames;
+static uint32_t s_dropped_frames;
+
+// Calls fn with the number in every sample record of a batch frame
+template <typename F>
+static bool for_each_sample(const uint8_t *frame, size_t len, F fn)
+{
+    dt_frame_view_t view;
+    if (dt_frame_decode(frame, len, &view) <= 0 || view.hdr->type != DT_TYPE_BATCH)
+    {
+        return false;
+    }
+    size_t offset = 0;
+    const dt_record_hdr_t *rec;
+    const uint8_t *rec_data;
+    while (dt_record_next(view.payload, view.hdr->len, &offset, &rec, &rec_data))
+    {
+        if (rec->type == DT_TYPE_SENSOR && rec->len == sizeof(dt_sample_t))
+        {
+            dt_sample_t sample;
+            memcpy(&sample, rec_data, sizeof(sample));
+            fn((uint32_t)sample.value);
+        }
+    }
+    return true;
+}
+
+static int slave_raw_send(const uint8_t *peer_addr, const uint8_t *frame, size_t len)
+{
+    return dt_transport_send(s_slave_radio, peer_addr, frame, len);
+}
+
+// same as espnow_batch_send in the slave, without the spool
+static int slave_batch_send(const uint8_t *peer_addr, const uint8_t *frame, size_t len)
+{
+    return espnow_txq_push(&s_txq, peer_addr, frame, len);
+}
+
+static void slave_on_drop(const uint8_t *, const uint8_t *frame, size_t len)
+{
+    s_dropped_frames++;
+    for_each_sample(frame, len, [](uint32_t n) { s_dropped[n] = 1; });
+}
+
+static void slave_on_sent(dt_transport_t *, const uint8_t *dst_mac, bool success)
+{
+    espnow_txq_on_sent(&s_txq, dst_mac, success);
+    espnow_txq_poll(&s_txq);
+}
+
+static void bs_on_recv(dt_transport_t *, const uint8_t *, int8_t, const uint8_t *data, size_t len)
+{
+    if (!for_each_sample(data, len, [](uint32_t n) { s_arrived[n]++; }))
+    {
+        s_bad_frames++;
+    }
+}
+
+static bool sim_run(const char *label, double loss, uint32_t kbps, uint32_t rate, int64_t duration_us, uint32_t seed)
+{
+    dt_sim_config_t config = dt_sim_default_config();
+    config.loss = loss;
+    config.bitrate_kbps = kbps;
+    config.seed = seed;
+    dt_sim_radio_init(&s_radio, 2, &config);
+
+    dt_transport_t *bs = dt_sim_radio_node(&s_radio, SIM_BS);
+    dt_transport_set_callbacks(bs, bs_on_recv, NULL, NULL);
+    dt_transport_own_mac(bs, s_bs_mac);
+    s_slave_radio = dt_sim_radio_node(&s_radio, SIM_SLAVE);
+    dt_transport_set_callbacks(s_slave_radio, NULL, slave_on_sent, NULL);
+    dt_transport_add_peer(s_slave_radio, s_bs_mac, DT_SIM_CHANNEL);
+
+    shared_buf_pool_init(&s_pool, s_bufs, s_buf_next, ESPNOW_TXQ_DEPTH);
+    espnow_txq_init(&s_txq, SIM_TX_WINDOW, SIM_TX_ATTEMPTS, slave_raw_send, &s_pool);
+    espnow_txq_set_on_drop(&s_txq, slave_on_drop);
+    espnow_batch_init(&s_batch, SIM_SLAVE, SIM_BATCH_LATENCY_MS, slave_batch_send);
+
+    uint32_t offered = (uint32_t)(duration_us * rate / 1000000);
+    s_accepted.assign(offered, 0);
+    s_arrived.assign(offered, 0);
+    s_dropped.assign(offered, 0);
+    s_bad_frames = 0;
+    s_dropped_frames = 0;
+
+    uint32_t next = 0;
+    for (int64_t now = 0; now < duration_us + SIM_DRAIN_US; now += SIM_STEP_US)
+    {
+        dt_sim_radio_run_until(&s_radio, now);
+        while (next < offered && (int64_t)next * 1000000 / rate <= now)
+        {
+            dt_sample_t sample = {0, (int32_t)next};
+            s_accepted[next] = espnow_batch_add(&s_batch, s_bs_mac, DT_TYPE_SENSOR, &sample, sizeof(sample)) == 0;
+            next++;
+        }
+        espnow_batch_poll(&s_batch);
+        espnow_txq_poll(&s_txq);
+    }
+
+    uint32_t accepted = 0, arrived = 0, dropped = 0, lost = 0, twice = 0;
+    for (uint32_t n = 0; n < offered; n++)
+    {
+        accepted += s_accepted[n];
+        arrived += s_arrived[n] > 0;
+        dropped += s_dropped[n];
+        twice += s_arrived[n] > 1;
+        lost += s_accepted[n] && !s_arrived[n] && !s_dropped[n];
+    }
+
+    const espnow_batch_stats_t *st = &s_batch.stats;
+    printf("%-10s %5.0f%% %5lu %8lu %8lu %8lu %8lu %6lu %7lu %7lu %6lu %5lu\n",
+           label, loss * 100, (unsigned long)kbps, (unsigned long)offered, (unsigned long)st->add_refused,
+           (unsigned long)accepted, (unsigned long)arrived, (unsigned long)st->send_errors,
+           (unsigned long)s_dropped_frames, (unsigned long)dropped, (unsigned long)lost, (unsigned long)twice);
+
+    return lost == 0 && twice == 0 && s_bad_frames == 0 && accepted + st->add_refused == offered &&
+           espnow_txq_queued(&s_txq) == 0 && s_pool.in_use.load() == 0;
+}
+
+int main(int argc, char **argv)
+{
+    int seconds = argc > 1 ? atoi(argv[1]) : 60;
+    uint32_t seed = argc > 2 ? (uint32_t)atol(argv[2]) : 1;
+    int64_t duration_us = (int64_t)seconds * 1000000;
+    esp_log_level_set("*", ESP_LOG_ERROR);
+
+    printf("%-10s %6s %5s %8s %8s %8s %8s %6s %7s %7s %6s %5s\n",
+           "", "loss", "kbps", "offered", "refused", "accepted", "arrived", "held", "gave up", "in them", "lost", "twice");
+
+    bool ok = true;
+    ok &= sim_run("default", 0.0, 1000, 200, duration_us, seed);
+    ok &= sim_run("default", 0.1, 1000, 200, duration_us, seed);
+    ok &= sim_run("default", 0.3, 1000, 200, duration_us, seed);
+    ok &= sim_run("backed up", 0.0, 100, 1500, duration_us, seed);
+    ok &= sim_run("backed up", 0.1, 100, 1500, duration_us, seed);
+
+    printf(ok ? "every accepted record arrived once or was in a frame given up on\n" : "records lost\n");
+    return ok ? 0 : 1;
+}
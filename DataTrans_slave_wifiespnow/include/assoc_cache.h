@@ -0,0 +1,47 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+    What the slave learnt about its network last time, kept in NVS so the next boot can skip
+    the wait for wifi and the join broadcast
+        - The AP's channel and BSSID: wifi goes straight for that AP on that channel instead of
+          scanning them all, and ESP-NOW can go out on the channel before wifi has finished
+        - The base stations that took us in, newest first, and the slot the last one gave us
+        - Boot to first delivered frame on the last cold and the last cached boot, so one log
+          line compares the two paths
+        - Saved only when something in it changed, NVS wears too
+        - ESP32 only, not thread safe: the sender task owns it once the slave is up
+*/
+
+#define ASSOC_CACHE_NAMESPACE "dt_assoc"
+#define ASSOC_CACHE_VERSION 1
+#define ASSOC_CACHE_MAX_PEERS 4
+
+typedef struct __attribute__((packed))
+{
+    uint8_t version;
+    uint8_t channel;                    // 0 = nothing known
+    uint8_t bssid[6];
+    uint8_t peer_count;
+    uint8_t peers[ASSOC_CACHE_MAX_PEERS][6];
+    uint16_t slot;                      // TDMA slot from peers[0]'s last join ack
+    uint32_t cold_first_frame_ms;       // 0 = no boot of that kind yet
+    uint32_t cached_first_frame_ms;
+} assoc_cache_t;
+
+// Fills `cache` in from NVS. False (and an empty cache) if there is nothing, or it is from another version
+bool assoc_cache_load(assoc_cache_t *cache);
+
+// Writes it to NVS if it differs from what is there
+int assoc_cache_save(const assoc_cache_t *cache);
+
+// `mac` becomes peers[0], the rest move down and the oldest falls off
+void assoc_cache_add_peer(assoc_cache_t *cache, const uint8_t *mac);
+
+// Enough to start sending without a scan or a join
+static inline bool assoc_cache_usable(const assoc_cache_t *cache)
+{
+    return cache->channel != 0 && cache->peer_count > 0;
+}
@@ -0,0 +1,124 @@
+#pragma once
+
+#include <stdint.h>
+
+/*
+    Finding the base station again after it changed channel (the router moved, or the base
+    station went to another AP). Decides which channel ESP-NOW should be on, the caller
+    moves the radio and the peers and sends the probes
+        - The base station puts its channel in every beacon and join ack. Hearing it name
+          another channel than ours (our radio was moved under us, wifi reassociated) moves
+          us there straight away
+        - Delivery collapse: CHAN_TRACK_FAIL_RUN sends to the base station in a row came back
+          on_sent(false), or no beacon for CHAN_TRACK_SILENCE_BEACONS superframes (at least
+          CHAN_TRACK_SILENCE_MS) once we have had some. Plain loss doesn't get there, at 30%
+          loss eight in a row is 1 in 15000
+        - Then a sweep: one probe per channel (a join request, the base station answers every
+          one) and long enough there to hear a beacon too, one superframe and
+          CHAN_TRACK_DWELL_MARGIN_MS, at least CHAN_TRACK_DWELL_MS. The probe goes out at a
+          random point in the first half of that: every slave lost the base station at the
+          same moment, and fifty join requests at once crowd out the beacon itself.
+          1, 6 and 11 first, what routers pick, then the rest, and the channel we were on
+          last in case it was only noise. All 13 take 0.65 s at the shortest superframe
+        - Anything from the base station during the sweep ends it on that channel. A sweep
+          that found nothing goes back to the old channel and the next one starts after
+          CHAN_TRACK_BACKOFF_MS, doubling up to CHAN_TRACK_BACKOFF_MAX_MS, so a base station
+          that is simply off costs a sweep now and then rather than the channel
+        - Wifi reconnecting on a new channel is a hint: the base station is most likely on
+          the same AP, so that channel is tried first without waiting for a collapse
+        - Before the base station is known there are only broadcast join requests, which
+          always "work". One going unanswered starts the sweep instead (chan_track_no_answer)
+        - Not thread safe, belongs to the sender task
+*/
+
+#define CHAN_TRACK_MAX_CHANNEL 13
+#define CHAN_TRACK_FAIL_RUN 8
+#define CHAN_TRACK_SILENCE_BEACONS 8
+#define CHAN_TRACK_SILENCE_MS 1000
+#define CHAN_TRACK_DWELL_MS 50
+#define CHAN_TRACK_DWELL_MARGIN_MS 10
+#define CHAN_TRACK_BACKOFF_MS 1000
+#define CHAN_TRACK_BACKOFF_MAX_MS 30000
+
+typedef enum
+{
+    CHAN_TRACK_OK,                          // on the base station's channel as far as we know
+    CHAN_TRACK_SWEEP,
+    CHAN_TRACK_LOST,                        // last sweep found nothing, waiting for the next
+} chan_track_state_t;
+
+typedef struct
+{
+    uint32_t sweeps;
+    uint32_t found;                         // sweeps that ended on the base station
+    uint32_t probes;
+    uint32_t moves;                         // times the channel we settled on changed
+    uint32_t announced;                     // moves because the base station named another channel
+    uint32_t outage_max_ms;                 // last good contact to found again
+    uint32_t outage_last_ms;
+} chan_track_stats_t;
+
+typedef struct
+{
+    uint8_t state;                          // chan_track_state_t
+    uint8_t channel;                        // where the radio should be now
+    uint8_t home;                           // where it was when the sweep started
+
+    uint32_t fail_run;
+    bool beacons;                           // heard one since the last move, silence counts
+    int64_t last_heard_us;
+    int64_t last_ok_us;                     // last frame from it or send that got there
+
+    uint8_t order[CHAN_TRACK_MAX_CHANNEL];  // this sweep's channels, in the order they are tried
+    uint8_t count;
+    uint8_t next;
+    int64_t dwell_end_us;
+    int64_t probe_us;                       // when this channel's probe goes, 0 = it went
+    int64_t retry_us;                       // CHAN_TRACK_LOST: next sweep
+    uint32_t backoff_ms;
+    uint32_t dwell_us;
+    uint32_t silence_us;
+    uint32_t rng;
+
+    chan_track_stats_t stats;
+} chan_track_t;
+
+// `seed` spreads the probes out, anything that differs between slaves (the node id)
+void chan_track_init(chan_track_t *t, uint8_t channel, uint32_t seed, int64_t now_us);
+
+// on_sent for a unicast to the base station. Broadcasts say nothing, they always "work"
+void chan_track_on_sent(chan_track_t *t, bool success, int64_t now_us);
+
+/*
+    A frame from the base station. `announced` is the channel it said it is on, 0 if the frame
+    doesn't say. `superframe_us` is the beacon's, 0 for anything else
+*/
+void chan_track_on_heard(chan_track_t *t, uint8_t announced, uint32_t superframe_us, int64_t now_us);
+
+// The STA (re)associated, the AP is on `channel`
+void chan_track_hint(chan_track_t *t, uint8_t channel, int64_t now_us);
+
+/*
+    A broadcast join request went unanswered on chan_track_channel. Nothing is registered yet
+    for on_sent to fail on, so this is the collapse while joining: sweep now. True if a sweep
+    started, false while one runs or the last one's backoff is still on
+*/
+bool chan_track_no_answer(chan_track_t *t, int64_t now_us);
+
+/*
+    Run the timers. True if a probe should go out now, on chan_track_channel. Call it at
+    least every CHAN_TRACK_DWELL_MARGIN_MS while sweeping, and move the radio whenever
+    chan_track_channel changes
+*/
+bool chan_track_poll(chan_track_t *t, int64_t now_us);
+
+static inline uint8_t chan_track_channel(const chan_track_t *t)
+{
+    return t->channel;
+}
+
+// Data frames would only go to the wrong channel
+static inline bool chan_track_sweeping(const chan_track_t *t)
+{
+    return t->state == CHAN_TRACK_SWEEP;
+}
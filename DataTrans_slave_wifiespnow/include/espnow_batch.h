@@ -0,0 +1,109 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "dt_frame.h"
+#include "sample_codec.h"
+
+/*
+    ESP-NOW send aggregation
+        - Records (samples, text) for a peer are packed into one DT_TYPE_BATCH frame
+        - The frame goes out when the next record would not fit, or when the oldest
+          record in it has waited max_latency_ms
+        - The actual send is a function pointer so this can run without a radio
+        - Samples added with espnow_batch_add_sample go into a DT_TYPE_SENSOR_PACKED record
+          that keeps growing by one delta while the samples are for the same channel and
+          nothing else was added in between
+        - Frames are stamped when they are sent, by the clock set with espnow_batch_set_clock
+          (the base station's time, once the slave has it) or our own
+        - A frame the send refuses stays where it is and goes again on the next poll, as it
+          was (same seq). Until it is taken, adding to that peer returns -1
+*/
+
+#define ESPNOW_BATCH_MAX_PEERS 4
+#define ESPNOW_BATCH_RETRY_MS 10    // how soon poll wants to run again while a frame is held
+
+/*
+    Rough airtime of one ESP-NOW frame at the default 1 Mbps rate, for comparing setups:
+    long preamble + 43 bytes of 802.11 vendor action framing + payload, then SIFS + ACK
+*/
+#define ESPNOW_PHY_RATE_MBPS 1
+#define ESPNOW_PREAMBLE_US 192
+#define ESPNOW_MAC_OVERHEAD 43
+#define ESPNOW_ACK_US (10 + ESPNOW_PREAMBLE_US + 14 * 8 / ESPNOW_PHY_RATE_MBPS)
+
+static inline uint32_t espnow_airtime_us(size_t frame_len)
+{
+    return ESPNOW_PREAMBLE_US + (uint32_t)((ESPNOW_MAC_OVERHEAD + frame_len) * 8 / ESPNOW_PHY_RATE_MBPS) + ESPNOW_ACK_US;
+}
+
+typedef int (*espnow_batch_send_t)(const uint8_t *peer_addr, const uint8_t *frame, size_t len);
+
+typedef struct
+{
+    uint8_t peer_addr[6];
+    uint8_t frame[DT_FRAME_MAX_SIZE];   // records are written straight into its payload
+    size_t used;
+    uint16_t records;
+    int64_t oldest_us;
+    size_t held_len;                    // finished frame the send refused, 0 = none
+
+    bool pack_open;                     // the last record in the frame is a packed one still taking samples
+    size_t pack_at;                     // where its dt_record_hdr_t is in the payload
+    sample_pack_t pack;
+} espnow_batch_peer_t;
+
+typedef struct
+{
+    uint32_t records;
+    uint32_t frames;
+    uint32_t flush_full;        // sent because the frame was full
+    uint32_t flush_deadline;    // sent because the oldest record hit max_latency_ms
+    uint32_t send_errors;       // sends refused, the frame is kept and tried again
+    uint32_t add_refused;       // records turned away while a frame was held
+    uint64_t frame_bytes;
+    uint64_t airtime_us;        // espnow_airtime_us of every frame sent
+} espnow_batch_stats_t;
+
+typedef struct
+{
+    espnow_batch_peer_t peers[ESPNOW_BATCH_MAX_PEERS];
+    int peer_count;
+
+    uint16_t node_id;
+    uint32_t seq;
+    int64_t max_latency_us;
+    espnow_batch_send_t send;
+    dt_frame_clock_t clock;             // NULL: our own time
+
+    espnow_batch_stats_t stats;
+} espnow_batch_t;
+
+void espnow_batch_init(espnow_batch_t *batch, uint16_t node_id, uint32_t max_latency_ms, espnow_batch_send_t send);
+
+// Queue one record for the peer. Sends the current frame first if the record does not fit.
+// -1 if it can't be taken, including while a refused frame is still waiting to go
+int espnow_batch_add(espnow_batch_t *batch, const uint8_t *peer_addr, uint8_t type, const void *data, size_t len);
+
+// Queue one sample, delta encoded onto the open packed record if there is one for the channel
+int espnow_batch_add_sample(espnow_batch_t *batch, const uint8_t *peer_addr, uint16_t channel, int32_t value);
+
+// Change max_latency, e.g. from the slave's rate control. Frames already open get the new deadline too
+static inline void espnow_batch_set_latency_us(espnow_batch_t *batch, int64_t max_latency_us)
+{
+    batch->max_latency_us = max_latency_us;
+}
+
+// What timestamp_us says in the frames from now on, see dt_frame_clock_t
+static inline void espnow_batch_set_clock(espnow_batch_t *batch, dt_frame_clock_t clock)
+{
+    batch->clock = clock;
+}
+
+// Send every frame whose oldest record has waited long enough, and try held ones again.
+// Returns ms until the next deadline
+uint32_t espnow_batch_poll(espnow_batch_t *batch);
+
+// Send whatever is waiting for every peer
+void espnow_batch_flush_all(espnow_batch_t *batch);
@@ -0,0 +1,148 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "dt_frame.h"
+#include "shared_buf.h"
+
+/*
+    Flow controlled ESP-NOW send queue
+        - Frames wait here until fewer than `window` are in flight
+        - A frame stays in flight until on_data_sent reports it (espnow_txq_on_sent).
+          ESP-NOW reports frames in the order they were sent, so the in-flight frame to that
+          MAC that went to the driver first is the one the callback is about. That is not
+          always the oldest in the queue: a retried frame goes back after ones sent since
+        - Failed frames are sent again, up to max_attempts times in total. After that the
+          drop callback (espnow_txq_set_on_drop) gets one last look at the frame
+        - If there is a gate (espnow_txq_set_gate), it is asked before every frame goes to the
+          driver, with that frame and the ones still in flight ahead of it. The TDMA slot is
+          checked this way, so a second frame in the window only goes if both still fit
+        - Frames are copied into a shared_buf_t from the pool given to espnow_txq_init
+          and handed back when they are finished with. The pool can be shared with the
+          receive path, so the two draw on one fixed budget
+        - Not thread safe: the send callback runs on the wifi task, so the firmware
+          passes its results over to the sender task through a FreeRTOS queue
+*/
+
+#define ESPNOW_TXQ_DEPTH 16
+#define ESPNOW_TXQ_MAX_PEERS 4
+#define ESPNOW_TXQ_TIMEOUT_MS 200   // give up waiting for a callback that never came, unless espnow_txq_set_timeout_us says longer
+
+typedef int (*espnow_txq_send_t)(const uint8_t *peer_addr, const uint8_t *frame, size_t len);
+typedef void (*espnow_txq_drop_t)(const uint8_t *peer_addr, const uint8_t *frame, size_t len);
+
+// How long until a frame of len bytes may go to the driver, behind in_flight frames of in_flight_bytes. 0 = now
+typedef int64_t (*espnow_txq_gate_t)(size_t len, int in_flight, size_t in_flight_bytes);
+
+typedef enum
+{
+    ESPNOW_TXQ_QUEUED,
+    ESPNOW_TXQ_IN_FLIGHT,
+    ESPNOW_TXQ_DONE,
+} espnow_txq_state_t;
+
+typedef struct
+{
+    shared_buf_t *buf;          // frame, buf->mac is the peer it goes to
+    uint8_t state;
+    uint8_t attempts;
+    int64_t queued_us;
+    int64_t sent_us;
+    uint32_t sent_order;        // txq->sends when it last went to the driver
+} espnow_txq_entry_t;
+
+typedef struct
+{
+    uint8_t peer_addr[6];
+    uint32_t delivered;
+    uint32_t failed;            // gave up after max_attempts
+    uint32_t retries;
+    uint32_t latency_min_us;    // queued to delivered
+    uint32_t latency_max_us;
+    uint64_t latency_sum_us;
+} espnow_txq_peer_stats_t;
+
+typedef struct
+{
+    espnow_txq_entry_t entries[ESPNOW_TXQ_DEPTH];
+    int head;
+    int count;
+    int in_flight;
+    uint32_t sends;             // handed to the driver, ever
+
+    int window;
+    int max_attempts;
+    espnow_txq_send_t send;
+    espnow_txq_drop_t on_drop;  // NULL = just count it
+    block_pool_t *pool;
+    espnow_txq_gate_t gate;     // NULL = frames go whenever the window has room
+    bool paused;                // hold queued frames back, e.g. during a channel sweep
+    int64_t timeout_us;
+
+    espnow_txq_peer_stats_t peers[ESPNOW_TXQ_MAX_PEERS];
+    int peer_count;
+
+    uint32_t rejected;          // pushed while the queue (or the pool) was full
+    uint32_t timeouts;
+    uint32_t gate_waits;        // polls that stopped at the gate with a frame waiting
+} espnow_txq_t;
+
+void espnow_txq_init(espnow_txq_t *txq, int window, int max_attempts, espnow_txq_send_t send, block_pool_t *pool);
+
+// Queue a frame. Returns -1 if the queue is full, which is the backpressure signal
+int espnow_txq_push(espnow_txq_t *txq, const uint8_t *peer_addr, const uint8_t *frame, size_t len);
+
+/*
+    Result of one send, straight from on_data_sent. Returns how long the frame was with the
+    driver (handed over to callback) in us, -1 if no frame to that peer was in flight
+*/
+int32_t espnow_txq_on_sent(espnow_txq_t *txq, const uint8_t *peer_addr, bool success);
+
+// Time out lost callbacks and send queued frames the window has room for
+void espnow_txq_poll(espnow_txq_t *txq);
+
+// Stop or restart handing queued frames to the radio. Frames already in flight carry on
+static inline void espnow_txq_pause(espnow_txq_t *txq, bool paused)
+{
+    txq->paused = paused;
+}
+
+/*
+    How long a frame may be with the driver before it counts as lost and goes again. On a
+    crowded channel callbacks take longer than ESPNOW_TXQ_TIMEOUT_MS, and resending frames
+    the driver still has only makes it more crowded, so the slave sets this from its round
+    trip estimate (rate_ctl_rto_us). Never below ESPNOW_TXQ_TIMEOUT_MS
+*/
+static inline void espnow_txq_set_timeout_us(espnow_txq_t *txq, int64_t timeout_us)
+{
+    txq->timeout_us = timeout_us > ESPNOW_TXQ_TIMEOUT_MS * 1000 ? timeout_us : ESPNOW_TXQ_TIMEOUT_MS * 1000;
+}
+
+// Per frame check before the driver gets it, see espnow_txq_gate_t
+static inline void espnow_txq_set_gate(espnow_txq_t *txq, espnow_txq_gate_t gate)
+{
+    txq->gate = gate;
+}
+
+// Called with every frame given up on, before its buffer goes back to the pool
+static inline void espnow_txq_set_on_drop(espnow_txq_t *txq, espnow_txq_drop_t on_drop)
+{
+    txq->on_drop = on_drop;
+}
+
+// Frames waiting to be sent (not counting ones in flight)
+static inline int espnow_txq_queued(const espnow_txq_t *txq)
+{
+    int queued = 0;
+    for (int i = 0; i < txq->count; i++)
+    {
+        if (txq->entries[(txq->head + i) % ESPNOW_TXQ_DEPTH].state == ESPNOW_TXQ_QUEUED)
+        {
+            queued++;
+        }
+    }
+    return queued;
+}
+
+const espnow_txq_peer_stats_t *espnow_txq_peer_stats(espnow_txq_t *txq, int i);
@@ -0,0 +1,89 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "dt_frame.h"
+
+/*
+    Sending messages bigger than one ESP-NOW frame
+        - A message of up to DT_FRAG_MAX_MSG_SIZE bytes goes out as numbered DT_TYPE_FRAG
+          frames, DT_FRAG_DATA_SIZE bytes each
+        - The base station answers with a dt_frag_status_t: DONE, DROPPED, or MISSING with
+          a bitmap of the fragments to send again, so only the lost ones are repeated
+        - If no status comes FRAG_TX_STATUS_TIMEOUT_MS after the last fragment, the last
+          fragment is sent again to ask for one, up to FRAG_TX_MAX_POKES times
+        - The message bytes are not copied: they belong to the caller and have to stay
+          put until the done callback says the message is finished with
+        - Not thread safe, runs on the sender task like espnow_batch_t
+*/
+
+#define FRAG_TX_MAX_MSGS 2
+#define FRAG_TX_STATUS_TIMEOUT_MS 300
+#define FRAG_TX_MAX_POKES 5
+
+typedef int (*frag_tx_send_t)(const uint8_t *peer_addr, const uint8_t *frame, size_t len);
+typedef void (*frag_tx_done_t)(uint16_t msg_id, bool delivered);
+
+typedef struct
+{
+    bool used;
+    uint8_t peer_addr[6];
+    uint16_t msg_id;
+    uint8_t type;
+    const uint8_t *data;
+    uint32_t len;
+    uint16_t count;
+
+    uint16_t next;                          // first pass: next fragment to send
+    uint8_t resend[(DT_FRAG_MAX_COUNT + 7) / 8];    // fragments the base station asked for again
+    int64_t start_us;
+    int64_t last_sent_us;
+    uint8_t pokes;
+} frag_tx_msg_t;
+
+typedef struct
+{
+    uint32_t messages;
+    uint32_t delivered;
+    uint32_t failed;
+    uint32_t fragments;         // every DT_TYPE_FRAG sent, repeats included
+    uint32_t retransmits;       // fragments sent again because of a MISSING status
+    uint32_t pokes;
+    uint32_t backpressure;      // send refused a fragment, tried again on the next poll
+    uint32_t latency_max_ms;    // frag_tx_send to DONE
+} frag_tx_stats_t;
+
+typedef struct
+{
+    frag_tx_msg_t msgs[FRAG_TX_MAX_MSGS];
+    uint16_t node_id;
+    uint32_t *seq;              // shared with the other frames this node sends
+    uint16_t next_msg_id;
+
+    frag_tx_send_t send;
+    frag_tx_done_t done;
+    dt_frame_clock_t clock;     // stamps the fragments, NULL for our own time
+
+    frag_tx_stats_t stats;
+} frag_tx_t;
+
+void frag_tx_init(frag_tx_t *tx, uint16_t node_id, uint32_t *seq, frag_tx_send_t send, frag_tx_done_t done);
+
+// What timestamp_us says in the fragments from now on, see dt_frame_clock_t
+static inline void frag_tx_set_clock(frag_tx_t *tx, dt_frame_clock_t clock)
+{
+    tx->clock = clock;
+}
+
+// Start sending a message. Returns its msg_id, or -1 if it is too big or FRAG_TX_MAX_MSGS are already going
+int frag_tx_send(frag_tx_t *tx, const uint8_t *peer_addr, uint8_t type, const void *data, size_t len, int64_t now_us);
+
+// A DT_TYPE_FRAG_STATUS payload from peer_addr
+void frag_tx_on_status(frag_tx_t *tx, const uint8_t *peer_addr, const void *payload, size_t len, int64_t now_us);
+
+// Send whatever fragments the send function will take, and chase missing statuses
+void frag_tx_poll(frag_tx_t *tx, int64_t now_us);
+
+// True while any message is unfinished
+bool frag_tx_busy(const frag_tx_t *tx);
@@ -0,0 +1,92 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+    AIMD send rate control, one per stream the slave sends (ESP-NOW samples, TCP requests)
+        - The rate climbs by `increase` per second for as long as the feedback is clean, and
+          is cut to `decrease_pct` percent of itself on a congestion signal
+        - Congestion is a failed send (rate_ctl_on_loss), or a smoothed round trip more than
+          `rtt_margin_us` above the lowest seen lately. The round trip goes up as soon as
+          queues build somewhere, well before anything is dropped
+        - At most one cut per `holdoff_ms`, and no climbing during it either. Whatever went
+          out before the cut still reports back after it, one crowded moment counts once
+        - The round trip floor is the minimum over the last one to two RATE_CTL_FLOOR_WINDOW_MS,
+          so a link that got slower for good becomes the new normal instead of congestion forever
+        - Rates are in thousandths per second, a stream sending every 5 s still has room to step
+        - Not thread safe, it belongs to the task that sends. Anyone may read the numbers
+*/
+
+#define RATE_CTL_MILLI 1000
+#define RATE_CTL_FLOOR_WINDOW_MS 10000
+#define RATE_CTL_MAX_STEP_US 1000000    // a longer quiet gap between two acks only counts this much toward climbing
+
+typedef struct
+{
+    uint32_t min_milli;
+    uint32_t max_milli;
+    uint32_t start_milli;
+    uint32_t increase_milli;    // per second of clean feedback
+    uint8_t decrease_pct;       // share of the rate kept on congestion
+    uint32_t rtt_margin_us;     // 0 = only losses count
+    uint32_t holdoff_ms;
+} rate_ctl_config_t;
+
+typedef struct
+{
+    uint32_t acks;
+    uint32_t losses;
+    uint32_t slow_rtts;         // acks whose smoothed round trip counted as congestion
+    uint32_t decreases;
+} rate_ctl_stats_t;
+
+typedef struct
+{
+    rate_ctl_config_t config;
+    uint32_t rate_milli;
+
+    uint32_t srtt_us;           // 1/8 EWMA, like TCP
+    uint32_t rttvar_us;         // 1/4 EWMA of |rtt - srtt|
+    uint32_t rtt_floor_us;      // minimum of the last finished window
+    uint32_t rtt_window_min_us; // minimum of the window being collected
+    int64_t rtt_window_start_us;
+
+    int64_t last_ack_us;
+    int64_t last_decrease_us;
+
+    rate_ctl_stats_t stats;
+} rate_ctl_t;
+
+void rate_ctl_init(rate_ctl_t *ctl, const rate_ctl_config_t *config);
+
+// A send that got through, and how long its answer took
+void rate_ctl_on_ack(rate_ctl_t *ctl, uint32_t rtt_us, int64_t now_us);
+
+// A send that failed, or the queue in front of the radio was full
+void rate_ctl_on_loss(rate_ctl_t *ctl, int64_t now_us);
+
+// Time from one send to the next at the current rate
+static inline int64_t rate_ctl_period_us(const rate_ctl_t *ctl)
+{
+    return 1000000LL * RATE_CTL_MILLI / ctl->rate_milli;
+}
+
+static inline float rate_ctl_rate(const rate_ctl_t *ctl)
+{
+    return (float)ctl->rate_milli / RATE_CTL_MILLI;
+}
+
+// Retransmit timeout the way TCP works it out (RFC 6298), never below min_us
+static inline int64_t rate_ctl_rto_us(const rate_ctl_t *ctl, int64_t min_us)
+{
+    int64_t rto_us = (int64_t)ctl->srtt_us + 4 * (int64_t)ctl->rttvar_us;
+    return rto_us > min_us ? rto_us : min_us;
+}
+
+// The floor congestion is measured against, 0 before the first ack
+static inline uint32_t rate_ctl_rtt_floor(const rate_ctl_t *ctl)
+{
+    uint32_t floor = ctl->rtt_floor_us < ctl->rtt_window_min_us ? ctl->rtt_floor_us : ctl->rtt_window_min_us;
+    return floor == UINT32_MAX ? 0 : floor;
+}
@@ -0,0 +1,127 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "dt_flash.h"
+
+/*
+    Store and forward queue in flash, for frames the base station can't be reached for.
+    A log-structured ring over the "spool" partition (partitions.csv)
+
+    | sector header | record | record | ... | 0xFF ... |      one 4 KB sector
+    | len | crc | data ... |                                  one record, crc is CRC-16 over len + data
+
+        - Append only. Records collect in a RAM buffer and reach the flash a buffer at a time
+          (sync_bytes, or spool_sync), so a run of frames costs a few page programs, not one each
+        - Sectors are used strictly in turn and only erased just before they are written again,
+          so every sector wears the same. The header keeps each one's erase count
+        - Reading never erases. How far a sector has been drained is appended to its header,
+          a 2 byte mark every SPOOL_MARK_EVERY records (and SPOOL_MARK_BYTES, so tiny records
+          don't run out of marks), so draining is reads and goes as fast as the radio takes them
+        - Full: the oldest sector is erased and its records counted as dropped, newest data wins
+        - Power loss: spool_open finds the newest sector by sequence number and a record whose crc
+          does not match ends its sector (torn write). What was still in the RAM buffer is gone,
+          and drained records since the last mark come out again
+        - Not thread safe, belongs to the task that sends. Anyone may read the numbers
+*/
+
+#define SPOOL_MAGIC 0x4C4F5053          // "SPOL"
+#define SPOOL_SECTOR_SIZE DT_FLASH_SECTOR_SIZE
+#define SPOOL_MAX_SECTORS 256
+#define SPOOL_DRAIN_MARKS 26            // makes the header 64 bytes
+#define SPOOL_MARK_EVERY 4
+#define SPOOL_MARK_BYTES (SPOOL_SECTOR_SIZE / SPOOL_DRAIN_MARKS)
+#define SPOOL_WRITE_BUF 1024
+#define SPOOL_NO_MARK 0xFFFF
+
+typedef struct __attribute__((packed))
+{
+    uint32_t magic;
+    uint32_t seq;                       // one more than the sector written before it
+    uint32_t erases;                    // times this sector has been erased
+    uint16_t drained[SPOOL_DRAIN_MARKS];    // offsets read up to, filled in order
+} spool_sector_hdr_t;
+
+typedef struct __attribute__((packed))
+{
+    uint16_t len;                       // 0xFFFF: nothing written here yet
+    uint16_t crc;
+} spool_rec_hdr_t;
+
+#define SPOOL_MAX_RECORD (SPOOL_WRITE_BUF - sizeof(spool_rec_hdr_t))
+
+typedef struct
+{
+    uint32_t sync_bytes;                // write the buffer out once it holds this much, 0 = every record
+} spool_config_t;
+
+typedef struct
+{
+    uint32_t appended;
+    uint32_t drained;
+    uint32_t dropped;                   // overwritten before anyone drained them
+    uint32_t torn;                      // records spool_open found cut short
+    uint32_t syncs;
+    uint32_t marks;
+    uint64_t bytes;                     // record data appended
+} spool_stats_t;
+
+typedef struct
+{
+    dt_flash_t *flash;
+    spool_config_t config;
+    uint32_t sectors;
+    uint32_t erases[SPOOL_MAX_SECTORS];
+
+    // writing: head_end is how much of the head sector is in flash, the buffer goes after it
+    uint32_t head;
+    uint32_t head_seq;
+    uint32_t head_end;
+    bool head_sealed;                   // something we can't write after, start the next sector
+    uint8_t buf[SPOOL_WRITE_BUF];
+    uint32_t buf_len;
+
+    // reading
+    uint32_t tail;
+    uint32_t tail_off;
+    uint32_t tail_marks;                // drain marks used in the tail sector
+    uint32_t tail_mark_off;             // where the last one points
+    uint32_t unmarked;                  // records drained since the last mark
+    uint32_t peek_len;                  // record spool_peek handed out, 0 = none
+
+    uint32_t records;                   // waiting to be drained
+    spool_stats_t stats;
+} spool_t;
+
+// Scan the flash and carry on from where the last run stopped
+int spool_open(spool_t *spool, dt_flash_t *flash, const spool_config_t *config);
+
+// Returns -1 if it is too big or the flash failed. A full spool makes room, it never refuses
+int spool_append(spool_t *spool, const void *data, size_t len);
+
+// Put the RAM buffer in flash
+int spool_sync(spool_t *spool);
+
+/*
+    Copy out the oldest record. Returns its length, 0 if there is none, -1 if the flash
+    failed or cap is too small. It stays the oldest until spool_pop
+*/
+int spool_peek(spool_t *spool, void *buf, size_t cap);
+
+void spool_pop(spool_t *spool);
+
+static inline uint32_t spool_count(const spool_t *spool)
+{
+    return spool->records;
+}
+
+// Records that fit in the whole partition at `len` bytes each, one sector's worth is always being reused
+static inline uint32_t spool_capacity(const spool_t *spool, size_t len)
+{
+    uint32_t per_sector = (SPOOL_SECTOR_SIZE - sizeof(spool_sector_hdr_t)) / (sizeof(spool_rec_hdr_t) + len);
+    return per_sector * (spool->sectors - 1);
+}
+
+// Lowest and highest erase count over the sectors
+void spool_wear(const spool_t *spool, uint32_t *min, uint32_t *max);
@@ -0,0 +1,90 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "dt_port.h"
+#include "dt_frame.h"
+
+/*
+    Long lived TCP connection to the base station
+        - Connects once and keeps the socket open between messages
+        - Up to `window` requests can be waiting for a response at the same time
+        - If the connection drops it reconnects, backing off from
+          TCP_LINK_BACKOFF_MIN_MS up to TCP_LINK_BACKOFF_MAX_MS
+        - Responses come back in the order the requests went out, so each one is matched
+          to its send time for the round trip (rtt_us)
+        - A DT_TYPE_TIME_RESP is a response like any other, the newest one is kept with when
+          it arrived for the time sync (tcp_link_time_resp)
+*/
+
+#define TCP_LINK_BACKOFF_MIN_MS 250
+#define TCP_LINK_BACKOFF_MAX_MS 8000
+#define TCP_LINK_RX_SIZE 512
+#define TCP_LINK_MAX_WINDOW 16
+
+typedef struct
+{
+    uint32_t connects;
+    uint32_t connect_failures;
+    uint32_t disconnects;
+    uint32_t sent;
+    uint32_t completed;     // responses received
+    uint32_t lost;          // still in flight when the connection dropped
+} tcp_link_stats_t;
+
+typedef struct
+{
+    struct sockaddr_in dest_addr;
+    int window;
+
+    int sock;
+    uint32_t backoff_ms;
+    int64_t next_connect_us;
+    int in_flight;
+    int64_t sent_us[TCP_LINK_MAX_WINDOW];   // send time of each request in flight, oldest at sent_head
+    int sent_head;
+    uint32_t rtt_us;                        // round trip of the latest response
+
+    bool time_ready;                        // time_resp not taken yet
+    dt_time_resp_t time_resp;
+    int64_t time_rx_us;
+
+    size_t rx_len;
+    uint8_t rx_buf[TCP_LINK_RX_SIZE];
+
+    tcp_link_stats_t stats;
+
+    // for tcp_link_rate
+    int64_t rate_start_us;
+    uint32_t rate_start_completed;
+} tcp_link_t;
+
+void tcp_link_init(tcp_link_t *link, const char *host_ip, uint16_t port, int window);
+
+// True if connected (or allowed to try connecting now) and the in-flight window has room
+bool tcp_link_can_send(const tcp_link_t *link);
+
+// Send one request, connecting first if needed. Returns 0, or -1 if it could not be sent
+int tcp_link_send(tcp_link_t *link, const void *data, size_t len);
+
+// Wait up to timeout_ms for responses. Returns how many came back, or -1 if the connection dropped
+int tcp_link_poll(tcp_link_t *link, int timeout_ms);
+
+// The newest DT_TYPE_TIME_RESP and when recv had it, once. False if none came since the last call
+static inline bool tcp_link_time_resp(tcp_link_t *link, dt_time_resp_t *resp, int64_t *rx_us)
+{
+    if (!link->time_ready)
+    {
+        return false;
+    }
+    *resp = link->time_resp;
+    *rx_us = link->time_rx_us;
+    link->time_ready = false;
+    return true;
+}
+
+// Responses per second since the last call
+float tcp_link_rate(tcp_link_t *link);
+
+void tcp_link_close(tcp_link_t *link);
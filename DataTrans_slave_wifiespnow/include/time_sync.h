@@ -0,0 +1,160 @@
+#pragma once
+
+#include <stdint.h>
+#include <atomic>
+
+#include "dt_frame.h"
+
+/*
+    The base station's clock on the slave, so frames can be stamped with it and the base station
+    can tell how long each one took to get there (one way, not half a round trip)
+        - Two things go into it. Beacons carry the time the base station's previous beacon went
+          on the air (two step, it only knows once on_sent says so), so every superframe is a
+          free (our rx time, its tx time) pair. Their difference is the offset plus however long
+          the beacon took to reach us, which hardly changes: good for the drift, not the offset
+        - The offset comes from NTP style exchanges, DT_TYPE_TIME_REQ / DT_TYPE_TIME_RESP:
+          offset = ((t2 - t1) + (t3 - t4)) / 2, delay = (t4 - t1) - (t3 - t2). Over ESP-NOW every
+          TIME_SYNC_PERIOD_MS (quicker until the first few are in), and over TCP for when
+          ESP-NOW isn't getting through
+        - Beacons: the earliest arrival (largest offset) of each TIME_SYNC_WINDOW_MS is a point,
+          and a least squares line through the last TIME_SYNC_POINTS points is the drift.
+          Exchanges: of the last TIME_SYNC_EXCHANGES, the one with the shortest round trip is
+          the most symmetric and sets the offset, on top of the beacon line. Without beacons the
+          exchanges get a line of their own, the shortest round trip of every
+          TIME_SYNC_EXCHANGE_WINDOW_MS a point
+        - TCP exchanges are only worth it while ESP-NOW isn't answering (time_sync_want_tcp),
+          and never beat an ESP-NOW one: a TCP round trip goes through the AP and lwIP both
+          ways and the legs are rarely even
+        - Every slave's exchanges are spread out at random (+-TIME_SYNC_SPREAD_PCT of the
+          period): two answers queued behind each other make one leg longer than the other,
+          and that is exactly the error the round trip can't see
+        - TIME_SYNC_STEP_RUN samples in a row more than TIME_SYNC_STEP_US off the model mean
+          the base station's clock jumped (it rebooted): everything is thrown away and sync
+          starts again
+        - The result is a model, master = master_ref + (local - local_ref) * (1 + drift), that
+          any task can read through time_sync_master_us. Only the sender task feeds it
+*/
+
+#define TIME_SYNC_PERIOD_MS 4000        // an exchange every, once synced
+#define TIME_SYNC_FAST_MS 250           // until TIME_SYNC_FAST_COUNT exchanges have come back
+#define TIME_SYNC_FAST_COUNT 4
+#define TIME_SYNC_SPREAD_PCT 25
+#define TIME_SYNC_EXCHANGES 8
+#define TIME_SYNC_EXCHANGE_MAX_AGE_MS 60000
+#define TIME_SYNC_AGING_PPM 20         // how fast an exchange goes stale while there's no line for the drift
+#define TIME_SYNC_MAX_RTT_MS 500        // an answer later than this is to some other request
+#define TIME_SYNC_WINDOW_MS 1000        // beacon line
+#define TIME_SYNC_EXCHANGE_WINDOW_MS 8000
+#define TIME_SYNC_TCP_AFTER_MS 12000    // no ESP-NOW exchange for this long, over TCP instead
+#define TIME_SYNC_POINTS 16
+#define TIME_SYNC_MIN_POINTS 4          // before this many the line is not trusted
+#define TIME_SYNC_MAX_DRIFT_PPM 500     // crystals are +-40, anything past this is a bad fit
+#define TIME_SYNC_STEP_US 20000
+#define TIME_SYNC_STEP_RUN 3
+
+typedef enum
+{
+    TIME_SYNC_VIA_ESPNOW,
+    TIME_SYNC_VIA_TCP,
+} time_sync_via_t;
+
+typedef struct
+{
+    uint32_t requests;
+    uint32_t exchanges;             // answers taken
+    uint32_t tcp_exchanges;
+    uint32_t stale;                 // answers too late or to nothing we sent
+    uint32_t beacon_points;
+    uint32_t steps;                 // the base station's clock jumped, sync started again
+    uint32_t last_delay_us;
+    uint32_t min_delay_us;          // of the exchanges kept now
+} time_sync_stats_t;
+
+typedef struct
+{
+    int64_t local_us;
+    int64_t offset_us;              // master - local
+    int64_t cost;                   // lower is better: round trip, or -offset for beacons
+} time_sync_sample_t;
+
+// One line through (local, offset) points, see line_add in time_sync.cpp
+typedef struct
+{
+    time_sync_sample_t best;        // this window's
+    bool open;
+    int64_t window_start_us;
+    time_sync_sample_t points[TIME_SYNC_POINTS];
+    uint8_t head;                   // next to write
+    uint8_t count;
+
+    int64_t ref_local_us;           // the fit: offset = ref_offset_us + drift * (local - ref_local_us)
+    int64_t ref_offset_us;
+    int32_t drift_ppb;
+} time_sync_line_t;
+
+typedef struct
+{
+    int64_t local_us;               // half way through it, our clock
+    int64_t offset_us;
+    uint32_t delay_us;
+    uint8_t via;                    // time_sync_via_t
+} time_sync_exchange_t;
+
+typedef struct
+{
+    // what time_sync_master_us reads, under a sequence lock: odd while the sender is writing
+    std::atomic<uint32_t> version;
+    bool synced;
+    int64_t local_ref_us;
+    int64_t master_ref_us;
+    int32_t drift_ppb;
+
+    time_sync_line_t beacons;
+    time_sync_line_t exchange_line; // for when there are no beacon times
+    time_sync_exchange_t exchanges[TIME_SYNC_EXCHANGES];
+    uint8_t exchange_head;
+    uint8_t exchange_count;
+
+    bool have_beacon;
+    uint32_t beacon_seq;
+    int64_t beacon_rx_us;
+
+    uint8_t step_run;
+    int64_t next_request_us;
+    uint32_t answered;              // exchanges since the last start, for the fast ones
+    uint32_t rng;
+    std::atomic<uint32_t> espnow_ms;    // our clock, last ESP-NOW exchange taken, 0 = none yet. The TCP task reads it
+
+    time_sync_stats_t stats;
+} time_sync_t;
+
+// `seed` spreads the exchanges out, anything that differs between slaves (the node id)
+void time_sync_init(time_sync_t *ts, uint32_t seed, int64_t now_us);
+
+// True if an exchange is due: send a DT_TYPE_TIME_REQ to the base station, see time_sync_request
+bool time_sync_due(time_sync_t *ts, int64_t now_us);
+
+// True if exchanges should go over TCP too, ESP-NOW hasn't answered for a while. Any task
+bool time_sync_want_tcp(const time_sync_t *ts, int64_t now_us);
+
+// The request's payload. Call it as late as possible, right before the frame goes to the radio
+static inline void time_sync_request(dt_time_req_t *req, int64_t now_us)
+{
+    memset(req, 0, sizeof(*req));
+    req->t1_us = (uint64_t)now_us;
+}
+
+// The base station's answer, rx_us is when it arrived on our clock
+void time_sync_on_response(time_sync_t *ts, const dt_time_resp_t *resp, int64_t rx_us, uint8_t via);
+
+// A beacon with its seq (from the frame header) and the base station's tx time of the one before, 0 if it has none
+void time_sync_on_beacon(time_sync_t *ts, uint32_t seq, uint64_t prev_tx_us, int64_t rx_us);
+
+// The base station's time at local_us on our clock. False (and nothing written) until the first exchange. Any task
+bool time_sync_master_us(const time_sync_t *ts, int64_t local_us, int64_t *master_us);
+
+// The model's drift, parts per billion our clock runs slow by. Sender task
+static inline int32_t time_sync_drift_ppb(const time_sync_t *ts)
+{
+    return ts->drift_ppb;
+}
@@ -0,0 +1,87 @@
+#include <string.h>
+
+#include "esp_log.h"
+#include "nvs.h"
+
+#include "assoc_cache.h"
+
+static const char *TAG = "assoc_cache";
+
+#define ASSOC_CACHE_KEY "assoc"
+
+bool assoc_cache_load(assoc_cache_t *cache)
+{
+    memset(cache, 0, sizeof(*cache));
+    cache->version = ASSOC_CACHE_VERSION;
+
+    nvs_handle_t nvs;
+    if (nvs_open(ASSOC_CACHE_NAMESPACE, NVS_READONLY, &nvs) != ESP_OK)
+    {
+        return false;   // first boot, the namespace isn't there yet
+    }
+
+    assoc_cache_t stored;
+    size_t len = sizeof(stored);
+    esp_err_t err = nvs_get_blob(nvs, ASSOC_CACHE_KEY, &stored, &len);
+    nvs_close(nvs);
+
+    if (err != ESP_OK || len != sizeof(stored) || stored.version != ASSOC_CACHE_VERSION ||
+        stored.peer_count > ASSOC_CACHE_MAX_PEERS)
+    {
+        return false;
+    }
+    *cache = stored;
+    return true;
+}
+
+int assoc_cache_save(const assoc_cache_t *cache)
+{
+    nvs_handle_t nvs;
+    if (nvs_open(ASSOC_CACHE_NAMESPACE, NVS_READWRITE, &nvs) != ESP_OK)
+    {
+        return -1;
+    }
+
+    assoc_cache_t stored;
+    size_t len = sizeof(stored);
+    if (nvs_get_blob(nvs, ASSOC_CACHE_KEY, &stored, &len) == ESP_OK && len == sizeof(stored) &&
+        memcmp(&stored, cache, sizeof(stored)) == 0)
+    {
+        nvs_close(nvs);
+        return 0;
+    }
+
+    esp_err_t err = nvs_set_blob(nvs, ASSOC_CACHE_KEY, cache, sizeof(*cache));
+    if (err == ESP_OK)
+    {
+        err = nvs_commit(nvs);
+    }
+    nvs_close(nvs);
+
+    if (err != ESP_OK)
+    {
+        ESP_LOGW(TAG, "Could not save: %s", esp_err_to_name(err));
+        return -1;
+    }
+    return 0;
+}
+
+void assoc_cache_add_peer(assoc_cache_t *cache, const uint8_t *mac)
+{
+    int at = 0;
+    while (at < cache->peer_count && memcmp(cache->peers[at], mac, 6) != 0)
+    {
+        at++;
+    }
+    if (at == ASSOC_CACHE_MAX_PEERS)
+    {
+        at--;
+    }
+    else if (at == cache->peer_count)
+    {
+        cache->peer_count++;
+    }
+
+    memmove(cache->peers[1], cache->peers[0], at * 6);
+    memcpy(cache->peers[0], mac, 6);
+}
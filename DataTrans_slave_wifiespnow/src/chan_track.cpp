@@ -0,0 +1,216 @@
+#include <string.h>
+
+#include "chan_track.h"
+
+// Where APs are set up by hand or pick by themselves, the three that don't overlap
+static const uint8_t CHAN_TRACK_LIKELY[] = { 1, 6, 11 };
+
+void chan_track_init(chan_track_t *t, uint8_t channel, uint32_t seed, int64_t now_us)
+{
+    memset(t, 0, sizeof(*t));
+    t->state = CHAN_TRACK_OK;
+    t->channel = channel;
+    t->home = channel;
+    t->last_heard_us = now_us;
+    t->last_ok_us = now_us;
+    t->backoff_ms = CHAN_TRACK_BACKOFF_MS;
+    t->dwell_us = CHAN_TRACK_DWELL_MS * 1000;
+    t->silence_us = CHAN_TRACK_SILENCE_MS * 1000;
+    t->rng = seed != 0 ? seed : 1;
+}
+
+// xorshift32, the tracker's own
+static uint32_t random(chan_track_t *t)
+{
+    uint32_t x = t->rng;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    t->rng = x;
+    return x;
+}
+
+static bool likely(uint8_t channel)
+{
+    for (uint8_t c : CHAN_TRACK_LIKELY)
+    {
+        if (c == channel)
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+static void start_sweep(chan_track_t *t, int64_t now_us)
+{
+    int n = 0;
+    for (uint8_t c : CHAN_TRACK_LIKELY)
+    {
+        if (c != t->home)
+        {
+            t->order[n++] = c;
+        }
+    }
+    for (uint8_t c = 1; c <= CHAN_TRACK_MAX_CHANNEL; c++)
+    {
+        if (c != t->home && !likely(c))
+        {
+            t->order[n++] = c;
+        }
+    }
+    // the home channel goes last, and only if it is a real one
+    if (t->home >= 1 && t->home <= CHAN_TRACK_MAX_CHANNEL)
+    {
+        t->order[n++] = t->home;
+    }
+
+    t->state = CHAN_TRACK_SWEEP;
+    t->count = (uint8_t)n;
+    t->next = 0;
+    t->dwell_end_us = now_us;
+    t->fail_run = 0;
+    t->stats.sweeps++;
+}
+
+// Settle on `channel` and start watching it afresh
+static void move_to(chan_track_t *t, uint8_t channel, int64_t now_us)
+{
+    if (channel != t->home)
+    {
+        t->stats.moves++;
+    }
+    t->state = CHAN_TRACK_OK;
+    t->channel = channel;
+    t->home = channel;
+    t->fail_run = 0;
+    t->last_heard_us = now_us;
+    t->backoff_ms = CHAN_TRACK_BACKOFF_MS;
+}
+
+// The base station is on `channel` after all, whatever we were doing
+static void found(chan_track_t *t, uint8_t channel, int64_t now_us)
+{
+    if (t->state != CHAN_TRACK_OK)
+    {
+        uint32_t outage_ms = (uint32_t)((now_us - t->last_ok_us) / 1000);
+        t->stats.found++;
+        t->stats.outage_last_ms = outage_ms;
+        t->stats.outage_max_ms = outage_ms > t->stats.outage_max_ms ? outage_ms : t->stats.outage_max_ms;
+    }
+    move_to(t, channel, now_us);
+    t->last_ok_us = now_us;
+}
+
+void chan_track_on_sent(chan_track_t *t, bool success, int64_t now_us)
+{
+    if (!success)
+    {
+        t->fail_run++;
+        return;
+    }
+
+    // something queued before the sweep paused the sender can still get through on the old channel
+    if (t->state == CHAN_TRACK_SWEEP)
+    {
+        return;
+    }
+    if (t->state != CHAN_TRACK_OK)
+    {
+        found(t, t->channel, now_us);
+    }
+    t->fail_run = 0;
+    t->last_ok_us = now_us;
+}
+
+void chan_track_on_heard(chan_track_t *t, uint8_t announced, uint32_t superframe_us, int64_t now_us)
+{
+    uint8_t channel = t->channel;
+    if (announced >= 1 && announced <= CHAN_TRACK_MAX_CHANNEL && announced != channel)
+    {
+        channel = announced;
+        t->stats.announced++;
+    }
+
+    if (t->state != CHAN_TRACK_OK || channel != t->channel)
+    {
+        found(t, channel, now_us);
+    }
+    t->fail_run = 0;
+    t->last_heard_us = now_us;
+    t->last_ok_us = now_us;
+    if (superframe_us != 0)
+    {
+        uint32_t dwell_us = superframe_us + CHAN_TRACK_DWELL_MARGIN_MS * 1000;
+        uint32_t silence_us = superframe_us * CHAN_TRACK_SILENCE_BEACONS;
+        t->dwell_us = dwell_us > CHAN_TRACK_DWELL_MS * 1000 ? dwell_us : CHAN_TRACK_DWELL_MS * 1000;
+        t->silence_us = silence_us > CHAN_TRACK_SILENCE_MS * 1000 ? silence_us : CHAN_TRACK_SILENCE_MS * 1000;
+        t->beacons = true;
+    }
+}
+
+void chan_track_hint(chan_track_t *t, uint8_t channel, int64_t now_us)
+{
+    if (channel < 1 || channel > CHAN_TRACK_MAX_CHANNEL || channel == t->channel)
+    {
+        return;
+    }
+    // not found yet, only a good guess: if it is wrong the collapse check sweeps again
+    move_to(t, channel, now_us);
+}
+
+bool chan_track_no_answer(chan_track_t *t, int64_t now_us)
+{
+    if (t->state != CHAN_TRACK_OK)
+    {
+        return false;
+    }
+    start_sweep(t, now_us);
+    return true;
+}
+
+bool chan_track_poll(chan_track_t *t, int64_t now_us)
+{
+    if (t->state == CHAN_TRACK_OK)
+    {
+        bool silent = t->beacons && now_us - t->last_heard_us >= (int64_t)t->silence_us;
+        if (t->fail_run < CHAN_TRACK_FAIL_RUN && !silent)
+        {
+            return false;
+        }
+        start_sweep(t, now_us);
+    }
+    else if (t->state == CHAN_TRACK_LOST)
+    {
+        if (now_us < t->retry_us)
+        {
+            return false;
+        }
+        start_sweep(t, now_us);
+    }
+
+    if (now_us >= t->dwell_end_us)
+    {
+        // every channel tried, back where we were until the next go
+        if (t->next == t->count)
+        {
+            t->state = CHAN_TRACK_LOST;
+            t->channel = t->home;
+            t->retry_us = now_us + (int64_t)t->backoff_ms * 1000;
+            t->backoff_ms = t->backoff_ms * 2 < CHAN_TRACK_BACKOFF_MAX_MS ? t->backoff_ms * 2 : CHAN_TRACK_BACKOFF_MAX_MS;
+            return false;
+        }
+
+        t->channel = t->order[t->next++];
+        t->dwell_end_us = now_us + t->dwell_us;
+        t->probe_us = now_us + random(t) % (t->dwell_us / 2);
+    }
+
+    if (t->probe_us == 0 || now_us < t->probe_us)
+    {
+        return false;
+    }
+    t->probe_us = 0;
+    t->stats.probes++;
+    return true;
+}
@@ -0,0 +1,241 @@
+#include <string.h>
+
+#include "dt_port.h"
+#include "espnow_batch.h"
+
+static const char *TAG = "espnow_batch";
+
+void espnow_batch_init(espnow_batch_t *batch, uint16_t node_id, uint32_t max_latency_ms, espnow_batch_send_t send)
+{
+    memset(batch, 0, sizeof(*batch));
+    batch->node_id = node_id;
+    batch->max_latency_us = (int64_t)max_latency_ms * 1000;
+    batch->send = send;
+}
+
+static espnow_batch_peer_t *find_peer(espnow_batch_t *batch, const uint8_t *peer_addr)
+{
+    for (int i = 0; i < batch->peer_count; i++)
+    {
+        if (memcmp(batch->peers[i].peer_addr, peer_addr, 6) == 0)
+        {
+            return &batch->peers[i];
+        }
+    }
+
+    if (batch->peer_count == ESPNOW_BATCH_MAX_PEERS)
+    {
+        return NULL;
+    }
+
+    espnow_batch_peer_t *peer = &batch->peers[batch->peer_count++];
+    memcpy(peer->peer_addr, peer_addr, 6);
+    peer->used = 0;
+    peer->records = 0;
+    peer->pack_open = false;
+    peer->held_len = 0;
+    return peer;
+}
+
+// Finish the frame if it isn't yet and send it. false if the send refused it, it is kept for the next try
+static bool flush_peer(espnow_batch_t *batch, espnow_batch_peer_t *peer)
+{
+    if (peer->held_len == 0)
+    {
+        if (peer->records == 0)
+        {
+            return true;
+        }
+        peer->held_len = dt_frame_finish_at(peer->frame, DT_TYPE_BATCH, batch->node_id, batch->seq++,
+                                            batch->clock, esp_timer_get_time(), peer->used);
+    }
+
+    if (batch->send(peer->peer_addr, peer->frame, peer->held_len) != 0)
+    {
+        batch->stats.send_errors++;
+        return false;
+    }
+    batch->stats.frames++;
+    batch->stats.frame_bytes += peer->held_len;
+    batch->stats.airtime_us += espnow_airtime_us(peer->held_len);
+
+    peer->held_len = 0;
+    peer->used = 0;
+    peer->records = 0;
+    peer->pack_open = false;
+    return true;
+}
+
+static void count_record(espnow_batch_t *batch, espnow_batch_peer_t *peer)
+{
+    if (peer->records == 0)
+    {
+        peer->oldest_us = esp_timer_get_time();
+    }
+    peer->records++;
+    batch->stats.records++;
+}
+
+int espnow_batch_add(espnow_batch_t *batch, const uint8_t *peer_addr, uint8_t type, const void *data, size_t len)
+{
+    espnow_batch_peer_t *peer = find_peer(batch, peer_addr);
+    if (peer == NULL)
+    {
+        ESP_LOGE(TAG, "No room for another peer (max %d)", ESPNOW_BATCH_MAX_PEERS);
+        return -1;
+    }
+    if (peer->held_len != 0)
+    {
+        batch->stats.add_refused++;
+        return -1;
+    }
+
+    uint8_t *payload = dt_frame_payload(peer->frame);
+
+    if (!dt_record_append(payload, DT_FRAME_MAX_PAYLOAD, &peer->used, type, data, len))
+    {
+        if (peer->records == 0)
+        {
+            return -1; // too big even for an empty frame
+        }
+
+        batch->stats.flush_full++;
+        if (!flush_peer(batch, peer))
+        {
+            batch->stats.add_refused++;
+            return -1;
+        }
+
+        if (!dt_record_append(payload, DT_FRAME_MAX_PAYLOAD, &peer->used, type, data, len))
+        {
+            return -1;
+        }
+    }
+
+    // a packed record is only grown while it is the last one
+    peer->pack_open = false;
+    count_record(batch, peer);
+    return 0;
+}
+
+// New packed record at the end of the payload, with the first sample in full
+static bool open_pack(espnow_batch_peer_t *peer, uint16_t channel, int32_t value)
+{
+    size_t room = DT_FRAME_MAX_PAYLOAD - peer->used;
+    if (room <= sizeof(dt_record_hdr_t))
+    {
+        return false;
+    }
+    room -= sizeof(dt_record_hdr_t);
+
+    uint8_t *payload = dt_frame_payload(peer->frame);
+    if (!sample_pack_begin(&peer->pack, payload + peer->used + sizeof(dt_record_hdr_t), room < 255 ? room : 255, channel, value))
+    {
+        return false;
+    }
+
+    dt_record_hdr_t *rec = (dt_record_hdr_t *)(payload + peer->used);
+    rec->type = DT_TYPE_SENSOR_PACKED;
+    rec->len = (uint8_t)peer->pack.len;
+    peer->pack_at = peer->used;
+    peer->pack_open = true;
+    peer->used += sizeof(dt_record_hdr_t) + peer->pack.len;
+    return true;
+}
+
+int espnow_batch_add_sample(espnow_batch_t *batch, const uint8_t *peer_addr, uint16_t channel, int32_t value)
+{
+    espnow_batch_peer_t *peer = find_peer(batch, peer_addr);
+    if (peer == NULL)
+    {
+        ESP_LOGE(TAG, "No room for another peer (max %d)", ESPNOW_BATCH_MAX_PEERS);
+        return -1;
+    }
+    if (peer->held_len != 0)
+    {
+        batch->stats.add_refused++;
+        return -1;
+    }
+
+    if (peer->pack_open && peer->pack.channel == channel)
+    {
+        if (sample_pack_add(&peer->pack, value))
+        {
+            uint8_t *payload = dt_frame_payload(peer->frame);
+            ((dt_record_hdr_t *)(payload + peer->pack_at))->len = (uint8_t)peer->pack.len;
+            peer->used = peer->pack_at + sizeof(dt_record_hdr_t) + peer->pack.len;
+            count_record(batch, peer);
+            return 0;
+        }
+    }
+
+    if (!open_pack(peer, channel, value))
+    {
+        if (peer->records == 0)
+        {
+            return -1;
+        }
+
+        batch->stats.flush_full++;
+        if (!flush_peer(batch, peer))
+        {
+            batch->stats.add_refused++;
+            return -1;
+        }
+
+        if (!open_pack(peer, channel, value))
+        {
+            return -1;
+        }
+    }
+
+    count_record(batch, peer);
+    return 0;
+}
+
+uint32_t espnow_batch_poll(espnow_batch_t *batch)
+{
+    int64_t now = esp_timer_get_time();
+    int64_t next_us = batch->max_latency_us;
+
+    for (int i = 0; i < batch->peer_count; i++)
+    {
+        espnow_batch_peer_t *peer = &batch->peers[i];
+        if (peer->held_len != 0)
+        {
+            if (!flush_peer(batch, peer) && ESPNOW_BATCH_RETRY_MS * 1000 < next_us)
+            {
+                next_us = ESPNOW_BATCH_RETRY_MS * 1000;
+            }
+            continue;
+        }
+        if (peer->records == 0)
+        {
+            continue;
+        }
+
+        int64_t left_us = peer->oldest_us + batch->max_latency_us - now;
+        if (left_us <= 0)
+        {
+            batch->stats.flush_deadline++;
+            if (!flush_peer(batch, peer) && ESPNOW_BATCH_RETRY_MS * 1000 < next_us)
+            {
+                next_us = ESPNOW_BATCH_RETRY_MS * 1000;
+            }
+        }
+        else if (left_us < next_us)
+        {
+            next_us = left_us;
+        }
+    }
+
+    return (uint32_t)((next_us + 999) / 1000);
+}
+
+void espnow_batch_flush_all(espnow_batch_t *batch)
+{
+    for (int i = 0; i < batch->peer_count; i++)
+    {
+        flush_peer(batch, &batch->peers[i]);
+    }
+}
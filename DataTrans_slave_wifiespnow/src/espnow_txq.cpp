@@ -0,0 +1,232 @@
+#include <string.h>
+
+#include "dt_port.h"
+#include "espnow_txq.h"
+#include "trace.h"
+
+static const char *TAG = "espnow_txq";
+
+void espnow_txq_init(espnow_txq_t *txq, int window, int max_attempts, espnow_txq_send_t send, block_pool_t *pool)
+{
+    memset(txq, 0, sizeof(*txq));
+    txq->window = window > 0 ? window : 1;
+    txq->timeout_us = ESPNOW_TXQ_TIMEOUT_MS * 1000;
+    txq->max_attempts = max_attempts > 0 ? max_attempts : 1;
+    txq->send = send;
+    txq->pool = pool;
+}
+
+static espnow_txq_entry_t *entry_at(espnow_txq_t *txq, int i)
+{
+    return &txq->entries[(txq->head + i) % ESPNOW_TXQ_DEPTH];
+}
+
+static espnow_txq_peer_stats_t *peer_stats(espnow_txq_t *txq, const uint8_t *peer_addr)
+{
+    for (int i = 0; i < txq->peer_count; i++)
+    {
+        if (memcmp(txq->peers[i].peer_addr, peer_addr, 6) == 0)
+        {
+            return &txq->peers[i];
+        }
+    }
+
+    if (txq->peer_count == ESPNOW_TXQ_MAX_PEERS)
+    {
+        return NULL;
+    }
+
+    espnow_txq_peer_stats_t *stats = &txq->peers[txq->peer_count++];
+    memset(stats, 0, sizeof(*stats));
+    memcpy(stats->peer_addr, peer_addr, 6);
+    stats->latency_min_us = UINT32_MAX;
+    return stats;
+}
+
+const espnow_txq_peer_stats_t *espnow_txq_peer_stats(espnow_txq_t *txq, int i)
+{
+    return i < txq->peer_count ? &txq->peers[i] : NULL;
+}
+
+int espnow_txq_push(espnow_txq_t *txq, const uint8_t *peer_addr, const uint8_t *frame, size_t len)
+{
+    if (txq->count == ESPNOW_TXQ_DEPTH)
+    {
+        txq->rejected++;
+        return -1;
+    }
+
+    int64_t now = esp_timer_get_time();
+    shared_buf_t *buf = shared_buf_alloc(txq->pool, frame, len, now, peer_addr, 0);
+    if (buf == NULL)
+    {
+        txq->rejected++;
+        return -1;
+    }
+
+    espnow_txq_entry_t *entry = entry_at(txq, txq->count);
+    entry->buf = buf;
+    entry->attempts = 0;
+    entry->state = ESPNOW_TXQ_QUEUED;
+    entry->queued_us = now;
+    txq->count++;
+    trace_frame(TRACE_TXQ_PUSH, frame, len, txq->count);
+
+    espnow_txq_poll(txq);
+    return 0;
+}
+
+// A frame is finished with, one way or the other
+static void entry_done(espnow_txq_t *txq, espnow_txq_entry_t *entry, bool delivered)
+{
+    espnow_txq_peer_stats_t *stats = peer_stats(txq, entry->buf->mac);
+
+    if (stats != NULL)
+    {
+        if (delivered)
+        {
+            uint32_t latency_us = (uint32_t)(esp_timer_get_time() - entry->queued_us);
+            stats->delivered++;
+            stats->latency_sum_us += latency_us;
+            if (latency_us < stats->latency_min_us)
+            {
+                stats->latency_min_us = latency_us;
+            }
+            if (latency_us > stats->latency_max_us)
+            {
+                stats->latency_max_us = latency_us;
+            }
+        }
+        else
+        {
+            stats->failed++;
+        }
+    }
+
+    entry->state = ESPNOW_TXQ_DONE;
+    shared_buf_release(entry->buf);
+    entry->buf = NULL;
+
+    // free finished entries off the front. One still being retried holds up the ones behind it
+    while (txq->count > 0 && entry_at(txq, 0)->state == ESPNOW_TXQ_DONE)
+    {
+        txq->head = (txq->head + 1) % ESPNOW_TXQ_DEPTH;
+        txq->count--;
+    }
+}
+
+static void entry_failed(espnow_txq_t *txq, espnow_txq_entry_t *entry)
+{
+    if (entry->attempts < txq->max_attempts)
+    {
+        espnow_txq_peer_stats_t *stats = peer_stats(txq, entry->buf->mac);
+        if (stats != NULL)
+        {
+            stats->retries++;
+        }
+        entry->state = ESPNOW_TXQ_QUEUED;
+    }
+    else
+    {
+        ESP_LOGW(TAG, "Frame dropped after %d attempts", entry->attempts);
+        if (txq->on_drop != NULL)
+        {
+            txq->on_drop(entry->buf->mac, entry->buf->data, entry->buf->len);
+        }
+        entry_done(txq, entry, false);
+    }
+}
+
+int32_t espnow_txq_on_sent(espnow_txq_t *txq, const uint8_t *peer_addr, bool success)
+{
+    espnow_txq_entry_t *entry = NULL;
+    for (int i = 0; i < txq->count; i++)
+    {
+        espnow_txq_entry_t *e = entry_at(txq, i);
+        if (e->state == ESPNOW_TXQ_IN_FLIGHT && memcmp(e->buf->mac, peer_addr, 6) == 0 &&
+            (entry == NULL || (int32_t)(e->sent_order - entry->sent_order) < 0))
+        {
+            entry = e;
+        }
+    }
+
+    int32_t driver_us = -1;
+    if (entry != NULL)
+    {
+        txq->in_flight--;
+        driver_us = (int32_t)(esp_timer_get_time() - entry->sent_us);
+        if (success)
+        {
+            trace_frame(TRACE_ESPNOW_SENT, entry->buf->data, entry->buf->len, entry->attempts);
+            entry_done(txq, entry, true);
+        }
+        else
+        {
+            entry_failed(txq, entry);
+        }
+    }
+
+    espnow_txq_poll(txq);
+    return driver_us;
+}
+
+static size_t in_flight_bytes(espnow_txq_t *txq)
+{
+    size_t bytes = 0;
+    for (int i = 0; i < txq->count; i++)
+    {
+        espnow_txq_entry_t *entry = entry_at(txq, i);
+        if (entry->state == ESPNOW_TXQ_IN_FLIGHT)
+        {
+            bytes += entry->buf->len;
+        }
+    }
+    return bytes;
+}
+
+void espnow_txq_poll(espnow_txq_t *txq)
+{
+    int64_t now = esp_timer_get_time();
+    bool gated = false;
+
+    for (int i = 0; i < txq->count; i++)
+    {
+        espnow_txq_entry_t *entry = entry_at(txq, i);
+
+        if (entry->state == ESPNOW_TXQ_IN_FLIGHT && now - entry->sent_us > txq->timeout_us)
+        {
+            txq->timeouts++;
+            txq->in_flight--;
+            entry_failed(txq, entry);
+            i = -1; // the front may have moved, start again
+            continue;
+        }
+
+        if (entry->state == ESPNOW_TXQ_QUEUED && txq->in_flight < txq->window && !txq->paused && !gated)
+        {
+            // frames go in order, so one the gate holds back holds back the rest. Timeouts still get looked at
+            if (txq->gate != NULL && txq->gate(entry->buf->len, txq->in_flight, in_flight_bytes(txq)) > 0)
+            {
+                txq->gate_waits++;
+                gated = true;
+                continue;
+            }
+
+            entry->attempts++;
+            entry->sent_us = now;
+            entry->sent_order = txq->sends++;
+
+            if (txq->send(entry->buf->mac, entry->buf->data, entry->buf->len) == 0)
+            {
+                entry->state = ESPNOW_TXQ_IN_FLIGHT;
+                txq->in_flight++;
+            }
+            else
+            {
+                // the driver would not take it (out of buffers), no callback will come
+                entry_failed(txq, entry);
+                break;
+            }
+        }
+    }
+}
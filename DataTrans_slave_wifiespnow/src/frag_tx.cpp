@@ -0,0 +1,214 @@
+#include <string.h>
+
+#include "dt_port.h"
+#include "frag_tx.h"
+
+static const char *TAG = "frag_tx";
+
+void frag_tx_init(frag_tx_t *tx, uint16_t node_id, uint32_t *seq, frag_tx_send_t send, frag_tx_done_t done)
+{
+    memset(tx, 0, sizeof(*tx));
+    tx->node_id = node_id;
+    tx->seq = seq;
+    tx->send = send;
+    tx->done = done;
+}
+
+bool frag_tx_busy(const frag_tx_t *tx)
+{
+    for (int i = 0; i < FRAG_TX_MAX_MSGS; i++)
+    {
+        if (tx->msgs[i].used)
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+int frag_tx_send(frag_tx_t *tx, const uint8_t *peer_addr, uint8_t type, const void *data, size_t len, int64_t now_us)
+{
+    if (len == 0 || len > DT_FRAG_MAX_MSG_SIZE)
+    {
+        return -1;
+    }
+
+    frag_tx_msg_t *msg = NULL;
+    for (int i = 0; i < FRAG_TX_MAX_MSGS; i++)
+    {
+        if (!tx->msgs[i].used)
+        {
+            msg = &tx->msgs[i];
+            break;
+        }
+    }
+    if (msg == NULL)
+    {
+        return -1;
+    }
+
+    memset(msg, 0, sizeof(*msg));
+    msg->used = true;
+    memcpy(msg->peer_addr, peer_addr, 6);
+    msg->msg_id = tx->next_msg_id++;
+    msg->type = type;
+    msg->data = (const uint8_t *)data;
+    msg->len = (uint32_t)len;
+    msg->count = (uint16_t)((len + DT_FRAG_DATA_SIZE - 1) / DT_FRAG_DATA_SIZE);
+    msg->start_us = now_us;
+    msg->last_sent_us = now_us;
+
+    tx->stats.messages++;
+    frag_tx_poll(tx, now_us);
+    return msg->msg_id;
+}
+
+static void msg_finish(frag_tx_t *tx, frag_tx_msg_t *msg, bool delivered, int64_t now_us)
+{
+    if (delivered)
+    {
+        uint32_t latency_ms = (uint32_t)((now_us - msg->start_us) / 1000);
+        if (latency_ms > tx->stats.latency_max_ms)
+        {
+            tx->stats.latency_max_ms = latency_ms;
+        }
+        tx->stats.delivered++;
+    }
+    else
+    {
+        ESP_LOGW(TAG, "Message %u (%lu bytes) not delivered", msg->msg_id, (unsigned long)msg->len);
+        tx->stats.failed++;
+    }
+
+    msg->used = false;
+    if (tx->done != NULL)
+    {
+        tx->done(msg->msg_id, delivered);
+    }
+}
+
+// Returns false if the send function would not take it
+static bool send_fragment(frag_tx_t *tx, frag_tx_msg_t *msg, uint16_t index, int64_t now_us)
+{
+    uint8_t frame[DT_FRAME_MAX_SIZE];
+    uint8_t *payload = dt_frame_payload(frame);
+
+    dt_frag_hdr_t hdr;
+    hdr.msg_id = msg->msg_id;
+    hdr.index = index;
+    hdr.count = msg->count;
+    hdr.total_len = msg->len;
+    hdr.type = msg->type;
+
+    uint32_t offset = (uint32_t)index * DT_FRAG_DATA_SIZE;
+    uint32_t data_len = msg->len - offset < (uint32_t)DT_FRAG_DATA_SIZE ? msg->len - offset : DT_FRAG_DATA_SIZE;
+
+    memcpy(payload, &hdr, sizeof(hdr));
+    memcpy(payload + sizeof(hdr), msg->data + offset, data_len);
+    size_t frame_len = dt_frame_finish_at(frame, DT_TYPE_FRAG, tx->node_id, *tx->seq, tx->clock, now_us, sizeof(hdr) + data_len);
+
+    if (tx->send(msg->peer_addr, frame, frame_len) != 0)
+    {
+        tx->stats.backpressure++;
+        return false;
+    }
+
+    (*tx->seq)++;
+    tx->stats.fragments++;
+    msg->last_sent_us = now_us;
+    return true;
+}
+
+static void msg_poll(frag_tx_t *tx, frag_tx_msg_t *msg, int64_t now_us)
+{
+    // asked-for repeats first, they are holding the message up
+    for (uint16_t i = 0; i < msg->count; i++)
+    {
+        if (msg->resend[i / 8] & (1 << (i % 8)))
+        {
+            if (!send_fragment(tx, msg, i, now_us))
+            {
+                return;
+            }
+            msg->resend[i / 8] &= ~(1 << (i % 8));
+            tx->stats.retransmits++;
+        }
+    }
+
+    while (msg->next < msg->count)
+    {
+        if (!send_fragment(tx, msg, msg->next, now_us))
+        {
+            return;
+        }
+        msg->next++;
+    }
+
+    // everything is out, the status for it has gone missing
+    if (now_us - msg->last_sent_us >= FRAG_TX_STATUS_TIMEOUT_MS * 1000)
+    {
+        if (msg->pokes == FRAG_TX_MAX_POKES)
+        {
+            msg_finish(tx, msg, false, now_us);
+            return;
+        }
+        if (send_fragment(tx, msg, msg->count - 1, now_us))
+        {
+            msg->pokes++;
+            tx->stats.pokes++;
+        }
+    }
+}
+
+void frag_tx_poll(frag_tx_t *tx, int64_t now_us)
+{
+    for (int i = 0; i < FRAG_TX_MAX_MSGS; i++)
+    {
+        if (tx->msgs[i].used)
+        {
+            msg_poll(tx, &tx->msgs[i], now_us);
+        }
+    }
+}
+
+void frag_tx_on_status(frag_tx_t *tx, const uint8_t *peer_addr, const void *payload, size_t len, int64_t now_us)
+{
+    if (len < sizeof(dt_frag_status_t))
+    {
+        return;
+    }
+    const dt_frag_status_t *status = (const dt_frag_status_t *)payload;
+
+    for (int i = 0; i < FRAG_TX_MAX_MSGS; i++)
+    {
+        frag_tx_msg_t *msg = &tx->msgs[i];
+        if (!msg->used || msg->msg_id != status->msg_id || memcmp(msg->peer_addr, peer_addr, 6) != 0)
+        {
+            continue;
+        }
+
+        if (status->state == DT_FRAG_DONE)
+        {
+            msg_finish(tx, msg, true, now_us);
+        }
+        else if (status->state == DT_FRAG_DROPPED)
+        {
+            msg_finish(tx, msg, false, now_us);
+        }
+        else if (status->state == DT_FRAG_MISSING)
+        {
+            // only fragments already sent once, the rest are still coming in the first pass
+            for (uint16_t j = 0; j < msg->next; j++)
+            {
+                if (status->missing[j / 8] & (1 << (j % 8)))
+                {
+                    msg->resend[j / 8] |= 1 << (j % 8);
+                }
+            }
+            msg->pokes = 0;
+            msg->last_sent_us = now_us;
+            msg_poll(tx, msg, now_us);
+        }
+        return;
+    }
+}
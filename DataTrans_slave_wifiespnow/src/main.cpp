@@ -19,9 +19,30 @@
 #include "lwip/sockets.h"
 #include "lwip/ip_addr.h"
 
+#include "dt_frame.h"
+#include "led_indicator.h"
+#include "espnow_batch.h"
+#include "shared_buf.h"
+#include "espnow_txq.h"
+#include "tdma.h"
+#include "tcp_link.h"
+#include "frag_tx.h"
+#include "trace.h"
+#include "dt_transport_espnow.h"
+#include "dt_tasks.h"
+#include "sample_codec.h"
+#include "rate_ctl.h"
+#include "dt_flash.h"
+#include "spool.h"
+#include "assoc_cache.h"
+#include "chan_track.h"
+#include "time_sync.h"
+
 // LED Pins
 #define LED_WIFI GPIO_NUM_13
 #define LED_ESPNOW GPIO_NUM_12
+#define LED_ON_MS 500
+#define LED_OFF_MS 500
 
 // Success/Fail statuses
 #define WIFI_FAIL 0
@@ -29,8 +50,16 @@
 #define TCP_FAIL 0
 #define TCP_SUCC 1
 
+// Event group bits. They can't be the statuses above, setting bit "0" sets nothing and the wait never ended on a failure
+#define WIFI_SUCC_BIT BIT0
+#define WIFI_FAIL_BIT BIT1
+
 static const char *TAG = "Data_Trans";
 
+// Activity LEDs, pulsed by the housekeeping task when the counters move
+static led_indicator_t s_led_wifi;
+static led_indicator_t s_led_espnow;
+
 // event group to contain status information
 static EventGroupHandle_t wifi_event_group;
 #define MAX_FAILURES 10
@@ -38,25 +67,176 @@ static EventGroupHandle_t wifi_event_group;
 // retry tracker
 static int s_retry_num = 0;
 
+/*
+    Boot (assoc_cache.h). With a cached channel and base station the slave sends ESP-NOW straight
+    away and wifi connects in the background, pinned to the cached AP. Without, it waits for wifi
+    and broadcasts a join like it always did. Either way the time from boot to the first frame the
+    base station took is logged and kept, for the last cold and the last cached boot
+*/
+#define ASSOC_CACHE_USE 1                   // 0 = every boot is a cold one, to compare against
+#define ASSOC_RESUME_TIMEOUT_MS 2000        // the cached base station has this long to take a frame before we look for one
+#define WIFI_PINNED_RETRIES 2               // tries at the cached BSSID before scanning for any AP with the SSID
+#define WIFI_ASSOC_STACK 3072
+#define WIFI_ASSOC_PRIO 2
+
+// Owned by esp_now_sender once it runs
+static assoc_cache_t s_assoc;
+static bool s_fast_boot;
+static int64_t s_first_frame_us;
+
+// What wifi found, from whoever ran wifi_wait_connected to the sender
+static std::atomic<bool> s_wifi_done;
+static int64_t s_wifi_done_us;
+static uint8_t s_ap_channel;                // 0 = wifi gave up
+static uint8_t s_ap_bssid[6];
+static bool s_wifi_pinned;                  // only trying the cached BSSID
+static esp_event_handler_instance_t s_wifi_handler_inst;
+static esp_event_handler_instance_t s_ip_handler_inst;
+
+// Once up, a lost AP is tried again this often. Every try is a scan over all channels, ESP-NOW hears nothing meanwhile
+#define WIFI_RECONNECT_MS 10000
+static esp_timer_handle_t s_reconnect_timer;
+
+// Channel the STA reassociated on, from the wifi event handler to the sender. 0 = nothing new
+static std::atomic<uint8_t> s_wifi_channel;
+
 uint8_t CONFIG_ESPNOW_CHANNEL;
 
 #define PORT 5000
 
-// Receiver MAC Address
-uint8_t mac_destination[6] = {0xd8, 0x13, 0x2a, 0x7f, 0xab, 0x24};
+// Tasks, see dt_tasks.h for which core does what
+#define ESPNOW_SENDER_PRIO 6
+#define ESPNOW_SENDER_STACK 4096
+#define TCP_CLIENT_PRIO 5
+#define TCP_CLIENT_STACK 4096
+#define HOUSEKEEPING_STACK 4096
 
-extern "C"
+// ESP-NOW sender
+#define ESPNOW_SAMPLE_PERIOD_MS 100     // one sensor sample every
+#define ESPNOW_TEXT_PERIOD_MS 2000      // the hello message every
+#define ESPNOW_BATCH_LATENCY_MS 500     // longest a record waits for its frame to fill, to start with
+#define ESPNOW_REPORT_MS 10000
+#define ESPNOW_TX_WINDOW 2              // frames handed to the driver before waiting on on_data_sent
+#define ESPNOW_TX_ATTEMPTS 3
+#define ESPNOW_JOIN_RETRY_MS 1000       // how often to broadcast a join request until answered
+#define ESPNOW_JOIN_TIMEOUT_MS 10000    // longest the sender stops for a join, then it runs (and spools) a while
+#define ESPNOW_JOIN_PAUSE_MS 2000       // between joins that found nothing
+#define ESPNOW_DUMP_PERIOD_MS 60000     // the recent sample history goes to the base station every
+#define ESPNOW_HISTORY_SAMPLES (ESPNOW_DUMP_PERIOD_MS / ESPNOW_SAMPLE_PERIOD_MS)
+
+/*
+    How often a batch frame goes out, AIMD (rate_ctl.h). Frames are what take the airtime, a
+    sample is a byte or two of one, so the rate control moves the batch deadline rather than
+    the sample rate: up to ESPNOW_RATE_MAX frames/s while the channel keeps up, down to one
+    every 5 s when it does not. Numbers from net_sim, where 100 slaves go from 250 ms to 55 ms
+    median latency on a free channel and follow the bitrate down to 250 kbps and back
+*/
+#define ESPNOW_RATE_MIN_MILLI 200
+#define ESPNOW_RATE_MAX_MILLI 10000
+#define ESPNOW_RATE_INCREASE_MILLI 1000 // per second
+#define ESPNOW_RATE_DECREASE_PCT 70
+#define ESPNOW_RATE_RTT_MARGIN_US 20000 // with the driver this much longer than usual is a queue building up
+#define ESPNOW_RATE_HOLDOFF_MS 500
+
+/*
+    Store and forward (spool.h): batch frames the base station can't be reached for go to the
+    "spool" flash partition. The first frame the send queue gives up on marks the link down, and
+    from then on new batches go straight to flash. One spooled frame is tried every
+    ESPNOW_SPOOL_PROBE_MS, and as soon as one gets through the rest are fed to the send queue
+    as fast as it empties, on top of whatever is new
+*/
+#define ESPNOW_SPOOL_PARTITION "spool"
+#define ESPNOW_SPOOL_SYNC_BYTES 1024    // one flash write per ~4 full frames, each stalls both cores for a moment
+#define ESPNOW_SPOOL_SYNC_MS 2000       // and at least this often, the most a reboot loses
+#define ESPNOW_SPOOL_PROBE_MS 1000
+#define ESPNOW_SPOOL_DRAIN_QUEUED 2     // spooled frames kept waiting in the send queue while draining
+
+// TCP client
+#define TCP_WINDOW 4            // requests allowed in flight on the one connection
+#define TCP_SEND_PERIOD_MS 5000        // slowest, and where it starts
+#define TCP_RATE_MAX_MILLI 20000       // requests per second, when the round trip stays short
+#define TCP_RATE_INCREASE_MILLI 500
+#define TCP_RATE_DECREASE_PCT 50
+#define TCP_RATE_RTT_MARGIN_US 50000
+#define TCP_RATE_HOLDOFF_MS 1000
+#define TCP_POLL_MS 100
+#define TCP_REPORT_MS 10000
+
+// Receiver MAC Address, learnt from the base station's join ack
+uint8_t mac_destination[6];
+
+// This slave's id in every frame it sends, set in esp_now_client
+static uint16_t s_node_id = 0;
+
+// The radio, only ever touched through dt_transport_*
+static dt_transport_t *s_radio;
+
+// ESP-NOW callbacks -> esp_now_sender
+typedef enum
 {
+    ESPNOW_EVT_SENT,        // on_data_sent result
+    ESPNOW_EVT_RECV,        // frame from the base station
+    ESPNOW_EVT_SLOT,        // our TDMA slot has opened
+    ESPNOW_EVT_TCP_TIME,    // a time sync answer over TCP, buf holds the dt_time_resp_t and rx_us
+} espnow_evt_kind_t;
 
-    void blinky(gpio_num_t led_pin)
-    {
-        gpio_set_level(led_pin, 1);
+typedef struct
+{
+    uint8_t kind;
+    uint8_t mac[6];
+    bool success;
+    shared_buf_t *buf;      // ESPNOW_EVT_RECV and _TCP_TIME, the receiver releases it
+} espnow_evt_t;
 
-        vTaskDelay(500 / portTICK_PERIOD_MS);
+#define ESPNOW_EVT_QUEUE_LEN 16
+static QueueHandle_t s_espnow_queue;
 
-        gpio_set_level(led_pin, 0);
-        vTaskDelay(500 / portTICK_PERIOD_MS);   
-    }
+// Frames received and frames waiting to send both come out of this, so neither touches the heap
+#define ESPNOW_FRAME_BUFS (ESPNOW_EVT_QUEUE_LEN + ESPNOW_TXQ_DEPTH)
+static shared_buf_t s_frame_bufs[ESPNOW_FRAME_BUFS];
+static std::atomic<uint16_t> s_frame_buf_next[ESPNOW_FRAME_BUFS];
+static block_pool_t s_frame_pool;
+
+// Which channel the base station is on (chan_track.h), owned by the sender task
+static chan_track_t s_chan;
+
+// The base station's clock (time_sync.h). The sender task feeds it, any task can read it
+static time_sync_t s_time;
+
+// TDMA slot from the join ack, timing from the base station's beacons
+static tdma_sched_t s_tdma;
+static esp_timer_handle_t s_slot_timer;
+static espnow_txq_t s_txq;
+static espnow_batch_t s_batch;
+
+// The one connection to the base station's TCP server, owned by tcp_client_task
+static tcp_link_t s_tcp_link;
+
+// Send rates, each owned by its task and only read by housekeeping
+static rate_ctl_t s_espnow_rate;
+static rate_ctl_t s_tcp_rate;
+
+// Owned by the sender task, housekeeping only reads the numbers
+static dt_flash_t s_spool_flash;
+static spool_t s_spool;
+static bool s_spool_ok;
+static bool s_link_down;
+
+// Samples kept for the periodic dump, far too many for one frame so it goes out fragmented.
+// The dump is packed (and LZ'd if that helps) into its own buffer, frag_tx reads it until the base station has the lot
+#define ESPNOW_DUMP_MAX (SAMPLE_PACK_HEADER_MAX + ESPNOW_HISTORY_SAMPLES * SAMPLE_VARINT_MAX)
+static dt_sample_t s_history[ESPNOW_HISTORY_SAMPLES];
+static uint32_t s_history_count;
+static uint8_t s_dump_packed[ESPNOW_DUMP_MAX];
+static uint8_t s_dump[ESPNOW_DUMP_MAX];
+static sample_lz_state_t s_dump_lz;
+static frag_tx_t s_frag_tx;
+
+static_assert(ESPNOW_DUMP_MAX <= DT_FRAG_MAX_MSG_SIZE, "sample dump too big for one fragmented message");
+static_assert(ESPNOW_DUMP_MAX <= SAMPLE_LZ_MAX_RAW, "the base station could not unpack a dump this big");
+
+extern "C"
+{
 
     void gpio_out_setup(unsigned long led_pin)
     {
@@ -91,18 +271,30 @@ extern "C"
         // if disconnected somehow
         else if (event_base == WIFI_EVENT && event_id == WIFI_EVENT_STA_DISCONNECTED)
         {
+            // the cached AP isn't there (replaced, or the SSID moved to another one), look at all of them
+            if (s_wifi_pinned && s_retry_num == WIFI_PINNED_RETRIES)
+            {
+                wifi_config_t cfg;
+                esp_wifi_get_config(WIFI_IF_STA, &cfg);
+                cfg.sta.bssid_set = false;
+                cfg.sta.channel = 0;
+                esp_wifi_set_config(WIFI_IF_STA, &cfg);
+                s_wifi_pinned = false;
+                ESP_LOGI(TAG, "Cached AP not answering, scanning");
+            }
+
             if (s_retry_num < MAX_FAILURES) 
             // if can still try connecting, then try connect 
             {
                 ESP_LOGI(TAG, "Reconnecting to AP...");
                 esp_wifi_connect();
                 s_retry_num++;
-                blinky(LED_ESPNOW);
+                led_pulse(&s_led_espnow);
             } 
             else 
             // Load unable to connect status
             {
-                xEventGroupSetBits(wifi_event_group, WIFI_FAIL);
+                xEventGroupSetBits(wifi_event_group, WIFI_FAIL_BIT);
             }
         }
     }
@@ -117,10 +309,56 @@ extern "C"
             ESP_LOGI(TAG, "STA IP: " IPSTR, IP2STR(&event->ip_info.ip));
 
             s_retry_num = 0; // reset counter so that we wont go thru the connect disconnect again
-            xEventGroupSetBits(wifi_event_group, WIFI_SUCC);
+            xEventGroupSetBits(wifi_event_group, WIFI_SUCC_BIT);
         }
     }
 
+    static void reconnect_timer_cb(void *arg)
+    {
+        esp_wifi_connect();
+    }
+
+    /*
+        After boot: the AP went away (rebooted, or moved to another channel). Any AP with the SSID
+        will do now, the cached BSSID and channel may be the reason it's gone. A reconnect on
+        another channel is passed to the sender, the base station is most likely there too
+    */
+    static void wifi_roam_handler(void* arg, esp_event_base_t event_base, int32_t event_id, void* event_data)
+    {
+        if (event_id == WIFI_EVENT_STA_DISCONNECTED)
+        {
+            if (s_wifi_pinned)
+            {
+                wifi_config_t cfg;
+                esp_wifi_get_config(WIFI_IF_STA, &cfg);
+                cfg.sta.bssid_set = false;
+                cfg.sta.channel = 0;
+                esp_wifi_set_config(WIFI_IF_STA, &cfg);
+                s_wifi_pinned = false;
+            }
+            if (!esp_timer_is_active(s_reconnect_timer))
+            {
+                esp_timer_start_once(s_reconnect_timer, WIFI_RECONNECT_MS * 1000);
+            }
+        }
+        else if (event_id == WIFI_EVENT_STA_CONNECTED)
+        {
+            const wifi_event_sta_connected_t *event = (const wifi_event_sta_connected_t *)event_data;
+            ESP_LOGI(TAG, "Back on the AP, channel %d", event->channel);
+            s_wifi_channel.store(event->channel, std::memory_order_relaxed);
+        }
+    }
+
+    // the boot handlers only see it through to the first connect, this one stays
+    static void wifi_keep_connected()
+    {
+        esp_timer_create_args_t reconnect_args = {};
+        reconnect_args.callback = reconnect_timer_cb;
+        reconnect_args.name = "wifi_reconnect";
+        ESP_ERROR_CHECK(esp_timer_create(&reconnect_args, &s_reconnect_timer));
+        ESP_ERROR_CHECK(esp_event_handler_instance_register(WIFI_EVENT, ESP_EVENT_ANY_ID, &wifi_roam_handler, NULL, NULL));
+    }
+
     void init_nvs()
     {
         esp_err_t ret = nvs_flash_init();
@@ -142,10 +380,14 @@ extern "C"
         ESP_ERROR_CHECK( ret ); // check if we get errors
     }
 
-    esp_err_t init_wifi()
+    /*
+        Start connecting, without waiting for it (wifi_wait_connected does that). With a cache
+        the STA goes for the cached AP on its channel, no full scan, and the radio is put on
+        that channel so ESP-NOW can start before the association is done
+    */
+    void init_wifi(const assoc_cache_t *cache)
     {
         /* Init of wifi stuff*/
-        int curr_status = WIFI_FAIL;
 
         // init network interface
         ESP_ERROR_CHECK(esp_netif_init()); 
@@ -174,7 +416,6 @@ extern "C"
         */
         wifi_event_group = xEventGroupCreate();
 
-        esp_event_handler_instance_t wifi_handler_inst;
         ESP_ERROR_CHECK
         (
             esp_event_handler_instance_register
@@ -183,11 +424,10 @@ extern "C"
                 ESP_EVENT_ANY_ID, // like call event when any disconnect/connect 
                 &wifi_event_handler, // callback funct event
                 NULL,
-                &wifi_handler_inst
+                &s_wifi_handler_inst
             )
         );
 
-        esp_event_handler_instance_t ip_handler_inst;
         ESP_ERROR_CHECK
         (
             esp_event_handler_instance_register
@@ -196,7 +436,7 @@ extern "C"
                 IP_EVENT_STA_GOT_IP, // if got IP
                 &ip_event_handler, // callback funct event
                 NULL,
-                &ip_handler_inst
+                &s_ip_handler_inst
             )
         );
 
@@ -212,21 +452,41 @@ extern "C"
             },
         };
 
+        if (cache != NULL && cache->channel != 0)
+        {
+            wifi_config.sta.channel = cache->channel;
+            memcpy(wifi_config.sta.bssid, cache->bssid, 6);
+            wifi_config.sta.bssid_set = true;
+            s_wifi_pinned = true;
+        }
+
         // set the wifi config
         ESP_ERROR_CHECK(esp_wifi_set_config(WIFI_IF_STA, &wifi_config) );
 
         // start the wifi driver
         ESP_ERROR_CHECK(esp_wifi_start());
 
+        // can fail if the connect has already started, which is on the same channel anyway
+        if (cache != NULL && cache->channel != 0)
+        {
+            esp_wifi_set_channel(cache->channel, WIFI_SECOND_CHAN_NONE);
+        }
+
         ESP_LOGI(TAG, "STA initialization complete");
+    }
+
+    // Block until init_wifi's connect worked or ran out of retries
+    int wifi_wait_connected()
+    {
+        int curr_status = WIFI_FAIL;
 
         EventBits_t bits = xEventGroupWaitBits(wifi_event_group,
-            WIFI_SUCC | WIFI_FAIL,
+            WIFI_SUCC_BIT | WIFI_FAIL_BIT,
             pdFALSE,
             pdFALSE,
             portMAX_DELAY);
         
-        if (bits & WIFI_SUCC) 
+        if (bits & WIFI_SUCC_BIT) 
         {
             ESP_LOGI(TAG, "Connected to ap");
             wifi_ap_record_t ap_info;
@@ -238,10 +498,16 @@ extern "C"
             ESP_LOGI(TAG, "ESP32 MAC: %02X:%02X:%02X:%02X:%02X:%02X" , mac_addr[0], mac_addr[1], mac_addr[2], mac_addr[3], mac_addr[4], mac_addr[5]);
             ESP_LOGI(TAG , "AP channel: %02X" , ap_info.primary);
             
-            CONFIG_ESPNOW_CHANNEL = ap_info.primary;
+            // on a cached boot ESP-NOW is already going, the sender moves it if the AP changed channel
+            if (!s_fast_boot)
+            {
+                CONFIG_ESPNOW_CHANNEL = ap_info.primary;
+            }
+            s_ap_channel = ap_info.primary;
+            memcpy(s_ap_bssid, ap_info.bssid, 6);
             curr_status = WIFI_SUCC;
         } 
-        else if (bits & WIFI_FAIL) 
+        else if (bits & WIFI_FAIL_BIT) 
         {
             ESP_LOGI(TAG, "Failed to connect to ap");
             curr_status = WIFI_FAIL;
@@ -253,98 +519,1038 @@ extern "C"
         }
 
         /* The event will not be processed after unregister */
-        ESP_ERROR_CHECK(esp_event_handler_instance_unregister(IP_EVENT, IP_EVENT_STA_GOT_IP, ip_handler_inst));
-        ESP_ERROR_CHECK(esp_event_handler_instance_unregister(WIFI_EVENT, ESP_EVENT_ANY_ID, wifi_handler_inst));
+        ESP_ERROR_CHECK(esp_event_handler_instance_unregister(IP_EVENT, IP_EVENT_STA_GOT_IP, s_ip_handler_inst));
+        ESP_ERROR_CHECK(esp_event_handler_instance_unregister(WIFI_EVENT, ESP_EVENT_ANY_ID, s_wifi_handler_inst));
         vEventGroupDelete(wifi_event_group);
+        wifi_keep_connected();
 
         #if CONFIG_ESPNOW_ENABLE_LONG_RANGE
             ESP_ERROR_CHECK( esp_wifi_set_protocol(ESPNOW_WIFI_IF, WIFI_PROTOCOL_11B|WIFI_PROTOCOL_11G|WIFI_PROTOCOL_11N|WIFI_PROTOCOL_LR) );
         #endif
+
+        s_wifi_done_us = esp_timer_get_time();
+        s_wifi_done.store(true, std::memory_order_release);
         return curr_status;
     }
 
-    void tcp_client(void)
+    // Cached boot: the association finishes here while the sender is already sending
+    static void wifi_assoc_task(void * pvParams)
+    {
+        ESP_LOGI(TAG , "Connect wifi: %i" , wifi_wait_connected());
+        vTaskDelete(NULL);
+    }
+
+    // dt_frame_clock_t: the base station's time once time sync has it, so it can tell the one way latency. Any task
+    static uint32_t frame_clock(int64_t local_us, uint8_t *flags)
+    {
+        int64_t master_us;
+        if (!time_sync_master_us(&s_time, local_us, &master_us))
+        {
+            return (uint32_t)local_us;
+        }
+        *flags |= DT_FLAG_MASTER_TIME;
+        return (uint32_t)master_us;
+    }
+
+    // A time sync answer that came over TCP, to the sender task which owns s_time
+    static void tcp_time_resp(tcp_link_t *link)
+    {
+        dt_time_resp_t resp;
+        int64_t rx_us;
+        if (!tcp_link_time_resp(link, &resp, &rx_us))
+        {
+            return;
+        }
+
+        espnow_evt_t evt;
+        evt.kind = ESPNOW_EVT_TCP_TIME;
+        evt.buf = shared_buf_alloc(&s_frame_pool, (const uint8_t *)&resp, sizeof(resp), rx_us, mac_destination, 0);
+        if (evt.buf != NULL && xQueueSend(s_espnow_queue, &evt, 0) != pdTRUE)
+        {
+            shared_buf_release(evt.buf);
+        }
+    }
+
+    static void tcp_client_task(void * pvParams)
     {
-        char rx_buffer[128];
         char host_ip[] = "192.168.10.119"; // Server IP
-        int addr_family = 0;
-        int ip_protocol = 0;
-        static const char *payload = "Message from ESP32 TCP Socket Client";
+        static const char *message = "Message from ESP32 TCP Socket Client";
+        tcp_link_t *link = &s_tcp_link;
+        uint8_t frame[DT_FRAME_MAX_SIZE];
+        uint32_t seq = 0;
+
+        tcp_link_init(link, host_ip, PORT, TCP_WINDOW);
 
+        rate_ctl_config_t rate_config =
+        {
+            .min_milli = 1000 * RATE_CTL_MILLI / TCP_SEND_PERIOD_MS,
+            .max_milli = TCP_RATE_MAX_MILLI,
+            .start_milli = 1000 * RATE_CTL_MILLI / TCP_SEND_PERIOD_MS,
+            .increase_milli = TCP_RATE_INCREASE_MILLI,
+            .decrease_pct = TCP_RATE_DECREASE_PCT,
+            .rtt_margin_us = TCP_RATE_RTT_MARGIN_US,
+            .holdoff_ms = TCP_RATE_HOLDOFF_MS,
+        };
+        rate_ctl_init(&s_tcp_rate, &rate_config);
+
+        int64_t next_send_us = 0;
+        int64_t next_time_us = 0;
+
+        // one connection for the life of the task, reconnect with backoff if it drops
         while (1)
         {
-            struct sockaddr_in dest_addr;
-            inet_pton(AF_INET, host_ip, &dest_addr.sin_addr);
-            dest_addr.sin_family = AF_INET;
-            dest_addr.sin_port = htons(PORT);
-            addr_family = AF_INET;
-            ip_protocol = IPPROTO_IP;
+            int64_t now = esp_timer_get_time();
+
+            // time sync goes this way too while ESP-NOW isn't answering it
+            if (now >= next_time_us && tcp_link_can_send(link))
+            {
+                if (time_sync_want_tcp(&s_time, now))
+                {
+                    dt_time_req_t req;
+                    time_sync_request(&req, esp_timer_get_time());
+                    size_t frame_len = dt_frame_encode(frame, sizeof(frame), DT_TYPE_TIME_REQ, s_node_id,
+                                                       seq, (uint32_t)req.t1_us, &req, sizeof(req));
+                    if (tcp_link_send(link, frame, frame_len) == 0)
+                    {
+                        seq++;
+                    }
+                }
+                next_time_us = now + TIME_SYNC_PERIOD_MS * 1000;
+            }
+
+            if (now >= next_send_us && tcp_link_can_send(link))
+            {
+                size_t message_len = strlen(message);
+                memcpy(dt_frame_payload(frame), message, message_len);
+                size_t frame_len = dt_frame_finish_at(frame, DT_TYPE_TEXT, s_node_id, seq, frame_clock, now, message_len);
 
-            int sock = socket(addr_family, SOCK_STREAM, ip_protocol);
-            if (sock < 0)
+                if (tcp_link_send(link, frame, frame_len) == 0)
+                {
+                    seq++;
+                    next_send_us = now + rate_ctl_period_us(&s_tcp_rate);
+                }
+                else
+                {
+                    rate_ctl_on_loss(&s_tcp_rate, now);
+                }
+            }
+
+            // the round trip of the newest response speaks for the lot, a dropped connection is a loss
+            int wait_ms = (int)((next_send_us - now) / 1000);
+            int responses = tcp_link_poll(link, wait_ms > 0 && wait_ms < TCP_POLL_MS ? wait_ms : TCP_POLL_MS);
+            if (responses > 0)
+            {
+                rate_ctl_on_ack(&s_tcp_rate, link->rtt_us, esp_timer_get_time());
+                tcp_time_resp(link);
+            }
+            else if (responses < 0)
+            {
+                rate_ctl_on_loss(&s_tcp_rate, esp_timer_get_time());
+            }
+        }
+    }
+
+    // Callback function, runs on the wifi task so just hand the result to the sender task
+    static void on_data_sent(dt_transport_t *t, const uint8_t *mac_addr, bool success)
+    {
+        espnow_evt_t evt;
+        evt.kind = ESPNOW_EVT_SENT;
+        memcpy(evt.mac, mac_addr, 6);
+        evt.success = success;
+        xQueueSend(s_espnow_queue, &evt, 0);
+    }
+
+    static void on_data_recv(dt_transport_t *t, const uint8_t *src_mac, int8_t rssi, const uint8_t *data, size_t len)
+    {
+        if (len > DT_FRAME_MAX_SIZE)
+        {
+            return;
+        }
+
+        espnow_evt_t evt;
+        evt.kind = ESPNOW_EVT_RECV;
+        memcpy(evt.mac, src_mac, 6);
+        evt.buf = shared_buf_alloc(&s_frame_pool, data, len, esp_timer_get_time(), src_mac, rssi);
+        if (evt.buf == NULL)
+        {
+            return; // counted in s_frame_pool.exhausted
+        }
+        if (xQueueSend(s_espnow_queue, &evt, 0) != pdTRUE)
+        {
+            shared_buf_release(evt.buf);
+        }
+    }
+
+    static int add_peer(const uint8_t *mac)
+    {
+        return dt_transport_add_peer(s_radio, mac, CONFIG_ESPNOW_CHANNEL);
+    }
+
+    void esp_now_client()
+    {
+        // node id for the frame header is the bottom of the MAC, unique enough for one fleet
+        uint8_t mac_addr[6];
+        ESP_ERROR_CHECK(esp_read_mac(mac_addr , ESP_MAC_WIFI_STA)); 
+        s_node_id = (uint16_t)((mac_addr[4] << 8) | mac_addr[5]);
+
+        // ESP-NOW initiation and register a callback function that will be called
+        shared_buf_pool_init(&s_frame_pool, s_frame_bufs, s_frame_buf_next, ESPNOW_FRAME_BUFS);
+        s_espnow_queue = xQueueCreate(ESPNOW_EVT_QUEUE_LEN, sizeof(espnow_evt_t));
+
+        s_radio = dt_transport_espnow_init();
+        dt_transport_set_callbacks(s_radio, on_data_recv, on_data_sent, NULL);
+
+        // the base station is found by broadcasting, see espnow_join
+        add_peer(DT_BROADCAST_MAC);
+    }
+
+    // A base station took us in: register it as our peer
+    static bool handle_join_ack(const shared_buf_t *buf)
+    {
+        dt_frame_view_t view;
+        if (dt_frame_decode(buf->data, buf->len, &view) <= 0 ||
+            view.hdr->type != DT_TYPE_JOIN_ACK ||
+            view.hdr->len < sizeof(dt_join_ack_t))
+        {
+            return false;
+        }
+
+        const dt_join_ack_t *ack = (const dt_join_ack_t *)view.payload;
+        if (ack->status != DT_JOIN_ACCEPTED)
+        {
+            return false;
+        }
+
+        // it answered on the channel we are on, the tracker moves us if it named another
+        chan_track_on_heard(&s_chan, ack->channel, 0, buf->rx_us);
+        memcpy(mac_destination, buf->mac, 6);
+        add_peer(mac_destination);
+        s_tdma.slot = ack->slot;
+        ESP_LOGI(TAG, "Joined base station %02X:%02X:%02X:%02X:%02X:%02X on channel %d, slot %u",
+                 buf->mac[0], buf->mac[1], buf->mac[2], buf->mac[3], buf->mac[4], buf->mac[5], ack->channel, ack->slot);
+
+        assoc_cache_add_peer(&s_assoc, buf->mac);
+        s_assoc.slot = ack->slot;
+        s_assoc.channel = ack->channel != 0 ? ack->channel : s_assoc.channel;
+        assoc_cache_save(&s_assoc);
+        return true;
+    }
+
+    // Cached boot: straight to the base station we had last time, no broadcast
+    static void espnow_resume(void)
+    {
+        memcpy(mac_destination, s_assoc.peers[0], 6);
+        add_peer(mac_destination);
+        s_tdma.slot = s_assoc.slot;
+        ESP_LOGI(TAG, "Resuming with base station %02X:%02X:%02X:%02X:%02X:%02X on channel %d, slot %u",
+                 mac_destination[0], mac_destination[1], mac_destination[2], mac_destination[3], mac_destination[4], mac_destination[5],
+                 CONFIG_ESPNOW_CHANNEL, s_assoc.slot);
+    }
+
+    // Broadcast one join request, the base station answers with a join ack saying which channel it is on
+    static void espnow_send_join_req(void)
+    {
+        static uint32_t seq = 0;
+        uint8_t frame[DT_FRAME_MAX_SIZE];
+        size_t frame_len = dt_frame_encode(frame, sizeof(frame), DT_TYPE_JOIN_REQ, s_node_id,
+                                           seq++, (uint32_t)esp_timer_get_time(), NULL, 0);
+        dt_transport_send(s_radio, DT_BROADCAST_MAC, frame, frame_len);
+    }
+
+    // esp_timer task. Ticks are 10 ms, far coarser than a slot, so a timer wakes the sender instead
+    static void slot_timer_cb(void *arg)
+    {
+        espnow_evt_t evt;
+        evt.kind = ESPNOW_EVT_SLOT;
+        xQueueSend(s_espnow_queue, &evt, 0);
+    }
+
+    // Frames from the base station after joining
+    static void handle_espnow_frame(const shared_buf_t *buf)
+    {
+        dt_frame_view_t view;
+        if (dt_frame_decode(buf->data, buf->len, &view) <= 0 || memcmp(buf->mac, mac_destination, 6) != 0)
+        {
+            return;
+        }
+
+        if (view.hdr->type == DT_TYPE_BEACON && view.hdr->len >= DT_BEACON_MIN_SIZE)
+        {
+            const dt_beacon_t *beacon = (const dt_beacon_t *)view.payload;
+            tdma_on_beacon(&s_tdma, beacon, buf->rx_us);
+            chan_track_on_heard(&s_chan, DT_BEACON_HAS(view.hdr->len, channel) ? beacon->channel : 0, beacon->superframe_us, buf->rx_us);
+            if (DT_BEACON_HAS(view.hdr->len, prev_tx_us))
+            {
+                time_sync_on_beacon(&s_time, view.hdr->seq, beacon->prev_tx_us, buf->rx_us);
+            }
+        }
+        else if (view.hdr->type == DT_TYPE_TIME_RESP && view.hdr->len >= sizeof(dt_time_resp_t))
+        {
+            time_sync_on_response(&s_time, (const dt_time_resp_t *)view.payload, buf->rx_us, TIME_SYNC_VIA_ESPNOW);
+        }
+        else if (view.hdr->type == DT_TYPE_FRAG_STATUS)
+        {
+            frag_tx_on_status(&s_frag_tx, buf->mac, view.payload, view.hdr->len, esp_timer_get_time());
+        }
+        else if (view.hdr->type == DT_TYPE_JOIN_ACK && view.hdr->len >= sizeof(dt_join_ack_t))
+        {
+            // the base station forgot us and took us back in, possibly in another slot. Or it answered a channel sweep's probe
+            const dt_join_ack_t *ack = (const dt_join_ack_t *)view.payload;
+            chan_track_on_heard(&s_chan, ack->channel, 0, buf->rx_us);
+            if (ack->slot == s_tdma.slot)
+            {
+                return;
+            }
+            s_tdma.slot = ack->slot;
+            ESP_LOGI(TAG, "Base station moved us to slot %u", s_tdma.slot);
+            s_assoc.slot = s_tdma.slot;
+            assoc_cache_save(&s_assoc);
+        }
+    }
+
+    // Keep the send queue off the radio while a channel sweep has it. Our TDMA slot is checked per frame, see espnow_tx_gate
+    static void update_tx_gate(void)
+    {
+        espnow_txq_pause(&s_txq, chan_track_sweeping(&s_chan));
+    }
+
+    // The send queue's gate: a frame only goes if it and the ones still with the driver ahead of it fit in what is left of our slot
+    static int64_t espnow_tx_gate(size_t len, int in_flight, size_t in_flight_bytes)
+    {
+        uint32_t airtime_us = espnow_airtime_us(len) + in_flight * espnow_airtime_us(0) +
+                              (uint32_t)(in_flight_bytes * 8 / ESPNOW_PHY_RATE_MBPS);
+        int64_t wait_us = tdma_wait_us(&s_tdma, esp_timer_get_time(), airtime_us);
+
+        // with frames in flight their on_data_sent polls again sooner, the timer is for an empty driver
+        if (wait_us > 0 && in_flight == 0 && !esp_timer_is_active(s_slot_timer))
+        {
+            esp_timer_start_once(s_slot_timer, wait_us);
+        }
+        return wait_us;
+    }
+
+    static int espnow_raw_send(const uint8_t *peer_addr, const uint8_t *frame, size_t len)
+    {
+        trace_frame(TRACE_ESPNOW_SEND, frame, len, len);
+
+        // a time request's t1 is when the driver gets it, not when it was queued behind our slot
+        const dt_frame_hdr_t *hdr = (const dt_frame_hdr_t *)frame;
+        if (len == DT_FRAME_HDR_SIZE + sizeof(dt_time_req_t) && hdr->type == DT_TYPE_TIME_REQ)
+        {
+            uint8_t restamped[DT_FRAME_HDR_SIZE + sizeof(dt_time_req_t)];
+            int64_t now = esp_timer_get_time();
+            time_sync_request((dt_time_req_t *)dt_frame_payload(restamped), now);
+            dt_frame_finish(restamped, DT_TYPE_TIME_REQ, hdr->node_id, hdr->seq, (uint32_t)now, sizeof(dt_time_req_t));
+            return dt_transport_send(s_radio, peer_addr, restamped, len);
+        }
+        return dt_transport_send(s_radio, peer_addr, frame, len);
+    }
+
+    // An exchange with the base station when time sync wants one, through the send queue like everything else
+    static void espnow_time_request(int64_t now)
+    {
+        if (!time_sync_due(&s_time, now))
+        {
+            return;
+        }
+        uint8_t frame[DT_FRAME_MAX_SIZE];
+        dt_time_req_t req;
+        time_sync_request(&req, now);
+        size_t frame_len = dt_frame_encode(frame, sizeof(frame), DT_TYPE_TIME_REQ, s_node_id, s_batch.seq++,
+                                           (uint32_t)now, &req, sizeof(req));
+        espnow_txq_push(&s_txq, mac_destination, frame, frame_len);
+    }
+
+    // Keep a frame for later. Only batches: fragments belong to a message frag_tx retries itself
+    static bool spool_frame(const uint8_t *frame, size_t len)
+    {
+        if (!s_spool_ok || len < DT_FRAME_HDR_SIZE || ((const dt_frame_hdr_t *)frame)->type != DT_TYPE_BATCH)
+        {
+            return false;
+        }
+        return spool_append(&s_spool, frame, len) == 0;
+    }
+
+    // The send queue gave up on a frame, the base station is gone until something gets through again
+    static void espnow_txq_dropped(const uint8_t *peer_addr, const uint8_t *frame, size_t len)
+    {
+        if (!s_link_down && s_spool_ok)
+        {
+            ESP_LOGW(TAG, "Base station unreachable, spooling to flash");
+        }
+        s_link_down = true;
+        spool_frame(frame, len);
+    }
+
+    // full batches go through the flow controlled queue rather than straight to the radio, or to flash if it can't take them
+    static int espnow_batch_send(const uint8_t *peer_addr, const uint8_t *frame, size_t len)
+    {
+        if (!s_link_down && espnow_txq_push(&s_txq, peer_addr, frame, len) == 0)
+        {
+            return 0;
+        }
+        return spool_frame(frame, len) ? 0 : -1;
+    }
+
+    static int espnow_frag_send(const uint8_t *peer_addr, const uint8_t *frame, size_t len)
+    {
+        return espnow_txq_push(&s_txq, peer_addr, frame, len);
+    }
+
+    static void espnow_link_up(void)
+    {
+        if (s_link_down && s_spool_ok)
+        {
+            ESP_LOGI(TAG, "Base station back, %lu spooled frames to send", (unsigned long)spool_count(&s_spool));
+        }
+        s_link_down = false;
+    }
+
+    /*
+        Spooled frames into the send queue: a probe now and then while the link is down, otherwise
+        as many as keep ESPNOW_SPOOL_DRAIN_QUEUED waiting. Their seq and timestamps are the ones
+        they were made with, the base station sees them late rather than new
+    */
+    static void spool_drain(int64_t now, int64_t *next_probe_us)
+    {
+        if (!s_spool_ok || spool_count(&s_spool) == 0)
+        {
+            return;
+        }
+
+        int room = ESPNOW_SPOOL_DRAIN_QUEUED - espnow_txq_queued(&s_txq);
+        if (s_link_down)
+        {
+            if (now < *next_probe_us)
+            {
+                return;
+            }
+            room = 1;
+            *next_probe_us = now + ESPNOW_SPOOL_PROBE_MS * 1000;
+        }
+
+        uint8_t frame[DT_FRAME_MAX_SIZE];
+        while (room-- > 0 && s_txq.count < ESPNOW_TXQ_DEPTH)
+        {
+            int len = spool_peek(&s_spool, frame, sizeof(frame));
+            if (len <= 0)
+            {
+                break;
+            }
+            // old seq and timestamp, the base station keeps it out of its sequence and latency tracking
+            dt_frame_add_flags(frame, DT_FLAG_REPLAY);
+            if (espnow_txq_push(&s_txq, mac_destination, frame, len) != 0)
             {
-                ESP_LOGE(TAG, "Unable to create socket: errno %d", errno);
                 break;
             }
-            ESP_LOGI(TAG, "Socket created ");
-            ESP_LOGI(TAG, "Connecting to %s:%d", host_ip, PORT);
+            // from here the send queue has it, and gives it back through espnow_txq_dropped if it fails
+            spool_pop(&s_spool);
+        }
+    }
 
-            int err = connect(sock, (struct sockaddr *)&dest_addr, sizeof(dest_addr));
-            if (err != 0)
+    static void spool_start(void)
+    {
+        spool_config_t config = { .sync_bytes = ESPNOW_SPOOL_SYNC_BYTES };
+        if (dt_flash_open(&s_spool_flash, ESPNOW_SPOOL_PARTITION, 0) != 0 || spool_open(&s_spool, &s_spool_flash, &config) != 0)
+        {
+            ESP_LOGW(TAG, "No \"%s\" partition, frames are lost while the base station is unreachable", ESPNOW_SPOOL_PARTITION);
+            return;
+        }
+        s_spool_ok = true;
+        ESP_LOGI(TAG, "Spool: %lu KB, %lu frames left from before", (unsigned long)(s_spool_flash.size / 1024),
+                 (unsigned long)spool_count(&s_spool));
+    }
+
+    static void log_spool_stats(void)
+    {
+        if (!s_spool_ok)
+        {
+            return;
+        }
+
+        const spool_stats_t *st = &s_spool.stats;
+        uint32_t wear_min, wear_max;
+        spool_wear(&s_spool, &wear_min, &wear_max);
+        ESP_LOGI(TAG, "Spool %lu waiting (link %s), %lu spooled, %lu sent, %lu dropped, %lu flash writes, %lu erases, wear %lu-%lu",
+                 (unsigned long)spool_count(&s_spool), s_link_down ? "down" : "up",
+                 (unsigned long)st->appended, (unsigned long)st->drained, (unsigned long)st->dropped,
+                 (unsigned long)s_spool_flash.stats.writes, (unsigned long)s_spool_flash.stats.erases,
+                 (unsigned long)wear_min, (unsigned long)wear_max);
+    }
+
+    static void log_chan_stats(void)
+    {
+        const chan_track_stats_t *st = &s_chan.stats;
+        if (st->sweeps == 0 && st->moves == 0)
+        {
+            return;
+        }
+        ESP_LOGI(TAG, "ESP-NOW on channel %d: %lu sweeps (%lu found it), %lu probes, %lu moves (%lu announced), longest outage %lu ms",
+                 s_chan.channel, (unsigned long)st->sweeps, (unsigned long)st->found, (unsigned long)st->probes,
+                 (unsigned long)st->moves, (unsigned long)st->announced, (unsigned long)st->outage_max_ms);
+    }
+
+    static void log_time_stats(void)
+    {
+        const time_sync_stats_t *st = &s_time.stats;
+        int64_t master_us;
+        bool synced = time_sync_master_us(&s_time, esp_timer_get_time(), &master_us);
+        ESP_LOGI(TAG, "Time sync %s, drift %ld ppb: %lu exchanges of %lu asked (%lu over TCP, %lu stale), round trip min %lu us last %lu us, "
+                      "%lu beacon points, %lu restarts",
+                 synced ? "on" : "off", (long)time_sync_drift_ppb(&s_time),
+                 (unsigned long)st->exchanges, (unsigned long)st->requests, (unsigned long)st->tcp_exchanges,
+                 (unsigned long)st->stale, (unsigned long)st->min_delay_us, (unsigned long)st->last_delay_us,
+                 (unsigned long)st->beacon_points, (unsigned long)st->steps);
+    }
+
+    static void log_txq_stats(void)
+    {
+        for (int i = 0; ; i++)
+        {
+            const espnow_txq_peer_stats_t *st = espnow_txq_peer_stats(&s_txq, i);
+            if (st == NULL)
             {
-                ESP_LOGE(TAG, "Socket unable to connect: errno %d", errno);
                 break;
             }
-            ESP_LOGI(TAG, "Successfully connected");
 
-            send(sock, payload, strlen(payload), 0);
+            const uint8_t *mac = st->peer_addr;
+            ESP_LOGI(TAG, "Peer %02X:%02X:%02X:%02X:%02X:%02X delivered %lu, failed %lu, retries %lu, latency min/avg/max %lu/%lu/%lu us",
+                     mac[0], mac[1], mac[2], mac[3], mac[4], mac[5],
+                     (unsigned long)st->delivered,
+                     (unsigned long)st->failed,
+                     (unsigned long)st->retries,
+                     (unsigned long)(st->delivered ? st->latency_min_us : 0),
+                     (unsigned long)(st->delivered ? st->latency_sum_us / st->delivered : 0),
+                     (unsigned long)st->latency_max_us);
+        }
+        ESP_LOGI(TAG, "Send queue rejected %lu, callback timeouts %lu, held for our slot %lu",
+                 (unsigned long)s_txq.rejected, (unsigned long)s_txq.timeouts, (unsigned long)s_txq.gate_waits);
+        ESP_LOGI(TAG, "Frame buffers: %lu/%d in use, high water %lu, exhausted %lu",
+                 (unsigned long)block_pool_in_use(&s_frame_pool), ESPNOW_FRAME_BUFS,
+                 (unsigned long)s_frame_pool.high_water.load(std::memory_order_relaxed),
+                 (unsigned long)s_frame_pool.exhausted.load(std::memory_order_relaxed));
+
+        const frag_tx_stats_t *frag = &s_frag_tx.stats;
+        if (frag->messages > 0)
+        {
+            ESP_LOGI(TAG, "Fragmented: %lu messages, %lu delivered, %lu failed, %lu fragments (%lu resent, %lu pokes), "
+                          "%lu queue full, slowest %lu ms",
+                     (unsigned long)frag->messages,
+                     (unsigned long)frag->delivered,
+                     (unsigned long)frag->failed,
+                     (unsigned long)frag->fragments,
+                     (unsigned long)frag->retransmits,
+                     (unsigned long)frag->pokes,
+                     (unsigned long)frag->backpressure,
+                     (unsigned long)frag->latency_max_ms);
+        }
+    }
+
+    static void history_add(const dt_sample_t *sample)
+    {
+        if (s_history_count == ESPNOW_HISTORY_SAMPLES)
+        {
+            memmove(s_history, s_history + 1, sizeof(s_history) - sizeof(s_history[0]));
+            s_history_count--;
+        }
+        s_history[s_history_count++] = *sample;
+    }
+
+    /*
+        The history as one packed body, and through the LZ pass if that comes out smaller.
+        It is all channel 0, read_sample is the only source. Returns the length in s_dump
+    */
+    static size_t pack_history(uint8_t *type)
+    {
+        sample_pack_t pack;
+        sample_pack_begin(&pack, s_dump_packed, sizeof(s_dump_packed), s_history[0].channel, s_history[0].value);
+        for (uint32_t i = 1; i < s_history_count; i++)
+        {
+            sample_pack_add(&pack, s_history[i].value);
+        }
 
-            int len = recv(sock, rx_buffer, sizeof(rx_buffer) - 1, 0);
-            rx_buffer[len] = 0; // Null-terminate
-            ESP_LOGI(TAG, "Received %d bytes from %s:", len, host_ip);
-            ESP_LOGI(TAG, "%s", rx_buffer);
-            vTaskDelay(5000 / portTICK_PERIOD_MS);
+        size_t lz_len = sample_lz_compress(&s_dump_lz, s_dump_packed, pack.len, s_dump, pack.len - 1);
+        if (lz_len > 0)
+        {
+            *type = DT_TYPE_SENSOR_LZ;
+            return lz_len;
+        }
+        memcpy(s_dump, s_dump_packed, pack.len);
+        *type = DT_TYPE_SENSOR_PACKED;
+        return pack.len;
+    }
+
+    // Stand-in for a real sensor until the slaves have one
+    static int32_t read_sample(void)
+    {
+        return (int32_t)esp_get_free_heap_size();
+    }
+
+    // The base station took a frame for the first time since boot. Timed from app start, the bootloader's ~0.3 s comes before
+    static void espnow_first_frame(void)
+    {
+        s_first_frame_us = esp_timer_get_time();
+        ESP_LOGI(TAG, "Boot to first delivered frame: %lu ms on the %s path (before this the last cold boot took %lu ms, the last cached %lu ms)",
+                 (unsigned long)(s_first_frame_us / 1000), s_fast_boot ? "cached" : "cold",
+                 (unsigned long)s_assoc.cold_first_frame_ms, (unsigned long)s_assoc.cached_first_frame_ms);
+        if (s_fast_boot)
+        {
+            s_assoc.cached_first_frame_ms = (uint32_t)(s_first_frame_us / 1000);
+        }
+        else
+        {
+            s_assoc.cold_first_frame_ms = (uint32_t)(s_first_frame_us / 1000);
+        }
+        assoc_cache_save(&s_assoc);
+    }
+
+    // The radio and both peers to `channel`. While the STA is associated the radio stays on the AP's, only the peers move
+    static void espnow_set_channel(uint8_t channel)
+    {
+        if (dt_transport_set_channel(s_radio, channel) != 0)
+        {
+            ESP_LOGD(TAG, "Radio could not go to channel %d", channel);
+        }
+        CONFIG_ESPNOW_CHANNEL = channel;
+        dt_transport_del_peer(s_radio, DT_BROADCAST_MAC);
+        add_peer(DT_BROADCAST_MAC);
+        dt_transport_del_peer(s_radio, mac_destination);
+        add_peer(mac_destination);
+    }
 
-            if (sock != -1)
+    /*
+        Follow the base station from channel to channel: hints from wifi, the tracker's sweeps and
+        probes, the radio moved to wherever it says. Logs whenever the state changes
+    */
+    static void espnow_track_channel(int64_t now)
+    {
+        static uint8_t last_state = CHAN_TRACK_OK;
+        static uint32_t last_moves = 0;
+
+        uint8_t wifi_channel = s_wifi_channel.exchange(0, std::memory_order_relaxed);
+        if (wifi_channel != 0 && wifi_channel != chan_track_channel(&s_chan))
+        {
+            ESP_LOGI(TAG, "Wifi reassociated on channel %d, trying the base station there", wifi_channel);
+            chan_track_hint(&s_chan, wifi_channel, now);
+        }
+
+        bool probe = chan_track_poll(&s_chan, now);
+        if (chan_track_channel(&s_chan) != CONFIG_ESPNOW_CHANNEL)
+        {
+            espnow_set_channel(chan_track_channel(&s_chan));
+        }
+        if (probe)
+        {
+            espnow_send_join_req();
+        }
+
+        if (s_chan.state != last_state)
+        {
+            if (s_chan.state == CHAN_TRACK_SWEEP && last_state == CHAN_TRACK_OK)
+            {
+                ESP_LOGW(TAG, "Base station lost on channel %d, sweeping", s_chan.home);
+            }
+            else if (s_chan.state == CHAN_TRACK_LOST)
+            {
+                ESP_LOGW(TAG, "Base station not on any channel, back to %d, next sweep in %lu ms",
+                         s_chan.home, (unsigned long)((s_chan.retry_us - now) / 1000));
+            }
+            else if (s_chan.state == CHAN_TRACK_OK)
             {
-                shutdown(sock, 0);
-                close(sock);
+                ESP_LOGI(TAG, "Base station found on channel %d, %lu ms since the last contact",
+                         s_chan.home, (unsigned long)s_chan.stats.outage_last_ms);
             }
+            last_state = s_chan.state;
+        }
+        // settled somewhere new, the next cached boot starts ESP-NOW there
+        if (s_chan.state == CHAN_TRACK_OK && s_chan.stats.moves != last_moves)
+        {
+            last_moves = s_chan.stats.moves;
+            s_assoc.channel = s_chan.channel;
+            assoc_cache_save(&s_assoc);
         }
     }
 
-    // Callback function
-    void on_data_sent(const uint8_t *mac_addr, esp_now_send_status_t status)
+    // Wifi finished connecting (or gave up). Keep the AP for next boot, and follow it if it changed channel
+    static void espnow_wifi_done(void)
     {
-        printf("Sent to MAC %02X:%02X:%02X:%02X:%02X:%02X - Status: %s\n",
-            mac_addr[0], mac_addr[1], mac_addr[2],
-            mac_addr[3], mac_addr[4], mac_addr[5],
-            status == ESP_NOW_SEND_SUCCESS ? "Success" : "Fail");
+        if (s_ap_channel == 0)
+        {
+            return;
+        }
+        ESP_LOGI(TAG, "Wifi up %lu ms after boot", (unsigned long)(s_wifi_done_us / 1000));
+
+        if (s_ap_channel != CONFIG_ESPNOW_CHANNEL)
+        {
+            ESP_LOGW(TAG, "AP is on channel %d, not the cached %d, moving ESP-NOW over", s_ap_channel, CONFIG_ESPNOW_CHANNEL);
+            chan_track_hint(&s_chan, s_ap_channel, esp_timer_get_time());
+            espnow_set_channel(s_ap_channel);
+        }
+
+        s_assoc.channel = s_ap_channel;
+        memcpy(s_assoc.bssid, s_ap_bssid, 6);
+        assoc_cache_save(&s_assoc);
     }
 
-    void esp_now_client()
+    // Once, whenever wifi gets there: from the sender loop and from a join it is stuck in
+    static void espnow_check_wifi(void)
     {
-        // ESP-NOW initiation and register a callback function that will be called
-        esp_now_init();
-        esp_now_register_send_cb((esp_now_send_cb_t )on_data_sent);
+        static bool seen = false;
+        if (!seen && s_wifi_done.load(std::memory_order_acquire))
+        {
+            seen = true;
+            espnow_wifi_done();
+        }
+    }
 
-        // Add a peer device with which ESP32 can communicate
-        esp_now_peer_info_t peer = {0};
+    /*
+        Broadcast join requests until a base station answers, or give up at give_up_us. Wifi and
+        the channel tracker keep running meanwhile: the AP (and the base station with it) may be
+        on another channel than the one we start on, and a request nobody answers sweeps the rest
+    */
+    static bool espnow_join(int64_t give_up_us)
+    {
+        espnow_evt_t evt;
+        int64_t next_req_us = 0;
+        uint8_t asked = 0;      // channel the last request went out on
 
-        // register peer/Base station
-        memcpy(peer.peer_addr, mac_destination, 6);
-        peer.channel = CONFIG_ESPNOW_CHANNEL;
-        peer.encrypt = false;
-        esp_now_add_peer(&peer);
+        ESP_LOGI(TAG, "Looking for a base station...");
+        while (1)
+        {
+            int64_t now = esp_timer_get_time();
+            if (now >= give_up_us)
+            {
+                ESP_LOGW(TAG, "No base station answered on any channel, trying again in %d ms", ESPNOW_JOIN_PAUSE_MS);
+                return false;
+            }
+
+            espnow_check_wifi();
+            espnow_track_channel(now);
+
+            // the sweep sends its own requests, one per channel
+            if (!chan_track_sweeping(&s_chan) && now >= next_req_us)
+            {
+                if (asked == chan_track_channel(&s_chan) && chan_track_no_answer(&s_chan, now))
+                {
+                    continue;
+                }
+                espnow_send_join_req();
+                asked = chan_track_channel(&s_chan);
+                next_req_us = now + ESPNOW_JOIN_RETRY_MS * 1000;
+            }
+
+            int64_t wait_us = (chan_track_sweeping(&s_chan) ? CHAN_TRACK_DWELL_MARGIN_MS * 1000 : next_req_us - now);
+            wait_us = wait_us < give_up_us - now ? wait_us : give_up_us - now;
+            TickType_t wait_ticks = wait_us / 1000 / portTICK_PERIOD_MS > 0 ? wait_us / 1000 / portTICK_PERIOD_MS : 1;
+            while (xQueueReceive(s_espnow_queue, &evt, wait_ticks) == pdTRUE)
+            {
+                wait_ticks = 0;
+                // SENT and SLOT carry nothing, the rest own a buffer whatever we make of them
+                if (evt.kind == ESPNOW_EVT_TCP_TIME)
+                {
+                    time_sync_on_response(&s_time, (const dt_time_resp_t *)evt.buf->data, evt.buf->rx_us, TIME_SYNC_VIA_TCP);
+                    shared_buf_release(evt.buf);
+                }
+                if (evt.kind != ESPNOW_EVT_RECV)
+                {
+                    continue;
+                }
+
+                bool joined = handle_join_ack(evt.buf);
+                shared_buf_release(evt.buf);
+                if (joined)
+                {
+                    return true;
+                }
+            }
+        }
     }
 
     static void esp_now_sender(void * pvParams)
     {
         const char *message = "Hello via ESP-NOW";
+        espnow_batch_t *batch = &s_batch;
+
+        tdma_init(&s_tdma);
+
+        esp_timer_create_args_t slot_args = {};
+        slot_args.callback = slot_timer_cb;
+        slot_args.dispatch_method = ESP_TIMER_TASK;
+        slot_args.name = "tdma_slot";
+        ESP_ERROR_CHECK(esp_timer_create(&slot_args, &s_slot_timer));
+
+        chan_track_init(&s_chan, CONFIG_ESPNOW_CHANNEL, s_node_id, esp_timer_get_time());
+
+        // until a base station takes a frame, look for one at join_us: straight away on a cold boot, once the cached one had its chance otherwise
+        int64_t join_us = esp_timer_get_time();
+        if (s_fast_boot)
+        {
+            espnow_resume();
+            join_us += ASSOC_RESUME_TIMEOUT_MS * 1000;
+        }
+
+        espnow_txq_init(&s_txq, ESPNOW_TX_WINDOW, ESPNOW_TX_ATTEMPTS, espnow_raw_send, &s_frame_pool);
+        espnow_txq_set_gate(&s_txq, espnow_tx_gate);
+        espnow_txq_set_on_drop(&s_txq, espnow_txq_dropped);
+        spool_start();
+        espnow_batch_init(batch, s_node_id, ESPNOW_BATCH_LATENCY_MS, espnow_batch_send);
+        espnow_batch_set_clock(batch, frame_clock);
+        time_sync_init(&s_time, s_node_id, esp_timer_get_time());
+
+        rate_ctl_config_t rate_config =
+        {
+            .min_milli = ESPNOW_RATE_MIN_MILLI,
+            .max_milli = ESPNOW_RATE_MAX_MILLI,
+            .start_milli = 1000 * RATE_CTL_MILLI / ESPNOW_BATCH_LATENCY_MS,
+            .increase_milli = ESPNOW_RATE_INCREASE_MILLI,
+            .decrease_pct = ESPNOW_RATE_DECREASE_PCT,
+            .rtt_margin_us = ESPNOW_RATE_RTT_MARGIN_US,
+            .holdoff_ms = ESPNOW_RATE_HOLDOFF_MS,
+        };
+        rate_ctl_init(&s_espnow_rate, &rate_config);
+        uint32_t congestion = 0;
+        // same sequence numbers as the batches, the base station sees one stream from us
+        frag_tx_init(&s_frag_tx, s_node_id, &batch->seq, espnow_frag_send, NULL);
+        frag_tx_set_clock(&s_frag_tx, frame_clock);
+
+        int64_t now = esp_timer_get_time();
+        int64_t next_sample_us = now;
+        int64_t next_text_us = now;
+        int64_t next_dump_us = now + ESPNOW_DUMP_PERIOD_MS * 1000;
+        int64_t next_probe_us = now;
+        int64_t next_spool_sync_us = now + ESPNOW_SPOOL_SYNC_MS * 1000;
+
+        while(1)
+        {
+            now = esp_timer_get_time();
+
+            espnow_check_wifi();
+            // the cached base station is gone or has moved on, find one the usual way. A join that
+            // found nobody hands back to this loop for a while, so samples still get spooled
+            if (join_us != 0 && s_first_frame_us == 0 && now >= join_us)
+            {
+                if (s_fast_boot && memcmp(mac_destination, s_assoc.peers[0], 6) == 0)
+                {
+                    ESP_LOGW(TAG, "Cached base station not answering");
+                }
+                bool joined = espnow_join(now + ESPNOW_JOIN_TIMEOUT_MS * 1000);
+                join_us = joined ? 0 : esp_timer_get_time() + ESPNOW_JOIN_PAUSE_MS * 1000;
+            }
+
+            espnow_track_channel(now);
+            update_tx_gate();
+
+            if (now >= next_sample_us)
+            {
+                dt_sample_t sample = { 0, read_sample() };
+                espnow_batch_add_sample(batch, mac_destination, sample.channel, sample.value);
+                history_add(&sample);
+                next_sample_us += ESPNOW_SAMPLE_PERIOD_MS * 1000;
+            }
+            if (now >= next_text_us)
+            {
+                espnow_batch_add(batch, mac_destination, DT_TYPE_TEXT, message, strlen(message));
+                next_text_us += ESPNOW_TEXT_PERIOD_MS * 1000;
+            }
+
+            // a dump still going when the next is due is skipped, not queued
+            if (now >= next_dump_us)
+            {
+                if (!frag_tx_busy(&s_frag_tx) && s_history_count > 0)
+                {
+                    uint8_t type;
+                    size_t len = pack_history(&type);
+                    frag_tx_send(&s_frag_tx, mac_destination, type, s_dump, len, now);
+                }
+                next_dump_us += ESPNOW_DUMP_PERIOD_MS * 1000;
+            }
+
+            espnow_time_request(now);
+            espnow_batch_set_latency_us(batch, rate_ctl_period_us(&s_espnow_rate));
+            uint32_t wait_ms = espnow_batch_poll(batch);
+            frag_tx_poll(&s_frag_tx, now);
+
+            // sleep until the next sample is due or a batch hits its deadline
+            int64_t until_sample_ms = (next_sample_us - now) / 1000;
+            if (until_sample_ms < wait_ms)
+            {
+                wait_ms = until_sample_ms > 0 ? (uint32_t)until_sample_ms : 0;
+            }
+            if (s_txq.in_flight > 0 && wait_ms > ESPNOW_TXQ_TIMEOUT_MS)
+            {
+                wait_ms = ESPNOW_TXQ_TIMEOUT_MS;
+            }
+            if (frag_tx_busy(&s_frag_tx) && wait_ms > FRAG_TX_STATUS_TIMEOUT_MS)
+            {
+                wait_ms = FRAG_TX_STATUS_TIMEOUT_MS;
+            }
+            if (chan_track_sweeping(&s_chan) && wait_ms > CHAN_TRACK_DWELL_MARGIN_MS)
+            {
+                wait_ms = CHAN_TRACK_DWELL_MARGIN_MS;
+            }
+
+            // send results wake us straight away so the next frame goes out as soon as there is room
+            espnow_evt_t evt;
+            TickType_t wait_ticks = wait_ms / portTICK_PERIOD_MS > 0 ? wait_ms / portTICK_PERIOD_MS : 1;
+            while (xQueueReceive(s_espnow_queue, &evt, wait_ticks) == pdTRUE)
+            {
+                wait_ticks = 0;
+                if (evt.kind == ESPNOW_EVT_RECV)
+                {
+                    handle_espnow_frame(evt.buf);
+                    shared_buf_release(evt.buf);
+                }
+                else if (evt.kind == ESPNOW_EVT_TCP_TIME)
+                {
+                    time_sync_on_response(&s_time, (const dt_time_resp_t *)evt.buf->data, evt.buf->rx_us, TIME_SYNC_VIA_TCP);
+                    shared_buf_release(evt.buf);
+                }
+                if (evt.kind != ESPNOW_EVT_SENT)
+                {
+                    continue;
+                }
+
+                // how long the driver had it is the round trip: ESP-NOW's ACK is the answer
+                int32_t driver_us = espnow_txq_on_sent(&s_txq, evt.mac, evt.success);
+                if (memcmp(evt.mac, mac_destination, 6) == 0)
+                {
+                    chan_track_on_sent(&s_chan, evt.success, esp_timer_get_time());
+                }
+                if (evt.success && driver_us >= 0)
+                {
+                    espnow_link_up();
+                    if (s_first_frame_us == 0)
+                    {
+                        espnow_first_frame();
+                    }
+                    rate_ctl_on_ack(&s_espnow_rate, (uint32_t)driver_us, esp_timer_get_time());
+                    espnow_txq_set_timeout_us(&s_txq, rate_ctl_rto_us(&s_espnow_rate, 0));
+                }
+                else if (!evt.success)
+                {
+                    rate_ctl_on_loss(&s_espnow_rate, esp_timer_get_time());
+                }
+            }
+            spool_drain(esp_timer_get_time(), &next_probe_us);
+            update_tx_gate();
+            espnow_txq_poll(&s_txq);
+
+            if (s_spool_ok && now >= next_spool_sync_us)
+            {
+                spool_sync(&s_spool);
+                next_spool_sync_us = now + ESPNOW_SPOOL_SYNC_MS * 1000;
+            }
+
+            // callbacks that never came and frames the queue had no room for count as losses too
+            if (s_txq.timeouts + s_txq.rejected != congestion)
+            {
+                rate_ctl_on_loss(&s_espnow_rate, esp_timer_get_time());
+                congestion = s_txq.timeouts + s_txq.rejected;
+            }
+        }
+    }
+
+    static void log_rate(const char *what, const rate_ctl_t *rate)
+    {
+        ESP_LOGI(TAG, "%s %.2f/s (period %lu ms), srtt %lu us, floor %lu us, acks %lu, losses %lu, slow %lu, cuts %lu",
+                 what, rate_ctl_rate(rate),
+                 (unsigned long)(rate_ctl_period_us(rate) / 1000),
+                 (unsigned long)rate->srtt_us,
+                 (unsigned long)rate_ctl_rtt_floor(rate),
+                 (unsigned long)rate->stats.acks,
+                 (unsigned long)rate->stats.losses,
+                 (unsigned long)rate->stats.slow_rtts,
+                 (unsigned long)rate->stats.decreases);
+    }
+
+    static uint32_t txq_delivered(void)
+    {
+        uint32_t delivered = 0;
+        for (int i = 0; espnow_txq_peer_stats(&s_txq, i) != NULL; i++)
+        {
+            delivered += espnow_txq_peer_stats(&s_txq, i)->delivered;
+        }
+        return delivered;
+    }
+
+    /*
+        Bottom priority on the sender's core. Everything here reads what the sender and the
+        TCP task count, without a lock: the worst it sees is a number one update behind
+    */
+    static void housekeeping_task(void * pvParams)
+    {
+        uint32_t last_delivered = 0;
+        uint32_t last_completed = 0;
+        espnow_batch_stats_t last_batch = s_batch.stats;
+        uint32_t last_report_completed = 0;
+
+        int64_t now = esp_timer_get_time();
+        int64_t next_espnow_report_us = now + ESPNOW_REPORT_MS * 1000;
+        int64_t next_tcp_report_us = now + TCP_REPORT_MS * 1000;
+
         while(1)
         {
-            esp_now_send(mac_destination, (uint8_t *)message, strlen(message));
-            vTaskDelay(2000 / portTICK_PERIOD_MS);
+            dt_delay_ms(DT_HOUSEKEEPING_PERIOD_MS);
+            now = esp_timer_get_time();
+
+            // a blink for anything delivered since last time, neither data path touches a GPIO or a timer
+            uint32_t delivered = txq_delivered();
+            if (delivered != last_delivered)
+            {
+                led_pulse(&s_led_espnow);
+                last_delivered = delivered;
+            }
+            uint32_t completed = s_tcp_link.stats.completed;
+            if (completed != last_completed)
+            {
+                led_pulse(&s_led_wifi);
+                last_completed = completed;
+            }
+
+            trace_console_poll();
+
+            if (now >= next_espnow_report_us)
+            {
+                espnow_batch_stats_t st = s_batch.stats;
+                uint32_t records = st.records - last_batch.records;
+                uint32_t frames = st.frames - last_batch.frames;
+                uint64_t airtime_us = st.airtime_us - last_batch.airtime_us;
+
+                ESP_LOGI(TAG, "esp_now %.1f records/s in %.1f frames/s, %.1f records/frame, ~%lu us airtime/record",
+                         records * 1000.0f / ESPNOW_REPORT_MS,
+                         frames * 1000.0f / ESPNOW_REPORT_MS,
+                         frames ? (float)records / frames : 0.0f,
+                         (unsigned long)(records ? airtime_us / records : 0));
+                if (st.add_refused != last_batch.add_refused)
+                {
+                    ESP_LOGW(TAG, "esp_now %lu records turned away, %lu frame sends refused and held",
+                             (unsigned long)(st.add_refused - last_batch.add_refused),
+                             (unsigned long)(st.send_errors - last_batch.send_errors));
+                }
+
+                log_txq_stats();
+                log_spool_stats();
+                log_chan_stats();
+                log_time_stats();
+                log_rate("esp_now frames", &s_espnow_rate);
+
+                last_batch = st;
+                next_espnow_report_us += ESPNOW_REPORT_MS * 1000;
+            }
+
+            if (now >= next_tcp_report_us)
+            {
+                const tcp_link_t *link = &s_tcp_link;
+                ESP_LOGI(TAG, "TCP %.1f msg/s, sent %lu, completed %lu, lost %lu, reconnects %lu",
+                         (completed - last_report_completed) * 1000.0f / TCP_REPORT_MS,
+                         (unsigned long)link->stats.sent,
+                         (unsigned long)completed,
+                         (unsigned long)link->stats.lost,
+                         (unsigned long)link->stats.connects);
+                log_rate("TCP requests", &s_tcp_rate);
+                last_report_completed = completed;
+                next_tcp_report_us += TCP_REPORT_MS * 1000;
+            }
         }
     }
 
@@ -352,12 +1558,29 @@ extern "C"
     {
         gpio_out_setup(LED_WIFI);
         gpio_out_setup(LED_ESPNOW);
+        led_indicator_init(&s_led_wifi, LED_WIFI, LED_ON_MS, LED_OFF_MS);
+        led_indicator_init(&s_led_espnow, LED_ESPNOW, LED_ON_MS, LED_OFF_MS);
 
         init_nvs();
-        ESP_LOGI(TAG , "Connect wifi: %i" , init_wifi());
+
+        // the cold path is the old one: wait for wifi, learn the channel from the AP, then join
+        bool cached = assoc_cache_load(&s_assoc);
+        s_fast_boot = ASSOC_CACHE_USE && cached && assoc_cache_usable(&s_assoc);
+        init_wifi(ASSOC_CACHE_USE && cached ? &s_assoc : NULL);
+        if (s_fast_boot)
+        {
+            CONFIG_ESPNOW_CHANNEL = s_assoc.channel;
+            dt_task_start(wifi_assoc_task, "wifi_assoc", WIFI_ASSOC_STACK, WIFI_ASSOC_PRIO, DT_CORE_NET, NULL);
+        }
+        else
+        {
+            ESP_LOGI(TAG , "Connect wifi: %i" , wifi_wait_connected());
+        }
         esp_now_client();
 
-        xTaskCreate(esp_now_sender , "esp_now_sender" , 4096 , NULL , 5 , NULL);
-        tcp_client();
+        dt_task_start(esp_now_sender, "esp_now_sender", ESPNOW_SENDER_STACK, ESPNOW_SENDER_PRIO, DT_CORE_RADIO, NULL);
+        // next to lwIP's tcpip task, every socket call hands over to it
+        dt_task_start(tcp_client_task, "tcp_client", TCP_CLIENT_STACK, TCP_CLIENT_PRIO, DT_CORE_NET, NULL);
+        dt_task_start(housekeeping_task, "housekeeping", HOUSEKEEPING_STACK, DT_HOUSEKEEPING_PRIO, DT_CORE_RADIO, NULL);
     }
 }
\ No newline at end of file
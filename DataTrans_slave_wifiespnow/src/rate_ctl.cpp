@@ -0,0 +1,111 @@
+#include <string.h>
+
+#include "dt_port.h"
+#include "rate_ctl.h"
+
+void rate_ctl_init(rate_ctl_t *ctl, const rate_ctl_config_t *config)
+{
+    memset(ctl, 0, sizeof(*ctl));
+    ctl->config = *config;
+    if (ctl->config.min_milli == 0)
+    {
+        ctl->config.min_milli = 1;
+    }
+    if (ctl->config.max_milli < ctl->config.min_milli)
+    {
+        ctl->config.max_milli = ctl->config.min_milli;
+    }
+
+    ctl->rate_milli = config->start_milli;
+    if (ctl->rate_milli < ctl->config.min_milli)
+    {
+        ctl->rate_milli = ctl->config.min_milli;
+    }
+    if (ctl->rate_milli > ctl->config.max_milli)
+    {
+        ctl->rate_milli = ctl->config.max_milli;
+    }
+
+    ctl->rtt_floor_us = UINT32_MAX;
+    ctl->rtt_window_min_us = UINT32_MAX;
+}
+
+static bool in_holdoff(const rate_ctl_t *ctl, int64_t now_us)
+{
+    return ctl->stats.decreases > 0 && now_us - ctl->last_decrease_us < (int64_t)ctl->config.holdoff_ms * 1000;
+}
+
+static void decrease(rate_ctl_t *ctl, int64_t now_us)
+{
+    if (in_holdoff(ctl, now_us))
+    {
+        return;
+    }
+
+    uint32_t rate = (uint32_t)((uint64_t)ctl->rate_milli * ctl->config.decrease_pct / 100);
+    ctl->rate_milli = rate > ctl->config.min_milli ? rate : ctl->config.min_milli;
+    ctl->last_decrease_us = now_us;
+    ctl->stats.decreases++;
+}
+
+static void track_rtt(rate_ctl_t *ctl, uint32_t rtt_us, int64_t now_us)
+{
+    if (now_us - ctl->rtt_window_start_us >= (int64_t)RATE_CTL_FLOOR_WINDOW_MS * 1000)
+    {
+        ctl->rtt_floor_us = ctl->rtt_window_min_us;
+        ctl->rtt_window_min_us = UINT32_MAX;
+        ctl->rtt_window_start_us = now_us;
+    }
+    if (rtt_us < ctl->rtt_window_min_us)
+    {
+        ctl->rtt_window_min_us = rtt_us;
+    }
+
+    if (ctl->srtt_us == 0)
+    {
+        ctl->srtt_us = rtt_us;
+        ctl->rttvar_us = rtt_us / 2;
+    }
+    else
+    {
+        int64_t err = (int64_t)rtt_us - ctl->srtt_us;
+        ctl->rttvar_us = (uint32_t)((int64_t)ctl->rttvar_us + ((err < 0 ? -err : err) - (int64_t)ctl->rttvar_us) / 4);
+        ctl->srtt_us = (uint32_t)((int64_t)ctl->srtt_us + err / 8);
+    }
+}
+
+void rate_ctl_on_ack(rate_ctl_t *ctl, uint32_t rtt_us, int64_t now_us)
+{
+    ctl->stats.acks++;
+    track_rtt(ctl, rtt_us, now_us);
+
+    int64_t step_us = ctl->last_ack_us != 0 ? now_us - ctl->last_ack_us : 0;
+    ctl->last_ack_us = now_us;
+
+    // the sample itself, not srtt: at a frame a second an average would remember a crowded
+    // minute for the next one, and the holdoff already keeps one slow answer from doing much
+    if (ctl->config.rtt_margin_us > 0 && rtt_us > rate_ctl_rtt_floor(ctl) + ctl->config.rtt_margin_us)
+    {
+        ctl->stats.slow_rtts++;
+        decrease(ctl, now_us);
+        return;
+    }
+    if (in_holdoff(ctl, now_us))
+    {
+        return;
+    }
+
+    // additive: increase per second, however many acks that second brought
+    if (step_us > RATE_CTL_MAX_STEP_US)
+    {
+        step_us = RATE_CTL_MAX_STEP_US;
+    }
+    uint64_t rate = ctl->rate_milli + (uint64_t)ctl->config.increase_milli * step_us / 1000000;
+    ctl->rate_milli = rate < ctl->config.max_milli ? (uint32_t)rate : ctl->config.max_milli;
+}
+
+void rate_ctl_on_loss(rate_ctl_t *ctl, int64_t now_us)
+{
+    ctl->stats.losses++;
+    decrease(ctl, now_us);
+}
@@ -0,0 +1,432 @@
+#include <string.h>
+
+#include "dt_port.h"
+#include "dt_frame.h"
+#include "spool.h"
+
+static const char *TAG = "spool";
+
+static_assert(sizeof(spool_sector_hdr_t) == 64, "sector header should stay 64 bytes");
+
+#define SPOOL_DATA_START ((uint32_t)sizeof(spool_sector_hdr_t))
+
+static uint32_t sector_addr(uint32_t sector)
+{
+    return sector * SPOOL_SECTOR_SIZE;
+}
+
+static uint16_t record_crc(uint16_t len, const uint8_t *data)
+{
+    uint16_t crc = dt_crc16(0xFFFF, (const uint8_t *)&len, sizeof(len));
+    return dt_crc16(crc, data, len);
+}
+
+static int read_header(spool_t *spool, uint32_t sector, spool_sector_hdr_t *hdr)
+{
+    return dt_flash_read(spool->flash, sector_addr(sector), hdr, sizeof(*hdr));
+}
+
+// Marks used, and the offset the last one says the sector was drained to
+static uint32_t drain_marks(const spool_sector_hdr_t *hdr, uint32_t *off)
+{
+    uint32_t marks = 0;
+    *off = SPOOL_DATA_START;
+    // half a mark (the power went between its bytes) reads as more than a sector, and ends the list
+    while (marks < SPOOL_DRAIN_MARKS && hdr->drained[marks] >= SPOOL_DATA_START && hdr->drained[marks] <= SPOOL_SECTOR_SIZE)
+    {
+        *off = hdr->drained[marks++];
+    }
+    return marks;
+}
+
+/*
+    Read the record at `off` in the flash. Returns its length, 0 where the sector's records end:
+    never written, or garbage, or a crc that does not match (a write the power cut short)
+*/
+static int read_record(spool_t *spool, uint32_t sector, uint32_t off, uint8_t *data, size_t cap)
+{
+    spool_rec_hdr_t rec;
+    if (off + sizeof(rec) > SPOOL_SECTOR_SIZE || dt_flash_read(spool->flash, sector_addr(sector) + off, &rec, sizeof(rec)) != 0)
+    {
+        return 0;
+    }
+    if (rec.len == 0 || rec.len > SPOOL_MAX_RECORD || rec.len > cap || off + sizeof(rec) + rec.len > SPOOL_SECTOR_SIZE)
+    {
+        return 0;
+    }
+    if (dt_flash_read(spool->flash, sector_addr(sector) + off + sizeof(rec), data, rec.len) != 0 ||
+        record_crc(rec.len, data) != rec.crc)
+    {
+        return 0;
+    }
+    return rec.len;
+}
+
+// Records from `off` on, and where they end. The write buffer is borrowed to check the crcs
+static uint32_t count_records(spool_t *spool, uint32_t sector, uint32_t off, uint32_t *end, bool *clean)
+{
+    uint32_t count = 0;
+    int len;
+    while ((len = read_record(spool, sector, off, spool->buf, sizeof(spool->buf))) > 0)
+    {
+        off += sizeof(spool_rec_hdr_t) + len;
+        count++;
+    }
+
+    // the sector ends in erased flash, or in something half written
+    spool_rec_hdr_t rec;
+    *clean = off + sizeof(rec) > SPOOL_SECTOR_SIZE ||
+             (dt_flash_read(spool->flash, sector_addr(sector) + off, &rec, sizeof(rec)) == 0 && rec.len == 0xFFFF);
+    *end = off;
+    return count;
+}
+
+static void load_tail(spool_t *spool, uint32_t sector)
+{
+    spool_sector_hdr_t hdr;
+    spool->tail = sector;
+    spool->tail_marks = 0;
+    spool->tail_off = SPOOL_DATA_START;
+    spool->unmarked = 0;
+    if (read_header(spool, sector, &hdr) == 0 && hdr.magic == SPOOL_MAGIC)
+    {
+        spool->tail_marks = drain_marks(&hdr, &spool->tail_off);
+    }
+    spool->tail_mark_off = spool->tail_off;
+}
+
+int spool_open(spool_t *spool, dt_flash_t *flash, const spool_config_t *config)
+{
+    memset(spool, 0, sizeof(*spool));
+    spool->flash = flash;
+    spool->config = *config;
+    if (spool->config.sync_bytes > SPOOL_WRITE_BUF)
+    {
+        spool->config.sync_bytes = SPOOL_WRITE_BUF;
+    }
+    spool->sectors = flash->size / SPOOL_SECTOR_SIZE;
+    if (spool->sectors > SPOOL_MAX_SECTORS)
+    {
+        spool->sectors = SPOOL_MAX_SECTORS;
+    }
+    if (spool->sectors < 2)
+    {
+        return -1;
+    }
+
+    // the newest sector is the head
+    bool found = false;
+    for (uint32_t i = 0; i < spool->sectors; i++)
+    {
+        spool_sector_hdr_t hdr;
+        if (read_header(spool, i, &hdr) != 0)
+        {
+            return -1;
+        }
+        if (hdr.magic != SPOOL_MAGIC)
+        {
+            continue;
+        }
+        spool->erases[i] = hdr.erases;
+        if (!found || (int32_t)(hdr.seq - spool->head_seq) > 0)
+        {
+            spool->head = i;
+            spool->head_seq = hdr.seq;
+            found = true;
+        }
+    }
+
+    if (!found)
+    {
+        // nothing yet, the first append starts at sector 0
+        spool->head = spool->sectors - 1;
+        spool->head_end = SPOOL_SECTOR_SIZE;
+        spool->head_sealed = true;
+        load_tail(spool, 0);
+        return 0;
+    }
+
+    // the ring runs back from the head for as long as the sequence numbers do
+    uint32_t oldest = spool->head;
+    for (uint32_t n = 1; n < spool->sectors; n++)
+    {
+        uint32_t i = (spool->head + spool->sectors - n) % spool->sectors;
+        spool_sector_hdr_t hdr;
+        if (read_header(spool, i, &hdr) != 0 || hdr.magic != SPOOL_MAGIC || hdr.seq != spool->head_seq - n)
+        {
+            break;
+        }
+        oldest = i;
+    }
+
+    // then forward: the first sector with records past its drain mark is the tail
+    uint32_t tail = spool->head;
+    bool have_tail = false;
+    for (uint32_t i = oldest; ; i = (i + 1) % spool->sectors)
+    {
+        spool_sector_hdr_t hdr;
+        uint32_t from = SPOOL_DATA_START;
+        uint32_t end;
+        bool clean;
+        if (read_header(spool, i, &hdr) == 0)
+        {
+            drain_marks(&hdr, &from);
+        }
+        uint32_t count = count_records(spool, i, from, &end, &clean);
+        if (count > 0 && !have_tail)
+        {
+            tail = i;
+            have_tail = true;
+        }
+        spool->records += count;
+
+        if (i == spool->head)
+        {
+            // records before the drain mark still take room. A torn record, or a mark past
+            // the end (drained from the buffer, then the power went), and nothing more goes here
+            count_records(spool, i, SPOOL_DATA_START, &spool->head_end, &clean);
+            spool->head_sealed = !clean || from > spool->head_end;
+            spool->stats.torn += clean ? 0 : 1;
+            break;
+        }
+    }
+    load_tail(spool, tail);
+
+    ESP_LOGI(TAG, "%lu records waiting, head sector %lu (seq %lu), tail sector %lu",
+             (unsigned long)spool->records, (unsigned long)spool->head,
+             (unsigned long)spool->head_seq, (unsigned long)spool->tail);
+    return 0;
+}
+
+int spool_sync(spool_t *spool)
+{
+    if (spool->buf_len == 0)
+    {
+        return 0;
+    }
+
+    int ret = dt_flash_write(spool->flash, sector_addr(spool->head) + spool->head_end, spool->buf, spool->buf_len);
+    spool->head_end += spool->buf_len;
+    spool->buf_len = 0;
+    spool->stats.syncs++;
+    if (ret != 0)
+    {
+        // whatever landed is half a record at worst, spool_open stops at its crc
+        spool->head_sealed = true;
+        ESP_LOGE(TAG, "Flash write failed, buffered records lost");
+    }
+    return ret;
+}
+
+static void write_mark(spool_t *spool, bool final)
+{
+    // the last slot is kept for "all of it", so a sector with tiny records still finishes
+    uint32_t slots = final ? SPOOL_DRAIN_MARKS : SPOOL_DRAIN_MARKS - 1;
+    if (spool->unmarked == 0 || spool->tail_marks >= slots)
+    {
+        return;
+    }
+
+    uint16_t mark = (uint16_t)spool->tail_off;
+    uint32_t at = sector_addr(spool->tail) + offsetof(spool_sector_hdr_t, drained) + spool->tail_marks * sizeof(mark);
+    if (dt_flash_write(spool->flash, at, &mark, sizeof(mark)) == 0)
+    {
+        spool->tail_marks++;
+        spool->tail_mark_off = spool->tail_off;
+        spool->unmarked = 0;
+        spool->stats.marks++;
+    }
+}
+
+// The writer wants `sector` back. Anything left to drain in it is lost
+static void drop_sector(spool_t *spool, uint32_t sector)
+{
+    if (spool->records == 0 || spool->tail != sector)
+    {
+        return;
+    }
+
+    uint32_t end;
+    bool clean;
+    uint32_t lost = count_records(spool, sector, spool->tail_off, &end, &clean);
+    lost = lost < spool->records ? lost : spool->records;
+    spool->records -= lost;
+    spool->stats.dropped += lost;
+    ESP_LOGW(TAG, "Full, dropped the oldest %lu records", (unsigned long)lost);
+    load_tail(spool, (sector + 1) % spool->sectors);
+}
+
+static int open_next_sector(spool_t *spool)
+{
+    uint32_t next = (spool->head + 1) % spool->sectors;
+    if (spool->records == 0)
+    {
+        write_mark(spool, true);
+    }
+    drop_sector(spool, next);
+
+    if (dt_flash_erase_sector(spool->flash, sector_addr(next)) != 0)
+    {
+        return -1;
+    }
+    spool->erases[next]++;
+
+    spool_sector_hdr_t hdr;
+    memset(&hdr, 0xFF, sizeof(hdr));
+    hdr.magic = SPOOL_MAGIC;
+    hdr.seq = spool->head_seq + 1;
+    hdr.erases = spool->erases[next];
+    // magic last, a header the power cut short never looks like the newest sector
+    if (dt_flash_write(spool->flash, sector_addr(next) + sizeof(hdr.magic), &hdr.seq, sizeof(hdr.seq) + sizeof(hdr.erases)) != 0 ||
+        dt_flash_write(spool->flash, sector_addr(next), &hdr.magic, sizeof(hdr.magic)) != 0)
+    {
+        return -1;
+    }
+
+    spool->head = next;
+    spool->head_seq = hdr.seq;
+    spool->head_end = SPOOL_DATA_START;
+    spool->head_sealed = false;
+
+    // nothing left behind, the reader can wait where the next record will be
+    if (spool->records == 0)
+    {
+        load_tail(spool, next);
+    }
+    return 0;
+}
+
+int spool_append(spool_t *spool, const void *data, size_t len)
+{
+    uint32_t need = sizeof(spool_rec_hdr_t) + len;
+    if (len == 0 || len > SPOOL_MAX_RECORD)
+    {
+        return -1;
+    }
+
+    if (spool->buf_len + need > sizeof(spool->buf))
+    {
+        spool_sync(spool);
+    }
+    if (spool->head_sealed || spool->head_end + spool->buf_len + need > SPOOL_SECTOR_SIZE)
+    {
+        spool_sync(spool);
+        if (open_next_sector(spool) != 0)
+        {
+            ESP_LOGE(TAG, "Could not start sector %lu", (unsigned long)((spool->head + 1) % spool->sectors));
+            return -1;
+        }
+    }
+
+    spool_rec_hdr_t rec;
+    rec.len = (uint16_t)len;
+    rec.crc = record_crc(rec.len, (const uint8_t *)data);
+    memcpy(spool->buf + spool->buf_len, &rec, sizeof(rec));
+    memcpy(spool->buf + spool->buf_len + sizeof(rec), data, len);
+    spool->buf_len += need;
+
+    spool->records++;
+    spool->stats.appended++;
+    spool->stats.bytes += len;
+
+    if (spool->buf_len >= spool->config.sync_bytes)
+    {
+        return spool_sync(spool);
+    }
+    return 0;
+}
+
+int spool_peek(spool_t *spool, void *buf, size_t cap)
+{
+    spool->peek_len = 0;
+
+    // at most once round the ring, past the ends of drained sectors
+    for (uint32_t n = 0; spool->records > 0 && n <= spool->sectors; n++)
+    {
+        int len;
+        if (spool->tail == spool->head && spool->tail_off >= spool->head_end)
+        {
+            // not in flash yet
+            uint32_t at = spool->tail_off - spool->head_end;
+            spool_rec_hdr_t rec;
+            if (at + sizeof(rec) > spool->buf_len)
+            {
+                break;
+            }
+            memcpy(&rec, spool->buf + at, sizeof(rec));
+            if (rec.len > cap)
+            {
+                return -1;
+            }
+            memcpy(buf, spool->buf + at + sizeof(rec), rec.len);
+            len = rec.len;
+        }
+        else
+        {
+            spool_rec_hdr_t rec;
+            if (spool->tail_off + sizeof(rec) <= SPOOL_SECTOR_SIZE)
+            {
+                if (dt_flash_read(spool->flash, sector_addr(spool->tail) + spool->tail_off, &rec, sizeof(rec)) != 0)
+                {
+                    return -1;
+                }
+                if (rec.len <= SPOOL_MAX_RECORD && rec.len > cap)
+                {
+                    return -1;
+                }
+            }
+            len = read_record(spool, spool->tail, spool->tail_off, (uint8_t *)buf, cap);
+        }
+
+        if (len > 0)
+        {
+            spool->peek_len = sizeof(spool_rec_hdr_t) + len;
+            return len;
+        }
+        if (spool->tail == spool->head)
+        {
+            break;
+        }
+
+        // end of this sector, on to the next one
+        write_mark(spool, true);
+        load_tail(spool, (spool->tail + 1) % spool->sectors);
+    }
+
+    // the count and the flash disagree, believe the flash
+    if (spool->records > 0)
+    {
+        ESP_LOGW(TAG, "%lu records missing", (unsigned long)spool->records);
+        spool->records = 0;
+    }
+    return 0;
+}
+
+void spool_pop(spool_t *spool)
+{
+    if (spool->peek_len == 0)
+    {
+        return;
+    }
+
+    spool->tail_off += spool->peek_len;
+    spool->peek_len = 0;
+    spool->records--;
+    spool->stats.drained++;
+    spool->unmarked++;
+    if (spool->unmarked >= SPOOL_MARK_EVERY && spool->tail_off - spool->tail_mark_off >= SPOOL_MARK_BYTES)
+    {
+        write_mark(spool, false);
+    }
+}
+
+void spool_wear(const spool_t *spool, uint32_t *min, uint32_t *max)
+{
+    *min = UINT32_MAX;
+    *max = 0;
+    for (uint32_t i = 0; i < spool->sectors; i++)
+    {
+        *min = spool->erases[i] < *min ? spool->erases[i] : *min;
+        *max = spool->erases[i] > *max ? spool->erases[i] : *max;
+    }
+}
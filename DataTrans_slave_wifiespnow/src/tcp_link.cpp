@@ -0,0 +1,219 @@
+#include <string.h>
+
+#include "tcp_link.h"
+#include "dt_frame.h"
+
+static const char *TAG = "tcp_link";
+
+void tcp_link_init(tcp_link_t *link, const char *host_ip, uint16_t port, int window)
+{
+    memset(link, 0, sizeof(*link));
+
+    inet_pton(AF_INET, host_ip, &link->dest_addr.sin_addr);
+    link->dest_addr.sin_family = AF_INET;
+    link->dest_addr.sin_port = htons(port);
+
+    link->window = window > 0 ? window : 1;
+    if (link->window > TCP_LINK_MAX_WINDOW)
+    {
+        link->window = TCP_LINK_MAX_WINDOW;
+    }
+    link->sock = -1;
+    link->backoff_ms = TCP_LINK_BACKOFF_MIN_MS;
+    link->rate_start_us = esp_timer_get_time();
+}
+
+void tcp_link_close(tcp_link_t *link)
+{
+    if (link->sock < 0)
+    {
+        return;
+    }
+
+    shutdown(link->sock, 0);
+    close(link->sock);
+    link->sock = -1;
+
+    link->stats.disconnects++;
+    link->stats.lost += link->in_flight;
+    link->in_flight = 0;
+    link->sent_head = 0;
+    link->rx_len = 0;
+
+    // try again straight away the first time, back off if that fails too
+    link->next_connect_us = esp_timer_get_time();
+}
+
+static int link_connect(tcp_link_t *link)
+{
+    char host_ip[16];
+    inet_ntoa_r(link->dest_addr.sin_addr, host_ip, sizeof(host_ip) - 1);
+
+    int sock = socket(AF_INET, SOCK_STREAM, IPPROTO_IP);
+    if (sock < 0)
+    {
+        ESP_LOGE(TAG, "Unable to create socket: errno %d", errno);
+        return -1;
+    }
+
+    ESP_LOGI(TAG, "Connecting to %s:%d", host_ip, ntohs(link->dest_addr.sin_port));
+
+    if (connect(sock, (struct sockaddr *)&link->dest_addr, sizeof(link->dest_addr)) != 0)
+    {
+        ESP_LOGE(TAG, "Socket unable to connect: errno %d, retry in %lu ms", errno, (unsigned long)link->backoff_ms);
+        close(sock);
+
+        link->stats.connect_failures++;
+        link->next_connect_us = esp_timer_get_time() + (int64_t)link->backoff_ms * 1000;
+        link->backoff_ms *= 2;
+        if (link->backoff_ms > TCP_LINK_BACKOFF_MAX_MS)
+        {
+            link->backoff_ms = TCP_LINK_BACKOFF_MAX_MS;
+        }
+        return -1;
+    }
+
+    // requests are small and we do not wait on each one, so do not let Nagle hold them back
+    int opt = 1;
+    setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &opt, sizeof(opt));
+
+    ESP_LOGI(TAG, "Successfully connected");
+    link->sock = sock;
+    link->backoff_ms = TCP_LINK_BACKOFF_MIN_MS;
+    link->stats.connects++;
+    return 0;
+}
+
+bool tcp_link_can_send(const tcp_link_t *link)
+{
+    if (link->sock < 0)
+    {
+        return esp_timer_get_time() >= link->next_connect_us;
+    }
+    return link->in_flight < link->window;
+}
+
+int tcp_link_send(tcp_link_t *link, const void *data, size_t len)
+{
+    if (link->sock < 0)
+    {
+        if (esp_timer_get_time() < link->next_connect_us || link_connect(link) < 0)
+        {
+            return -1;
+        }
+    }
+
+    const uint8_t *p = (const uint8_t *)data;
+    while (len > 0)
+    {
+        int sent = send(link->sock, p, len, 0);
+        if (sent < 0)
+        {
+            ESP_LOGE(TAG, "send failed: errno %d", errno);
+            tcp_link_close(link);
+            return -1;
+        }
+        p += sent;
+        len -= sent;
+    }
+
+    link->sent_us[(link->sent_head + link->in_flight) % TCP_LINK_MAX_WINDOW] = esp_timer_get_time();
+    link->in_flight++;
+    link->stats.sent++;
+    return 0;
+}
+
+int tcp_link_poll(tcp_link_t *link, int timeout_ms)
+{
+    if (link->sock < 0)
+    {
+        dt_delay_ms(timeout_ms);
+        return 0;
+    }
+
+    fd_set read_fds;
+    FD_ZERO(&read_fds);
+    FD_SET(link->sock, &read_fds);
+
+    struct timeval tv;
+    tv.tv_sec = timeout_ms / 1000;
+    tv.tv_usec = (timeout_ms % 1000) * 1000;
+
+    int ready = select(link->sock + 1, &read_fds, NULL, NULL, &tv);
+    if (ready <= 0)
+    {
+        return 0;
+    }
+
+    int len = recv(link->sock, link->rx_buf + link->rx_len, sizeof(link->rx_buf) - link->rx_len, 0);
+    int64_t rx_us = esp_timer_get_time();
+    if (len <= 0)
+    {
+        ESP_LOGW(TAG, "Connection closed by server (%d in flight)", link->in_flight);
+        tcp_link_close(link);
+        return -1;
+    }
+    link->rx_len += len;
+
+    // responses are dt_frame's back to back
+    int responses = 0;
+    size_t used = 0;
+    while (used < link->rx_len)
+    {
+        dt_frame_view_t resp;
+        int frame_len = dt_frame_decode(link->rx_buf + used, link->rx_len - used, &resp);
+        if (frame_len == 0)
+        {
+            break;
+        }
+        if (frame_len < 0)
+        {
+            used++; // resync on the next magic byte
+            continue;
+        }
+
+        used += frame_len;
+        if (resp.hdr->type == DT_TYPE_RESPONSE)
+        {
+            responses++;
+        }
+        else if (resp.hdr->type == DT_TYPE_TIME_RESP && resp.hdr->len >= sizeof(dt_time_resp_t))
+        {
+            memcpy(&link->time_resp, resp.payload, sizeof(dt_time_resp_t));
+            link->time_rx_us = rx_us;
+            link->time_ready = true;
+            responses++;
+        }
+    }
+    memmove(link->rx_buf, link->rx_buf + used, link->rx_len - used);
+    link->rx_len -= used;
+
+    if (link->rx_len == sizeof(link->rx_buf))
+    {
+        ESP_LOGE(TAG, "Response bigger than %d bytes", TCP_LINK_RX_SIZE);
+        tcp_link_close(link);
+        return -1;
+    }
+
+    int64_t now = esp_timer_get_time();
+    for (int i = 0; i < responses && link->in_flight > 0; i++)
+    {
+        link->rtt_us = (uint32_t)(now - link->sent_us[link->sent_head]);
+        link->sent_head = (link->sent_head + 1) % TCP_LINK_MAX_WINDOW;
+        link->in_flight--;
+    }
+    link->stats.completed += responses;
+    return responses;
+}
+
+float tcp_link_rate(tcp_link_t *link)
+{
+    int64_t now = esp_timer_get_time();
+    int64_t elapsed_us = now - link->rate_start_us;
+    uint32_t done = link->stats.completed - link->rate_start_completed;
+
+    link->rate_start_us = now;
+    link->rate_start_completed = link->stats.completed;
+
+    return elapsed_us > 0 ? done * 1000000.0f / elapsed_us : 0.0f;
+}
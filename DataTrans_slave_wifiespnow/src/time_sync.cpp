@@ -0,0 +1,360 @@
+#include <string.h>
+
+#include "time_sync.h"
+
+// xorshift32, its own like chan_track's
+static uint32_t random(time_sync_t *ts)
+{
+    uint32_t x = ts->rng;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    ts->rng = x;
+    return x;
+}
+
+// period_ms +-TIME_SYNC_SPREAD_PCT
+static int64_t spread_us(time_sync_t *ts, uint32_t period_ms)
+{
+    int64_t range_us = (int64_t)period_ms * 1000 * TIME_SYNC_SPREAD_PCT / 100;
+    return (int64_t)period_ms * 1000 - range_us + (int64_t)(random(ts) % (uint32_t)(2 * range_us + 1));
+}
+
+static void line_reset(time_sync_line_t *l)
+{
+    memset(l, 0, sizeof(*l));
+}
+
+static int64_t line_offset(const time_sync_line_t *l, int64_t local_us)
+{
+    return l->ref_offset_us + (int64_t)l->drift_ppb * (local_us - l->ref_local_us) / 1000000000;
+}
+
+// Least squares through the points, centred on the newest so the sums stay small
+static void line_fit(time_sync_line_t *l)
+{
+    const time_sync_sample_t *ref = &l->points[(l->head + TIME_SYNC_POINTS - 1) % TIME_SYNC_POINTS];
+    l->ref_local_us = ref->local_us;
+    l->ref_offset_us = ref->offset_us;
+    l->drift_ppb = 0;
+    if (l->count < 2)
+    {
+        return;
+    }
+
+    double sx = 0, sy = 0, sxx = 0, sxy = 0;
+    for (int i = 0; i < l->count; i++)
+    {
+        const time_sync_sample_t *p = &l->points[i];
+        double x = (double)(p->local_us - ref->local_us);
+        double y = (double)(p->offset_us - ref->offset_us);
+        sx += x;
+        sy += y;
+        sxx += x * x;
+        sxy += x * y;
+    }
+    double n = l->count;
+    double d = n * sxx - sx * sx;
+    if (d <= 0)
+    {
+        return;
+    }
+    double slope = (n * sxy - sx * sy) / d;
+    double intercept = (sy - slope * sx) / n;
+
+    if (slope > TIME_SYNC_MAX_DRIFT_PPM * 1e-6 || slope < -TIME_SYNC_MAX_DRIFT_PPM * 1e-6)
+    {
+        return;
+    }
+    l->ref_offset_us = ref->offset_us + (int64_t)(intercept < 0 ? intercept - 0.5 : intercept + 0.5);
+    l->drift_ppb = (int32_t)(slope * 1e9);
+}
+
+static void line_push(time_sync_line_t *l, const time_sync_sample_t *s)
+{
+    l->points[l->head] = *s;
+    l->head = (l->head + 1) % TIME_SYNC_POINTS;
+    if (l->count < TIME_SYNC_POINTS)
+    {
+        l->count++;
+    }
+    line_fit(l);
+}
+
+// The lowest cost sample of every window_us becomes a point. True when one did
+static bool line_add(time_sync_line_t *l, const time_sync_sample_t *s, int64_t window_us)
+{
+    bool pushed = false;
+    if (l->open && s->local_us - l->window_start_us >= window_us)
+    {
+        line_push(l, &l->best);
+        l->open = false;
+        pushed = true;
+    }
+    if (!l->open)
+    {
+        l->best = *s;
+        l->window_start_us = s->local_us;
+        l->open = true;
+    }
+    else if (s->cost < l->best.cost)
+    {
+        l->best = *s;
+    }
+    return pushed;
+}
+
+static void publish(time_sync_t *ts, bool synced, int64_t local_ref_us, int64_t master_ref_us, int32_t drift_ppb)
+{
+    uint32_t version = ts->version.load(std::memory_order_relaxed);
+    ts->version.store(version + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+
+    ts->synced = synced;
+    ts->local_ref_us = local_ref_us;
+    ts->master_ref_us = master_ref_us;
+    ts->drift_ppb = drift_ppb;
+
+    ts->version.store(version + 2, std::memory_order_release);
+}
+
+// Everything learnt so far is wrong, the base station's clock started again
+static void restart(time_sync_t *ts, int64_t now_us)
+{
+    line_reset(&ts->beacons);
+    line_reset(&ts->exchange_line);
+    ts->exchange_count = 0;
+    ts->exchange_head = 0;
+    ts->step_run = 0;
+    ts->answered = 0;
+    ts->next_request_us = now_us + random(ts) % (TIME_SYNC_FAST_MS * 1000);
+    ts->stats.steps++;
+    publish(ts, false, 0, 0, 0);
+}
+
+void time_sync_init(time_sync_t *ts, uint32_t seed, int64_t now_us)
+{
+    ts->rng = seed != 0 ? seed : 1;
+    ts->version.store(0, std::memory_order_relaxed);
+    ts->synced = false;
+    ts->local_ref_us = 0;
+    ts->master_ref_us = 0;
+    ts->drift_ppb = 0;
+    line_reset(&ts->beacons);
+    line_reset(&ts->exchange_line);
+    ts->exchange_head = 0;
+    ts->exchange_count = 0;
+    ts->have_beacon = false;
+    ts->beacon_seq = 0;
+    ts->beacon_rx_us = 0;
+    ts->step_run = 0;
+    ts->next_request_us = now_us + random(ts) % (TIME_SYNC_FAST_MS * 1000);
+    ts->answered = 0;
+    ts->espnow_ms.store(0, std::memory_order_relaxed);
+    memset(&ts->stats, 0, sizeof(ts->stats));
+}
+
+/*
+    The shortest round trip kept, ESP-NOW before TCP: a short TCP round trip can still have one
+    leg through the AP's queue and lwIP and the other not, ESP-NOW's legs are far more even.
+    With no drift to carry it forward (`aging` false) an old exchange is worth less, by as much
+    as TIME_SYNC_AGING_PPM could have moved it since
+*/
+static const time_sync_exchange_t *best_exchange(const time_sync_t *ts, int64_t now_us, bool aging)
+{
+    const time_sync_exchange_t *best = NULL;
+    int64_t best_cost = 0;
+    for (int i = 0; i < ts->exchange_count; i++)
+    {
+        const time_sync_exchange_t *e = &ts->exchanges[i];
+        int64_t age_us = now_us - e->local_us;
+        if (age_us > TIME_SYNC_EXCHANGE_MAX_AGE_MS * 1000LL)
+        {
+            continue;
+        }
+        int64_t cost = e->delay_us / 2 + (aging ? age_us * TIME_SYNC_AGING_PPM / 1000000 : 0);
+        if (best == NULL || e->via < best->via || (e->via == best->via && cost < best_cost))
+        {
+            best = e;
+            best_cost = cost;
+        }
+    }
+    return best;
+}
+
+/*
+    The drift from whichever line has enough points, beacons first. The line goes through the
+    best exchange: a beacon line is off by the beacon's trip, an exchange line is pulled about
+    by the longer round trips it averages in
+*/
+static void update_model(time_sync_t *ts, int64_t now_us)
+{
+    const time_sync_line_t *line = ts->beacons.count >= TIME_SYNC_MIN_POINTS ? &ts->beacons :
+                                   ts->exchange_line.count >= TIME_SYNC_MIN_POINTS ? &ts->exchange_line : NULL;
+    const time_sync_exchange_t *best = best_exchange(ts, now_us, line == NULL);
+    if (best == NULL)
+    {
+        return; // keep going on the last model until something new comes in
+    }
+    ts->stats.min_delay_us = best->delay_us;
+
+    if (line == NULL)
+    {
+        publish(ts, true, best->local_us, best->local_us + best->offset_us, 0);
+        return;
+    }
+    int64_t correction = best->offset_us - line_offset(line, best->local_us);
+    publish(ts, true, line->ref_local_us, line->ref_local_us + line->ref_offset_us + correction, line->drift_ppb);
+}
+
+// Offset the model gives at local_us, master - local
+static int64_t model_offset(const time_sync_t *ts, int64_t local_us)
+{
+    int64_t dt = local_us - ts->local_ref_us;
+    return ts->master_ref_us - ts->local_ref_us + (int64_t)ts->drift_ppb * dt / 1000000000;
+}
+
+// Far off the model: an outlier, or a run of them and the base station's clock jumped. True to drop the sample
+static bool step_check(time_sync_t *ts, int64_t error_us, int64_t slack_us, int64_t now_us)
+{
+    if (error_us < 0)
+    {
+        error_us = -error_us;
+    }
+    if (error_us <= TIME_SYNC_STEP_US + slack_us)
+    {
+        ts->step_run = 0;
+        return false;
+    }
+    if (++ts->step_run < TIME_SYNC_STEP_RUN)
+    {
+        return true;
+    }
+    restart(ts, now_us);
+    return false;
+}
+
+bool time_sync_due(time_sync_t *ts, int64_t now_us)
+{
+    if (now_us < ts->next_request_us)
+    {
+        return false;
+    }
+    uint32_t period_ms = ts->answered < TIME_SYNC_FAST_COUNT ? TIME_SYNC_FAST_MS : TIME_SYNC_PERIOD_MS;
+    ts->next_request_us = now_us + spread_us(ts, period_ms);
+    ts->stats.requests++;
+    return true;
+}
+
+bool time_sync_want_tcp(const time_sync_t *ts, int64_t now_us)
+{
+    uint32_t espnow_ms = ts->espnow_ms.load(std::memory_order_relaxed);
+    return espnow_ms == 0 || (uint32_t)(now_us / 1000) - espnow_ms >= TIME_SYNC_TCP_AFTER_MS;
+}
+
+void time_sync_on_response(time_sync_t *ts, const dt_time_resp_t *resp, int64_t rx_us, uint8_t via)
+{
+    int64_t t1 = (int64_t)resp->t1_us;
+    int64_t t2 = (int64_t)resp->t2_us;
+    int64_t t3 = (int64_t)resp->t3_us;
+    int64_t t4 = rx_us;
+    if (t1 > t4 || t4 - t1 > TIME_SYNC_MAX_RTT_MS * 1000LL || t3 < t2)
+    {
+        ts->stats.stale++;
+        return;
+    }
+
+    int64_t delay = (t4 - t1) - (t3 - t2);
+    time_sync_exchange_t e;
+    e.local_us = t1 + (t4 - t1) / 2;
+    e.offset_us = ((t2 - t1) + (t3 - t4)) / 2;
+    e.delay_us = delay > 0 ? (uint32_t)delay : 0;
+    e.via = via;
+
+    // half the round trip is as far off as an honest answer can be
+    if (ts->synced && step_check(ts, e.offset_us - model_offset(ts, e.local_us), e.delay_us / 2, t4))
+    {
+        return;
+    }
+
+    ts->stats.exchanges++;
+    if (via == TIME_SYNC_VIA_TCP)
+    {
+        ts->stats.tcp_exchanges++;
+    }
+    else
+    {
+        ts->espnow_ms.store((uint32_t)(t4 / 1000), std::memory_order_relaxed);
+    }
+    ts->stats.last_delay_us = e.delay_us;
+    ts->answered++;
+
+    // TCP ones only go on the exchange line while ESP-NOW isn't answering, they'd only pull it about
+    const time_sync_exchange_t *best = best_exchange(ts, t4, false);
+    if (best == NULL || via <= best->via)
+    {
+        time_sync_sample_t s = { e.local_us, e.offset_us, (int64_t)e.delay_us };
+        line_add(&ts->exchange_line, &s, TIME_SYNC_EXCHANGE_WINDOW_MS * 1000LL);
+    }
+
+    ts->exchanges[ts->exchange_head] = e;
+    ts->exchange_head = (ts->exchange_head + 1) % TIME_SYNC_EXCHANGES;
+    if (ts->exchange_count < TIME_SYNC_EXCHANGES)
+    {
+        ts->exchange_count++;
+    }
+    update_model(ts, t4);
+}
+
+void time_sync_on_beacon(time_sync_t *ts, uint32_t seq, uint64_t prev_tx_us, int64_t rx_us)
+{
+    bool paired = ts->have_beacon && prev_tx_us != 0 && seq == ts->beacon_seq + 1;
+    int64_t local_us = ts->beacon_rx_us;
+    ts->have_beacon = true;
+    ts->beacon_seq = seq;
+    ts->beacon_rx_us = rx_us;
+    if (!paired)
+    {
+        return;
+    }
+
+    // the earliest arrival in a window has the least delay in it, so the largest offset
+    time_sync_sample_t s = { local_us, (int64_t)prev_tx_us - local_us, 0 };
+    s.cost = -s.offset_us;
+    if (ts->beacons.count >= TIME_SYNC_MIN_POINTS &&
+        step_check(ts, s.offset_us - line_offset(&ts->beacons, local_us), 0, rx_us))
+    {
+        return;
+    }
+
+    if (line_add(&ts->beacons, &s, TIME_SYNC_WINDOW_MS * 1000LL))
+    {
+        ts->stats.beacon_points++;
+        update_model(ts, rx_us);
+    }
+}
+
+bool time_sync_master_us(const time_sync_t *ts, int64_t local_us, int64_t *master_us)
+{
+    uint32_t version;
+    bool synced;
+    int64_t local_ref_us, master_ref_us;
+    int32_t drift_ppb;
+    do
+    {
+        version = ts->version.load(std::memory_order_acquire);
+        synced = ts->synced;
+        local_ref_us = ts->local_ref_us;
+        master_ref_us = ts->master_ref_us;
+        drift_ppb = ts->drift_ppb;
+        std::atomic_thread_fence(std::memory_order_acquire);
+    } while ((version & 1) != 0 || ts->version.load(std::memory_order_relaxed) != version);
+
+    if (!synced)
+    {
+        return false;
+    }
+    int64_t dt = local_us - local_ref_us;
+    *master_us = master_ref_us + dt + (int64_t)drift_ppb * dt / 1000000000;
+    return true;
+}